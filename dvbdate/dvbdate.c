@@ -43,10 +43,14 @@
 
 #ifdef NEWSTRUCT
 #include <linux/dvb/dmx.h>
-#define DVB_DEMUX_DEVICE "/dev/dvb/adapter0/demux0"
+#include "dvbdev.h"
+#define open_demux(flags) dvbdev_open(0,"demux0",(flags))
+#define dmx_ioctl dvbdev_ioctl
 #else
 #include <ost/dmx.h>
 #define DVB_DEMUX_DEVICE "/dev/ost/demux0"
+#define open_demux(flags) open(DVB_DEMUX_DEVICE,(flags))
+#define dmx_ioctl ioctl
 #define dmx_sct_filter_params dmxSctFilterParams
 #endif
 
@@ -108,7 +112,7 @@ time_t scan_date() {
   struct pollfd ufd;
 
   t = 0;
-  if((fd_date = open(DVB_DEMUX_DEVICE,O_RDWR|O_NONBLOCK)) < 0){
+  if((fd_date = open_demux(O_RDWR|O_NONBLOCK)) < 0){
       perror("fd_date DEVICE: ");
       return -1;
   }
@@ -116,19 +120,20 @@ time_t scan_date() {
   sctFilterParams.pid=0x14;
   memset(&sctFilterParams.filter.filter,0,DMX_FILTER_SIZE);
   memset(&sctFilterParams.filter.mask,0,DMX_FILTER_SIZE);
+  memset(&sctFilterParams.filter.mode,0,DMX_FILTER_SIZE);
   sctFilterParams.timeout = 0;
   sctFilterParams.flags = DMX_IMMEDIATE_START;
   sctFilterParams.filter.filter[0]=0x70;
   sctFilterParams.filter.mask[0]=0xff;
 
-  if (ioctl(fd_date,DMX_SET_FILTER,&sctFilterParams) < 0) {
+  if (dmx_ioctl(fd_date,DMX_SET_FILTER,&sctFilterParams) < 0) {
     perror("DATE - DMX_SET_FILTER:");
     close(fd_date);
     return -1;
   }
 
   ufd.fd=fd_date;
-  ufd.events=POLLPRI;
+  ufd.events=POLLIN|POLLPRI;
   if (poll(&ufd,1,10000) < 0) {
      errmsg("TIMEOUT reading from fd_date\n");
      close(fd_date);
@@ -157,7 +162,11 @@ time_t scan_date() {
  */
 int set_time(time_t *new_time)
 {
-  if (stime(new_time)) {
+  struct timespec ts;
+
+  ts.tv_sec = *new_time;
+  ts.tv_nsec = 0;
+  if (clock_settime(CLOCK_REALTIME, &ts)) {
     perror("Unable to set time");
     exit(1);
   }
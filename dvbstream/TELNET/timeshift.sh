@@ -0,0 +1,15 @@
+#!/bin/sh
+# Play the -shift: output 0 from $1 seconds ago (30 by default) to
+# stdout, then carry on with the live stream, e.g.
+#   dvbstream -f 12441 -p v -s 27500 -shift:/tmp/shift 512 660
+#   ./timeshift.sh 60 | mplayer -
+./svdrpsend.pl -d localhost -p 12345 seek 0 ${1:-30} | tr -d '\r' |
+  sed -n 's/^250-FILE //p' | {
+  last=""
+  while read file offset length; do
+    [ -n "$last" ] && tail -c +$((lastoff + 1)) "$last" | head -c $lastlen
+    last=$file lastoff=$offset lastlen=$length
+  done
+  # The file still being written
+  [ -n "$last" ] && tail -c +$((lastoff + 1)) -f "$last"
+}
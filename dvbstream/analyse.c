@@ -0,0 +1,200 @@
+/*
+ * analyse.c: watching the PIDs of a transport stream (-analyse).
+ *
+ * For each PID: its bitrate over the last few seconds, continuity
+ * counter errors, whether it is scrambled, and for the PIDs carrying a
+ * PCR, the longest gap between PCRs and how far each PCR is from where
+ * the previous ones put it.  The accuracy is measured against the
+ * packet positions in the stream, as in TR 101 290 (PCR_AC), so it
+ * needs the whole TS (PID 8192) to mean anything.
+ *
+ * A report goes out every few seconds as comma separated lines, one per
+ * PID, for a monitoring script to pick up.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "analyse.h"
+#include "pcrclock.h"
+
+#define TS_SIZE 188
+#define NULL_PID 0x1fff
+#define SEC_NS 1000000000LL
+
+int analyser_init(analyser_t *a, int report_secs, FILE *out)
+{
+  memset(a, 0, sizeof(analyser_t));
+  memset(a->cc, ANALYSE_CC_NONE, sizeof(a->cc));
+  a->hist = calloc(ANALYSE_WINDOW + 1, ANALYSE_PIDS * sizeof(uint64_t));
+  if (a->hist == NULL) {
+    fprintf(stderr, "analyse: couldn't allocate the bitrate history\n");
+    return -1;
+  }
+  a->start = monotonic_ns();
+  a->hist_t[0] = a->start;
+  a->filled = 1;
+  a->next_tick = a->start + SEC_NS;
+  a->out = out;
+  if (report_secs > 0) {
+    a->report_ns = report_secs * SEC_NS;
+    a->next_report = a->start + a->report_ns;
+    fprintf(out, "# time,pid,kbit/s,packets,cc_errors,scrambling,pcrs,pcr_interval_ms,pcr_accuracy_ns\n");
+    fflush(out);
+  }
+  return 0;
+}
+
+static void pcr_packet(analyser_t *a, int pid, uint8_t *pkt, uint64_t pos)
+{
+  analyse_pcr_t *r = a->pcr[pid];
+  int64_t pcr, d, e;
+  int disc;
+
+  if (!get_pcr(pkt, &pcr, &disc))
+    return;
+  if (r == NULL) {
+    if ((r = calloc(1, sizeof(analyse_pcr_t))) == NULL)
+      return;
+    r->last = -1;
+    a->pcr[pid] = r;
+  }
+  r->count++;
+  if (r->last >= 0 && !disc) {
+    d = (pcr - r->last + PCR_WRAP) % PCR_WRAP;
+    if (d > PCR_HZ / 10)
+      r->jumps++;
+    if (d > 10 * PCR_HZ) {
+      r->ticks_per_pkt = 0;       // a jump, not a gap
+    } else {
+      if (d > r->max_interval)
+        r->max_interval = d;
+      if (r->ticks_per_pkt > 0) {
+        e = d - (int64_t)((pos - r->pos) * r->ticks_per_pkt);
+        if (e < 0) e = -e;
+        if (e > r->max_error)
+          r->max_error = e;
+        if (e * 2000000 > PCR_HZ)
+          r->inaccurate++;
+      }
+      r->ticks_per_pkt = (double)d / (pos - r->pos);
+    }
+  } else {
+    r->ticks_per_pkt = 0;
+  }
+  r->last = pcr;
+  r->pos = pos;
+}
+
+/* Take in a batch of packets */
+void analyse_batch(analyser_t *a, uint8_t **pkts, int n)
+{
+  uint16_t pid[n];
+  uint8_t b3[n], af[n];
+  int i, p, c, last, pay, err;
+
+  /* Pick the headers out first, with nothing carried from one packet to
+     the next.  af[i] is the adaptation field flags, or 0. */
+  for (i = 0; i < n; i++) {
+    pid[i] = ((pkts[i][1] & 0x1f) << 8) | pkts[i][2];
+    b3[i] = pkts[i][3];
+    af[i] = ((b3[i] & 0x20) && pkts[i][4] > 0) ? pkts[i][5] : 0;
+  }
+
+  /* The continuity counter goes up by one with each packet that has a
+     payload; a repeated packet keeps it, as does one with no
+     payload.  A discontinuity_indicator excuses a jump, and null
+     packets don't count. */
+  for (i = 0; i < n; i++) {
+    p = pid[i];
+    c = b3[i] & 0x0f;
+    pay = (b3[i] >> 4) & 1;
+    last = a->cc[p];
+    err = (last != ANALYSE_CC_NONE) & (c != ((last + pay) & 0x0f)) & !(pay & (c == last))
+          & !(af[i] >> 7) & (p != NULL_PID);
+    a->cc_errors[p] += err;
+    a->cc[p] = c;
+    a->tsc[p] = b3[i] >> 6;
+    a->packets[p]++;
+  }
+
+  for (i = 0; i < n; i++) {
+    if (af[i] & 0x10)
+      pcr_packet(a, pid[i], pkts[i], a->pos + i);
+  }
+  a->pos += n;
+}
+
+/* The slot of the oldest snapshot in the window */
+static int oldest(analyser_t *a)
+{
+  return (a->filled <= ANALYSE_WINDOW) ? 0 : (a->slot + 1) % (ANALYSE_WINDOW + 1);
+}
+
+/* Write out every PID seen so far.  The packet and error counts are
+   totals; the PCR figures are the worst since the last report. */
+void analyser_report(analyser_t *a)
+{
+  int64_t now = monotonic_ns();
+  int o = oldest(a);
+  uint64_t *then = a->hist + o * ANALYSE_PIDS;
+  double secs = (now - a->hist_t[o]) / 1e9;
+  analyse_pcr_t *r;
+  int p;
+
+  for (p = 0; p < ANALYSE_PIDS; p++) {
+    if (a->packets[p] == 0) continue;
+    fprintf(a->out, "%.3f,%d,%.1f,%llu,%u,%d", (now - a->start) / 1e9, p,
+            secs > 0 ? (a->packets[p] - then[p]) * TS_SIZE * 8 / secs / 1000 : 0.0,
+            (unsigned long long)a->packets[p], a->cc_errors[p], a->tsc[p]);
+    if ((r = a->pcr[p]) != NULL) {
+      fprintf(a->out, ",%llu,%.1f,%.0f\n", (unsigned long long)r->count,
+              r->max_interval * 1000.0 / PCR_HZ, r->max_error * 1e9 / PCR_HZ);
+      r->max_interval = r->max_error = 0;
+    } else {
+      fprintf(a->out, ",0,,\n");
+    }
+  }
+  fflush(a->out);
+}
+
+/* Take the once a second snapshots and write the reports that are due */
+void analyser_poll(analyser_t *a)
+{
+  int64_t now = monotonic_ns();
+
+  while (now >= a->next_tick) {
+    a->slot = (a->slot + 1) % (ANALYSE_WINDOW + 1);
+    memcpy(a->hist + a->slot * ANALYSE_PIDS, a->packets, sizeof(a->packets));
+    a->hist_t[a->slot] = now;
+    if (a->filled <= ANALYSE_WINDOW)
+      a->filled++;
+    a->next_tick += SEC_NS;
+    if (a->next_tick <= now)      // stalled: don't catch up
+      a->next_tick = now + SEC_NS;
+  }
+  if (a->report_ns && now >= a->next_report) {
+    analyser_report(a);
+    a->next_report += a->report_ns;
+    if (a->next_report <= now)
+      a->next_report = now + a->report_ns;
+  }
+}
+
+void analyser_free(analyser_t *a)
+{
+  int p;
+
+  for (p = 0; p < ANALYSE_PIDS; p++) {
+    free(a->pcr[p]);
+    a->pcr[p] = NULL;
+  }
+  free(a->hist);
+  a->hist = NULL;
+}
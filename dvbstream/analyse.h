@@ -0,0 +1,53 @@
+#ifndef _ANALYSE_H
+#define _ANALYSE_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#define ANALYSE_PIDS 8192
+#define ANALYSE_WINDOW 5      /* seconds the bitrates are averaged over */
+#define ANALYSE_CC_NONE 0x10  /* no packet of the PID yet */
+
+/* The PCRs of one PID */
+typedef struct {
+  int64_t last;                /* last PCR, -1: none yet */
+  uint64_t pos;                /* the packet it was in */
+  double ticks_per_pkt;        /* rate between the last two, 0 until then */
+  uint64_t count;
+  int64_t max_interval;        /* since the last report, 27 MHz ticks */
+  int64_t max_error;           /* worst PCR accuracy since then, ticks */
+  uint64_t inaccurate;         /* PCRs more than 500 ns out */
+  uint64_t jumps;              /* more than 100 ms on from the last, or
+                                  back, with no discontinuity_indicator */
+} analyse_pcr_t;
+
+/* -analyse: continuous per-PID measurements of a transport stream.  The
+   state of each PID is kept in separate arrays indexed by PID, so the
+   per-packet work is a short loop over each batch with no calls in it;
+   only the packets with a PCR get any more attention. */
+typedef struct {
+  uint64_t packets[ANALYSE_PIDS];
+  uint32_t cc_errors[ANALYSE_PIDS];
+  uint8_t cc[ANALYSE_PIDS];    /* CC of the last packet */
+  uint8_t tsc[ANALYSE_PIDS];   /* transport_scrambling_control of it */
+  analyse_pcr_t *pcr[ANALYSE_PIDS];  /* the PIDs that carry PCRs */
+  uint64_t pos;                /* packets seen */
+
+  /* packets[] once a second, for the bitrates over the window */
+  uint64_t *hist;
+  int64_t hist_t[ANALYSE_WINDOW+1];
+  int slot, filled;
+  int64_t start, next_tick;
+
+  /* periodic reports, or none */
+  FILE *out;
+  int64_t report_ns, next_report;
+} analyser_t;
+
+int analyser_init(analyser_t *a, int report_secs, FILE *out);
+void analyse_batch(analyser_t *a, uint8_t **pkts, int n);
+void analyser_poll(analyser_t *a);
+void analyser_report(analyser_t *a);
+void analyser_free(analyser_t *a);
+
+#endif
@@ -0,0 +1,98 @@
+#!/bin/sh
+#
+# bench.sh: throughput benchmarks of dvbstream and the tools around it,
+# on synthetic streams made by tsgen, so they need no DVB card and no
+# network.  "make bench" runs them and compares the figures with
+# bench/baseline, which "make bench-baseline" writes.  The baseline is
+# only meaningful on the machine it was made on.
+#
+# Each case runs BENCH_REPEAT times (5) and the fastest run counts.  The
+# streams, of BENCH_PACKETS packets (1000000), are made in BENCH_DIR with
+# fixed seeds, so every run reads the same bytes.
+#
+#   bench.sh         run the cases and compare them with the baseline
+#   bench.sh -save   run the cases and make them the baseline
+
+cd "$(dirname "$0")/.." || exit 1
+
+DIR=${BENCH_DIR:-/tmp/dvbstream-bench}
+PACKETS=${BENCH_PACKETS:-1000000}
+REPEAT=${BENCH_REPEAT:-5}
+PORT=${BENCH_PORT:-15004}
+TOLERANCE=${BENCH_TOLERANCE:-10}
+BASELINE=bench/baseline
+
+save=0
+[ "$1" = "-save" ] && save=1
+
+mkdir -p "$DIR" || exit 1
+RESULTS=$DIR/results
+
+gen() {
+  name=$1; shift
+  ./tsgen -n "$PACKETS" -seed 1 "$@" > "$DIR/$name.ts" || exit 1
+}
+
+# run case stream [tsbench options] -- command args...
+run() {
+  name=$1; stream=$2; shift 2
+  n=0
+  while [ $n -lt "$REPEAT" ]; do
+    ./tsbench -name "$name" -i "$DIR/$stream.ts" -p "$PACKETS" "$@" || exit 1
+    n=$((n + 1))
+  done | sort -k2 -n | tail -1 | tee -a "$RESULTS"
+}
+
+echo "Making the streams in $DIR ($PACKETS packets each)"
+gen mux                         # 8 programs of video and audio, 20 Mbit/s
+gen pids -pids 1000             # and 1000 more PIDs
+gen churn -churn 200            # new PAT and PMT versions 5 times a second
+gen corrupt -corrupt 500        # one packet in 500 damaged
+gen m2ts -size 192
+gen rs -size 204
+
+: > "$RESULTS"
+printf "%-20s %12s %9s %9s %8s %9s %9s %9s\n" case packets/s MB/s secs cpu/Gbit reads writes udp
+run whole-null mux -- ./dvbstream -stdin -o 8192
+run whole-file mux -- ./dvbstream -stdin -o:"$DIR/out.ts" 8192
+run whole-udp mux -u "$PORT" -- ./dvbstream -stdin -i 127.0.0.1 -r "$PORT" 8192
+run whole-udp-threads mux -u "$PORT" -- ./dvbstream -stdin -threads 1 -i 127.0.0.1 -r "$PORT" 8192
+run pids-demux pids -- ./dvbstream -stdin -o:/dev/null $(seq 4096 4595)
+run psi-churn churn -- ./dvbstream -stdin -prog -o:/dev/null 1 2 3 4 5 6 7 8
+run corrupt corrupt -- ./dvbstream -stdin -o 8192
+run corrupt-monitor corrupt -- ./dvbstream -stdin -monitor -o:/dev/null 8192
+run m2ts m2ts -- ./dvbstream -stdin -o 8192
+run rs rs -- ./dvbstream -stdin -o 8192
+run ps-mpegtools mux -- ./dvbstream -stdin -o -ps 258 257
+run virtual-whole mux -- env DVB_VIRTUAL="$DIR/mux.ts" ./dvbstream -o 8192
+run virtual-pids mux -- env DVB_VIRTUAL="$DIR/mux.ts" ./dvbstream -o:/dev/null 257 258 273 274
+run virtual-prog mux -- env DVB_VIRTUAL="$DIR/mux.ts" ./dvbstream -prog -o:/dev/null "Service 3"
+run ts_filter mux -- ./ts_filter 257 258
+run ts_filter-rs rs -- ./ts_filter 257 258
+run dvbts2pes mux -- ../dvbts2pes/dvbts2pes 257
+rm -f "$DIR/out.ts"
+
+if [ $save = 1 ]; then
+  cp "$RESULTS" "$BASELINE"
+  echo "Saved the baseline in $BASELINE"
+  exit 0
+fi
+if [ ! -f "$BASELINE" ]; then
+  echo "No baseline to compare with - run \"make bench-baseline\" to make one"
+  exit 0
+fi
+
+# Packets per second against the baseline; slower by more than the
+# tolerance is flagged, but it doesn't fail the run
+echo
+echo "Against $BASELINE (packets/s, flagged if more than $TOLERANCE% slower):"
+awk -v tol="$TOLERANCE" '
+  NR == FNR { base[$1] = $2; next }
+  {
+    if (!($1 in base) || base[$1] == 0) {
+      printf "%-20s %12.0f   (not in the baseline)\n", $1, $2
+      next
+    }
+    d = ($2 - base[$1]) * 100 / base[$1]
+    printf "%-20s %12.0f %12.0f %+7.1f%%%s\n", $1, base[$1], $2, d, (d < -tol) ? "  SLOWER" : ""
+  }' "$BASELINE" "$RESULTS"
@@ -0,0 +1,27 @@
+#!/bin/sh
+#
+# follow.sh: replays a stream whose PMTs move the audio PIDs through
+# -stdin into a -prog output and checks with followcheck that the
+# output followed program 2's audio from PID 274 to 282 and back, with
+# no packets lost at the changes.  The threaded run must write the
+# same file.  "make check" runs it.
+
+cd "$(dirname "$0")/.." || exit 1
+
+DIR=${BENCH_DIR:-/tmp/dvbstream-bench}/follow
+
+rm -rf "$DIR"
+mkdir -p "$DIR" || exit 1
+# A new PAT and PMTs every second, for 2.6 seconds at 20 Mbit/s
+./tsgen -n 35000 -churn 1000 > "$DIR/in.ts" || exit 1
+
+./dvbstream -stdin -prog -o:"$DIR/out.ts" 2 < "$DIR/in.ts" 2> "$DIR/dvbstream.log" || exit 1
+grep 'map 0' "$DIR/dvbstream.log"
+./followcheck 274 282 274 < "$DIR/out.ts" || exit 1
+
+./dvbstream -stdin -threads 2 -prog -o:"$DIR/threads.ts" 2 < "$DIR/in.ts" 2> "$DIR/threads.log" || exit 1
+if ! cmp -s "$DIR/out.ts" "$DIR/threads.ts"; then
+  echo "follow: the threaded run wrote a different file"
+  exit 1
+fi
+exit 0
@@ -0,0 +1,49 @@
+#!/bin/sh
+#
+# loss.sh: sends a synthetic stream in real time over the loopback
+# through udploss, which drops some of the datagrams, and receives it
+# with dumprtp - as it is, with SMPTE 2022-1 FEC and with NACKs - to
+# show how much of the loss each puts back.  "make loss" runs it.
+#
+#   LOSS_PERCENT  percent of datagrams starting a loss (1)
+#   LOSS_BURST    datagrams lost each time (1)
+#   LOSS_PACKETS  TS packets sent, at 20 Mbit/s (50000, about 4 seconds)
+#   FEC_MATRIX    L x D of the FEC (10x10)
+#   NACK_MS       how long dumprtp waits for a packet it has asked for (200)
+
+cd "$(dirname "$0")/.." || exit 1
+
+DIR=${BENCH_DIR:-/tmp/dvbstream-bench}
+PORT=${BENCH_PORT:-15004}
+LOSS=${LOSS_PERCENT:-1}
+BURST=${LOSS_BURST:-1}
+PACKETS=${LOSS_PACKETS:-50000}
+MATRIX=${FEC_MATRIX:-10x10}
+NACK=${NACK_MS:-200}
+RPORT=$((PORT + 10))
+
+mkdir -p "$DIR" || exit 1
+./tsgen -n "$PACKETS" -seed 1 > "$DIR/loss.ts" || exit 1
+
+# trial name "dvbstream options" "dumprtp options"
+trial() {
+  ./dumprtp $3 127.0.0.1 $RPORT > "$DIR/loss-out.ts" 2> "$DIR/loss-dumprtp.log" &
+  recv=$!
+  ./udploss -loss "$LOSS" -burst "$BURST" -seed 1 -idle 1 $PORT 127.0.0.1 $RPORT 2> "$DIR/loss-udploss.log" &
+  relay=$!
+  sleep 1
+  ./dvbstream -stdin -pace $2 -i 127.0.0.1 -r $PORT 8192 < "$DIR/loss.ts" 2> /dev/null
+  wait $relay
+  kill -INT $recv
+  wait $recv
+  echo "$1:"
+  sed 's/^/  /' "$DIR/loss-udploss.log"
+  grep '^dumprtp: [0-9]* packets' "$DIR/loss-dumprtp.log" | tail -1 | sed 's/^/  /'
+  echo "  $(($(stat -c %s "$DIR/loss-out.ts") / 188)) of $PACKETS TS packets came out"
+}
+
+echo "Losing $LOSS% of the datagrams, $BURST at a time"
+trial "Without FEC" "" ""
+trial "With $MATRIX FEC" "-fec $MATRIX" "-fec"
+trial "With NACKs, waiting up to $NACK ms" "-nack 1000" "-nack $NACK"
+rm -f "$DIR/loss.ts" "$DIR/loss-out.ts" "$DIR/loss-dumprtp.log" "$DIR/loss-udploss.log"
@@ -0,0 +1,29 @@
+#!/bin/sh
+#
+# mapfd.sh: runs mapcheck against a dvbstream with the telnet interface
+# reading a virtual card, so that MAP n ADD and MAP n REMOVE open and
+# close real filters.  "make check" runs it.  The telnet port (12345)
+# must be free.
+
+cd "$(dirname "$0")/.." || exit 1
+
+DIR=${BENCH_DIR:-/tmp/dvbstream-bench}/mapfd
+
+rm -rf "$DIR"
+mkdir -p "$DIR" || exit 1
+./tsgen -n 20000 > "$DIR/in.ts" || exit 1
+
+DVB_VIRTUAL="$DIR/in.ts,rate=20000,loop" ./dvbstream-telnet -f 12441 -p v -s 27500 \
+  -o:/dev/null 257 2> "$DIR/dvbstream.log" &
+pid=$!
+trap 'kill $pid 2> /dev/null' EXIT
+trap 'exit 1' INT TERM HUP PIPE
+
+./mapcheck $pid
+bad=$?
+if ! kill -0 $pid 2> /dev/null; then
+  echo "mapfd: dvbstream died:"
+  tail -3 "$DIR/dvbstream.log"
+  bad=1
+fi
+exit $bad
@@ -0,0 +1,31 @@
+#!/bin/sh
+#
+# monitor.sh: plays synthetic streams on a virtual card in real time
+# with -monitor and checks the PCR repetition count: none with PCRs
+# every 30 ms, and some with PCRs 60 ms apart, over the 40 ms that
+# TR 101 290 allows.  "make check" runs it.
+
+cd "$(dirname "$0")/.." || exit 1
+
+DIR=${BENCH_DIR:-/tmp/dvbstream-bench}/monitor
+
+rm -rf "$DIR"
+mkdir -p "$DIR" || exit 1
+
+# The number of PCR repetition errors in the stream with PCRs ms apart
+pcr_errors()
+{
+  ./tsgen -n 100000 -pcr $1 > "$DIR/pcr$1.ts" || return 1
+  DVB_VIRTUAL="$DIR/pcr$1.ts,rate=20000" ./dvbstream -f 12441 -p v -s 27500 \
+    -monitor -o:/dev/null 8192 2> "$DIR/pcr$1.log" || return 1
+  sed -n 's/.*pcr_repetition_error \([0-9]*\).*/\1/p' "$DIR/pcr$1.log"
+}
+
+bad=0
+n=$(pcr_errors 30)
+echo "monitor: PCRs every 30 ms: ${n:-no} PCR repetition errors"
+[ "$n" = 0 ] || bad=1
+n=$(pcr_errors 60)
+echo "monitor: PCRs every 60 ms: ${n:-no} PCR repetition errors"
+[ -n "$n" ] && [ "$n" -gt 0 ] || bad=1
+exit $bad
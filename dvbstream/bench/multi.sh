@@ -0,0 +1,73 @@
+#!/bin/sh
+#
+# multi.sh: sends several synthetic streams in real time to multicast
+# groups on the loopback, records them all with one "dumprtp -c" and
+# checks that each file holds what was sent.  "make multi" runs it.
+#
+#   MULTI_CHANNELS  streams, to 239.255.42.1 and up (8)
+#   MULTI_PACKETS   TS packets in each, at 20 Mbit/s (20000, under 2 seconds)
+#   MULTI_MAXSIZE   MB in each file before the next is started (1)
+
+cd "$(dirname "$0")/.." || exit 1
+
+DIR=${BENCH_DIR:-/tmp/dvbstream-bench}/multi
+PORT=${BENCH_PORT:-15004}
+CHANNELS=${MULTI_CHANNELS:-8}
+PACKETS=${MULTI_PACKETS:-20000}
+MAXSIZE=${MULTI_MAXSIZE:-1}
+
+rm -rf "$DIR"
+mkdir -p "$DIR" || exit 1
+: > "$DIR/channels"
+n=1
+while [ $n -le $CHANNELS ]; do
+  ./tsgen -n "$PACKETS" -seed $n > "$DIR/in$n.ts" || exit 1
+  echo "ch$n 239.255.42.$n:$PORT" >> "$DIR/channels"
+  n=$((n + 1))
+done
+
+./dumprtp -if lo -c "$DIR/channels" -d "$DIR" -maxsize "$MAXSIZE" 2> "$DIR/dumprtp.log" &
+recv=$!
+# Don't leave it recording into $DIR if this is interrupted
+trap 'kill $recv 2> /dev/null' EXIT
+trap 'exit 1' INT TERM HUP PIPE
+sleep 1
+senders=
+n=1
+while [ $n -le $CHANNELS ]; do
+  ./dvbstream -stdin -pace -if lo -i 239.255.42.$n -r $PORT 8192 < "$DIR/in$n.ts" 2> "$DIR/send$n.log" &
+  senders="$senders $!"
+  n=$((n + 1))
+done
+bad=0
+n=1
+for pid in $senders; do
+  if ! wait $pid; then
+    echo "ch$n: dvbstream failed:"
+    tail -3 "$DIR/send$n.log"
+    bad=1
+  fi
+  n=$((n + 1))
+done
+sleep 1
+kill -INT $recv
+wait $recv
+
+grep 'packets in' "$DIR/dumprtp.log"
+n=1
+while [ $n -le $CHANNELS ]; do
+  # The files are named by time, so they sort into order
+  files=$(LC_ALL=C ls "$DIR"/ch$n-*.ts 2> /dev/null)
+  got=$(cat $files /dev/null | wc -c)
+  sent=$(wc -c < "$DIR/in$n.ts")
+  if [ "$got" -ne "$sent" ]; then
+    echo "ch$n: $got of $sent bytes recorded"
+    bad=1
+  elif ! cat $files | cmp -s - "$DIR/in$n.ts"; then
+    echo "ch$n: what was recorded differs from what was sent"
+    bad=1
+  fi
+  echo "ch$n: $((got / 188)) of $PACKETS TS packets in $(echo $files | wc -w) files"
+  n=$((n + 1))
+done
+exit $bad
@@ -0,0 +1,253 @@
+/*
+ * control.c: the telnet control interface, for any number of clients.
+ *
+ * Commands are read a buffer at a time, split into lines and handed to
+ * dvbstream's command handler.  Replies go into a per-client buffer that
+ * is sent without blocking, so a slow client can hold up nothing but
+ * itself.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+
+#include "control.h"
+
+int control_init(control_t *c, int port, char *greeting, control_cmd_cb cmd)
+{
+  struct sockaddr_in name;
+  int i, one = 1;
+
+  memset(c, 0, sizeof(control_t));
+  c->epfd = -1;
+  c->greeting = greeting;
+  c->cmd = cmd;
+  for (i = 0; i < CONTROL_CLIENTS; i++)
+    c->clients[i].fd = -1;
+
+  if ((c->fd = socket(PF_INET, SOCK_STREAM|SOCK_NONBLOCK, 0)) < 0) {
+    perror("control: socket");
+    return -1;
+  }
+  setsockopt(c->fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  memset(&name, 0, sizeof(name));
+  name.sin_family = AF_INET;
+  name.sin_port = htons(port);
+  name.sin_addr.s_addr = htonl(INADDR_ANY);
+  if (bind(c->fd, (struct sockaddr *)&name, sizeof(name)) < 0) {
+    perror("control: bind");
+    close(c->fd);
+    c->fd = -1;
+    return -1;
+  }
+  if (listen(c->fd, CONTROL_CLIENTS) < 0) {
+    perror("control: listen");
+    close(c->fd);
+    c->fd = -1;
+    return -1;
+  }
+  return 0;
+}
+
+static void watch_fd(control_t *c, int fd, int add)
+{
+  struct epoll_event ev;
+
+  if (c->epfd < 0)
+    return;
+  ev.events = EPOLLIN;
+  ev.data.ptr = NULL;
+  epoll_ctl(c->epfd, add ? EPOLL_CTL_ADD : EPOLL_CTL_DEL, fd, &ev);
+}
+
+/* Wake epfd up for new connections and commands.  Its events for them
+   have a NULL data.ptr. */
+void control_watch(control_t *c, int epfd)
+{
+  int i;
+
+  if (c->fd < 0)
+    return;
+  c->epfd = epfd;
+  watch_fd(c, c->fd, 1);
+  for (i = 0; i < CONTROL_CLIENTS; i++) {
+    if (c->clients[i].fd >= 0)
+      watch_fd(c, c->clients[i].fd, 1);
+  }
+}
+
+/* Send what the client will take of its replies.  Returns -1 if it has
+   gone away. */
+static int send_out(control_client_t *cl)
+{
+  int n;
+
+  while (cl->out_len > 0) {
+    n = send(cl->fd, cl->out, cl->out_len, MSG_DONTWAIT|MSG_NOSIGNAL);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+      return -1;
+    }
+    memmove(cl->out, cl->out + n, cl->out_len - n);
+    cl->out_len -= n;
+  }
+  return 0;
+}
+
+void control_reply(control_client_t *cl, const char *fmt, ...)
+{
+  va_list ap;
+  char *p;
+  int n;
+
+  if (cl->fd < 0 || cl->overflow)
+    return;
+  for (;;) {
+    va_start(ap, fmt);
+    n = vsnprintf(cl->out + cl->out_len, cl->out_size - cl->out_len, fmt, ap);
+    va_end(ap);
+    if (n < 0)
+      return;
+    if (cl->out_len + n < cl->out_size)
+      break;
+    /* It isn't reading its replies: drop it at the next poll rather
+       than send it a reply with a piece missing */
+    if (cl->out_size >= CONTROL_MAX_OUT) {
+      cl->overflow = 1;
+      return;
+    }
+    p = realloc(cl->out, cl->out_size ? cl->out_size * 2 : 4096);
+    if (p == NULL) {
+      cl->overflow = 1;
+      return;
+    }
+    cl->out = p;
+    cl->out_size = cl->out_size ? cl->out_size * 2 : 4096;
+  }
+  cl->out_len += n;
+}
+
+void control_close_client(control_t *c, control_client_t *cl)
+{
+  if (cl->fd < 0)
+    return;
+  send_out(cl);            // the last reply, if it fits
+  watch_fd(c, cl->fd, 0);
+  close(cl->fd);
+  cl->fd = -1;
+  free(cl->out);
+  free(cl->priv);
+  cl->out = cl->priv = NULL;
+  cl->out_len = cl->out_size = 0;
+  cl->overflow = 0;
+  c->nclients--;
+  fprintf(stderr, "Closed connection\n");
+}
+
+static void accept_clients(control_t *c)
+{
+  control_client_t *cl;
+  int fd, i;
+
+  while ((fd = accept4(c->fd, NULL, NULL, SOCK_NONBLOCK)) >= 0) {
+    for (i = 0; i < CONTROL_CLIENTS; i++) {
+      if (c->clients[i].fd < 0) break;
+    }
+    if (i == CONTROL_CLIENTS) {
+      send(fd, "BUSY\r\n", 6, MSG_DONTWAIT|MSG_NOSIGNAL);
+      close(fd);
+      continue;
+    }
+    cl = &c->clients[i];
+    memset(cl, 0, sizeof(control_client_t));
+    cl->fd = fd;
+    c->nclients++;
+    c->connections++;
+    watch_fd(c, fd, 1);
+    fprintf(stderr, "Opened connection\n");
+    control_reply(cl, "%s", c->greeting);
+  }
+}
+
+/* Run the complete lines in the client's buffer.  Any control
+   character ends a line. */
+static void run_lines(control_t *c, control_client_t *cl, char *p, int n)
+{
+  int i;
+
+  for (i = 0; i < n && cl->fd >= 0; i++) {
+    if ((unsigned char)p[i] >= 32) {
+      if (cl->in_len < CONTROL_LINE - 1)
+        cl->in[cl->in_len++] = p[i];
+      else
+        cl->too_long = 1;
+      continue;
+    }
+    if (cl->in_len > 0 && !cl->too_long) {
+      cl->in[cl->in_len] = 0;
+      c->commands++;
+      c->cmd(c, cl, cl->in);
+    } else if (cl->too_long) {
+      control_reply(cl, "550-line too long\r\nDONE\r\n");
+    }
+    cl->in_len = 0;
+    cl->too_long = 0;
+  }
+}
+
+/* Accept new clients, run the commands that have come in and send the
+   replies.  Never waits.  Returns the number of clients. */
+int control_poll(control_t *c)
+{
+  control_client_t *cl;
+  char buf[4096];
+  int i, n;
+
+  if (c->fd < 0)
+    return 0;
+  accept_clients(c);
+
+  for (i = 0; i < CONTROL_CLIENTS; i++) {
+    cl = &c->clients[i];
+    if (cl->fd < 0) continue;
+    while ((n = recv(cl->fd, buf, sizeof(buf), MSG_DONTWAIT)) > 0) {
+      run_lines(c, cl, buf, n);
+      if (cl->fd < 0) break;
+    }
+    if (cl->fd < 0) continue;
+    if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+      control_close_client(c, cl);   // hung up
+      continue;
+    }
+    if (send_out(cl) < 0 || cl->overflow) {
+      if (cl->overflow)
+        fprintf(stderr, "control: client not reading its replies, dropping it\n");
+      control_close_client(c, cl);
+    }
+  }
+  return c->nclients;
+}
+
+void control_free(control_t *c)
+{
+  int i;
+
+  if (c->fd < 0)
+    return;
+  for (i = 0; i < CONTROL_CLIENTS; i++)
+    control_close_client(c, &c->clients[i]);
+  close(c->fd);
+  c->fd = -1;
+}
@@ -0,0 +1,49 @@
+#ifndef _CONTROL_H
+#define _CONTROL_H
+
+#include <stdint.h>
+
+#define CONTROL_CLIENTS 16
+#define CONTROL_LINE 1024
+#define CONTROL_MAX_OUT (1024*1024)  /* a client that won't read is dropped */
+
+typedef struct {
+  int fd;                      /* -1: free slot */
+  char in[CONTROL_LINE];       /* the line being read */
+  int in_len;
+  int too_long;                /* skipping the rest of an overlong line */
+  char *out;                   /* replies not sent yet */
+  int out_len, out_size;
+  int overflow;                /* a reply didn't fit: drop the client */
+  void *priv;                  /* the command handler's, freed with the client */
+} control_client_t;
+
+/* The telnet control server.  Nothing in it ever blocks: connections
+   are accepted and commands read whenever control_poll() is called,
+   which dvbstream does between batches, and replies are queued and
+   sent as the client takes them. */
+typedef struct control_s control_t;
+typedef void (*control_cmd_cb)(control_t *c, control_client_t *cl, char *line);
+
+struct control_s {
+  int fd;                      /* listening socket */
+  int epfd;                    /* epoll set the sockets are watched in, or -1 */
+  char *greeting;
+  control_client_t clients[CONTROL_CLIENTS];
+  int nclients;
+  control_cmd_cb cmd;
+
+  /* statistics */
+  uint64_t connections;
+  uint64_t commands;
+};
+
+int control_init(control_t *c, int port, char *greeting, control_cmd_cb cmd);
+void control_watch(control_t *c, int epfd);
+int control_poll(control_t *c);
+void control_reply(control_client_t *cl, const char *fmt, ...)
+  __attribute__ ((format (printf, 2, 3)));
+void control_close_client(control_t *c, control_client_t *cl);
+void control_free(control_t *c);
+
+#endif
@@ -0,0 +1,167 @@
+/*
+ * demux.c: routing the packets of a whole transport stream to outputs.
+ *
+ * The DVB driver only has a handful of hardware PID filters, so past
+ * that dvbstream asks for the whole transport stream and picks out the
+ * PIDs itself.  Each PID looks up its consumer set in a 16 kbyte table
+ * and the set's bitmask says which outputs want the packet, so routing
+ * costs the same whether there are three PIDs or three hundred.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "demux.h"
+
+int demux_init(demux_t *d, int consumers)
+{
+  memset(d, 0, sizeof(demux_t));
+  d->words = (consumers + 63) / 64;
+  if (d->words == 0) d->words = 1;
+  d->max_sets = 16;
+  d->masks = calloc(d->max_sets, d->words * sizeof(uint64_t));
+  if (d->masks == NULL) {
+    fprintf(stderr, "demux: couldn't allocate the consumer sets\n");
+    return -1;
+  }
+  demux_clear(d);
+  return 0;
+}
+
+/* Route every PID nowhere */
+void demux_clear(demux_t *d)
+{
+  memset(d->set, 0, sizeof(d->set));
+  memset(d->masks, 0, d->words * sizeof(uint64_t));
+  d->nsets = 1;
+  d->last_from = -1;
+}
+
+/* Drop the sets no PID refers to any more, keeping their order */
+static void collect_sets(demux_t *d)
+{
+  uint16_t *map;
+  int pid, s, n = 1;
+
+  map = calloc(d->nsets, sizeof(uint16_t));
+  if (map == NULL)
+    return;
+  for (pid = 0; pid < DEMUX_PIDS; pid++)
+    map[d->set[pid]] = 1;
+  map[0] = 0;                   /* the empty set stays set 0 */
+  for (s = 1; s < d->nsets; s++) {
+    if (!map[s]) continue;
+    memmove(demux_mask(d, n), demux_mask(d, s), d->words * sizeof(uint64_t));
+    map[s] = n++;
+  }
+  for (pid = 0; pid < DEMUX_PIDS; pid++)
+    d->set[pid] = map[d->set[pid]];
+  d->nsets = n;
+  d->last_from = -1;
+  free(map);
+}
+
+/* The set holding mask, added if there isn't one yet.  Returns -1 if
+   it couldn't be. */
+static int find_set(demux_t *d, uint64_t *mask)
+{
+  uint64_t *m;
+  int s;
+
+  for (s = 0; s < d->nsets; s++) {
+    if (memcmp(demux_mask(d, s), mask, d->words * sizeof(uint64_t)) == 0)
+      return s;
+  }
+  if (d->nsets == d->max_sets) {
+    if (d->max_sets == DEMUX_MAX_SETS)
+      return -1;
+    d->max_sets = (d->max_sets * 2 > DEMUX_MAX_SETS) ? DEMUX_MAX_SETS : d->max_sets * 2;
+    m = realloc(d->masks, d->max_sets * d->words * sizeof(uint64_t));
+    if (m == NULL)
+      return -1;
+    d->masks = m;
+  }
+  memcpy(demux_mask(d, d->nsets), mask, d->words * sizeof(uint64_t));
+  return d->nsets++;
+}
+
+/* Give pid the set with consumer's bit set to on */
+static int route(demux_t *d, int pid, int consumer, int on)
+{
+  uint64_t mask[d->words];
+  int from = d->set[pid];
+  int to;
+
+  if (on && from == d->last_from && consumer == d->last_consumer) {
+    d->set[pid] = d->last_to;
+    return 0;
+  }
+
+  memcpy(mask, demux_mask(d, from), sizeof(mask));
+  if (on)
+    mask[consumer / 64] |= 1ULL << (consumer % 64);
+  else
+    mask[consumer / 64] &= ~(1ULL << (consumer % 64));
+  if ((to = find_set(d, mask)) < 0) {
+    /* Sets left behind by earlier changes fill the table up */
+    collect_sets(d);
+    from = d->set[pid];
+    if ((to = find_set(d, mask)) < 0) {
+      fprintf(stderr, "demux: too many different PID routes\n");
+      return -1;
+    }
+  }
+  d->set[pid] = to;
+  if (on) {
+    d->last_from = from;
+    d->last_consumer = consumer;
+    d->last_to = to;
+  }
+  return 0;
+}
+
+/* Send the packets of pid to consumer as well */
+int demux_add(demux_t *d, int pid, int consumer)
+{
+  return route(d, pid, consumer, 1);
+}
+
+/* Stop sending the packets of pid to consumer */
+int demux_remove(demux_t *d, int pid, int consumer)
+{
+  return route(d, pid, consumer, 0);
+}
+
+/* Look up the consumer set of each of n packets.  Returns how many of
+   them anybody wants. */
+int demux_batch(demux_t *d, uint8_t **pkts, int n, uint16_t *sets)
+{
+  int i, wanted = 0;
+
+  for (i = 0; i < n; i++) {
+    sets[i] = d->set[TS_PID(pkts[i])];
+    wanted += (sets[i] != 0);
+  }
+  d->packets += n;
+  d->dropped += n - wanted;
+  return wanted;
+}
+
+void demux_report(demux_t *d, FILE *f, char *name)
+{
+  fprintf(f, "%s: software demux, %llu packets, %llu not wanted, %d consumer sets\n",
+          name, (unsigned long long)d->packets, (unsigned long long)d->dropped,
+          d->nsets - 1);
+}
+
+void demux_free(demux_t *d)
+{
+  free(d->masks);
+  d->masks = NULL;
+}
@@ -0,0 +1,42 @@
+#ifndef _DEMUX_H
+#define _DEMUX_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#define DEMUX_PIDS 8192
+#define DEMUX_MAX_SETS 65535
+
+#define TS_PID(p) ((((p)[1] & 0x1f) << 8) | (p)[2])
+
+/* Software PID demultiplexer: which consumers (outputs) want the
+   packets of each PID.  Every PID refers to a consumer set, and each
+   distinct set is stored once as a bitmask, so the table stays small -
+   16 kbytes plus a few masks - however many PIDs and consumers there
+   are.  Set 0 is the empty set: nobody wants the PID. */
+typedef struct {
+  uint16_t set[DEMUX_PIDS];    /* PID -> consumer set */
+  uint64_t *masks;             /* words bitmask words per set */
+  int words;
+  int nsets, max_sets;
+
+  /* last demux_add(), as the next one usually does the same */
+  int last_from, last_consumer, last_to;
+
+  /* statistics */
+  uint64_t packets;
+  uint64_t dropped;            /* no consumer wanted them */
+} demux_t;
+
+int demux_init(demux_t *d, int consumers);
+void demux_clear(demux_t *d);
+int demux_add(demux_t *d, int pid, int consumer);
+int demux_remove(demux_t *d, int pid, int consumer);
+int demux_batch(demux_t *d, uint8_t **pkts, int n, uint16_t *sets);
+void demux_report(demux_t *d, FILE *f, char *name);
+void demux_free(demux_t *d);
+
+/* The bitmask words of consumer set s */
+#define demux_mask(d, s) ((d)->masks + (s) * (d)->words)
+
+#endif
@@ -0,0 +1,77 @@
+/*
+ * demuxcheck.c: checks the software demux's routing table for
+ * "make check".  One PID is routed to an output and another is moved
+ * through enough different sets of outputs to fill the table of
+ * consumer sets, so the sets left behind are collected several times.
+ * After every change each PID must still go to exactly the outputs it
+ * was given, and PIDs never routed to anything to none.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "demux.h"
+
+#define CONSUMERS 20
+#define CHANGES 70000             /* past DEMUX_MAX_SETS */
+
+static int failed;
+
+/* Check that pid goes to the consumers in want, and no others */
+static void check(demux_t *d, int pid, uint32_t want, int change)
+{
+  uint64_t *m = demux_mask(d, d->set[pid]);
+
+  if (m[0] != want) {
+    if (failed++ < 10)
+      fprintf(stderr, "demuxcheck: change %d: PID %d goes to %#llx, not %#x\n",
+              change, pid, (unsigned long long)m[0], want);
+  }
+}
+
+int main(int argc, char **argv)
+{
+  demux_t d;
+  uint32_t mask = 0, next;
+  int i, c, collections = 0, nsets = 0;
+
+  if (demux_init(&d, CONSUMERS) < 0)
+    return 1;
+  demux_add(&d, 300, 0);
+
+  for (i = 1; i <= CHANGES; i++) {
+    /* Each step a set of outputs PID 100 hasn't had before, one
+       output different from the last (a Gray code) */
+    next = i ^ (i >> 1);
+    for (c = 0; c < CONSUMERS; c++) {
+      if ((next & (1 << c)) && !(mask & (1 << c)))
+        demux_add(&d, 100, c);
+      else if (!(next & (1 << c)) && (mask & (1 << c)))
+        demux_remove(&d, 100, c);
+    }
+    mask = next;
+    if (d.nsets < nsets)
+      collections++;
+    nsets = d.nsets;
+
+    check(&d, 100, mask, i);
+    check(&d, 300, 1, i);
+    check(&d, 2, 0, i);
+    check(&d, 8191, 0, i);
+  }
+
+  printf("demuxcheck: %d changes, %d set collections, %d errors\n", CHANGES, collections, failed);
+  demux_free(&d);
+  if (collections == 0) {
+    fprintf(stderr, "demuxcheck: the consumer sets were never collected\n");
+    return 1;
+  }
+  return failed ? 1 : 0;
+}
@@ -22,60 +22,481 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <resolv.h>
 #include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/epoll.h>
 
 #include "rtp.h"
+#include "rtprecv.h"
+#include "fec.h"
+#include "record.h"
 
-void dumprtp(int socket) {
-  char* buf;
+static volatile int stop = 0;
+
+static void on_signal(int sig) {
+  stop = 1;
+}
+
+static void show_counts(const char *name, const rtprecv_stats_t *rs) {
+  fprintf(stderr,"dumprtp: ");
+  if (name) fprintf(stderr,"%s: ",name);
+  fprintf(stderr,"%llu packets in %llu reads, %llu lost, %llu late, %llu duplicated, %llu reordered",
+          (unsigned long long)rs->datagrams,(unsigned long long)rs->calls,
+          (unsigned long long)rs->lost,(unsigned long long)rs->late,
+          (unsigned long long)rs->duplicates,(unsigned long long)rs->reordered);
+  if (rs->bad) fprintf(stderr,", %llu not RTP",(unsigned long long)rs->bad);
+  if (rs->restarts) fprintf(stderr,", %llu restarts",(unsigned long long)rs->restarts);
+  if (rs->fec) fprintf(stderr,", %llu recovered from %llu FEC packets",
+                       (unsigned long long)rs->recovered,(unsigned long long)rs->fec);
+  if (rs->nacks) fprintf(stderr,", %llu asked for again in %llu NACKs and %llu came",
+                         (unsigned long long)rs->nacked,(unsigned long long)rs->nacks,
+                         (unsigned long long)rs->retransmitted);
+  fprintf(stderr,"\n");
+}
+
+/* -s: print the jitter, and the latency going by the sender's RTCP
+   reports, every few seconds */
+static void show_stats(struct rtp_stats *st, struct rtpheader *rh, const rtprecv_stats_t *rs) {
+  fprintf(stderr,"dumprtp: SSRC %08x, jitter %.2f ms",rh->ssrc,st->jitter/90.0);
+  if (st->have_sr)
+    fprintf(stderr,", latency %.1f ms (max %.1f ms)",st->latency*1000,st->max_latency*1000);
+  fprintf(stderr,"\n");
+  show_counts(NULL,rs);
+}
+
+/* The packets come in batches, put back in order, and each batch goes
+   to stdout in one write */
+void dumprtp(int socket, int rtcp, int fec_col, int fec_row, int nack_ms) {
+  rtprecv_t *r;
+  rtprecv_pkt_t **pkts;
+  const rtprecv_stats_t *rs;
   struct rtpheader rh;
-  int lengthData;
-  unsigned short seq=0;
-  int flag=0;
+  struct rtp_stats st;
+  unsigned char sr[RTCP_MAX_LEN*4];
+  unsigned long long lost=0;
+  int i, n;
+  time_t now, next=0, warned=0;
+
+  if ((r=rtprecv_new(socket,(rtcp >= 0) ? RTPRECV_ARRIVAL : 0)) == NULL) {
+    fprintf(stderr,"dumprtp: out of memory\n");
+    exit(1);
+  }
+  if (fec_col >= 0 && rtprecv_fec(r,fec_col,fec_row) < 0) {
+    fprintf(stderr,"dumprtp: out of memory\n");
+    exit(1);
+  }
+  if (nack_ms > 0 && rtprecv_nack(r,nack_ms) < 0) {
+    fprintf(stderr,"dumprtp: out of memory\n");
+    exit(1);
+  }
+  rs=rtprecv_stats(r);
+  memset(&st,0,sizeof(st));
+  memset(&rh,0,sizeof(rh));
+  while(!stop) {
+    if ((n=rtprecv_get(r,&pkts)) < 0) {
+      if (errno == EINTR) continue;
+      perror("dumprtp: socket read error");
+      break;
+    }
+    if (rtcp >= 0) {
+      for (i=0; i<n; i++) {
+        rh.timestamp=pkts[i]->timestamp;
+        rh.ssrc=pkts[i]->ssrc;
+        rtp_stats_update(&st,&rh,pkts[i]->arrival);
+      }
+    }
+    if (rtprecv_write(r,1) < 0) {
+      perror("dumprtp: write error");
+      break;
+    }
+
+    now=time(NULL);
+    if (rs->lost != lost && now != warned) {
+      fprintf(stderr,"dumprtp: NETWORK CONGESTION - %llu packets lost\n",(unsigned long long)rs->lost-lost);
+      lost=rs->lost;
+      warned=now;
+    }
+    if (rtcp >= 0) {
+      while ((i=recv(rtcp,sr,sizeof(sr),MSG_DONTWAIT)) > 0) {
+        if (rtcp_parse_sr(sr,i,&st.sr) == 0) st.have_sr=1;
+      }
+      if (now >= next) {
+        if (next) show_stats(&st,&rh,rs);
+        next=now+5;
+      }
+    }
+  }
+  show_counts(NULL,rs);
+  rtprecv_free(r);
+}
+
+/* -c: one of many streams, each recorded to its own files */
+typedef struct {
+  char *name;
+  char *addr;
+  int port;
+  char *source;              /* SSM source, or NULL */
+  int fd;
+  int fec_fd[2];
+  rtprecv_t *r;
+  recorder_t rec;
+  time_t seg_start;          /* when the file was started */
+  time_t seg_end;            /* when to start the next one, 0: never */
+  int seg_same;              /* files started in the same second */
+  off_t seg_bytes;
+  unsigned long long lost;   /* when last warned of */
+  time_t warned;
+  int due;                   /* in this round's list */
+} channel_t;
+
+#define MAX_EVENTS 64
+
+static char *dir = ".";
+static int rotate_secs = 0;  /* -rotate */
+static off_t max_size = 0;   /* -maxsize */
+
+/* Read the channel list: a line "name address:port [source]" for each,
+   with # for comments.  Returns how many there are. */
+static int read_channels(const char *file, channel_t **chp) {
+  char line[512], name[256], addr[RTP_ADDR_LEN + 16], source[RTP_ADDR_LEN];
+  char host[RTP_ADDR_LEN];
+  channel_t *ch = NULL, *c;
+  FILE *f;
+  int n = 0, k, port, lineno = 0;
+
+  if ((f = fopen(file,"r")) == NULL) {
+    perror(file);
+    exit(1);
+  }
+  while (fgets(line,sizeof(line),f) != NULL) {
+    lineno++;
+    if (line[0] == '#' || (k = sscanf(line,"%255s %77s %61s",name,addr,source)) < 1)
+      continue;
+    if (k < 2 || rtp_splitaddr(addr,host,sizeof(host),&port) < 0) {
+      fprintf(stderr,"%s:%d: needs a name and address:port\n",file,lineno);
+      exit(1);
+    }
+    if ((ch = realloc(ch,(n+1)*sizeof(channel_t))) == NULL) {
+      fprintf(stderr,"dumprtp: out of memory\n");
+      exit(1);
+    }
+    c = &ch[n++];
+    memset(c,0,sizeof(channel_t));
+    c->name = strdup(name);
+    c->addr = strdup(host);
+    c->port = port;
+    c->source = (k > 2) ? strdup(source) : NULL;
+  }
+  fclose(f);
+  *chp = ch;
+  return n;
+}
+
+/* The name of the next file of channel c, started at now */
+static char *file_name(channel_t *c, time_t now) {
+  char stamp[32], *name;
+  int len = strlen(dir) + strlen(c->name) + 48;
+
+  if ((name = malloc(len)) == NULL)
+    return NULL;
+  if (rotate_secs == 0 && max_size == 0) {
+    snprintf(name,len,"%s/%s.ts",dir,c->name);
+    return name;
+  }
+  c->seg_same = (now == c->seg_start) ? c->seg_same + 1 : 1;
+  strftime(stamp,sizeof(stamp),"%Y%m%d-%H%M%S",localtime(&now));
+  if (c->seg_same > 1)
+    snprintf(name,len,"%s/%s-%s_%d.ts",dir,c->name,stamp,c->seg_same);
+  else
+    snprintf(name,len,"%s/%s-%s.ts",dir,c->name,stamp);
+  return name;
+}
 
-  while(1) {
-    getrtp2(socket,&rh, &buf,&lengthData);
-    if (flag==0) { seq=rh.b.sequence; flag=1; }
-    if (seq!=rh.b.sequence) {
-      fprintf(stderr,"rtptsaudio: NETWORK CONGESTION - expected %d, received %d\n",seq,rh.b.sequence);
-      seq=rh.b.sequence;
+/* Start the channel's next file */
+static void next_file(channel_t *c, time_t now) {
+  char *old = c->rec.filename, *name = file_name(c,now);
+
+  if (name == NULL || record_reopen(&c->rec,name) < 0)
+    perror(name ? name : "dumprtp");
+  free(old);
+  c->seg_start = now;
+  c->seg_bytes = 0;
+  if (rotate_secs)
+    c->seg_end = (now / rotate_secs + 1) * rotate_secs;
+}
+
+/* Take what has come for channel c and add it to its file */
+static int take_channel(channel_t *c) {
+  rtprecv_pkt_t **pkts;
+  struct iovec iov[RTPRECV_BATCH];
+  int i, k = 0, n;
+
+  if ((n = rtprecv_step(c->r,&pkts)) < 0)
+    return -1;
+  for (i = 0; i < n; i++) {
+    if (pkts[i]->len == 0)
+      continue;
+    iov[k].iov_base = pkts[i]->data;
+    iov[k].iov_len = pkts[i]->len;
+    c->seg_bytes += pkts[i]->len;
+    if (++k == RTPRECV_BATCH) {
+      record_write(&c->rec,iov,k);
+      k = 0;
+    }
+  }
+  if (k > 0)
+    record_write(&c->rec,iov,k);
+  if (max_size && c->seg_bytes >= max_size)
+    next_file(c,time(NULL));
+  return 0;
+}
+
+/* -c: record every channel in the list, from one epoll loop.  Each has
+   its own sockets, joined to its group, so the kernel sorts the
+   datagrams out by group and port; the packets are put in order per
+   channel and gathered into large blocks before they are written. */
+static void dumpmany(channel_t *ch, int nch, const struct netopts *defaults,
+                     int fec, int nack_ms, int stats, int direct, off_t prealloc) {
+  struct epoll_event ev, evs[MAX_EVENTS];
+  struct sockaddr_storage si;
+  struct netopts opts;
+  const rtprecv_stats_t *rs;
+  channel_t *c;
+  int *due, ndue, ep, i, k, n, fds[3], timeout, t;
+  time_t now, next = 0;
+
+  if ((ep = epoll_create1(0)) < 0) {
+    perror("dumprtp: epoll_create1");
+    exit(1);
+  }
+  if ((due = malloc(nch*sizeof(int))) == NULL) {
+    fprintf(stderr,"dumprtp: out of memory\n");
+    exit(1);
+  }
+  now = time(NULL);
+  for (i = 0; i < nch; i++) {
+    c = &ch[i];
+    opts = *defaults;
+    if (c->source)
+      opts.source = c->source;
+    c->fd = makeclientsocket(c->addr,c->port,2,&si,&opts);
+    c->fec_fd[0] = c->fec_fd[1] = -1;
+    if ((c->r = rtprecv_new(c->fd,0)) == NULL) {
+      fprintf(stderr,"dumprtp: out of memory\n");
+      exit(1);
+    }
+    if (fec) {
+      c->fec_fd[0] = makeclientsocket(c->addr,c->port+FEC_COLUMN_PORT,2,&si,&opts);
+      c->fec_fd[1] = makeclientsocket(c->addr,c->port+FEC_ROW_PORT,2,&si,&opts);
+      if (rtprecv_fec(c->r,c->fec_fd[0],c->fec_fd[1]) < 0) {
+        fprintf(stderr,"dumprtp: out of memory\n");
+        exit(1);
+      }
+    }
+    if (nack_ms > 0 && rtprecv_nack(c->r,nack_ms) < 0) {
+      fprintf(stderr,"dumprtp: out of memory\n");
+      exit(1);
+    }
+    c->seg_start = now;
+    c->seg_same = 0;
+    if (record_open(&c->rec,file_name(c,now),direct,0,REC_WAIT) < 0) {
+      perror(c->rec.filename);
+      exit(1);
+    }
+    if (prealloc)
+      record_preallocate(&c->rec,prealloc);
+    if (rotate_secs)
+      c->seg_end = (now / rotate_secs + 1) * rotate_secs;
+    n = rtprecv_fds(c->r,fds);
+    for (k = 0; k < n; k++) {
+      ev.events = EPOLLIN;
+      ev.data.u32 = i;
+      if (epoll_ctl(ep,EPOLL_CTL_ADD,fds[k],&ev) < 0) {
+        perror("dumprtp: epoll_ctl");
+        exit(1);
+      }
+    }
+    fprintf(stderr,"dumprtp: %s from %s:%d%s%s to %s\n",c->name,c->addr,c->port,
+            opts.source ? " source " : "",opts.source ? opts.source : "",c->rec.filename);
+  }
+
+  while (!stop) {
+    timeout = 1000;           // for the rotation and the stats
+    for (i = 0; i < nch; i++) {
+      t = rtprecv_timeout(ch[i].r);
+      if (t >= 0 && t < timeout)
+        timeout = t;
+    }
+    n = epoll_wait(ep,evs,MAX_EVENTS,timeout);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      perror("dumprtp: epoll_wait");
+      break;
+    }
+
+    /* The channels with something to read, and those that have waited
+       long enough for a missing packet */
+    ndue = 0;
+    for (i = 0; i < n; i++) {
+      c = &ch[evs[i].data.u32];
+      if (!c->due) {
+        c->due = 1;
+        due[ndue++] = evs[i].data.u32;
+      }
+    }
+    for (i = 0; i < nch; i++) {
+      if (!ch[i].due && rtprecv_timeout(ch[i].r) == 0) {
+        ch[i].due = 1;
+        due[ndue++] = i;
+      }
+    }
+    for (i = 0; i < ndue; i++) {
+      c = &ch[due[i]];
+      c->due = 0;
+      if (take_channel(c) < 0 && errno != EINTR)
+        fprintf(stderr,"dumprtp: %s: %s\n",c->name,strerror(errno));
+    }
+
+    now = time(NULL);
+    for (i = 0; i < nch; i++) {
+      c = &ch[i];
+      if (c->seg_end && now >= c->seg_end)
+        next_file(c,now);
+      rs = rtprecv_stats(c->r);
+      if (rs->lost != c->lost && now != c->warned) {
+        fprintf(stderr,"dumprtp: %s: %llu packets lost\n",c->name,(unsigned long long)rs->lost-c->lost);
+        c->lost = rs->lost;
+        c->warned = now;
+      }
+    }
+    if (stats && now >= next) {
+      if (next) {
+        for (i = 0; i < nch; i++)
+          show_counts(ch[i].name,rtprecv_stats(ch[i].r));
+      }
+      next = now+5;
     }
-    seq++;
-    write(1,buf,lengthData);
   }
+
+  for (i = 0; i < nch; i++) {
+    c = &ch[i];
+    show_counts(c->name,rtprecv_stats(c->r));
+    record_close(&c->rec);
+    free(c->rec.filename);
+    rtprecv_free(c->r);
+    close(c->fd);
+    for (k = 0; k < 2; k++) {
+      if (c->fec_fd[k] >= 0)
+        close(c->fec_fd[k]);
+    }
+  }
+  close(ep);
+  free(due);
 }
 
 int main(int argc, char *argv[]) {
 
-  struct sockaddr_in si;
-  int socketIn;
+  struct sockaddr_storage si, si2;
+  struct netopts opts = NETOPTS_DEFAULT;
+  int socketIn, socketRtcp=-1, stats=0, fec=0, nack_ms=0, i;
+  int socketCol=-1, socketRow=-1;
+  char *channels=NULL;
+  channel_t *ch;
+  int nch, direct=0;
+  off_t prealloc=-1;
 
   char *ip;
   int port;
 
   fprintf(stderr,"Rtp dump\n");
 
-  if (argc == 1) {
+  for (i=1; i<argc && argv[i][0]=='-'; i++) {
+    if (strcmp(argv[i],"-s")==0)
+      stats=1;
+    else if (strcmp(argv[i],"-fec")==0)
+      fec=1;
+    else if (strcmp(argv[i],"-nack")==0 && i+1<argc && (nack_ms=atoi(argv[i+1])) > 0)
+      i++;
+    else if (strcmp(argv[i],"-ssm")==0 && i+1<argc)
+      opts.source=argv[++i];
+    else if (strcmp(argv[i],"-if")==0 && i+1<argc)
+      opts.iface=argv[++i];
+    else if (strcmp(argv[i],"-rcvbuf")==0 && i+1<argc)
+      opts.rcvbuf=atoi(argv[++i]);
+    else if (strcmp(argv[i],"-c")==0 && i+1<argc)
+      channels=argv[++i];
+    else if (strcmp(argv[i],"-d")==0 && i+1<argc)
+      dir=argv[++i];
+    else if (strcmp(argv[i],"-rotate")==0 && i+1<argc)
+      rotate_secs=atoi(argv[++i]);
+    else if (strcmp(argv[i],"-maxsize")==0 && i+1<argc)
+      max_size=(off_t)atoi(argv[++i])<<20;
+    else if (strcmp(argv[i],"-prealloc")==0 && i+1<argc)
+      prealloc=(off_t)atoi(argv[++i])<<20;
+    else if (strcmp(argv[i],"-direct")==0)
+      direct=1;
+    else
+      break;
+  }
+  if (channels && argc-i == 0) {
+    ip   = NULL;
+    port = 0;
+  }
+  else if (argc-i == 0) {
     ip   = "224.0.1.2";
     port = 5004;
   }
-  else if (argc == 3) {
-    ip   = argv[1];
-    port = atoi(argv[2]);
+  else if (argc-i == 2) {
+    ip   = argv[i];
+    port = atoi(argv[i+1]);
   }
   else {
-    fprintf(stderr,"Usage %s ip port\n",argv[0]);
+    fprintf(stderr,"Usage %s [-s] [-fec] [-nack ms] [-ssm source] [-if name] [-rcvbuf bytes] ip port\n",argv[0]);
+    fprintf(stderr,"  -s        print the jitter and latency (RTCP on port+1) every 5 seconds\n");
+    fprintf(stderr,"  -fec      recover lost packets with the SMPTE 2022-1 FEC on port+2 and port+4\n");
+    fprintf(stderr,"  -nack ms  ask the sender (dvbstream -nack) for lost packets again, waiting up to ms\n");
+    fprintf(stderr,"  -ssm src  take the multicast group only from source src (IGMPv3/MLDv2)\n");
+    fprintf(stderr,"  -if name  join the group on interface name\n");
+    fprintf(stderr,"  -rcvbuf n socket receive buffer of n bytes\n");
+    fprintf(stderr,"  ip can be IPv4 or IPv6\n");
+    fprintf(stderr,"   or %s [options] -c channels [-d dir] [-rotate secs] [-maxsize MB] [-prealloc MB] [-direct]\n",argv[0]);
+    fprintf(stderr,"  -c file   record each \"name ip:port [source]\" line of file to dir/name.ts\n");
+    fprintf(stderr,"  -rotate s start a new file every s seconds, named by the time\n");
+    fprintf(stderr,"  -maxsize  start a new file after MB\n");
+    fprintf(stderr,"  -prealloc take MB of disk for each file up front (default: -maxsize)\n");
+    fprintf(stderr,"  -direct   write with O_DIRECT\n");
     exit(1);
   }
 
-  fprintf(stderr,"Using %s:%d\n",ip,port);
+  signal(SIGINT,on_signal);
+  signal(SIGTERM,on_signal);
+  if (channels) {
+    if ((nch=read_channels(channels,&ch)) == 0) {
+      fprintf(stderr,"%s: no channels\n",channels);
+      exit(1);
+    }
+    if (prealloc < 0)
+      prealloc=max_size;
+    dumpmany(ch,nch,&opts,fec,nack_ms,stats,direct,prealloc);
+    return(0);
+  }
 
-  socketIn  = makeclientsocket(ip,port,2,&si);
-  dumprtp(socketIn);
+  fprintf(stderr,"Using %s:%d\n",ip,port);
+  socketIn  = makeclientsocket(ip,port,2,&si,&opts);
+  if (stats)
+    socketRtcp = makeclientsocket(ip,port+1,2,&si2,&opts);
+  if (fec) {
+    socketCol = makeclientsocket(ip,port+FEC_COLUMN_PORT,2,&si2,&opts);
+    socketRow = makeclientsocket(ip,port+FEC_ROW_PORT,2,&si2,&opts);
+  }
+  dumprtp(socketIn,socketRtcp,socketCol,socketRow,nack_ms);
 
   close(socketIn);
   return(0);
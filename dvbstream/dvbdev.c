@@ -0,0 +1,771 @@
+/*
+ * dvbdev.c: opening the devices of a DVB card, or of a virtual card
+ * that plays a TS file (see dvbdev.h).
+ *
+ * Each device a virtual card hands out is one end of a socket pair.  A
+ * thread per card reads the file, at the bitrate asked for or as fast
+ * as it is taken, and runs every packet through the filters set on its
+ * demux devices, as the driver would (the section filters of all of
+ * them together, through secfilt.c).  What they pass is queued for the
+ * other ends of the socket pairs and sent between chunks of the file:
+ * TS packets to the DVRs, and TS packets, PES payload or sections to
+ * the demux devices.  Sections go out one at a time, each once the last
+ * has been read, so a read gives at most one section as it does from
+ * the driver.
+ *
+ * The ioctls come here with the caller's descriptor, which is matched
+ * to its device by number and by inode - a descriptor closed and
+ * reopened as something else is not taken for the device.  A device
+ * closed by its caller is noticed by the thread (its end of the pair
+ * hangs up) and dropped.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <linux/sockios.h>
+
+#include <linux/dvb/dmx.h>
+#include <linux/dvb/frontend.h>
+
+#include "dvbdev.h"
+#include "tsframe.h"
+#include "psi.h"
+#include "secfilt.h"
+
+#define TS_SIZE 188
+#define ALL_PIDS 8192
+
+#define CHUNK_PACKETS 348          /* 64 KB a go when not paced */
+#define PACE_NS 2000000            /* at most 2 ms of stream a go when paced */
+#define LOCK_MS 200
+#define IDLE_US 5000
+#define SETTLE_NS 20000000         /* filters unchanged this long before the start */
+
+#define DVR_BUFFER (2 << 20)       /* what the driver would buffer */
+#define DEMUX_BUFFER (64 << 10)
+#define SOCK_BUFFER (4 << 20)
+
+enum { DEV_FRONTEND, DEV_DEMUX, DEV_DVR };
+enum { FILTER_NONE, FILTER_PES, FILTER_SECTION };
+
+/* Which packets a card's filters want */
+#define WANT_DVR 1
+#define WANT_DEMUX 2
+#define WANT_SECTIONS 4
+
+typedef struct vdev {
+  int kind;
+  int fd;                      /* the caller's end */
+  ino_t ino;
+  int sock;                    /* ours */
+  int closed;                  /* the caller has closed its end */
+
+  /* A demux device's filter */
+  int filter;
+  int running;
+  int pid;
+  int output;                  /* DMX_OUT_... of a PES filter */
+  struct dmx_sct_filter_params sct;
+  secfilt_filter_t *sf;        /* the section filter, while it runs */
+  int pes_started;
+
+  /* Waiting to be sent */
+  uint8_t *out;
+  int len, max;
+  int limit;                   /* the device's buffer: past this it overflows */
+  uint64_t overflows;
+
+  struct vadapter *va;
+  struct vdev *next;
+} vdev_t;
+
+typedef struct vadapter {
+  char *spec;                  /* NULL: a real card */
+  char *file;
+  double rate;                 /* bit/s, 0: as fast as it is taken */
+  int lock_ms;
+  int type;
+  int loop;
+
+  int started;
+  vdev_t *devs;
+  uint8_t want[ALL_PIDS + 1];
+  int wants;                   /* all of want[] together */
+  secfilt_t *sections;         /* the section filters of the demux devices */
+  int dirty;                   /* the filters have changed */
+  int64_t changed_at;
+
+  int64_t tuned_at;            /* FE_SET_FRONTEND, 0: never tuned */
+  int event;                   /* the lock has still to be signalled */
+  struct dvb_frontend_parameters params;
+
+  int eof;
+  uint64_t packets, dropped;
+} vadapter_t;
+
+static vadapter_t vads[DVBDEV_MAX_ADAPTERS];
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static int env_read = 0;
+
+static int64_t now_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* Path of a device ("frontend0", "dvr0" or "demux0") of DVB card n */
+const char *dvbdev_path(int adapter, const char *dev)
+{
+  static char path[64];
+
+  snprintf(path, sizeof(path), "/dev/dvb/adapter%d/%s", adapter, dev);
+  return path;
+}
+
+/* Make adapter n a virtual card playing spec (see dvbdev.h) */
+int dvbdev_virtual(int adapter, const char *spec)
+{
+  vadapter_t *va;
+  char *s, *opt, *save;
+
+  if (adapter < 0 || adapter >= DVBDEV_MAX_ADAPTERS) {
+    errno = EINVAL;
+    return -1;
+  }
+  va = &vads[adapter];
+  if (va->started) {
+    errno = EBUSY;
+    return -1;
+  }
+  free(va->spec);
+  va->spec = strdup(spec);
+  va->rate = 0;
+  va->lock_ms = LOCK_MS;
+  va->type = FE_QPSK;
+  va->loop = 0;
+
+  s = strdup(spec);
+  va->file = strtok_r(s, ",", &save);
+  while ((opt = strtok_r(NULL, ",", &save)) != NULL) {
+    if (strncmp(opt, "rate=", 5) == 0)
+      va->rate = atof(opt + 5) * 1000;
+    else if (strncmp(opt, "lock=", 5) == 0)
+      va->lock_ms = atoi(opt + 5);
+    else if (strcmp(opt, "type=s") == 0)
+      va->type = FE_QPSK;
+    else if (strcmp(opt, "type=c") == 0)
+      va->type = FE_QAM;
+    else if (strcmp(opt, "type=t") == 0)
+      va->type = FE_OFDM;
+    else if (strcmp(opt, "loop") == 0)
+      va->loop = 1;
+    else {
+      fprintf(stderr, "dvbdev: unknown option \"%s\" for virtual adapter %d\n", opt, adapter);
+      free(s);
+      free(va->spec);
+      va->spec = NULL;
+      errno = EINVAL;
+      return -1;
+    }
+  }
+  if (va->file == NULL) {
+    free(s);
+    free(va->spec);
+    va->spec = NULL;
+    errno = EINVAL;
+    return -1;
+  }
+  return 0;
+}
+
+static void read_env(void)
+{
+  char name[32], *spec;
+  int n;
+
+  if (env_read)
+    return;
+  env_read = 1;
+  for (n = 0; n < DVBDEV_MAX_ADAPTERS; n++) {
+    if (n == 0)
+      strcpy(name, "DVB_VIRTUAL");
+    else
+      snprintf(name, sizeof(name), "DVB_VIRTUAL%d", n);
+    if ((spec = getenv(name)) != NULL && spec[0] && vads[n].spec == NULL)
+      dvbdev_virtual(n, spec);
+  }
+}
+
+/* Queue bytes for a device, or count them lost if its buffer is full */
+static void put(vdev_t *d, const uint8_t *p, int n)
+{
+  if (d->len + n > d->limit) {
+    d->overflows++;
+    return;
+  }
+  if (d->len + n > d->max) {
+    d->max = (d->len + n) * 2;
+    d->out = realloc(d->out, d->max);
+  }
+  memcpy(d->out + d->len, p, n);
+  d->len += n;
+}
+
+static int section_cb(void *arg, uint8_t *sec, int len)
+{
+  vdev_t *d = arg;
+
+  if (!d->running)
+    return 0;
+  put(d, sec, len);
+  if (d->sct.flags & DMX_ONESHOT) {
+    d->running = 0;
+    d->va->dirty = 1;
+  }
+  return 0;
+}
+
+/* A packet through one demux device's filter, to its own output */
+static void demux_packet(vdev_t *d, uint8_t *p)
+{
+  int af, l;
+
+  if (d->output == DMX_OUT_TSDEMUX_TAP) {
+    put(d, p, TS_SIZE);
+    return;
+  }
+  /* DMX_OUT_TAP: the PES packets, from the first that starts */
+  af = (p[3] >> 4) & 3;
+  if (!(af & 1) || (p[1] & 0x80))
+    return;
+  l = (af == 3) ? 5 + p[4] : 4;
+  if (p[1] & 0x40)
+    d->pes_started = 1;
+  if (d->pes_started && l < TS_SIZE)
+    put(d, p + l, TS_SIZE - l);
+}
+
+/* A device's section filter is only in the card's filters while it runs */
+static void drop_section(vadapter_t *va, vdev_t *d)
+{
+  if (d->sf != NULL) {
+    secfilt_remove(va->sections, d->sf);
+    d->sf = NULL;
+  }
+}
+
+static void rebuild_want(vadapter_t *va)
+{
+  vdev_t *d;
+  int flags;
+
+  memset(va->want, 0, sizeof(va->want));
+  va->wants = 0;
+  for (d = va->devs; d != NULL; d = d->next) {
+    if (d->kind != DEV_DEMUX)
+      continue;
+    if (d->closed || !d->running) {
+      drop_section(va, d);
+      continue;
+    }
+    if (d->filter == FILTER_SECTION && d->sf == NULL) {
+      flags = (d->sct.flags & DMX_CHECK_CRC) ? SECFILT_CRC : 0;
+      d->sf = secfilt_add(va->sections, d->pid, d->sct.filter.filter, d->sct.filter.mask,
+                          d->sct.filter.mode, flags, section_cb, d);
+    }
+    if (d->filter == FILTER_PES && d->output == DMX_OUT_TS_TAP)
+      va->want[d->pid] |= WANT_DVR;
+    else if (d->filter == FILTER_SECTION)
+      va->want[d->pid] |= WANT_SECTIONS;
+    else if (d->filter == FILTER_PES && (d->output == DMX_OUT_TAP || d->output == DMX_OUT_TSDEMUX_TAP))
+      va->want[d->pid] |= WANT_DEMUX;
+    va->wants |= va->want[d->pid];
+  }
+  va->dirty = 0;
+}
+
+/* The packets of a chunk through the filters */
+static void filter_packets(vadapter_t *va, uint8_t **pkts, int n)
+{
+  vdev_t *d;
+  int i, pid, w;
+
+  if (va->dirty)
+    rebuild_want(va);
+  for (i = 0; i < n; i++) {
+    pid = ((pkts[i][1] & 0x1f) << 8) | pkts[i][2];
+    w = va->want[pid] | va->want[ALL_PIDS];
+    if (w & WANT_DVR) {
+      for (d = va->devs; d != NULL; d = d->next) {
+        if (d->kind == DEV_DVR && !d->closed)
+          put(d, pkts[i], TS_SIZE);
+      }
+    }
+    if (w & WANT_SECTIONS)
+      secfilt_packet(va->sections, pkts[i]);
+    if (w & WANT_DEMUX) {
+      for (d = va->devs; d != NULL; d = d->next) {
+        if (d->kind == DEV_DEMUX && d->running && d->filter == FILTER_PES
+            && (d->pid == pid || d->pid == ALL_PIDS) && d->output != DMX_OUT_TS_TAP)
+          demux_packet(d, pkts[i]);
+      }
+    }
+  }
+  va->packets += n;
+}
+
+static fe_status_t fe_status(vadapter_t *va)
+{
+  if (va->tuned_at == 0 || now_ns() >= va->tuned_at + va->lock_ms * 1000000LL)
+    return FE_HAS_SIGNAL | FE_HAS_CARRIER | FE_HAS_VITERBI | FE_HAS_SYNC | FE_HAS_LOCK;
+  return FE_HAS_SIGNAL | FE_HAS_CARRIER;
+}
+
+/* Once the frontend has locked, tell its users: as with the driver,
+   the event makes the frontend poll with POLLPRI until FE_GET_EVENT */
+static void check_lock(vadapter_t *va)
+{
+  vdev_t *d;
+  char c = 1;
+
+  if (!va->event || !(fe_status(va) & FE_HAS_LOCK))
+    return;
+  for (d = va->devs; d != NULL; d = d->next) {
+    if (d->kind == DEV_FRONTEND && !d->closed)
+      send(d->sock, &c, 1, MSG_OOB | MSG_DONTWAIT | MSG_NOSIGNAL);
+  }
+  va->event = 0;
+}
+
+/* Drop the devices their callers have closed */
+static void reap(vadapter_t *va)
+{
+  struct pollfd pfd;
+  vdev_t **dp, *d;
+
+  for (dp = &va->devs; (d = *dp) != NULL; ) {
+    pfd.fd = d->sock;
+    pfd.events = 0;
+    if (!d->closed && poll(&pfd, 1, 0) > 0 && (pfd.revents & (POLLHUP | POLLERR)))
+      d->closed = 1;
+    if (d->closed) {
+      *dp = d->next;
+      if (d->kind == DEV_DEMUX)
+        va->dirty = 1;
+      drop_section(va, d);
+      if (!va->eof)
+        va->dropped += d->overflows;
+      close(d->sock);
+      free(d->out);
+      free(d);
+      continue;
+    }
+    dp = &d->next;
+  }
+}
+
+/* Send what is queued for a device.  Sections go one at a time, each
+   once the last has been read.  With blocking set, wait for the reader
+   rather than leaving the rest queued. */
+static void flush_dev(vdev_t *d, int blocking)
+{
+  int n, unread, len;
+
+  if (d->len == 0 || d->closed)
+    return;
+  if (d->filter == FILTER_SECTION) {
+    if (ioctl(d->sock, SIOCOUTQ, &unread) < 0 || unread > 0)
+      return;
+    len = 3 + (((d->out[1] & 0x0f) << 8) | d->out[2]);
+    n = send(d->sock, d->out, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+  } else {
+    n = send(d->sock, d->out, d->len, (blocking ? 0 : MSG_DONTWAIT) | MSG_NOSIGNAL);
+  }
+  if (n < 0) {
+    if (errno == EPIPE || errno == ECONNRESET)
+      d->closed = 1;
+    return;
+  }
+  d->len -= n;
+  memmove(d->out, d->out + n, d->len);
+}
+
+/* Every device that can see end of file sees it */
+static void end_devs(vadapter_t *va)
+{
+  vdev_t *d;
+
+  for (d = va->devs; d != NULL; d = d->next) {
+    if (d->kind != DEV_FRONTEND && d->len == 0 && !d->closed)
+      shutdown(d->sock, SHUT_WR);
+  }
+}
+
+/* Is anybody taking what the file would give?  Without a bitrate the
+   file only moves for them, and only starts once the filters have been
+   left alone for a moment - a program sets them one at a time, and
+   would otherwise miss the start of the file on all but the first. */
+static int wanted(vadapter_t *va)
+{
+  vdev_t *d;
+  int dvr = 0;
+
+  if (va->dirty)
+    rebuild_want(va);
+  for (d = va->devs; d != NULL; d = d->next) {
+    if (d->kind == DEV_DVR && !d->closed)
+      dvr = 1;
+  }
+  if (va->packets == 0 && now_ns() - va->changed_at < SETTLE_NS)
+    return 0;
+  return (va->wants & (WANT_DEMUX | WANT_SECTIONS)) || ((va->wants & WANT_DVR) && dvr);
+}
+
+static void *play(void *arg)
+{
+  vadapter_t *va = arg;
+  ts_framer_t fr;
+  uint8_t *buf, *pkts[CHUNK_PACKETS];
+  vdev_t *d, *dvr[16];
+  int fd, len = 0, used, n, i, ndvr, size, chunk = CHUNK_PACKETS, idle;
+  int64_t t0 = 0, played = 0, due, t;
+  struct timespec ts;
+
+  ts_framer_init(&fr);
+  fd = open(va->file, O_RDONLY);
+  if (va->rate > 0) {
+    chunk = va->rate * PACE_NS / 1e9 / (TS_SIZE * 8);
+    if (chunk < 1) chunk = 1;
+    if (chunk > CHUNK_PACKETS) chunk = CHUNK_PACKETS;
+  }
+  /* A chunk of the largest packets, and enough more for the framer to
+     find its feet however few packets a chunk is */
+  size = chunk * 204 + TS_SYNC_WINDOW;
+  buf = malloc(size);
+
+  for (;;) {
+    pthread_mutex_lock(&lock);
+    reap(va);
+    check_lock(va);
+    idle = va->eof || fd < 0 || !(fe_status(va) & FE_HAS_LOCK)
+           || (va->rate == 0 && !wanted(va));
+    if (idle)
+      t0 = 0;
+    n = 0;
+    if (!idle) {
+      /* Read the next chunk, and put it through the filters */
+      i = (len < size) ? read(fd, buf + len, size - len) : 1;
+      if (i > 0 && len < size)
+        len += i;
+      n = ts_frame(&fr, buf, len, pkts, chunk, &used);
+      filter_packets(va, pkts, n);
+      len -= used;
+      memmove(buf, buf + used, len);
+      if (n == 0 && i == 0 && va->loop && va->packets > 0) {
+        lseek(fd, 0, SEEK_SET);
+        ts_framer_init(&fr);
+        len = 0;
+      } else if (n == 0 && i <= 0) {
+        va->eof = 1;
+        for (d = va->devs; d != NULL; d = d->next)
+          va->dropped += d->overflows;
+        fprintf(stderr, "dvbdev: end of %s after %llu packets, %llu overflows\n", va->file,
+                (unsigned long long)va->packets, (unsigned long long)va->dropped);
+      }
+    }
+    if (va->eof)
+      end_devs(va);
+
+    /* Without a bitrate the DVRs wait for their readers, which mustn't
+       hold up the ioctls, so they are sent to without the lock.  Only
+       this thread touches their queues or frees a device. */
+    ndvr = 0;
+    for (d = va->devs; d != NULL; d = d->next) {
+      if (va->rate == 0 && d->kind == DEV_DVR && ndvr < 16)
+        dvr[ndvr++] = d;
+      else
+        flush_dev(d, 0);
+    }
+    pthread_mutex_unlock(&lock);
+    for (i = 0; i < ndvr; i++)
+      flush_dev(dvr[i], 1);
+
+    if (n == 0) {
+      usleep(IDLE_US);
+      continue;
+    }
+    if (va->rate > 0) {
+      /* Keep to the bitrate: this chunk was due played packets in */
+      t = now_ns();
+      if (t0 == 0) {
+        t0 = t;
+        played = 0;
+      }
+      played += n;
+      due = t0 + (int64_t)(played * TS_SIZE * 8 / va->rate * 1e9);
+      if (due > t) {
+        ts.tv_sec = due / 1000000000LL;
+        ts.tv_nsec = due % 1000000000LL;
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+      }
+    }
+  }
+  return NULL;
+}
+
+int dvbdev_open(int adapter, const char *dev, int flags)
+{
+  vadapter_t *va;
+  vdev_t *d;
+  pthread_t thread;
+  struct stat st;
+  int sv[2], kind, size = SOCK_BUFFER;
+
+  pthread_mutex_lock(&lock);
+  read_env();
+  pthread_mutex_unlock(&lock);
+  if (adapter < 0 || adapter >= DVBDEV_MAX_ADAPTERS || vads[adapter].spec == NULL)
+    return open(dvbdev_path(adapter, dev), flags);
+
+  va = &vads[adapter];
+  if (strncmp(dev, "frontend", 8) == 0)
+    kind = DEV_FRONTEND;
+  else if (strncmp(dev, "demux", 5) == 0)
+    kind = DEV_DEMUX;
+  else if (strncmp(dev, "dvr", 3) == 0)
+    kind = DEV_DVR;
+  else {
+    errno = ENODEV;
+    return -1;
+  }
+  if (access(va->file, R_OK) < 0)
+    return -1;
+
+  if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0)
+    return -1;
+  if (flags & O_NONBLOCK)
+    fcntl(sv[0], F_SETFL, O_NONBLOCK);
+  setsockopt(sv[1], SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+  fstat(sv[0], &st);
+
+  d = calloc(1, sizeof(vdev_t));
+  d->kind = kind;
+  d->fd = sv[0];
+  d->ino = st.st_ino;
+  d->sock = sv[1];
+  d->limit = (kind == DEV_DVR) ? DVR_BUFFER : DEMUX_BUFFER;
+  d->va = va;
+
+  pthread_mutex_lock(&lock);
+  d->next = va->devs;
+  va->devs = d;
+  if (kind == DEV_DVR) {
+    va->dirty = 1;
+    va->changed_at = now_ns();
+  }
+  if (va->eof && kind != DEV_FRONTEND)
+    shutdown(d->sock, SHUT_WR);
+  if (!va->started) {
+    va->started = 1;
+    if (pthread_create(&thread, NULL, play, va) == 0)
+      pthread_detach(thread);
+  }
+  pthread_mutex_unlock(&lock);
+  return sv[0];
+}
+
+/* The device fd is, if it is one of the virtual cards'.  Called with
+   the lock held. */
+static vdev_t *find(int fd, vadapter_t **vap)
+{
+  struct stat st;
+  vdev_t *d;
+  int a;
+
+  if (fstat(fd, &st) < 0)
+    return NULL;
+  for (a = 0; a < DVBDEV_MAX_ADAPTERS; a++) {
+    for (d = vads[a].devs; d != NULL; d = d->next) {
+      if (d->fd == fd && d->ino == st.st_ino && !d->closed) {
+        *vap = &vads[a];
+        return d;
+      }
+    }
+  }
+  return NULL;
+}
+
+static int frontend_ioctl(vadapter_t *va, vdev_t *d, unsigned long request, void *arg)
+{
+  struct dvb_frontend_info *info;
+  struct dvb_frontend_event *ev;
+  char c;
+
+  switch (request) {
+  case FE_GET_INFO:
+    info = arg;
+    memset(info, 0, sizeof(*info));
+    snprintf(info->name, sizeof(info->name), "Virtual DVB adapter (%s)", va->file);
+    info->type = va->type;
+    info->frequency_min = (va->type == FE_QPSK) ? 950000 : 47000000;
+    info->frequency_max = (va->type == FE_QPSK) ? 2150000 : 862000000;
+    info->frequency_stepsize = (va->type == FE_QPSK) ? 125 : 166667;
+    info->symbol_rate_min = 1000000;
+    info->symbol_rate_max = 45000000;
+    info->caps = FE_CAN_INVERSION_AUTO | FE_CAN_FEC_AUTO | FE_CAN_QAM_AUTO
+                 | FE_CAN_TRANSMISSION_MODE_AUTO | FE_CAN_GUARD_INTERVAL_AUTO
+                 | FE_CAN_HIERARCHY_AUTO;
+    return 0;
+  case FE_SET_FRONTEND:
+    va->params = *(struct dvb_frontend_parameters *)arg;
+    va->tuned_at = now_ns();
+    va->event = 1;
+    check_lock(va);
+    return 0;
+  case FE_GET_FRONTEND:
+    *(struct dvb_frontend_parameters *)arg = va->params;
+    return 0;
+  case FE_READ_STATUS:
+    *(fe_status_t *)arg = fe_status(va);
+    return 0;
+  case FE_GET_EVENT:
+    if (recv(d->fd, &c, 1, MSG_OOB | MSG_DONTWAIT) != 1) {
+      errno = EWOULDBLOCK;
+      return -1;
+    }
+    ev = arg;
+    ev->status = fe_status(va);
+    ev->parameters = va->params;
+    return 0;
+  case FE_READ_BER:
+  case FE_READ_UNCORRECTED_BLOCKS:
+    *(uint32_t *)arg = 0;
+    return 0;
+  case FE_READ_SIGNAL_STRENGTH:
+  case FE_READ_SNR:
+    *(uint16_t *)arg = (fe_status(va) & FE_HAS_LOCK) ? 0xc000 : 0x4000;
+    return 0;
+  case FE_SET_TONE:
+  case FE_SET_VOLTAGE:
+  case FE_ENABLE_HIGH_LNB_VOLTAGE:
+  case FE_DISEQC_SEND_MASTER_CMD:
+  case FE_DISEQC_SEND_BURST:
+  case FE_DISEQC_RESET_OVERLOAD:
+    return 0;
+  }
+  errno = ENOTTY;
+  return -1;
+}
+
+static int demux_ioctl(vadapter_t *va, vdev_t *d, unsigned long request, void *arg)
+{
+  struct dmx_pes_filter_params *pes;
+  struct dmx_sct_filter_params *sct;
+
+  switch (request) {
+  case DMX_SET_PES_FILTER:
+    pes = arg;
+    if (pes->pid > ALL_PIDS || pes->input != DMX_IN_FRONTEND) {
+      errno = EINVAL;
+      return -1;
+    }
+    drop_section(va, d);
+    d->filter = FILTER_PES;
+    d->pid = pes->pid;
+    d->output = pes->output;
+    d->pes_started = 0;
+    d->running = (pes->flags & DMX_IMMEDIATE_START) != 0;
+    d->len = 0;
+    break;
+  case DMX_SET_FILTER:
+    sct = arg;
+    if (sct->pid >= ALL_PIDS) {
+      errno = EINVAL;
+      return -1;
+    }
+    if (va->sections == NULL && (va->sections = secfilt_new(NULL)) == NULL) {
+      errno = ENOMEM;
+      return -1;
+    }
+    drop_section(va, d);
+    d->filter = FILTER_SECTION;
+    d->pid = sct->pid;
+    d->sct = *sct;
+    d->running = (sct->flags & DMX_IMMEDIATE_START) != 0;
+    d->len = 0;
+    break;
+  case DMX_START:
+    if (d->filter == FILTER_NONE) {
+      errno = EINVAL;
+      return -1;
+    }
+    drop_section(va, d);
+    d->running = 1;
+    break;
+  case DMX_STOP:
+    drop_section(va, d);
+    d->running = 0;
+    break;
+  case DMX_SET_BUFFER_SIZE:
+    d->limit = (int)(unsigned long)arg;
+    return 0;
+  default:
+    errno = ENOTTY;
+    return -1;
+  }
+  va->dirty = 1;
+  va->changed_at = now_ns();
+  return 0;
+}
+
+/* ioctl() for a device from dvbdev_open(), virtual or not */
+int dvbdev_ioctl(int fd, unsigned long request, ...)
+{
+  vadapter_t *va = NULL;
+  vdev_t *d;
+  va_list ap;
+  void *arg;
+  int r;
+
+  va_start(ap, request);
+  arg = va_arg(ap, void *);
+  va_end(ap);
+
+  pthread_mutex_lock(&lock);
+  if ((d = find(fd, &va)) == NULL) {
+    pthread_mutex_unlock(&lock);
+    return ioctl(fd, request, arg);
+  }
+  if (d->kind == DEV_FRONTEND)
+    r = frontend_ioctl(va, d, request, arg);
+  else if (d->kind == DEV_DEMUX)
+    r = demux_ioctl(va, d, request, arg);
+  else if (request == DMX_SET_BUFFER_SIZE) {
+    d->limit = (int)(unsigned long)arg;
+    r = 0;
+  } else {
+    errno = ENOTTY;
+    r = -1;
+  }
+  pthread_mutex_unlock(&lock);
+  return r;
+}
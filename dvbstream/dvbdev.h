@@ -0,0 +1,35 @@
+#ifndef _DVBDEV_H
+#define _DVBDEV_H
+
+/* The frontend, demux and DVR devices of DVB card n, or of a virtual
+   card that plays a TS file instead, so that tuning, section filters and
+   streaming can be tried out and timed without a card.
+
+   A virtual card is set up in the environment: DVB_VIRTUAL for adapter 0
+   and DVB_VIRTUAL1, DVB_VIRTUAL2 ... for the others, each
+
+     file.ts[,rate=kbit][,lock=ms][,type=s|c|t][,loop]
+
+   rate is the bitrate to play the file at; without it the file is read
+   as fast as the readers of the DVR take it.  lock is how long the
+   frontend takes to lock after FE_SET_FRONTEND (default 200 ms), and
+   nothing comes out of the demux in between.  type is the kind of
+   frontend FE_GET_INFO reports (default s, DVB-S).  With loop the file
+   starts again at its end; otherwise the DVR and demux devices see end
+   of file there.
+
+   Its descriptors are sockets, so read(), poll() and close() work on
+   them as on the devices; only the open and the ioctls go through
+   here.  PES filters (to the DVR, or their TS packets or PES payload
+   to the demux device) and section filters, with filter, mask and mode
+   as the driver has them, DMX_CHECK_CRC and DMX_ONESHOT, are done in
+   software.  Section filter timeouts are ignored. */
+
+#define DVBDEV_MAX_ADAPTERS 8
+
+const char *dvbdev_path(int adapter, const char *dev);
+int dvbdev_virtual(int adapter, const char *spec);
+int dvbdev_open(int adapter, const char *dev, int flags);
+int dvbdev_ioctl(int fd, unsigned long request, ...);
+
+#endif
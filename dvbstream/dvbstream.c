@@ -31,6 +31,7 @@ Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
 #include <sys/ioctl.h>
 #include <sys/time.h>
 #include <sys/poll.h>
+#include <sys/epoll.h>
 #include <sys/stat.h>
 #include <resolv.h>
 #include <fcntl.h>
@@ -38,9 +39,12 @@ Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
 #include <signal.h>
 #include <values.h>
 #include <string.h>
+#include <stdarg.h>
+#include <time.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <netdb.h>
+#include <arpa/inet.h>
 
 // DVB includes:
 #include <linux/dvb/dmx.h>
@@ -51,6 +55,22 @@ Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
 #include "mpegtools/remux.h"
 
 #include "tune.h"
+#include "dvbdev.h"
+#include "ingest.h"
+#include "egress.h"
+#include "record.h"
+#include "timeshift.h"
+#include "packetiser.h"
+#include "pacer.h"
+#include "pcrclock.h"
+#include "pipeline.h"
+#include "demux.h"
+#include "psi.h"
+#include "secfilt.h"
+#include "control.h"
+#include "analyse.h"
+#include "tr101290.h"
+#include "stats.h"
 
 // The default telnet port.
 #define DEFAULT_PORT 12345
@@ -78,11 +98,6 @@ unsigned int SLOF=(11700*1000UL);
 unsigned int LOF1=(9750*1000UL);
 unsigned int LOF2=(10600*1000UL);
 
-char* frontenddev[4]={"/dev/dvb/adapter0/frontend0","/dev/dvb/adapter1/frontend0","/dev/dvb/adapter2/frontend0","/dev/dvb/adapter3/frontend0"};
-char* dvrdev[4]={"/dev/dvb/adapter0/dvr0","/dev/dvb/adapter1/dvr0","/dev/dvb/adapter2/dvr0","/dev/dvb/adapter3/dvr0"};
-char* demuxdev[4]={"/dev/dvb/adapter0/demux0","/dev/dvb/adapter1/demux0","/dev/dvb/adapter2/demux0","/dev/dvb/adapter3/demux0"};
-
-int card=0;
 long now;
 long real_start_time;
 int Interrupted=0;
@@ -97,15 +112,14 @@ fe_hierarchy_t hier=HIERARCHY_DEFAULT;
 unsigned char diseqc=0;
 char pol=0;
 int streamtype = RTP;
-static int use_stdin=0;
 
 #define PID_MODE 0
 #define PROG_MODE 1
 static int selection_mode = PID_MODE;
 
 
-int open_fe(int* fd_frontend) {
-    if((*fd_frontend = open(frontenddev[card],O_RDWR | O_NONBLOCK)) < 0){
+int open_fe(int* fd_frontend, int card) {
+    if((*fd_frontend = dvbdev_open(card,"frontend0",O_RDWR | O_NONBLOCK)) < 0){
         perror("FRONTEND DEVICE: ");
         return -1;
     }
@@ -133,6 +147,8 @@ long getmsec() {
 
 // There seems to be a limit of 16 simultaneous filters in the driver
 #define MAX_CHANNELS 16
+// Past that the whole TS is read and the PIDs are picked out in software
+#define MAX_USER_PIDS 1024
 
 
 
@@ -147,7 +163,7 @@ void set_ts_filt(int fd,uint16_t pid, dmx_pes_type_t pestype)
   pesFilterParams.pes_type = pestype;
   pesFilterParams.flags   = DMX_IMMEDIATE_START;
 
-  if (ioctl(fd, DMX_SET_PES_FILTER, &pesFilterParams) < 0)  {
+  if (dvbdev_ioctl(fd, DMX_SET_PES_FILTER, &pesFilterParams) < 0)  {
     fprintf(stderr,"Failed setting filter for pid %i: ",pid);
     perror("DMX SET PES FILTER");
   }
@@ -167,206 +183,307 @@ void make_nonblock(int f) {
 
 typedef enum {STREAM_ON,STREAM_OFF} state_t;
 
+#define SDT_PID 0x11
 
-  int socketIn, ns;
-  int pids[MAX_CHANNELS];
-  int pestypes[MAX_CHANNELS];
-  unsigned char hi_mappids[8192];
-  unsigned char lo_mappids[8192];
+#define getbit(buf, pid) (buf[(pid)/8] & (1 << ((pid) % 8)))
+#define setbit(buf, pid) buf[(pid)/8] |= (1 << ((pid) % 8))
+#define clearbit(buf, pid) buf[(pid)/8] &= ~(1 << ((pid) % 8))
+#define clearbits(buf) memset(buf, 0, sizeof(PID_BIT_MAP))
+#define setallbits(buf) memset(buf, 0xFF, sizeof(PID_BIT_MAP))
+#define min(x, y) ((x) <= (y) ? (x) : (y))
+
+
+typedef uint8_t PID_BIT_MAP[1024];
+
+typedef struct {
+  int program;
+  int pmt_pid;
+} pat_entry;
+
+typedef struct {
+  psi_table_t table;
+  pat_entry *entries;
+  int entries_cnt;
+} pat_t;
+
+typedef struct {
+  secfilt_filter_t *filter;
+  psi_table_t table;
+  int *pids;          // the PCR PID, then the elementary streams
+  int pids_cnt;
+  int pids_max;
+  uint8_t name[256];
+} pmt_t;
+
+typedef struct {
+  pmt_t *entries;
+  int cnt;
+} pmt_list_t;
+
+typedef struct {
+  psi_table_t table;
+} sdt_t;
+
+/* A DVB adapter - or a file or FIFO standing in for one - with its own
+   tuning, PID filters and SI tables.  Each output map is fed from one
+   adapter. */
+#define MAX_ADAPTERS 16
+
+typedef struct {
+  int card;                 // DVB card number
+  char *input;              // file read instead of the card, "-" for stdin
+  int fd_dvr;
   int fd_frontend;
-  int pid,pid2;
-  int connectionOpen;
-  int fromlen;
-  char hostname[64];
-  char in_ch;
-  struct hostent *hp;
-  struct sockaddr_in name, fsin;
-  int ReUseAddr=1;
-  int oldflags;
-  int npids = 0;
-  int fd[MAX_CHANNELS];
-  int to_stdout = 0; /* to stdout instead of rtp stream */
+  int fd[MAX_CHANNELS];     // demux filters
+  int pids[MAX_USER_PIDS];
+  int pestypes[MAX_USER_PIDS];
+  int npids;
+  int soft_demux;           // more PIDs than filters: one filter for the whole TS
+  int SI_fd[MAX_CHANNELS];  // demux filters for the PMTs
+  int SI_fd_cnt;
+  int whole_ts;             // filter the whole TS (-prog)
+
+  /* tuning */
+  unsigned long freq;
+  unsigned long srate;
+  char pol;
+  int tone;
+  fe_spectral_inversion_t specInv;
+  unsigned char diseqc;
+  fe_modulation_t modulation;
+  fe_code_rate_t HP_CodeRate, LP_CodeRate;
+  fe_transmit_mode_t TransmissionMode;
+  fe_guard_interval_t guardInterval;
+  fe_bandwidth_t bandWidth;
+  fe_hierarchy_t hier;
+
+  /* SI */
+  pat_t PAT;
+  pmt_list_t PMT;
+  sdt_t SDT;
+  PID_BIT_MAP SI_PIDS;
+  PID_BIT_MAP USER_PIDS;
+  PID_BIT_MAP MAP_PIDS;     // read only for a telnet MAP n ADD
+  psi_stats_t psi;
+  secfilt_t *sections;      // the PAT, SDT and PMTs, from the SI PIDs
+
+  /* for each PID, the maps of this adapter it goes to - or with the
+     software demux in RTP_TS mode, whether output 0 wants it */
+  demux_t demux;
+
+  pcr_clock_t clock;        // the stream's time line, for RTP timestamps
+  uint64_t *pid_packets;    // packets of each PID, for the telnet STATS
+  tr_monitor_t *mon;        // -monitor
+  uint64_t mon_versions;    // the PSI versions it has the PIDs of
+  ingest_t ingest;
+  int done;                 // reached the end of its input
+  int always_ready;         // a regular file, which epoll can't watch
+} adapter_t;
+
+static adapter_t adapters[MAX_ADAPTERS];
+static int adapter_cnt = 0;
+static adapter_t *cur;      // the adapter whose packets are being handled
+
+static int is_file(adapter_t *ad)
+{
+  return ad->input != NULL;
+}
 
-  /* rtp */
-  struct rtpheader hdr;
-  struct sockaddr_in sOut;
-  int socketOut;
+/* Take the tuning options given so far for adapter ad */
+static void save_tuning(adapter_t *ad, unsigned long freq, unsigned long srate)
+{
+  ad->freq = freq;
+  ad->srate = srate;
+  ad->pol = pol;
+  ad->tone = tone;
+  ad->specInv = specInv;
+  ad->diseqc = diseqc;
+  ad->modulation = modulation;
+  ad->HP_CodeRate = HP_CodeRate;
+  ad->LP_CodeRate = LP_CodeRate;
+  ad->TransmissionMode = TransmissionMode;
+  ad->guardInterval = guardInterval;
+  ad->bandWidth = bandWidth;
+  ad->hier = hier;
+}
 
-  ipack pa, pv;
+static int tune_adapter(adapter_t *ad)
+{
+  return tune_it(ad->fd_frontend,ad->freq,ad->srate,ad->pol,ad->tone,ad->specInv,ad->diseqc,ad->modulation,ad->HP_CodeRate,ad->TransmissionMode,ad->guardInterval,ad->bandWidth,ad->LP_CodeRate,ad->hier);
+}
 
-#define IPACKS 2048
-#define TS_SIZE 188
-#define IN_SIZE TS_SIZE
+static int pat_section(void *arg, uint8_t *sec, int len);
+static int sdt_section(void *arg, uint8_t *sec, int len);
+static int pmt_section(void *arg, uint8_t *sec, int len);
+
+static adapter_t *new_adapter(int card, char *input)
+{
+  adapter_t *ad;
+
+  if (adapter_cnt == MAX_ADAPTERS) {
+    fprintf(stderr,"ERROR: at most %d adapters can be used\n",MAX_ADAPTERS);
+    exit(1);
+  }
+  ad = &adapters[adapter_cnt++];
+  memset(ad, 0, sizeof(adapter_t));
+  ad->card = card;
+  ad->input = input;
+  ad->fd_dvr = -1;
+  ad->fd_frontend = -1;
+  ad->pids[0] = 0;
+  ad->npids = 1;
+  psi_table_init(&ad->PAT.table, 0x00, -1, &ad->psi);
+  psi_table_init(&ad->SDT.table, 0x42, -1, &ad->psi);
+  if ((ad->sections = secfilt_new(&ad->psi)) == NULL) {
+    fprintf(stderr, "Out of memory\n");
+    exit(1);
+  }
+  secfilt_add_table(ad->sections, 0, 0x00, -1, 0, pat_section, NULL);
+  secfilt_add_table(ad->sections, SDT_PID, 0x42, -1, 0, sdt_section, NULL);
+  setbit(ad->SI_PIDS, 0);
+  setbit(ad->SI_PIDS, SDT_PID);
+  setbit(ad->USER_PIDS, 0);
+  pcr_clock_init(&ad->clock, -1);
+  return ad;
+}
+
+static void build_routes(adapter_t *ad);
+
+/* The demux filters in use: one per PID, or just the one for the whole
+   TS when the PIDs are picked out in software */
+static int filter_cnt(adapter_t *ad)
+{
+  return ad->soft_demux ? 1 : ad->npids;
+}
 
-int process_telnet() {
-  char cmd[1024];
-  int cmd_i=0;
+static void set_filters(adapter_t *ad)
+{
+  int i;
+
+  if (ad->soft_demux) {
+    set_ts_filt(ad->fd[0],8192,DMX_PES_OTHER);
+    return;
+  }
+  for (i=0;i<ad->npids;i++)
+    set_ts_filt(ad->fd[i],ad->pids[i],ad->pestypes[i]);
+}
+
+/* Open the adapter's DVR and demux filters, or its input file */
+static int open_adapter(adapter_t *ad)
+{
   int i;
-  char* ch;
-  dmx_pes_type_t pestype;
-  unsigned long freq=0;
-  unsigned long srate=0;
 
-    /* Open a new telnet session if a client is trying to connect */
-    if (ns==-1) {
-      if ((ns = accept(socketIn, (struct sockaddr *)&fsin, &fromlen)) > 0) {
-        make_nonblock(ns);
-        cmd_i=0;      
-        cmd[0]=0;
-        printf("Opened connection\n");
-        writes(ns,"220-DVBSTREAM - ");
-        writes(ns,hostname);
-        writes(ns,"\r\nDONE\r\n");
-        connectionOpen=1;
+  if (is_file(ad)) {
+    if (strcmp(ad->input,"-") == 0) {
+      ad->fd_dvr = fileno(stdin);
+    } else {
+      /* Opening a FIFO waits for its writer - non-blocking, reads
+         would see end of file until the writer turned up */
+      if ((ad->fd_dvr = open(ad->input,O_RDONLY)) < 0) {
+        perror(ad->input);
+        return -1;
       }
+      make_nonblock(ad->fd_dvr);
     }
+    return 0;
+  }
 
-    /* If a telnet session is open, receive and process any input */
-    if (connectionOpen) {
-      /* Read in at most a line of text - any ctrl character ends the line */
-      while (read(ns,&in_ch,1)>0) {
-          if (in_ch < 32) break;
-          /* Prevent buffer overflows */
-          if (cmd_i < 1024-1) {
-            cmd[cmd_i++]=in_ch;
-            cmd[cmd_i]=0;
-          }
-      }
-      if (in_ch > 0) {
-        if (cmd_i > 0) {
-          printf("CMD: \"%s\"\n",cmd);
-          if (strcasecmp(cmd,"QUIT")==0) {
-            writes(ns,"DONE\r\n");
-            close(ns);
-            ns=-1;
-            connectionOpen=0; 
-            printf("Closed connection\n");
-          } else if (strcasecmp(cmd,"STOP")==0) {
-            writes(ns,"STOP\n");
-            for (i=0;i<npids;i++) {
-              if (ioctl(fd[i], DMX_STOP) < 0)  {
-                 perror("DMX_STOP");
-              }
-            }
-            for (i=0;i<8192;i++) {
-              hi_mappids[i]=(i >> 8);
-              lo_mappids[i]=(i&0xff);
-            }
-            writes(ns,"DONE\r\n");
-          } else if (strncasecmp(cmd,"ADD",3)==0) {
-            i=4;
-            if ((cmd[3]=='V') || (cmd[3]=='v')) pestype=DMX_PES_VIDEO;
-            else if ((cmd[3]=='A') || (cmd[3]=='a')) pestype=DMX_PES_AUDIO;
-            else if ((cmd[3]=='T') || (cmd[3]=='t')) pestype=DMX_PES_TELETEXT;
-            else { pestype=DMX_PES_OTHER; i=3; }
-            while (cmd[i]==' ') i++;
-            if ((ch=(char*)strstr(&cmd[i],":"))!=NULL) {
-              pid2=atoi(&ch[1]);
-              ch[0]=0;
-            } else {
-              pid2=-1;
-            }
-            pid=atoi(&cmd[i]);
-            if (pid) {
-              if (npids == MAX_CHANNELS) {
-                fprintf(stderr,"\nsorry, you can only set up to 8 filters.\n\n");
-                return(-1);
-              } else {
-                pestypes[npids]=pestype;
-                pestype=DMX_PES_OTHER;
-                pids[npids]=pid;
-                if (pid2!=-1) {
-                  hi_mappids[pid]=pid2>>8;
-                  lo_mappids[pid]=pid2&0xff;
-                  fprintf(stderr,"Mapping %d to %d\n",pid,pid2);
-                }
-                
-                if((fd[npids] = open(demuxdev[card],O_RDWR|O_NONBLOCK)) < 0){
-                  fprintf(stderr,"FD %i: ",i);
-                  perror("DEMUX DEVICE: ");
-                } else {
-                  set_ts_filt(fd[npids],pids[npids],pestypes[npids]);
-                  npids++;
-                }
-              }
-            }
-            writes(ns,"DONE\r\n");
-          } else if (strcasecmp(cmd,"START")==0) {
-            writes(ns,"START\n");
-            for (i=0;i<npids;i++) {
-              set_ts_filt(fd[i],pids[i],pestypes[i]);
-            }
-            writes(ns,"DONE\r\n");
-          } else if (strncasecmp(cmd,"TUNE",4)==0) {
-            for (i=0;i<8192;i++) {
-              hi_mappids[i]=(i >> 8);
-              lo_mappids[i]=(i&0xff);
-            }
-            for (i=0;i<npids;i++) {
-              if (ioctl(fd[i], DMX_STOP) < 0)  {
-                 perror("DMX_STOP"); 
-                 close(fd[i]);
-              }
-            }
-            npids=0;
-            i=4;
-            while (cmd[i]==' ') i++;
-            freq=atoi(&cmd[i]);
-            while ((cmd[i]!=' ') && (cmd[i]!=0)) i++;
-            if (cmd[i]!=0) {
-              while (cmd[i]==' ') i++;
-              pol=cmd[i];
-              while ((cmd[i]!=' ') && (cmd[i]!=0)) i++;
-              if (cmd[i]!=0) {
-                while (cmd[i]==' ') i++;
-                srate=atoi(&cmd[i])*1000UL;
-                fprintf(stderr,"Tuning to %ld,%ld,%c\n",freq,srate,pol);
-                if(!use_stdin)
-                tune_it(fd_frontend,freq,srate,pol,tone,specInv,diseqc,modulation,HP_CodeRate,TransmissionMode,guardInterval,bandWidth, LP_CodeRate, hier);
-              }
-            }
-          }
-          cmd_i=0;
-          cmd[0]=0;
-          writes(ns,"DONE\r\n");
-        }
-      }
+  /* The driver only has a few filters, so past that take the whole TS
+     and pick the PIDs out ourselves */
+  if (ad->npids > MAX_CHANNELS) {
+    ad->soft_demux = 1;
+    fprintf(stderr,"Card %d: %d PIDs is more than the %d hardware filters, using the software demux\n",
+            ad->card,ad->npids,MAX_CHANNELS);
+  }
+  for (i=0;i<filter_cnt(ad);i++) {
+    if((ad->fd[i] = dvbdev_open(ad->card,"demux0",O_RDWR|O_NONBLOCK)) < 0){
+      fprintf(stderr,"FD %i: ",i);
+      perror("DEMUX DEVICE: ");
+      return -1;
     }
-    return(0);
+  }
+
+  if((ad->fd_dvr = dvbdev_open(ad->card,"dvr0",O_RDONLY|O_NONBLOCK)) < 0){
+    perror("DVR DEVICE: ");
+    return -1;
+  }
+
+  /* Now we set the filters */
+  set_filters(ad);
+  for (i=0;i<ad->npids;i++)
+    setbit(ad->USER_PIDS, ad->pids[i]);
+  if (ad->soft_demux)
+    build_routes(ad);
+  return 0;
 }
 
+#ifdef ENABLE_TELNET
+/* Telnet ADD with every hardware filter taken, or a program added to a
+   map: stop the filters and carry on with the software demux */
+static int switch_to_soft_demux(adapter_t *ad)
+{
+  int i;
 
-/* The output routine for sending a PS */
-void my_write_out(uint8_t *buf, int count,void  *p)
+  for (i=0;i<ad->npids;i++) {
+    dvbdev_ioctl(ad->fd[i], DMX_STOP);
+    close(ad->fd[i]);
+  }
+  /* The PMT filters would deliver the PMTs twice */
+  for (i=0;i<ad->SI_fd_cnt;i++)
+    close(ad->SI_fd[i]);
+  ad->SI_fd_cnt = 0;
+  ad->soft_demux = 1;
+  if((ad->fd[0] = dvbdev_open(ad->card,"demux0",O_RDWR|O_NONBLOCK)) < 0){
+    perror("DEMUX DEVICE: ");
+    return -1;
+  }
+  set_filters(ad);
+  fprintf(stderr,"More than %d PIDs, switched to the software demux\n",MAX_CHANNELS);
+  return 0;
+}
+#endif
+
+static void close_adapter(adapter_t *ad)
 {
-  /* to fix: change this buffer size and check for overflow */
-  static uint8_t out_buffer[1000000];
-  static int out_buffer_n=0;
   int i;
 
-  if (to_stdout) {
-    /* This one is easy. */
+  if (is_file(ad)) {
+    if (ad->fd_dvr != fileno(stdin)) close(ad->fd_dvr);
+    return;
+  }
+  for (i=0;i<filter_cnt(ad);i++) close(ad->fd[i]);
+  close(ad->fd_dvr);
+  if (ad->fd_frontend >= 0) close(ad->fd_frontend);
+}
 
-    write(STDOUT_FILENO, buf, count);
-  } else { /* We are streaming it. */
-    /* Copy data to write to the end of out_buffer */
 
-    memcpy(&out_buffer[out_buffer_n],buf,count);
-    out_buffer_n+=count;
 
-    /* Send as many full packets as possible */
+  unsigned char hi_mappids[8192];
+  unsigned char lo_mappids[8192];
+  int pid,pid2;
+  int to_stdout = 0; /* to stdout instead of rtp stream */
 
-    i=0;
-    while ((i + MAX_RTP_SIZE) < out_buffer_n) {
-       hdr.timestamp = getmsec()*90;
-       sendrtp2(socketOut,&sOut,&hdr,&out_buffer[i],MAX_RTP_SIZE);
-       i+=MAX_RTP_SIZE;
-    }
+  /* rtp */
+  struct rtpheader hdr;
+  struct sockaddr_storage sOut;
+  int socketOut;
+
+  ipack pa, pv;
+  ps_packetiser_t ps_out;   /* -ps datagrams */
+
+#define IPACKS 2048
+#define TS_SIZE 188
+#define IN_SIZE TS_SIZE
 
-    /* Move whatever data is left to the start of the buffer */
+/* The output routine for sending a PS */
+void my_write_out(uint8_t *buf, int count,void  *p)
+{
+  if (to_stdout) {
+    /* This one is easy. */
 
-    memmove(&out_buffer[0],&out_buffer[i],out_buffer_n-i);
-    out_buffer_n-=i;
+    write(STDOUT_FILENO, buf, count);
+  } else { /* We are streaming it - cut it into datagrams */
+    pspkt_write(&ps_out, buf, count);
   }
 }
 
@@ -404,466 +521,1874 @@ void my_ts_to_ps( uint8_t* buf, uint16_t pida, uint16_t pidv)
 }
 
 
-typedef uint8_t PID_BIT_MAP[1024];
-static PID_BIT_MAP SI_PIDS;
-static PID_BIT_MAP USER_PIDS;
 
 
 typedef struct {
   char *filename;
-  int fd;
-  int pids[MAX_CHANNELS];
+  recorder_t rec;     // the file, for -o: maps
+  tshift_t *shift;    // the ring, for -shift: maps (filename is its directory)
+  int pids[MAX_USER_PIDS];
   int num;
   int pid_cnt;
-  int progs[MAX_CHANNELS];
+  int progs[MAX_USER_PIDS];
   int progs_cnt;
   uint8_t **prognames;
   int prognames_cnt;
   PID_BIT_MAP pidmap;
+  PID_BIT_MAP fresh;  // PIDs just gained, for -discont
   long start_time; // in seconds
   long end_time;   // in seconds
   int socket;
   struct rtpheader hdr;
-  struct sockaddr_in sOut;
-  unsigned char buf[MTU];
-  unsigned char net[20];
-  int pos;
+  struct sockaddr_storage sOut;
+  int adapter;        // index of the adapter feeding the map
+  egress_t eg;
+  uint64_t packets;   // sent, for the telnet STATS
+  struct iovec *iov;  // packets waiting to be written to the file
+  int niov;
+  char net[RTP_ADDR_LEN];
   int port;
 } pids_map_t;
 
 pids_map_t *pids_map;
 int map_cnt;
 
-//1024 section payload +1 pointer +256 pointer value
-#define SECTION_LEN 1281
-typedef struct {
-  uint8_t buf[SECTION_LEN];
-  unsigned int pos;
-} section_t;
-
-typedef struct {
-  int program;
-  int pmt_pid;
-} pat_entry;
-
-static struct {
-  int len;	//section length
-  int version;
-  section_t section;
-  pat_entry *entries;
-  int entries_cnt;
-} PAT;
-
-#define MAX_PIDS 202
-typedef struct {
-  section_t section;
-  int version;
-  int pids[MAX_PIDS];
-  int pids_cnt;
-  uint8_t name[256];
-} pmt_t;
+/* Service following: the maps whose programs changed.  A table can
+   change several maps, and they are all worked out again together once
+   the table has been parsed. */
+static uint8_t *map_changed;
+static int maps_changed = 0;
+static int mark_discont = 0;   // -discont
 
-struct {
-  pmt_t *entries;
-  int cnt;
-} PMT;
+static void mark_map(int i)
+{
+  if (map_changed == NULL && (map_changed = calloc(map_cnt, 1)) == NULL)
+    return;
+  map_changed[i] = 1;
+  maps_changed = 1;
+}
 
-static struct {
-  int len;	//section length
-  int version;
-  section_t section;
-} SDT;
+/* Log a change to the streams, with the time it was seen */
+static void log_change(const char *fmt, ...)
+{
+  struct timeval tv;
+  struct tm tm;
+  char t[16];
+  va_list ap;
+
+  gettimeofday(&tv, NULL);
+  localtime_r(&tv.tv_sec, &tm);
+  strftime(t, sizeof(t), "%H:%M:%S", &tm);
+  fprintf(stderr, "%s.%03ld ", t, (long)tv.tv_usec / 1000);
+  va_start(ap, fmt);
+  vfprintf(stderr, fmt, ap);
+  va_end(ap);
+}
 
-static int SI_fd[MAX_CHANNELS];
-static int SI_fd_cnt = 0;
 
-#define SDT_PID 0x11
+/* Route each PID to the maps of the adapter that want it (demux.c), so
+   routing a packet costs the same however many maps and PIDs there are.
+   In RTP_TS mode the software demux routes the PIDs asked for to
+   output 0. */
+static void build_routes(adapter_t *ad)
+{
+  int i, pid, n;
 
-#define getbit(buf, pid) (buf[(pid)/8] & (1 << ((pid) % 8)))
-#define setbit(buf, pid) buf[(pid)/8] |= (1 << ((pid) % 8))
-#define clearbits(buf) memset(buf, 0, sizeof(PID_BIT_MAP))
-#define setallbits(buf) memset(buf, 0xFF, sizeof(PID_BIT_MAP))
-#define min(x, y) ((x) <= (y) ? (x) : (y))
+  n = ad - adapters;
+  if (map_cnt == 0 && !ad->soft_demux) return;
+  if (ad->demux.masks == NULL) {
+    if (demux_init(&ad->demux, map_cnt ? map_cnt : 1) < 0)
+      exit(1);
+  }
+  demux_clear(&ad->demux);
+  if (map_cnt == 0) {
+    for(pid = 0; pid < 8192; pid++)
+    {
+      if(getbit(ad->USER_PIDS, pid))
+        demux_add(&ad->demux, pid, 0);
+    }
+    return;
+  }
+  for(i = 0; i < map_cnt; i++)
+  {
+    if(pids_map[i].adapter != n) continue;
+    for(pid = 0; pid < 8192; pid++)
+    {
+      if(getbit(pids_map[i].pidmap, pid))
+        demux_add(&ad->demux, pid, i);
+    }
+  }
+}
 
-void update_bitmaps()
+/* The PIDs map wants from adapter ad: those on its PID list, the PMTs of
+   the programs they belong to, and everything in its own programs */
+static void map_pids(adapter_t *ad, pids_map_t *map, PID_BIT_MAP pidmap)
 {
-  int i, j, k, n;
+  PID_BIT_MAP listed;
+  pmt_t *pmt;
+  int j, k, n, want;
+
+  clearbits(pidmap);
+  setbit(pidmap, 0);
+  clearbits(listed);
+  for(j = 0; j < map->pid_cnt; j++)
+  {
+    if(map->pids[j] == 8192)
+    {
+      setallbits(pidmap);
+      return;
+    }
+    setbit(pidmap, map->pids[j]);
+    setbit(listed, map->pids[j]);
+  }
 
-  for(i = 0; i < map_cnt; i++)
+  for(k = 0; k < ad->PMT.cnt; k++)
   {
-    clearbits(pids_map[i].pidmap);
-    setbit(pids_map[i].pidmap, 0);
-    for(j = 0; j < MAX_CHANNELS; j++)
+    pmt = &ad->PMT.entries[k];
+    want = 0;
+    for(j = 0; j < map->progs_cnt; j++)
+      if(map->progs[j] == ad->PAT.entries[k].program) want = 1;
+    for(j = 0; j < map->prognames_cnt; j++)
+      if(pmt->name[0] && !strcmp((char *)map->prognames[j], (char *)pmt->name)) want = 1;
+    if(want)
     {
-      if(pids_map[i].pids[j] == -1) break;
-      if(pids_map[i].pids[j] == 8192)
+      setbit(pidmap, ad->PAT.entries[k].pmt_pid);
+      setbit(pidmap, SDT_PID);
+      for(n = 0; n < pmt->pids_cnt; n++)
+        setbit(pidmap, pmt->pids[n]);
+      continue;
+    }
+    for(n = 0; n < pmt->pids_cnt; n++)
+    {
+      if(getbit(listed, pmt->pids[n]))
       {
-        setallbits(pids_map[i].pidmap);
+        setbit(pidmap, ad->PAT.entries[k].pmt_pid);
         break;
       }
-      setbit(pids_map[i].pidmap, pids_map[i].pids[j]);
-      for(k = 0; k < PMT.cnt; k++)
-      {
-        for(n = 0; n < PMT.entries[k].pids_cnt; n++)
-        {
-          if(PMT.entries[k].pids[n] == pids_map[i].pids[j])
-          {
-            //add the pmt_pid to the map
-            //fprintf(stderr, "ADDING TO map %d PMT n. %d with PID: %d, j: %d\n", i, k, PAT.entries[k].pmt_pid, j);
-            setbit(pids_map[i].pidmap, PAT.entries[k].pmt_pid);
-          }
-        }
-      }
     }
   }
+}
+
+/* Work out the PIDs of all the maps fed by adapter ad */
+void update_bitmaps(adapter_t *ad)
+{
+  int i;
+  int a = ad - adapters;
 
+  for(i = 0; i < map_cnt; i++)
+  {
+    if(pids_map[i].adapter != a) continue;
+    map_pids(ad, &pids_map[i], pids_map[i].pidmap);
+    clearbits(pids_map[i].fresh);
+  }
+  build_routes(ad);
+}
 
-  for(j = 0; j < map_cnt; j++)
+/* Work out the PIDs of map i again, and reroute just the PIDs it gained
+   or lost */
+static void update_map(adapter_t *ad, int i)
+{
+  PID_BIT_MAP pidmap;
+  pids_map_t *map = &pids_map[i];
+  unsigned int b, d;
+  int pid, len = 0;
+  char changes[256];
+
+  map_pids(ad, map, pidmap);
+  changes[0] = 0;
+  for(b = 0; b < sizeof(PID_BIT_MAP); b++)
   {
-    for(k = 0; k < pids_map[j].progs_cnt; k++)
+    d = pidmap[b] ^ map->pidmap[b];
+    while(d)
     {
-      for(i = 0; i < PAT.entries_cnt; i++)
+      pid = b * 8 + __builtin_ctz(d);
+      d &= d - 1;
+      if(getbit(pidmap, pid))
       {
-        if(pids_map[j].progs[k] == PAT.entries[i].program)
-        {
-          setbit(pids_map[j].pidmap, PAT.entries[i].pmt_pid);
-          setbit(pids_map[j].pidmap, SDT_PID);
-          for(n = 0; n < PMT.entries[i].pids_cnt; n++)
-          {
-            int pid = PMT.entries[i].pids[n];
-
-            setbit(pids_map[j].pidmap, pid);
-            //fprintf(stderr, "\nADDED to map %d PROG pid %d, prog: %d", j, pid, PAT.entries[i].program);
-          }
-        }
+        demux_add(&ad->demux, pid, i);
+        if(mark_discont) setbit(map->fresh, pid);
       }
+      else
+        demux_remove(&ad->demux, pid, i);
+      if(len < sizeof(changes) - 16)
+        len += sprintf(changes + len, " %c%d", getbit(pidmap, pid) ? '+' : '-', pid);
+      else if(len < sizeof(changes) - 1)
+        len += sprintf(changes + len, " ...");
     }
   }
+  memcpy(map->pidmap, pidmap, sizeof(PID_BIT_MAP));
+  if(len > 0)
+    log_change("map %d (%s): PIDs%s\n", i,
+               map->filename ? map->filename : (char *)map->net, changes);
+}
 
+/* Apply the changes of the last batch */
+static void update_changed_maps(adapter_t *ad)
+{
+  int i;
 
+  maps_changed = 0;
   for(i = 0; i < map_cnt; i++)
   {
-    for(j = 0; j < pids_map[i].prognames_cnt; j++)
+    if(!map_changed[i]) continue;
+    map_changed[i] = 0;
+    update_map(ad, i);
+  }
+}
+
+/* Whether program k of adapter ad matters to map: it is one of the
+   map's programs, or one of the map's PIDs is among pids - the PIDs of
+   the program before and after a change */
+static int map_uses_program(adapter_t *ad, pids_map_t *map, int k, PID_BIT_MAP pids)
+{
+  int j;
+
+  for(j = 0; j < map->progs_cnt; j++)
+    if(map->progs[j] == ad->PAT.entries[k].program) return 1;
+  for(j = 0; j < map->prognames_cnt; j++)
+    if(!strcmp((char *)map->prognames[j], (char *)ad->PMT.entries[k].name)) return 1;
+  for(j = 0; j < map->pid_cnt; j++)
+  {
+    if(map->pids[j] == 8192) return 0;
+    if(getbit(pids, map->pids[j])) return 1;
+  }
+  return 0;
+}
+
+static void add_pmt_pids()
+{
+  int i;
+  PID_BIT_MAP simap;
+
+  for(i = 0; i < cur->SI_fd_cnt; i++)
+    close(cur->SI_fd[i]);
+  cur->SI_fd_cnt = 0;
+  if(is_file(cur) || cur->soft_demux)   // the PMTs are in the TS already
+    return;
+  if(map_cnt == 0)       // only -monitor parses the PSI, and takes what comes
+    return;
+
+  clearbits(simap);
+  setbit(simap, 0);
+  for(i=0; i<min(cur->PAT.entries_cnt, MAX_CHANNELS); i++)
+  {
+    if(getbit(cur->USER_PIDS, cur->PAT.entries[i].pmt_pid)) continue;
+    if(getbit(simap, cur->PAT.entries[i].pmt_pid)) continue;
+    if((cur->SI_fd[cur->SI_fd_cnt] = dvbdev_open(cur->card,"demux0",O_RDWR|O_NONBLOCK)) < 0)
+    {
+      fprintf(stderr,"COULDN'T OPEN DEMUX %i: for pid: %d", i, cur->PAT.entries[i].pmt_pid);
+      return;
+    }
+    //fprintf(stderr, "\nADDED PMT PID: %d\n", cur->PAT.entries[i].pmt_pid);
+    set_ts_filt(cur->SI_fd[cur->SI_fd_cnt], cur->PAT.entries[i].pmt_pid, DMX_PES_OTHER);
+    setbit(simap, cur->PAT.entries[i].pmt_pid);
+    cur->SI_fd_cnt++;
+  }
+}
+
+static void add_pmt_pid(pmt_t *pmt, int pid)
+{
+  int *p;
+
+  if(pmt->pids_cnt == pmt->pids_max)
+  {
+    p = realloc(pmt->pids, (pmt->pids_max + 16) * sizeof(int));
+    if(p == NULL) return;
+    pmt->pids = p;
+    pmt->pids_max += 16;
+  }
+  pmt->pids[pmt->pids_cnt++] = pid;
+}
+
+/* Name the programs from the service descriptors of the SDT.  Returns 1
+   if any name changed. */
+static int apply_sdt()
+{
+  psi_table_t *t = &cur->SDT.table;
+  unsigned int i, j, k, end, dend, dlen, prog, provider_len, name_len;
+  int s, changed = 0;
+  uint8_t *buf;
+  pmt_t *pmt;
+
+  for(s = 0; s <= t->last_section; s++)
+  {
+    if((buf = t->sec[s]) == NULL) continue;
+    end = t->len[s] - 4;
+    i = 11;
+    while(i + 5 <= end)
     {
-      for(k = 0; k < PMT.cnt; k++)
+      prog = (buf[i] << 8) | buf[i+1];
+      dlen = ((buf[i+3] & 0x0F) << 8) | buf[i+4];
+      dend = i + 5 + dlen;
+      if(dend > end) break;
+      for(k = 0; k < cur->PMT.cnt; k++)
+        if(cur->PAT.entries[k].program == prog) break;
+
+      for(j = i + 5; k < cur->PMT.cnt && j + 2 <= dend; j += 2 + buf[j+1])
       {
-        if(!strcmp(pids_map[i].prognames[j], PMT.entries[k].name))
-        {
-          setbit(pids_map[i].pidmap, PAT.entries[k].pmt_pid);
-          setbit(pids_map[i].pidmap, SDT_PID);
-          for(n = 0; n < PMT.entries[k].pids_cnt; n++)
-          {
-            int pid = PMT.entries[k].pids[n];
-
-            setbit(pids_map[i].pidmap, pid);
-            //fprintf(stderr, "\nADDED to map %d PROG pid %d, prog: %d", j, pid, PAT.entries[k].program);
-          }
-        }
+        if(j + 2 + buf[j+1] > dend) break;
+        if(buf[j] != 0x48) continue;
+        provider_len = buf[j+3];
+        if(provider_len + 3 > buf[j+1]) break;
+        name_len = buf[j+4+provider_len];
+        if(provider_len + 3 + name_len > buf[j+1]) break;
+        pmt = &cur->PMT.entries[k];
+        if(strlen((char *)pmt->name) == name_len && !memcmp(pmt->name, &buf[j+5+provider_len], name_len))
+          continue;
+        memcpy(pmt->name, &buf[j+5+provider_len], name_len);
+        pmt->name[name_len] = 0;
+        fprintf(stderr, "Program n. %d, name: '%s'\n", prog, pmt->name);
+        changed = 1;
+      }
+      i = dend;
+    }
+  }
+  return changed;
+}
+
+static int sdt_section(void *arg, uint8_t *sec, int len)
+{
+  int i;
+
+  if(psi_table_add(&cur->SDT.table, sec, len) != PSI_CHANGED)
+    return 0;
+  if(!apply_sdt())
+    return 1;
+  for(i = 0; i < map_cnt; i++)
+  {
+    if(pids_map[i].adapter == cur - adapters && pids_map[i].prognames_cnt > 0)
+      mark_map(i);
+  }
+  return 1;
+}
+
+/* A new PAT.  The programs that are still there keep their PMTs, the
+   others start again. */
+static void new_pat()
+{
+  psi_table_t *t = &cur->PAT.table;
+  pat_entry *entries;
+  pmt_t *pmts, *old = cur->PMT.entries;
+  char *kept;
+  int s, i, k, num, program, pid;
+  uint8_t *buf;
+
+  num = 0;
+  for(s = 0; s <= t->last_section; s++)
+    num += (t->len[s] - 12) / 4;
+  entries = malloc(sizeof(pat_entry) * (num + 1));
+  pmts = calloc(num + 1, sizeof(pmt_t));
+  kept = calloc(cur->PMT.cnt + 1, 1);
+  if(!entries || !pmts || !kept)
+  {
+    free(entries); free(pmts); free(kept);
+    return;
+  }
+
+  clearbits(cur->SI_PIDS);
+  setbit(cur->SI_PIDS, 0);
+  setbit(cur->SI_PIDS, SDT_PID);
+  num = 0;
+  for(s = 0; s <= t->last_section; s++)
+  {
+    buf = t->sec[s];
+    for(i = 8; i + 4 <= t->len[s] - 4; i += 4)
+    {
+      program = (buf[i] << 8) | buf[i+1];
+      pid = ((buf[i+2] & 0x1F) << 8) | buf[i+3];
+      if(program == 0)   // the network PID
+        continue;
+      entries[num].program = program;
+      entries[num].pmt_pid = pid;
+      setbit(cur->SI_PIDS, pid);
+      for(k = 0; k < cur->PMT.cnt; k++)
+      {
+        if(!kept[k] && cur->PAT.entries[k].program == program && cur->PAT.entries[k].pmt_pid == pid)
+          break;
+      }
+      if(k < cur->PMT.cnt)
+      {
+        pmts[num] = old[k];
+        kept[k] = 1;
+      }
+      else
+      {
+        psi_table_init(&pmts[num].table, 0x02, program, &cur->psi);
+      }
+      //fprintf(stderr, "PROGRAM: %d, pmt_pid: %d\n", program, pid);
+      num++;
+    }
+  }
+
+  for(k = 0; k < cur->PMT.cnt; k++)
+  {
+    secfilt_remove(cur->sections, old[k].filter);
+    if(kept[k]) continue;
+    psi_table_free(&old[k].table);
+    free(old[k].pids);
+  }
+  for(k = 0; k < num; k++)
+    pmts[k].filter = secfilt_add_table(cur->sections, entries[k].pmt_pid, 0x02, entries[k].program,
+                                       0, pmt_section, &pmts[k]);
+  free(kept);
+  free(old);
+  free(cur->PAT.entries);
+  cur->PAT.entries = entries;
+  cur->PAT.entries_cnt = num;
+  cur->PMT.entries = pmts;
+  cur->PMT.cnt = num;
+
+  apply_sdt();
+  add_pmt_pids();
+  for(k = 0; k < map_cnt; k++)
+  {
+    if(pids_map[k].adapter == cur - adapters)
+      mark_map(k);
+  }
+}
+
+static int pat_section(void *arg, uint8_t *sec, int len)
+{
+  if(psi_table_add(&cur->PAT.table, sec, len) != PSI_CHANGED)
+    return 0;
+  if(cur->PAT.entries != NULL)
+    log_change("new PAT, version %d\n", cur->PAT.table.version);
+  new_pat();
+  return 1;
+}
+
+/* A new version of a PMT: only the maps that take the program, or that
+   have one of its old or new PIDs, are worked out again */
+static int pmt_section(void *arg, uint8_t *sec, int len)
+{
+  pmt_t *pmt = arg;
+  int k = pmt - cur->PMT.entries;
+  PID_BIT_MAP pids;
+  unsigned int i, end;
+  int n, pid;
+
+  if(psi_table_add(&pmt->table, sec, len) != PSI_CHANGED)
+    return 0;
+
+  if(pmt->pids_cnt > 0)
+    log_change("program %d: new PMT, version %d\n", cur->PAT.entries[k].program, pmt->table.version);
+  clearbits(pids);
+  for(n = 0; n < pmt->pids_cnt; n++)
+    setbit(pids, pmt->pids[n]);
+
+  pmt->pids_cnt = 0;
+  add_pmt_pid(pmt, ((sec[8] & 0x1F) << 8) | sec[9]);
+  //fprintf(stderr, "\nPROGRAM: %d, pcr_pid: %d, version: %d\n", cur->PAT.entries[k].program, pmt->pids[0], pmt->table.version);
+  i = 12 + (((sec[10] & 0x0F) << 8) | sec[11]);
+  end = len - 4;
+  while(i + 5 <= end)
+  {
+    pid = ((sec[i+1] & 0x1F) << 8) | sec[i+2];
+    add_pmt_pid(pmt, pid);
+    i += 5 + (((sec[i+3] & 0x0F) << 8) | sec[i+4]);
+  }
+  for(n = 0; n < pmt->pids_cnt; n++)
+    setbit(pids, pmt->pids[n]);
+
+  for(n = 0; n < map_cnt; n++)
+  {
+    if(pids_map[n].adapter == cur - adapters && map_uses_program(cur, &pids_map[n], k, pids))
+      mark_map(n);
+  }
+  return 1;
+}
+
+/* Feed a packet of one of the SI PIDs to its tables */
+static int parse_ts_packet(uint8_t *buf)
+{
+  if(buf[0] != 0x47)
+    return 0;
+  return secfilt_packet(cur->sections, buf);
+}
+
+static int is_string(char *s)
+{
+  int i, n, len;
+
+  n = 0;
+  len = strlen(s);
+  for(i = 0; i < len; i++)
+    if(isdigit(s[i]))
+      n++;
+
+  return (n != len);
+}
+
+/* RTP_TS: remap the PIDs and gather the packets into MTU sized datagrams */
+static egress_t ts_egress;
+static struct iovec *stdout_iov;  // packets waiting to be written to stdout
+static int stdout_niov;
+static uint64_t ts_packets;       // sent, for the telnet STATS
+
+/* The RTP timestamp of the packet being output: its time on the
+   adapter's PCR time line, at 90 kHz (RFC 2250).  Egress threads output
+   packets routed a little earlier, so each thread has its own. */
+static __thread uint32_t out_stamp;
+static __thread int64_t out_read_ns;   // when the packets being sent were read
+
+static void stamp_packet(uint8_t *buf)
+{
+  int64_t t = pcr_clock_stamp(&cur->clock, buf);
+
+  if (t == 0)       // no PCR yet
+    t = monotonic_ns();
+  out_stamp = (uint32_t)(t * 9 / 100000);
+}
+
+/* Outputs are numbered: in RTP_TS mode output 0 is stdout or the network
+   stream, in MAP_TS mode output i is pids_map[i]. */
+static int output_count(int output_type)
+{
+  if (output_type==RTP_TS) return 1;
+  if (output_type==MAP_TS) return map_cnt;
+  return 0;
+}
+
+/* Queue a packet for output o.  Nothing is copied - the packet must stay
+   where it is until output_flush(). */
+static void output_packet(int o, uint8_t *buf)
+{
+  pids_map_t *map;
+
+  if (map_cnt == 0) {
+    if (to_stdout) {
+      stdout_iov[stdout_niov].iov_base = buf;
+      stdout_iov[stdout_niov].iov_len = TS_SIZE;
+      stdout_niov++;
+    } else {
+      if (ts_egress.len == 0) {
+        hdr.timestamp = hdr.ts_offset + out_stamp;
+        ts_egress.read_ns = out_read_ns;
+      }
+      egress_add(&ts_egress,buf,TS_SIZE);
+      // If there isn't enough room for 1 more packet, then send it.
+      if ((ts_egress.len+PACKET_SIZE)>MAX_RTP_SIZE) {
+        egress_end(&ts_egress);
+      }
+    }
+    return;
+  }
+
+  map = &pids_map[o];
+  if(map->filename) {
+    map->iov[map->niov].iov_base = buf;
+    map->iov[map->niov].iov_len = TS_SIZE;
+    map->niov++;
+  } else {
+    if (map->eg.len == 0) {
+      map->hdr.timestamp = map->hdr.ts_offset + out_stamp;
+      map->eg.read_ns = out_read_ns;
+    }
+    egress_add(&map->eg, buf, TS_SIZE);
+    if((map->eg.len + PACKET_SIZE) > MAX_RTP_SIZE) {
+      egress_end(&map->eg);
+    }
+  }
+}
+
+/* Send the datagrams queued for output o and write the packets collected
+   for a file.  Datagrams that are still being filled point into the
+   ingest buffer, which the next read would overwrite, so they keep a
+   reference to its slab. */
+static void output_flush(int o, slab_t *slab)
+{
+  pids_map_t *map;
+
+  if (map_cnt == 0) {
+    if (to_stdout) {
+      if (stdout_niov > 0)
+        write_iov(1,stdout_iov,stdout_niov);
+      stdout_niov = 0;
+    } else {
+      egress_flush(&ts_egress);
+      egress_hold(&ts_egress, slab);
+    }
+    return;
+  }
+
+  map = &pids_map[o];
+  if (map->shift) {
+    if (map->niov > 0)
+      tshift_write(map->shift, map->iov, map->niov);
+    else if (map->shift->rec.inflight)
+      record_poll(&map->shift->rec);
+    map->niov = 0;
+  } else if (map->filename) {
+    if (map->niov > 0)
+      record_write(&map->rec, map->iov, map->niov);
+    else if (map->rec.inflight)
+      record_poll(&map->rec);
+    map->niov = 0;
+  } else {
+    egress_flush(&map->eg);
+    egress_hold(&map->eg, slab);
+  }
+}
+
+/* Send the last datagram of output o, which output_flush() leaves
+   waiting for more packets, once the input has ended */
+static void output_finish(int o)
+{
+  egress_t *eg;
+
+  if (map_cnt == 0)
+    eg = to_stdout ? NULL : &ts_egress;
+  else
+    eg = pids_map[o].filename ? NULL : &pids_map[o].eg;
+  if (eg != NULL) {
+    egress_end(eg);
+    egress_flush(eg);
+  }
+}
+
+/* Where routed packets go: straight to output_packet(), or in threaded
+   mode to the ring of the egress thread that owns the output. */
+static void (*emit)(int o, uint8_t *buf) = output_packet;
+
+static void rtp_ts_batch(uint8_t **pkts, int n)
+{
+  uint16_t sets[n];
+  int i, pid;
+
+  /* The software demux reads the whole TS: drop the PIDs not asked for */
+  if (cur->soft_demux)
+    demux_batch(&cur->demux, pkts, n, sets);
+  for (i=0;i<n;i++) {
+    stamp_packet(pkts[i]);
+    if (cur->soft_demux && sets[i] == 0) continue;
+    pid=((pkts[i][1]&0x1f) << 8) | (pkts[i][2]);
+    pkts[i][1]=(pkts[i][1]&0xe0)|hi_mappids[pid];
+    pkts[i][2]=lo_mappids[pid];
+    emit(0,pkts[i]);
+    ts_packets++;
+  }
+}
+
+/* -discont: an adaptation field only packet with the discontinuity
+   indicator set, sent ahead of the first packet of a PID a map has just
+   gained.  It has the CC of the packet before the one it goes in front
+   of, so the counters run on from it.  The 16 of each PID are made once
+   and never change, so an egress thread can send them when it likes. */
+static uint8_t *discont_pkts[8192];
+
+static uint8_t *discont_packet(int pid, int cc)
+{
+  uint8_t *p, *b;
+  int c;
+
+  if (discont_pkts[pid] == NULL) {
+    if ((p = malloc(16 * TS_SIZE)) == NULL)
+      return NULL;
+    for (c = 0; c < 16; c++) {
+      b = p + c * TS_SIZE;
+      memset(b, 0xff, TS_SIZE);
+      b[0] = 0x47;
+      b[1] = pid >> 8;
+      b[2] = pid & 0xff;
+      b[3] = 0x20 | c;     // adaptation field only
+      b[4] = TS_SIZE - 5;
+      b[5] = 0x80;         // discontinuity_indicator
+    }
+    discont_pkts[pid] = p;
+  }
+  return discont_pkts[pid] + ((cc - 1) & 0x0f) * TS_SIZE;
+}
+
+/* MAP_TS: hand each packet to every map whose PID set contains it.  The
+   packets aren't copied - each map collects references to the packets it
+   wants and sends or writes them at the end of the batch.  The consumer
+   sets of the whole batch are looked up first, in one tight loop.  A
+   new PAT, PMT or SDT changes the maps it affects all at once, from the
+   packet that completed it on. */
+static void map_ts_batch(uint8_t **pkts, int n)
+{
+  demux_t *d = &cur->demux;
+  uint16_t sets[n];
+  uint64_t *mask, m;
+  uint8_t *dp;
+  int pid, i, j, o, w;
+  pids_map_t *map;
+
+  demux_batch(d, pkts, n, sets);
+  for (j = 0; j < n; j++) {
+    stamp_packet(pkts[j]);
+    pid = TS_PID(pkts[j]);
+    if(getbit(cur->SI_PIDS, pid)) {
+      parse_ts_packet(pkts[j]);
+      if (maps_changed) {
+        update_changed_maps(cur);
+        for (i = j; i < n; i++)
+          sets[i] = d->set[TS_PID(pkts[i])];
+      }
+    }
+    if (sets[j] == 0)
+      continue;
+
+    mask = demux_mask(d, sets[j]);
+    for (w = 0; w < d->words; w++) {
+      m = mask[w];
+      while (m) {
+        o = w * 64 + __builtin_ctzll(m);
+        m &= m - 1;
+        map = &pids_map[o];
+        if ( ((map->start_time!=-1) && (map->start_time > now))
+             || ((map->end_time!=-1) && (map->end_time < now)))
+          continue;
+        if (getbit(map->fresh, pid) && (pkts[j][3] & 0x10)) {
+          map->fresh[pid / 8] &= ~(1 << (pid % 8));
+          if ((dp = discont_packet(pid, pkts[j][3] & 0x0f)) != NULL)
+            emit(o, dp);
+        }
+        emit(o, pkts[j]);
+        map->packets++;
+      }
+    }
+  }
+}
+
+static void flush_outputs(int output_type, slab_t *slab)
+{
+  int i;
+
+  for (i = 0; i < output_count(output_type); i++)
+    output_flush(i, slab);
+  if (output_type==RTP_PS && !to_stdout)
+    pspkt_flush(&ps_out);
+}
+
+/* -analyse (analyse.c), with a report every -report seconds */
+static analyser_t analyser;
+static int report_secs = 0;
+
+/* -monitor: TR 101 290 checks (tr101290.c) on each adapter's packets */
+#define MONITOR_INTERVAL 100   // ms between checks for missing tables and PIDs
+static int monitoring = 0;
+
+/* Whether adapter ad gets the packets of pid at all */
+static int reads_pid(adapter_t *ad, int pid)
+{
+  return is_file(ad) || ad->soft_demux || ad->whole_ts || ad->pids[0] == 8192
+         || getbit(ad->USER_PIDS, pid);
+}
+
+/* What the PSI says each PID is, for the PIDs the adapter reads */
+static void monitor_tables(adapter_t *ad, int64_t now)
+{
+  uint8_t kind[8192];
+  pmt_t *pmt;
+  int k, n, pid;
+
+  memset(kind, 0, sizeof(kind));
+  kind[0] = TR_PAT;
+  for (k = 0; k < ad->PMT.cnt; k++) {
+    pid = ad->PAT.entries[k].pmt_pid;
+    if (reads_pid(ad, pid) || map_cnt)   // maps have PMT filters
+      kind[pid] |= TR_PMT;
+    pmt = &ad->PMT.entries[k];
+    for (n = 0; n < pmt->pids_cnt; n++) {
+      pid = pmt->pids[n];
+      if (pid < 0 || pid >= 0x1fff || !reads_pid(ad, pid)) continue;
+      kind[pid] |= (n == 0) ? TR_PCR : TR_ES;
+    }
+  }
+  tr_watch(ad->mon, kind, now);
+  ad->mon_versions = ad->psi.versions;
+}
+
+/* Check the packets of a batch before anything is done with them.  The
+   other modes don't parse the PSI, so the monitor does. */
+static void monitor_batch(int output_type, uint8_t **pkts, int n)
+{
+  int i;
+
+  if (output_type != MAP_TS) {
+    for (i = 0; i < n; i++) {
+      if (getbit(cur->SI_PIDS, TS_PID(pkts[i])))
+        parse_ts_packet(pkts[i]);
+    }
+  }
+  tr_batch(cur->mon, pkts, n, monotonic_ns());
+}
+
+static void monitor_poll()
+{
+  static long last = 0;
+  int64_t now;
+  int a;
+
+  if (getmsec() - last < MONITOR_INTERVAL)
+    return;
+  last = getmsec();
+  now = monotonic_ns();
+  for (a = 0; a < adapter_cnt; a++) {
+    if (adapters[a].mon == NULL) continue;
+    if (adapters[a].mon_versions != adapters[a].psi.versions)
+      monitor_tables(&adapters[a], now);
+    tr_poll(adapters[a].mon, now);
+  }
+}
+
+static void monitor_alarms(adapter_t *ad, tr_alarms_t *al)
+{
+  tr_alarms(ad->mon, al);
+  al->n[TR_SYNC_LOSS] = ad->ingest.framer.resyncs;
+  al->n[TR_CRC_ERROR] = ad->psi.crc_errors;
+}
+
+
+/* Handle one batch of packets read from the DVR */
+static void process_batch(int output_type, int do_analyse, uint8_t **pkts, int n)
+{
+  int i;
+
+  if (n == 0)
+    return;
+  if (cur->mon)
+    monitor_batch(output_type, pkts, n);
+  if (cur->pid_packets) {
+    for (i = 0; i < n; i++)
+      cur->pid_packets[TS_PID(pkts[i])]++;
+  }
+  if (output_type==RTP_TS) {
+    rtp_ts_batch(pkts, n);
+  } else if (output_type==MAP_TS) {
+    map_ts_batch(pkts, n);
+  } else if (output_type==RTP_PS) {
+    for (i = 0; i < n; i++)
+      my_ts_to_ps(pkts[i], cur->pids[1], cur->pids[2]);
+  } else if (do_analyse) {
+    analyse_batch(&analyser, pkts, n);
+  }
+}
+
+/* The telnet interface (make TELNET=1).  control.c serves any number of
+   clients without ever blocking, and the commands are run between
+   batches, so the stream never waits for them.  The PID commands act on
+   the first adapter, the MAP commands on the map's own.  Replies end
+   with DONE; the lines before it start "250-", or "550-" for an error. */
+static control_t control = { .fd = -1 };
+
+#ifdef ENABLE_TELNET
+static int64_t stats_start;      // when the STATS counters started
+
+/* A client's counters at its last STATS, to work out the rates since:
+   8192 PIDs per adapter, then the outputs */
+typedef struct {
+  int64_t t;
+  uint64_t counts[];
+} stats_snap_t;
+
+/* Add pid to the PIDs adapter ad reads.  Returns what went wrong, or
+   NULL. */
+static char *add_adapter_pid(adapter_t *ad, int pid, dmx_pes_type_t pestype)
+{
+  int i;
+
+  for (i=0;i<ad->npids;i++) {
+    if (ad->pids[i] == pid || ad->pids[i] == 8192)
+      return NULL;          // reading it already
+  }
+  if (ad->npids == MAX_USER_PIDS)
+    return "too many PIDs";
+  if (!is_file(ad) && !ad->soft_demux) {
+    if (ad->npids == MAX_CHANNELS) {
+      if (switch_to_soft_demux(ad) < 0)
+        return "couldn't open the demux";
+    } else {
+      if ((ad->fd[ad->npids] = dvbdev_open(ad->card,"demux0",O_RDWR|O_NONBLOCK)) < 0) {
+        perror("DEMUX DEVICE: ");
+        return "couldn't open the demux";
+      }
+      set_ts_filt(ad->fd[ad->npids],pid,pestype);
+    }
+  }
+  ad->pestypes[ad->npids]=(ad->soft_demux ? DMX_PES_OTHER : pestype);
+  ad->pids[ad->npids++]=pid;
+  if (pid < 8192)
+    setbit(ad->USER_PIDS, pid);
+  if (ad->soft_demux)
+    build_routes(ad);
+  return NULL;
+}
+
+/* Stop reading pid, closing its filter */
+static char *remove_adapter_pid(adapter_t *ad, int pid)
+{
+  int i, j;
+
+  for (i=0;i<ad->npids;i++) {
+    if (ad->pids[i] == pid) break;
+  }
+  if (i == ad->npids)
+    return "not one of the PIDs";
+  if (!is_file(ad) && !ad->soft_demux) {
+    dvbdev_ioctl(ad->fd[i], DMX_STOP);
+    close(ad->fd[i]);
+    for (j=i;j<ad->npids-1;j++)
+      ad->fd[j]=ad->fd[j+1];
+  }
+  for (j=i;j<ad->npids-1;j++) {
+    ad->pids[j]=ad->pids[j+1];
+    ad->pestypes[j]=ad->pestypes[j+1];
+  }
+  ad->npids--;
+  if (pid < 8192) {
+    clearbit(ad->USER_PIDS, pid);
+    hi_mappids[pid]=(pid >> 8);
+    lo_mappids[pid]=(pid&0xff);
+  }
+  if (ad->soft_demux)
+    build_routes(ad);
+  return NULL;
+}
+
+/* Stop every filter, closing them for TUNE */
+static void stop_filters(adapter_t *ad, int closing)
+{
+  int i;
+
+  if (is_file(ad))
+    return;
+  for (i=0;i<filter_cnt(ad);i++) {
+    if (dvbdev_ioctl(ad->fd[i], DMX_STOP) < 0)
+      perror("DMX_STOP");
+    if (closing)
+      close(ad->fd[i]);
+  }
+}
+
+/* Take v out of a list of cnt numbers */
+static void remove_int(int *list, int *cnt, int v)
+{
+  int i;
+
+  for (i=0;i<*cnt;i++) {
+    if (list[i] == v) {
+      memmove(&list[i], &list[i+1], (*cnt-i-1) * sizeof(int));
+      (*cnt)--;
+      return;
+    }
+  }
+}
+
+/* Whether any map of adapter a lists pid */
+static int map_wants_pid(int a, int pid)
+{
+  int n, i;
+
+  for (n=0;n<map_cnt;n++) {
+    if (pids_map[n].adapter != a) continue;
+    for (i=0;i<pids_map[n].pid_cnt;i++) {
+      if (pids_map[n].pids[i] == pid) return 1;
+    }
+  }
+  return 0;
+}
+
+/* MAP n ADD pid, MAP n REMOVE pid, MAP n ADDPROG prog and MAP n
+   REMOVEPROG prog, where prog is a program number or a service name.
+   The map takes on its new PIDs straight away. */
+static char *map_command(char *args)
+{
+  char op[16], arg[256];
+  pids_map_t *map;
+  adapter_t *ad;
+  int n, i, v;
+  char *err = NULL;
+
+  if (sscanf(args, "%d %15s %255[^\r\n]", &n, op, arg) != 3)
+    return "usage: MAP n ADD|REMOVE pid, MAP n ADDPROG|REMOVEPROG prog";
+  if (n < 0 || n >= map_cnt)
+    return "no such map";
+  map = &pids_map[n];
+  ad = &adapters[map->adapter];
+  v = atoi(arg);
+
+  if (strcasecmp(op, "ADD") == 0) {
+    if (v < 0 || v > 8192)
+      return "bad PID";
+    for (i=0;i<map->pid_cnt;i++) {
+      if (map->pids[i] == v) return NULL;
+    }
+    if (map->pid_cnt >= MAX_USER_PIDS-1)
+      return "too many PIDs";
+    if (map->pid_cnt == 0)
+      map->pids[map->pid_cnt++] = 0;
+    map->pids[map->pid_cnt++] = v;
+    i = ad->npids;
+    err = add_adapter_pid(ad, v, DMX_PES_OTHER);
+    if (ad->npids > i && v < 8192)
+      setbit(ad->MAP_PIDS, v);
+  } else if (strcasecmp(op, "REMOVE") == 0) {
+    remove_int(map->pids, &map->pid_cnt, v);
+    /* Its filter goes with the last map that wanted it */
+    if (v >= 0 && v < 8192 && getbit(ad->MAP_PIDS, v) && !map_wants_pid(map->adapter, v)) {
+      clearbit(ad->MAP_PIDS, v);
+      err = remove_adapter_pid(ad, v);
+    }
+  } else if (strcasecmp(op, "ADDPROG") == 0 || strcasecmp(op, "REMOVEPROG") == 0) {
+    if (toupper(op[0]) == 'A') {
+      /* Its PIDs aren't known yet: all of them have to come in */
+      if (!is_file(ad) && !ad->soft_demux && !ad->whole_ts && switch_to_soft_demux(ad) < 0)
+        return "couldn't open the demux";
+      if (!is_string(arg)) {
+        for (i=0;i<map->progs_cnt;i++) {
+          if (map->progs[i] == v) return NULL;
+        }
+        if (map->progs_cnt == MAX_USER_PIDS)
+          return "too many programs";
+        map->progs[map->progs_cnt++] = v;
+      } else {
+        for (i=0;i<map->prognames_cnt;i++) {
+          if (!strcmp((char *)map->prognames[i], arg)) return NULL;
+        }
+        map->prognames = realloc(map->prognames, (map->prognames_cnt+1)*sizeof(uint8_t *));
+        map->prognames[map->prognames_cnt++] = (uint8_t *)strdup(arg);
+      }
+    } else if (!is_string(arg)) {
+      remove_int(map->progs, &map->progs_cnt, v);
+    } else {
+      for (i=0;i<map->prognames_cnt;i++) {
+        if (!strcmp((char *)map->prognames[i], arg)) {
+          free(map->prognames[i]);
+          map->prognames[i] = map->prognames[--map->prognames_cnt];
+          break;
+        }
+      }
+    }
+  } else {
+    return "usage: MAP n ADD|REMOVE pid, MAP n ADDPROG|REMOVEPROG prog";
+  }
+  mark_map(n);
+  update_changed_maps(ad);
+  return err;
+}
+
+static void add_rate(control_client_t *cl, char *what, uint64_t now_cnt, uint64_t then, int64_t ns)
+{
+  control_reply(cl, "250-%s %.1f kbit/s\r\n", what,
+                ns > 0 ? (now_cnt - then) * TS_SIZE * 8.0 * 1e6 / ns : 0.0);
+}
+
+/* STATS: the bitrate of each PID read and of each output, since the
+   client's last STATS or since the start */
+static void stats_command(control_client_t *cl)
+{
+  int outs = (map_cnt ? map_cnt : 1);
+  int npids = adapter_cnt * 8192;
+  stats_snap_t *snap = cl->priv;
+  uint64_t *cnt;
+  int64_t t, ns;
+  int a, pid, o;
+  char what[300];
+  adapter_t *ad;
+
+  if (snap == NULL) {
+    snap = calloc(1, sizeof(stats_snap_t) + (npids + outs) * sizeof(uint64_t));
+    if (snap == NULL) {
+      control_reply(cl, "550-out of memory\r\n");
+      return;
+    }
+    snap->t = stats_start;
+    cl->priv = snap;
+  }
+  t = monotonic_ns();
+  ns = t - snap->t;
+  snap->t = t;
+
+  for (a=0;a<adapter_cnt;a++) {
+    ad = &adapters[a];
+    cnt = snap->counts + a * 8192;
+    if (ad->pid_packets == NULL) continue;
+    if (adapter_cnt > 1)
+      control_reply(cl, "250-ADAPTER %d\r\n", a);
+    for (pid=0;pid<8192;pid++) {
+      if (ad->pid_packets[pid] == 0) continue;
+      sprintf(what, "PID %d", pid);
+      add_rate(cl, what, ad->pid_packets[pid], cnt[pid], ns);
+      cnt[pid] = ad->pid_packets[pid];
+    }
+  }
+  cnt = snap->counts + npids;
+  if (map_cnt == 0) {
+    add_rate(cl, "OUTPUT 0", ts_packets, cnt[0], ns);
+    cnt[0] = ts_packets;
+  }
+  for (o=0;o<map_cnt;o++) {
+    if (pids_map[o].filename)
+      snprintf(what, sizeof(what), "OUTPUT %d %s", o, pids_map[o].filename);
+    else
+      snprintf(what, sizeof(what), "OUTPUT %d %s:%d", o, pids_map[o].net, pids_map[o].port);
+    add_rate(cl, what, pids_map[o].packets, cnt[o], ns);
+    cnt[o] = pids_map[o].packets;
+  }
+}
+
+/* The TR 101 290 error counts of each adapter, since the start */
+static void alarms_command(control_client_t *cl)
+{
+  tr_alarms_t al;
+  int a, k;
+
+  if (!monitoring) {
+    control_reply(cl,"550-not monitoring (-monitor)\r\n");
+    return;
+  }
+  for (a = 0; a < adapter_cnt; a++) {
+    if (adapter_cnt > 1)
+      control_reply(cl,"250-ADAPTER %d\r\n",a);
+    monitor_alarms(&adapters[a], &al);
+    for (k = 0; k < TR_ALARMS; k++)
+      control_reply(cl,"250-%s %llu\r\n",tr_alarm_names[k],(unsigned long long)al.n[k]);
+  }
+}
+
+static char *metrics_text(size_t *len);
+
+/* Every counter, as the -stats file has them */
+static void metrics_command(control_client_t *cl)
+{
+  char *text, *line, *save;
+  size_t len;
+
+  if ((text = metrics_text(&len)) == NULL) {
+    control_reply(cl,"550-out of memory\r\n");
+    return;
+  }
+  for (line = strtok_r(text,"\n",&save); line != NULL; line = strtok_r(NULL,"\n",&save))
+    control_reply(cl,"250-%s\r\n",line);
+  free(text);
+}
+
+/* SEEK n secs | SEEK n @time: where in the files of time-shift output n
+   the stream was secs seconds before where it has got to, or at time
+   (seconds since 1970), and what to read to play it from there */
+static char *seek_command(control_client_t *cl, char *args)
+{
+  shift_part_t *parts;
+  shift_entry_t at;
+  tshift_t *ts;
+  int64_t t;
+  char *p;
+  int o, n, k, rap;
+
+  o = strtol(args, &p, 10);
+  if (p == args)
+    return "usage: SEEK n secs, SEEK n @time";
+  if (o < 0 || o >= map_cnt || pids_map[o].shift == NULL)
+    return "not a time-shift output (-shift:)";
+  ts = pids_map[o].shift;
+  while (*p == ' ') p++;
+  if (*p == '@')
+    t = (int64_t)(atof(p+1) * 1e9);
+  else
+    t = tshift_now(ts) - (int64_t)(atof(p) * 1e9);
+
+  if ((parts = malloc(ts->nseg * sizeof(shift_part_t))) == NULL)
+    return "out of memory";
+  n = tshift_seek(ts, t, &at, &rap, parts);
+  if (n == 0) {
+    free(parts);
+    return "nothing recorded yet";
+  }
+  control_reply(cl,"250-SEEK %.3f PCR %lld PTS %lld %s\r\n", at.time / 1e9,
+                (long long)at.pcr, (long long)at.pts, rap ? "RAP" : "PCR");
+  for (k = 0; k < n; k++)
+    control_reply(cl,"250-FILE %s %lld %lld\r\n", parts[k].file,
+                  (long long)parts[k].offset, (long long)parts[k].length);
+  free(parts);
+  return NULL;
+}
+
+static void telnet_command(control_t *c, control_client_t *cl, char *cmd)
+{
+  adapter_t *ad = &adapters[0];
+  dmx_pes_type_t pestype;
+  unsigned long freq=0;
+  unsigned long srate=0;
+  char *ch, *err = NULL;
+  int i;
+
+  fprintf(stderr,"CMD: \"%s\"\n",cmd);
+  if (strcasecmp(cmd,"QUIT")==0) {
+    control_reply(cl,"DONE\r\n");
+    control_close_client(c,cl);
+    return;
+  } else if (strcasecmp(cmd,"STOP")==0) {
+    control_reply(cl,"STOP\r\n");
+    stop_filters(ad,0);
+    for (i=0;i<8192;i++) {
+      hi_mappids[i]=(i >> 8);
+      lo_mappids[i]=(i&0xff);
+    }
+  } else if (strcasecmp(cmd,"START")==0) {
+    control_reply(cl,"START\r\n");
+    if (!is_file(ad))
+      set_filters(ad);
+  } else if (strcasecmp(cmd,"STATS")==0) {
+    stats_command(cl);
+  } else if (strcasecmp(cmd,"ALARMS")==0) {
+    alarms_command(cl);
+  } else if (strcasecmp(cmd,"METRICS")==0) {
+    metrics_command(cl);
+  } else if (strncasecmp(cmd,"SEEK",4)==0) {
+    err = seek_command(cl, &cmd[4]);
+  } else if (strncasecmp(cmd,"MAP",3)==0) {
+    err = map_command(&cmd[3]);
+  } else if (strncasecmp(cmd,"REMOVE",6)==0) {
+    pid=atoi(&cmd[6]);
+    if (pid >= 0 && pid < 8192)
+      clearbit(ad->MAP_PIDS, pid);
+    err = remove_adapter_pid(ad, pid);
+  } else if (strncasecmp(cmd,"ADD",3)==0) {
+    i=4;
+    if ((cmd[3]=='V') || (cmd[3]=='v')) pestype=DMX_PES_VIDEO;
+    else if ((cmd[3]=='A') || (cmd[3]=='a')) pestype=DMX_PES_AUDIO;
+    else if ((cmd[3]=='T') || (cmd[3]=='t')) pestype=DMX_PES_TELETEXT;
+    else { pestype=DMX_PES_OTHER; i=3; }
+    while (cmd[i]==' ') i++;
+    if ((ch=(char*)strstr(&cmd[i],":"))!=NULL) {
+      pid2=atoi(&ch[1]);
+      ch[0]=0;
+    } else {
+      pid2=-1;
+    }
+    pid=atoi(&cmd[i]);
+    if (pid <= 0 || pid > 8192) {
+      err = "bad PID";
+    } else if ((err = add_adapter_pid(ad, pid, pestype)) == NULL && pid < 8192) {
+      clearbit(ad->MAP_PIDS, pid);  // not just the maps' any more
+      if (pid2 != -1) {
+        hi_mappids[pid]=pid2>>8;
+        lo_mappids[pid]=pid2&0xff;
+        fprintf(stderr,"Mapping %d to %d\n",pid,pid2);
+      }
+    }
+  } else if (strncasecmp(cmd,"TUNE",4)==0) {
+    for (i=0;i<8192;i++) {
+      hi_mappids[i]=(i >> 8);
+      lo_mappids[i]=(i&0xff);
+    }
+    stop_filters(ad,1);
+    ad->soft_demux=0;
+    ad->npids=0;
+    clearbits(ad->USER_PIDS);
+    clearbits(ad->MAP_PIDS);
+    i=4;
+    while (cmd[i]==' ') i++;
+    freq=atoi(&cmd[i]);
+    while ((cmd[i]!=' ') && (cmd[i]!=0)) i++;
+    if (cmd[i]!=0) {
+      while (cmd[i]==' ') i++;
+      pol=cmd[i];
+      while ((cmd[i]!=' ') && (cmd[i]!=0)) i++;
+      if (cmd[i]!=0) {
+        while (cmd[i]==' ') i++;
+        srate=atoi(&cmd[i])*1000UL;
+        fprintf(stderr,"Tuning to %ld,%ld,%c\n",freq,srate,pol);
+        ad->freq=freq;
+        ad->srate=srate;
+        ad->pol=pol;
+        if(!is_file(ad))
+          tune_adapter(ad);
+      }
+    }
+  } else {
+    err = "unknown command";
+  }
+  if (err != NULL)
+    control_reply(cl,"550-%s\r\n",err);
+  control_reply(cl,"DONE\r\n");
+}
+#endif
+
+/* -pace: hand each packet over when it is due, sending whatever has
+   been queued before waiting.  flush sends the queued datagrams. */
+static pacer_t pacer;
+static int pacing = 0;
+
+static void paced_batch(int output_type, int do_analyse, uint8_t **pkts, int n,
+                        void (*flush)(int output_type))
+{
+  int64_t due, t;
+  int i, start = 0;
+
+  for (i = 0; i < n; i++) {
+    due = pacer_stamp(&pacer, pkts[i]);
+    if (pacer.slot_ns) {
+      /* -cbr: null packets in the slots before this one's */
+      while ((t = pacer_null_slot(&pacer, due)) != 0) {
+        process_batch(output_type, do_analyse, pkts + start, i - start);
+        start = i;
+        if (pacer_early(&pacer, t)) {
+          flush(output_type);
+          pacer_wait(&pacer, t);
+        }
+        emit(0, null_packet);
+      }
+      due = pacer_slot(&pacer, due);
+    }
+    if (pacer_early(&pacer, due)) {
+      process_batch(output_type, do_analyse, pkts + start, i - start);
+      start = i;
+      flush(output_type);
+      pacer_wait(&pacer, due);
+    }
+  }
+  process_batch(output_type, do_analyse, pkts + start, n - start);
+}
+
+/* Threaded mode (-threads N).  Each adapter has an ingest thread which
+   owns its DVR and passes each batch it reads to the routing thread, which does the PID mapping,
+   the SI parsing and the telnet commands.  Packets for output o are then
+   passed on to egress thread o % N, which owns the output's socket or
+   file.  In -ps and -analyse modes the routing thread does the output
+   itself.
+
+   When the inputs are files (-stdin, -input) a full ring makes the stage feeding
+   it wait, so nothing is lost.  Reading from the DVR, a full ring drops
+   packets instead: a stalled output must not stop the DVR being read. */
+#define MAX_EGRESS_THREADS 16
+#define TELNET_INTERVAL 100  // ms between telnet checks
+
+static int egress_threads = 0;
+static int lossless = 0;
+static spsc_ring_t route_ring[MAX_ADAPTERS];      // one per ingest thread
+static spsc_ring_t egress_ring[MAX_EGRESS_THREADS];
+static batch_t *egress_batch[MAX_EGRESS_THREADS];  // being filled by the router
+static slab_t *route_slab;                         // slab of the batch being routed
+
+typedef struct {
+  int output_type;
+  int do_analyse;
+} pipeline_args_t;
+
+/* The counters of every stage, in the Prometheus text format (stats.c),
+   for the telnet METRICS command and, with -stats, a file rewritten
+   every few seconds for node_exporter's textfile collector to pick up */
+#define STATS_SECS 10
+static char *stats_file = NULL;
+static int stats_secs = STATS_SECS;
+
+static const stats_field_t ingest_fields[] = {
+  { "dvbstream_read_calls_total", "read() calls on the DVR or input", offsetof(ingest_t, reads), 0 },
+  { "dvbstream_read_bytes_total", "Bytes read", offsetof(ingest_t, bytes), 0 },
+  { "dvbstream_read_packets_total", "TS packets read", offsetof(ingest_t, packets), 0 },
+  { "dvbstream_sync_losses_total", "Times TS packet sync was lost", offsetof(ingest_t, framer.resyncs), 0 },
+};
+
+static const stats_field_t demux_fields[] = {
+  { "dvbstream_demux_packets_total", "Packets through the software demux", offsetof(demux_t, packets), 0 },
+  { "dvbstream_demux_dropped_total", "Packets of PIDs no output wanted", offsetof(demux_t, dropped), 0 },
+};
+
+static const stats_field_t psi_fields[] = {
+  { "dvbstream_psi_sections_total", "PSI sections parsed", offsetof(psi_stats_t, sections), 0 },
+  { "dvbstream_psi_crc_errors_total", "PSI sections with a bad CRC", offsetof(psi_stats_t, crc_errors), 0 },
+};
+
+static const stats_field_t egress_fields[] = {
+  { "dvbstream_send_datagrams_total", "Datagrams sent", offsetof(egress_t, datagrams), 0 },
+  { "dvbstream_send_bytes_total", "Bytes sent, headers included", offsetof(egress_t, bytes), 0 },
+  { "dvbstream_send_calls_total", "sendmmsg() and sendmsg() calls", offsetof(egress_t, syscalls), 0 },
+  { "dvbstream_send_errors_total", "Datagrams the kernel refused", offsetof(egress_t, errors), 0 },
+  { "dvbstream_send_eagain_total", "Datagrams dropped on EAGAIN", offsetof(egress_t, eagain), 0 },
+  { "dvbstream_send_fec_total", "SMPTE 2022-1 FEC packets sent", offsetof(egress_t, fec_sent), 0 },
+  { "dvbstream_send_nacks_total", "RTCP NACKs received", offsetof(egress_t, nacks), 0 },
+  { "dvbstream_send_retransmits_total", "Datagrams sent again for NACKs", offsetof(egress_t, retransmits), 0 },
+};
+
+static const stats_field_t record_fields[] = {
+  { "dvbstream_record_bytes_total", "Bytes written to the file", offsetof(recorder_t, bytes), 0 },
+  { "dvbstream_record_writes_total", "Writes issued", offsetof(recorder_t, writes), 0 },
+  { "dvbstream_record_dropped_total", "Packets dropped waiting for the disk", offsetof(recorder_t, dropped), 0 },
+  { "dvbstream_record_errors_total", "Failed writes", offsetof(recorder_t, errors), 0 },
+};
+
+static const stats_field_t ring_fields[] = {
+  { "dvbstream_ring_batches_total", "Batches passed through the ring", offsetof(spsc_ring_t, batches), 0 },
+  { "dvbstream_ring_packets_total", "Packets passed through the ring", offsetof(spsc_ring_t, packets), 0 },
+  { "dvbstream_ring_dropped_total", "Packets dropped because the ring was full", offsetof(spsc_ring_t, dropped), 0 },
+  { "dvbstream_ring_full_total", "Times the ring was found full", offsetof(spsc_ring_t, full), 0 },
+};
+
+#define NFIELDS(f) (sizeof(f) / sizeof(stats_field_t))
+#define LABEL_LEN 300
+
+static void write_metrics(FILE *f)
+{
+  int max = map_cnt + MAX_ADAPTERS + MAX_EGRESS_THREADS + 1;
+  void **objs = malloc(4 * max * sizeof(void *));
+  char **labels = malloc(4 * max * sizeof(char *));
+  char *names = malloc(max * LABEL_LEN);
+  latency_t **lat = malloc(max * sizeof(latency_t *));
+  uint64_t *packets = malloc(max * sizeof(uint64_t));
+  void **demux = objs + max, **eg = objs + 2*max, **rec = objs + 3*max;
+  char **demux_labels = labels + max, **eg_labels = labels + 2*max, **rec_labels = labels + 3*max;
+  char ad_names[MAX_ADAPTERS][32], ip[RTP_ADDR_LEN + 8], *name;
+  tr_alarms_t al;
+  int a, o, t, k, n, ndemux, neg, nrec, nout;
+
+  if (!objs || !labels || !names || !lat || !packets)
+    goto done;
+
+  ndemux = 0;
+  for (a = 0; a < adapter_cnt; a++) {
+    snprintf(ad_names[a], sizeof(ad_names[a]), "adapter=\"%d\"", a);
+    objs[a] = &adapters[a].ingest;
+    labels[a] = ad_names[a];
+    if (adapters[a].soft_demux) {
+      demux[ndemux] = &adapters[a].demux;
+      demux_labels[ndemux++] = ad_names[a];
+    }
+  }
+  stats_fields(f, ingest_fields, NFIELDS(ingest_fields), objs, labels, adapter_cnt);
+  stats_fields(f, demux_fields, NFIELDS(demux_fields), demux, demux_labels, ndemux);
+  for (a = 0; a < adapter_cnt; a++)
+    objs[a] = &adapters[a].psi;
+  stats_fields(f, psi_fields, NFIELDS(psi_fields), objs, labels, adapter_cnt);
+
+  /* The outputs: the network or stdout stream, or the maps */
+  neg = nrec = nout = 0;
+  if (map_cnt == 0) {
+    name = names;
+    if (!to_stdout && ts_egress.fd > 0) {
+      rtp_addrstr(&ts_egress.addr, ip, sizeof(ip));
+      snprintf(name, LABEL_LEN, "output=\"0\",dest=\"%s\"", ip);
+      eg[neg] = &ts_egress;
+      eg_labels[neg++] = name;
+    } else {
+      snprintf(name, LABEL_LEN, "output=\"0\"");
+    }
+    labels[nout] = name;
+    packets[nout++] = __atomic_load_n(&ts_packets, __ATOMIC_RELAXED);
+  }
+  for (o = 0; o < map_cnt; o++) {
+    name = names + o * LABEL_LEN;
+    if (pids_map[o].filename) {
+      snprintf(name, LABEL_LEN, "output=\"%d\",file=\"%s\"", o, pids_map[o].filename);
+      rec[nrec] = pids_map[o].shift ? &pids_map[o].shift->rec : &pids_map[o].rec;
+      rec_labels[nrec++] = name;
+    } else {
+      rtp_addrstr(&pids_map[o].eg.addr, ip, sizeof(ip));
+      snprintf(name, LABEL_LEN, "output=\"%d\",dest=\"%s\"", o, ip);
+      eg[neg] = &pids_map[o].eg;
+      eg_labels[neg++] = name;
+    }
+    labels[nout] = name;
+    packets[nout++] = __atomic_load_n(&pids_map[o].packets, __ATOMIC_RELAXED);
+  }
+  stats_family(f, "dvbstream_output_packets_total", "counter", "TS packets routed to the output");
+  for (o = 0; o < nout; o++)
+    stats_value(f, "dvbstream_output_packets_total", labels[o], packets[o]);
+  stats_fields(f, egress_fields, NFIELDS(egress_fields), eg, eg_labels, neg);
+  for (o = 0; o < neg; o++)
+    lat[o] = &((egress_t *)eg[o])->latency;
+  stats_latency(f, "dvbstream_send_latency_seconds", "From reading a datagram's first packet to sending it",
+                lat, eg_labels, neg);
+  stats_fields(f, record_fields, NFIELDS(record_fields), rec, rec_labels, nrec);
+
+  /* The rings between the threads */
+  if (egress_threads > 0) {
+    n = 0;
+    for (a = 0; a < adapter_cnt; a++) {
+      objs[n] = &route_ring[a];
+      labels[n] = names + n * LABEL_LEN;
+      snprintf(labels[n], LABEL_LEN, "ring=\"route\",adapter=\"%d\"", a);
+      n++;
+    }
+    for (t = 0; t < egress_threads; t++) {
+      objs[n] = &egress_ring[t];
+      labels[n] = names + n * LABEL_LEN;
+      snprintf(labels[n], LABEL_LEN, "ring=\"egress\",thread=\"%d\"", t);
+      n++;
+    }
+    stats_fields(f, ring_fields, NFIELDS(ring_fields), objs, labels, n);
+    stats_family(f, "dvbstream_ring_occupancy", "gauge", "Batches waiting in the ring");
+    for (k = 0; k < n; k++)
+      stats_value(f, "dvbstream_ring_occupancy", labels[k], spsc_occupancy(objs[k]));
+    stats_family(f, "dvbstream_ring_highwater", "gauge", "Most batches ever waiting in the ring");
+    for (k = 0; k < n; k++)
+      stats_value(f, "dvbstream_ring_highwater", labels[k],
+                  __atomic_load_n(&((spsc_ring_t *)objs[k])->highwater, __ATOMIC_RELAXED));
+  }
+
+  if (monitoring) {
+    stats_family(f, "dvbstream_tr101290_errors_total", "counter", "TR 101 290 errors counted by -monitor");
+    for (a = 0; a < adapter_cnt; a++) {
+      monitor_alarms(&adapters[a], &al);
+      for (k = 0; k < TR_ALARMS; k++) {
+        snprintf(names, LABEL_LEN, "adapter=\"%d\",error=\"%s\"", a, tr_alarm_names[k]);
+        stats_value(f, "dvbstream_tr101290_errors_total", names, al.n[k]);
       }
     }
   }
-}
 
+done:
+  free(objs); free(labels); free(names); free(lat); free(packets);
+}
 
-static int collect_section(section_t *section, int pusi, uint8_t *buf, unsigned int len)
+/* The metrics as text, to be freed */
+static char *metrics_text(size_t *len)
 {
-  int skip, slen;
-  uint8_t *ptr;
-
-  if(pusi)
-    section->pos = 0;
-
-  if(section->pos + len > SECTION_LEN)
-    return 0;
-
-  memcpy(&(section->buf[section->pos]), buf, len);
-  section->pos += len;
-
-  skip = section->buf[0];
-  if(skip + 4 > section->pos)
-    return 0;
-
-  ptr = &(section->buf[skip + 1]);
-  slen = ((ptr[1] & 0x0f) << 8) | ptr[2];
-  if(section->pos < (skip+1+3+slen))
-    return 0;
-
-  return skip+1;
+  char *text = NULL;
+  FILE *f;
+
+  if ((f = open_memstream(&text, len)) == NULL)
+    return NULL;
+  write_metrics(f);
+  fclose(f);
+  return text;
 }
 
-
-static int parse_pat(int pusi, uint8_t *b, int l)
+/* Rewrite the -stats file if it is due, or now */
+static void stats_poll(int force)
 {
-  unsigned int i, j, vers, seclen, num, skip;
-  uint8_t *buf;
-
-  skip = collect_section(&PAT.section, pusi, b, l);
-  if(!skip)
-    return 0;
+  static long last = 0;
+  char *text;
+  size_t len;
 
-  //now we know the section is complete
-  PAT.section.pos = 0;
-  buf = &(PAT.section.buf[skip]);
-
-  if(buf[0] != 0) //pat id
-    return 0;
-  if(!(buf[5] & 1)) //not yet valid
-    return 0;
+  if (stats_file == NULL || (!force && getmsec() - last < stats_secs * 1000L))
+    return;
+  last = getmsec();
+  if ((text = metrics_text(&len)) == NULL)
+    return;
+  if (stats_write_file(stats_file, text, len) < 0)
+    perror(stats_file);
+  free(text);
+}
 
-  vers = (buf[5] >> 1) & 0x1F;
-  if(PAT.version == vers) //PAT didn't change
-    return 1;
+/* Wait for a free slot in r, or give up straight away if packets may
+   be dropped */
+static batch_t *claim_slot(spsc_ring_t *r)
+{
+  batch_t *b;
+  int spins = 0;
 
-  clearbits(SI_PIDS);
-  setbit(SI_PIDS, 0);
-  setbit(SI_PIDS, SDT_PID);
-  seclen = ((buf[1] & 0x0F) << 8) | buf[2];
-  num = (seclen - 9) / 4;
-  if(PAT.entries_cnt != num)
-  {
-    PAT.entries = realloc(PAT.entries, sizeof(pat_entry)*num);
-    PAT.entries_cnt = num;
-    PMT.entries = realloc(PMT.entries, sizeof(pmt_t)*num);
-    if(!PMT.entries) return 0;
-    PMT.cnt = num;
+  while ((b = spsc_claim(r)) == NULL) {
+    if (!lossless || Interrupted)
+      return NULL;
+    spsc_idle(&spins);
   }
+  return b;
+}
 
-  i = 8;
-  j = 0;
-  for(j=0; j<num; j++)
-  {
-    PAT.entries[j].program = (buf[i] << 8) | buf[i+1];
-    PAT.entries[j].pmt_pid = ((buf[i+2] & 0x1F) << 8) | buf[i+3];
-    setbit(SI_PIDS, PAT.entries[j].pmt_pid);
-    i += 4;
-    //fprintf(stderr, "PROGRAM: %d, pmt_pid: %d\n", PAT.entries[j].program, PAT.entries[j].pmt_pid);
-    PMT.entries[j].section.pos = SECTION_LEN+1;
-    PMT.entries[j].version = -1;
-    PMT.entries[j].name[0] = 0;
+static void *ingest_thread(void *arg)
+{
+  adapter_t *ad = arg;
+  ingest_t *in = &ad->ingest;
+  spsc_ring_t *r = &route_ring[ad - adapters];
+  struct pollfd pfd;
+  batch_t *b;
+  int n;
+
+  pfd.fd = ingest_poll_fd(in);
+  pfd.events = POLLIN|POLLPRI;
+  while (!Interrupted) {
+    poll(&pfd,1,500);
+    n = ingest_read(in);
+    if (n < 0) break;
+    if (n == 0) continue;
+
+    if ((b = claim_slot(r)) == NULL) {
+      r->dropped += n;
+      continue;
+    }
+    memcpy(b->pkts, in->pkts, n * sizeof(uint8_t *));
+    b->n = n;
+    b->read_ns = monotonic_ns();
+    slab_ref(in->slab);
+    b->slab = in->slab;
+    spsc_publish(r);
   }
-  SDT.version=-1;
-  SDT.section.pos = SECTION_LEN+1;
-
-  PAT.version = vers;
-
-  return 2;
+  spsc_close(r);
+  return NULL;
 }
 
-static void add_pmt_pids()
+static void route_emit(int o, uint8_t *buf)
 {
-  int i;
-  PID_BIT_MAP simap;
+  int t = o % egress_threads;
+  batch_t *b = egress_batch[t];
 
-  for(i = 0; i < SI_fd_cnt; i++)
-    close(SI_fd[i]);
-
-  clearbits(simap);
-  setbit(simap, 0);
-  for(i=0; i<min(PAT.entries_cnt, MAX_CHANNELS); i++)
-  {
-    if(getbit(USER_PIDS, PAT.entries[i].pmt_pid)) continue;
-    if(getbit(simap, PAT.entries[i].pmt_pid)) continue;
-    if((SI_fd[i] = open(demuxdev[card], O_RDWR|O_NONBLOCK)) < 0)
-    {
-      fprintf(stderr,"COULDN'T OPEN DEMUX %i: for pid: %d", i, PAT.entries[i].pmt_pid);
+  if (b == NULL) {
+    if ((b = claim_slot(&egress_ring[t])) == NULL) {
+      egress_ring[t].dropped++;
       return;
     }
-    //fprintf(stderr, "\nADDED PMT PID: %d\n", PAT.entries[i].pmt_pid);
-    set_ts_filt(SI_fd[i], PAT.entries[i].pmt_pid, DMX_PES_OTHER);
-    setbit(simap, PAT.entries[i].pmt_pid);
-    SI_fd_cnt++;
+    slab_ref(route_slab);
+    b->slab = route_slab;
+    b->n = 0;
+    b->read_ns = out_read_ns;
+    egress_batch[t] = b;
+  }
+  b->pkts[b->n] = buf;
+  b->outs[b->n] = o;
+  b->stamps[b->n] = out_stamp;
+  b->n++;
+  if (b->n == egress_ring[t].max) {
+    spsc_publish(&egress_ring[t]);
+    egress_batch[t] = NULL;
   }
 }
 
-static int parse_pmt(int pusi, pmt_t *pmt, uint8_t *b, int l)
+/* Pass the packets routed so far on to the egress threads */
+static void publish_egress(int output_type)
 {
-  unsigned int i, version, seclen, skip, prog, pcr_pid, pid;
-  uint8_t *buf;
-
-  skip = collect_section(&(pmt->section), pusi, b, l);
-
-  if(!skip)
-    return 0;
-
-  //now we know the section is complete
-  pmt->section.pos = 0;
-  pmt->pids_cnt = 0;
-  buf = &(pmt->section.buf[skip]);
-
-  if(buf[0] != 2) //pmt id
-    return 0;
-  if(!(buf[5] & 1)) //not yet valid
-    return 0;
-
-  prog = (buf[3] << 8) | buf[4];
-  version = (buf[5] >> 1) & 0x1F;
-
-  if(pmt->version == version) //PMT didn't change
-    return 1;
-
-  seclen = ((buf[1] & 0x0F) << 8) | buf[2];
-  pcr_pid = ((buf[8] & 0x1F) << 8) | buf[9];
-  pmt->pids[pmt->pids_cnt++] = pcr_pid;
-  //fprintf(stderr, "\nPROGRAM: %d, pcr_pid: %d, version: %d vs %d\n", prog, pcr_pid, pmt->version, version);
-  skip = ((buf[10] & 0x0F) << 8) | buf[11];
-  if(skip+12 > seclen)
-    return 0;
-
-  i = skip+12;
-  while(i+5<seclen)
-  {
-    pid = ((buf[i+1] & 0x1F) << 8) | buf[i+2];
-    pmt->pids[pmt->pids_cnt++] = pid;
-    skip = ((buf[i+3] & 0x0F) << 8) | buf[i+4];
-    i += skip+5;
-    //fprintf(stderr, "prog %d, PID: %d, count: %d, type: 0x%x\n", prog, pid, pmt->pids_cnt, buf[i]);
+  int t;
+
+  if (output_type==RTP_PS && !to_stdout)
+    pspkt_flush(&ps_out);
+  for (t = 0; t < egress_threads; t++) {
+    if (egress_batch[t] != NULL) {
+      spsc_publish(&egress_ring[t]);
+      egress_batch[t] = NULL;
+    }
   }
-  pmt->version = version;
-  return 2;
 }
 
-static int parse_sdt(int pusi, uint8_t *b, int l)
+static void *route_thread(void *arg)
 {
-  unsigned int i, version, seclen, skip, prog, k, descr_len, found, len;
-  uint8_t *buf;
-
-  skip = collect_section(&(SDT.section), pusi, b, l);
+  pipeline_args_t *args = arg;
+  long last_telnet = 0;
+  batch_t *b;
+  int a, t, busy, running, spins = 0;
+
+  for (;;) {
+    if (getmsec() - last_telnet >= TELNET_INTERVAL) {
+      control_poll(&control);
+      last_telnet = getmsec();
+    }
+    if (args->do_analyse)
+      analyser_poll(&analyser);
+    if (monitoring)
+      monitor_poll();
+    stats_poll(0);
+
+    busy = running = 0;
+    for (a = 0; a < adapter_cnt; a++) {
+      if ((b = spsc_peek(&route_ring[a])) == NULL) {
+        if (!spsc_done(&route_ring[a])) running++;
+        continue;
+      }
+      busy = running = 1;
+
+      cur = &adapters[a];
+      route_slab = b->slab;
+      out_read_ns = b->read_ns;
+      if (pacing)
+        paced_batch(args->output_type, args->do_analyse, b->pkts, b->n, publish_egress);
+      else
+        process_batch(args->output_type, args->do_analyse, b->pkts, b->n);
+      publish_egress(args->output_type);
+      slab_put(b->slab);
+      spsc_release(&route_ring[a]);
+    }
+    if (!running) break;
+    if (busy)
+      spins = 0;
+    else
+      spsc_idle(&spins);
+  }
+  for (t = 0; t < egress_threads; t++)
+    spsc_close(&egress_ring[t]);
+  return NULL;
+}
 
-  if(!skip)
-    return 0;
+static void *egress_thread(void *arg)
+{
+  spsc_ring_t *r = arg;
+  int t = r - egress_ring;
+  int i, n, spins = 0;
+  batch_t *b;
+
+  n = output_count(map_cnt ? MAP_TS : RTP_TS);
+  for (;;) {
+    if ((b = spsc_peek(r)) == NULL) {
+      if (spsc_done(r)) break;
+      spsc_idle(&spins);
+      continue;
+    }
+    spins = 0;
 
-  buf = &(SDT.section.buf[skip]);
+    out_read_ns = b->read_ns;
+    for (i = 0; i < b->n; i++) {
+      out_stamp = b->stamps[i];
+      output_packet(b->outs[i], b->pkts[i]);
+    }
+    for (i = t; i < n; i += egress_threads)
+      output_flush(i, b->slab);
+    slab_put(b->slab);
+    spsc_release(r);
+  }
+  for (i = t; i < n; i += egress_threads)
+    output_finish(i);
+  return NULL;
+}
 
-  if(buf[0] != 0x42) //pmt id
-    return 0;
-  if(!(buf[5] & 1)) //not yet valid
-    return 0;
+static int pipeline_running()
+{
+  int a;
 
-  version = (buf[5] >> 1) & 0x1F;
+  for (a = 0; a < adapter_cnt; a++) {
+    if (!__atomic_load_n(&route_ring[a].closed, __ATOMIC_ACQUIRE))
+      return 1;
+  }
+  return 0;
+}
 
-  if(SDT.version == version) //SDT didn't change
-    return 1;
+/* Run the pipeline until the inputs end or we are interrupted */
+static int run_pipeline(pipeline_args_t *args, int *cpus, int ncpus, unsigned int secs)
+{
+  pthread_t ingest_tid[MAX_ADAPTERS], route_tid, egress_tid[MAX_EGRESS_THREADS];
+  int max = adapters[0].ingest.size / TS_SIZE + 1;
+  int a, t;
+  char name[32];
+
+  if (egress_threads > output_count(args->output_type))
+    egress_threads = output_count(args->output_type);
+  for (a = 0; a < adapter_cnt; a++) {
+    if (spsc_init(&route_ring[a], SPSC_SLOTS, max, 0) < 0) {
+      fprintf(stderr,"Couldn't allocate the pipeline rings\n");
+      return -1;
+    }
+  }
+  for (t = 0; t < egress_threads; t++) {
+    if (spsc_init(&egress_ring[t], SPSC_SLOTS, max, 1) < 0) {
+      fprintf(stderr,"Couldn't allocate the pipeline rings\n");
+      return -1;
+    }
+  }
+  emit = route_emit;
 
-  seclen = ((buf[1] & 0x0F) << 8) | buf[2];
-  if(seclen < 12)
-    return 0;
+  fprintf(stderr,"Pipelined: %d ingest, 1 routing and %d egress thread%s\n",
+          adapter_cnt,egress_threads,(egress_threads==1 ? "" : "s"));
+  for (t = 0; t < egress_threads; t++) {
+    if (start_thread(&egress_tid[t], egress_thread, &egress_ring[t],
+                     (2+t < ncpus) ? cpus[2+t] : -1) < 0)
+      return -1;
+  }
+  if (start_thread(&route_tid, route_thread, args, (ncpus > 1) ? cpus[1] : -1) < 0)
+    return -1;
+  for (a = 0; a < adapter_cnt; a++) {
+    if (start_thread(&ingest_tid[a], ingest_thread, &adapters[a], (ncpus > 0) ? cpus[0] : -1) < 0)
+      return -1;
+  }
 
-  i = 11;
-  while(i  < seclen - 4)
-  {
-    descr_len = ((buf[i+3] & 0x0F) << 8) | buf[i+4];
-    if(i+5+descr_len >= seclen)
-      break;
-    prog = (buf[i] << 8) | buf[i+1];
-    found = -1;
-    k = 0;
-    for(k = 0; k < PAT.entries_cnt, k < PMT.cnt; k++)
-      if(PAT.entries[k].program == prog)
-      {
-        found = k;
-        
+  /* The main thread just takes the signals and watches the clock */
+  while (!Interrupted && pipeline_running()) {
+    poll(NULL,0,100);
+    if ((secs!=-1) && (secs <=now)) { Interrupted=1; }
+  }
 
-    if(k != -1)
-    {
-      int j, len, dlen;
+  for (a = 0; a < adapter_cnt; a++)
+    pthread_join(ingest_tid[a], NULL);
+  pthread_join(route_tid, NULL);
+  for (t = 0; t < egress_threads; t++)
+    pthread_join(egress_tid[t], NULL);
 
-      j = i + 5;
-      len = dlen = 0;
-      while(len < descr_len)
-      {
-        int provider_len, name_len, n;
-        pmt_t *pmt;
-
-        n = j;
-        dlen = buf[n+1];
-        if(len + dlen > descr_len) break;
-        if(buf[n] == 0x48)
-        {
-          provider_len = buf[n+3];
-          if(provider_len + 2 > dlen)
-            break;
-          n += 4 + provider_len;
-          name_len = buf[n];
-          if(provider_len + 3 + name_len > dlen)
-            break;
-          pmt = &PMT.entries[k];
-          memcpy(pmt->name, &buf[n+1], name_len);
-          pmt->name[name_len] = 0;
-          fprintf(stderr, "Program n. %d, name: '%s'\n", prog, pmt->name);
-        }
-        len += dlen+2;
-        j += dlen+2;
-      }
-    }
-    }
-    i += 5 + descr_len;
+  for (a = 0; a < adapter_cnt; a++) {
+    sprintf(name, "ingest%d->route", a);
+    spsc_report(&route_ring[a], stderr, name);
+    spsc_free(&route_ring[a]);
+  }
+  for (t = 0; t < egress_threads; t++) {
+    sprintf(name, "route->egress%d", t);
+    spsc_report(&egress_ring[t], stderr, name);
+    spsc_free(&egress_ring[t]);
   }
-  SDT.version = version;
-  return 2;
+  return 0;
 }
 
+static void flush_current(int output_type)
+{
+  flush_outputs(output_type, cur->ingest.slab);
+}
 
-static int parse_ts_packet(uint8_t *buf)
+/* Single threaded: one event loop reads whichever adapters have data */
+static void run_loop(int output_type, int do_analyse, unsigned int secs)
 {
-  int pid, l, af, pusi;
+  struct epoll_event ev, events[MAX_ADAPTERS+CONTROL_CLIENTS+1];
+  adapter_t *ready[MAX_ADAPTERS];
+  long last_telnet = 0;
+  int epfd, telnet;
+  int a, i, n, nready, running, always = 0;
+
+  epfd = epoll_create1(0);
+  running = adapter_cnt;
+  for (a = 0; a < adapter_cnt; a++) {
+    ev.events = EPOLLIN|EPOLLPRI;
+    ev.data.ptr = &adapters[a];
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, ingest_poll_fd(&adapters[a].ingest), &ev) < 0) {
+      /* Regular files are always readable and epoll won't take them */
+      adapters[a].always_ready = 1;
+      always++;
+    }
+  }
 
-  if(buf[0] != 0x47)
-    return 0;
-  pusi = buf[1] & 0x40;
-  pid = ((buf[1] & 0x1F) << 8) | buf[2];
-  af = (buf[3] >> 4) & 0x03;
-  l = 4;
-  if(af == 2) //only adaption
-    return 0;
-  else if(af == 3)
-    l += buf[4] + 1;
-  if(l >= TS_SIZE - 4)
-    return 0;
+  /* Wake up for the telnet clients as well as the DVRs */
+  control_watch(&control, epfd);
 
-  if(pid == 0)
-  {
-    if(parse_pat(pusi, &buf[l], TS_SIZE - l) == 2)
-      add_pmt_pids();
-  }
-  else if(pid == SDT_PID)
-  {
-    if(parse_sdt(pusi, &buf[l], TS_SIZE - l) == 2)
-    {
-      int i;
-      for(i = 0; i < PMT.cnt; i++)
-      {
-        PMT.entries[i].section.pos = SECTION_LEN+1;
-        PMT.entries[i].version = -1;
+  while ( !Interrupted && running > 0) {
+    n = epoll_wait(epfd, events, MAX_ADAPTERS+CONTROL_CLIENTS+1, always ? 0 : 500);
+
+    nready = telnet = 0;
+    for (i = 0; i < n; i++) {
+      if (events[i].data.ptr != NULL)
+        ready[nready++] = events[i].data.ptr;
+      else
+        telnet = 1;
+    }
+    /* Run the telnet commands before the next batch, and now and then
+       anyway to send the rest of long replies */
+    if (telnet || getmsec() - last_telnet >= TELNET_INTERVAL) {
+      control_poll(&control);
+      last_telnet = getmsec();
+    }
+    for (a = 0; a < adapter_cnt; a++) {
+      if (adapters[a].always_ready && !adapters[a].done)
+        ready[nready++] = &adapters[a];
+    }
+    /* Nothing ready after the timeout: try the reads anyway, as before */
+    if (n == 0 && nready == 0) {
+      for (a = 0; a < adapter_cnt; a++) {
+        if (!adapters[a].done)
+          ready[nready++] = &adapters[a];
       }
-      update_bitmaps();
     }
-  }
-  else
-  {
-    int i;
 
-    for(i=0; i<PAT.entries_cnt; i++)
-    {
-      if(pid==PAT.entries[i].pmt_pid)
-      {
-        if(parse_pmt(pusi, &PMT.entries[i], &buf[l], TS_SIZE - l) == 2)
-          update_bitmaps();
+    for (i = 0; i < nready; i++) {
+      cur = ready[i];
+      /* Read as many packets as are available, up to one chunk */
+      n = ingest_read(&cur->ingest);
+      if (n < 0) {
+        cur->done = 1;
+        if (!cur->always_ready)
+          epoll_ctl(epfd, EPOLL_CTL_DEL, ingest_poll_fd(&cur->ingest), NULL);
+        else
+          always--;
+        running--;
+        continue;
       }
+      out_read_ns = monotonic_ns();
+      if (pacing)
+        paced_batch(output_type, do_analyse, cur->ingest.pkts, n, flush_current);
+      else
+        process_batch(output_type, do_analyse, cur->ingest.pkts, n);
+      flush_outputs(output_type, cur->ingest.slab);
     }
+    if (do_analyse)
+      analyser_poll(&analyser);
+    if (monitoring)
+      monitor_poll();
+    stats_poll(0);
+    if ((secs!=-1) && (secs <=now)) { Interrupted=1; }
   }
-}
-
-static int is_string(char *s)
-{
-  int i, n, len;
-
-  n = 0;
-  len = strlen(s);
-  for(i = 0; i < len; i++)
-    if(isdigit(s[i]))
-      n++;
-
-  return (n != len);
+  close(epfd);
 }
 
 int main(int argc, char **argv)
@@ -871,33 +2396,40 @@ int main(int argc, char **argv)
   //  state_t state=STREAM_OFF;
 #ifdef ENABLE_TELNET
   unsigned short int port=DEFAULT_PORT;
+  char hostname[64], greeting[128];
 #endif
-  int fd_dvr;
   int i,j;
-  uint8_t buf[MTU];
-  struct pollfd pfds[2];  // DVR device and Telnet connection
   unsigned int secs = -1;
   unsigned long freq=0;
   unsigned long srate=0;
-  int count;
+  int n;
   char* ch;
   dmx_pes_type_t pestype;
-  int bytes_read;
   int do_analyse=0;
-  unsigned char* free_bytes;
   int output_type=RTP_TS;
-  int64_t counts[8192];
+  int batch=INGEST_DEFAULT_PACKETS;
+  int use_gso=0;
+  int fec_l=0, fec_d=0;
+  int nack_ms=0;
+  int use_uring=0, use_direct=0, rec_policy;
+  int pcr_pid=-1;
+  long cbr=0;
+  int threads=0;
+  int cpus[2+MAX_EGRESS_THREADS];
+  int ncpus=0;
+  pipeline_args_t args;
+  adapter_t *ad;
   double f;
   long start_time=-1;
   long end_time=-1;
   struct timeval tv;
   int found;
-  int stream_whole_TS=0;
 
   /* Output: {uni,multi,broad}cast socket */
-  char ipOut[20];
+  char ipOut[RTP_ADDR_LEN];
   int portOut;
   int ttl = 2;
+  struct netopts netopts = NETOPTS_DEFAULT;  // for the outputs that follow
   
   pids_map = NULL;
   map_cnt = 0;
@@ -910,20 +2442,8 @@ int main(int argc, char **argv)
   for (i=0;i<8192;i++) {
     hi_mappids[i]=(i >> 8);
     lo_mappids[i]=(i&0xff);
-    counts[i]=0;
-  }
-  memset(&PAT, 0, sizeof(PAT));
-  PAT.version = -1;
-  PAT.section.pos = SECTION_LEN+1;
-  memset(&PMT, 0, sizeof(PMT));
-  clearbits(SI_PIDS);
-  setbit(SI_PIDS, 0);
-  memset(&SDT, 0, sizeof(SDT));
-  SDT.section.pos = SECTION_LEN+1;
-  SDT.version = -1;
-  setbit(SI_PIDS, SDT_PID);
-  clearbits(USER_PIDS);
-  setbit(USER_PIDS, 0);
+  }
+  ad = new_adapter(0, NULL);
 
   /* Set default IP and port */
   strcpy(ipOut,"224.0.1.2");
@@ -931,11 +2451,12 @@ int main(int argc, char **argv)
 
   if (argc==1) {
     fprintf(stderr,"Usage: dvbtune [OPTIONS] pid1 pid2 ... pid8\n\n");
-    fprintf(stderr,"-i          IP multicast address\n");
+    fprintf(stderr,"-i          IP multicast address (IPv4 or IPv6)\n");
     fprintf(stderr,"-r          IP multicast port\n");
-    fprintf(stderr,"-net ip:prt IP address:port combination to be followed by pids list. Can be repeated to generate multiple RTP streams\n");
+    fprintf(stderr,"-net ip:prt IP address:port combination ([ip]:port for IPv6) to be followed by pids list. Can be repeated to generate multiple RTP streams\n");
     fprintf(stderr,"-o          Stream to stdout instead of network\n");
     fprintf(stderr,"-o:file.ts  Stream to named file instead of network\n");
+    fprintf(stderr,"-shift:dir[:MB[:n]]  Time-shift into a ring of n files (default %d) of MB in all (default %d) in dir\n", SHIFT_SEGMENTS, SHIFT_MB);
     fprintf(stderr,"-n secs     Stop after secs seconds\n");
     fprintf(stderr,"-from n     Start saving the file previously specified with -o: syntax in n minutes time\n");
     fprintf(stderr,"-to n       Stop saving the file previously specified with -o: syntax in n minutes time\n");
@@ -967,21 +2488,45 @@ int main(int argc, char **argv)
     fprintf(stderr,"-tm N       DVB-T transmission mode - N=2%s or 8%s\n",(TRANSMISSION_MODE_DEFAULT==TRANSMISSION_MODE_2K ? " (default)" : ""),(TRANSMISSION_MODE_DEFAULT==TRANSMISSION_MODE_8K ? " (default)" : ""));
     fprintf(stderr,"-hy N       DVB-T hierarchy - N=1%s, 2%s, 4%s, NONE%s or AUTO%s\n",(HIERARCHY_DEFAULT==HIERARCHY_1 ? " (default)" : ""),(HIERARCHY_DEFAULT==HIERARCHY_2 ? " (default)" : ""),(HIERARCHY_DEFAULT==HIERARCHY_4 ? " (default)" : ""),(HIERARCHY_DEFAULT==HIERARCHY_NONE ? " (default)" : ""),(HIERARCHY_DEFAULT==HIERARCHY_AUTO ? " (default)" : ""));
     fprintf(stderr,"-ttl N      Sets TTL to N (default: 2) when streaming in RTP\n");
+    fprintf(stderr,"-if name    Send multicast out of interface name (unicast: bind to it)\n");
+    fprintf(stderr,"-sndbuf n   Socket send buffer of n bytes\n");
+    fprintf(stderr,"-dscp N     Mark the datagrams with DiffServ code point N (46 = EF)\n");
+    fprintf(stderr,"-prio N     Socket priority N (0-6) for queuing on this host\n");
+    fprintf(stderr,"-noloop     Don't loop multicast back to this host\n");
+    fprintf(stderr,"            (-ttl to -noloop apply to the -net outputs that follow them)\n");
     fprintf(stderr,"-rtp        Sets output type to RTP (default when using network out)\n");
     fprintf(stderr,"-udp        Sets output type to UDP \n");
     fprintf(stderr,"-prog       Selects PROGRAM mode (opens a demux on the whole TS)\n");
     fprintf(stderr,"-pid        Selects PID mode (default)\n");
+    fprintf(stderr,"-discont    When a program's PIDs change, flag a discontinuity on each new PID\n");
     fprintf(stderr,"-stdin      Use STDIN as source rather than a DVB card\n");
+    fprintf(stderr,"-adapter N  Read another DVB card; the tuning options, PIDs and -o:/-net maps\n");
+    fprintf(stderr,"            that follow are for this card (the first one replaces -c)\n");
+    fprintf(stderr,"-input file Like -adapter, but read a TS file or FIFO instead of a card\n");
+    fprintf(stderr,"-gso        Send each batch of datagrams with UDP segmentation offload where supported\n");
+    fprintf(stderr,"-fec LxD    Send SMPTE 2022-1 column and row FEC for an L x D matrix on ports +2 and +4\n");
+    fprintf(stderr,"-nack ms    Keep ms of the RTP stream and send again what receivers NACK\n");
+    fprintf(stderr,"-uring      Read the DVR and write -o: files with io_uring (make URING=1)\n");
+    fprintf(stderr,"-direct     Write -o: files with O_DIRECT, bypassing the page cache\n");
+    fprintf(stderr,"-pace       Send the stream in real time, timed by its PCRs (for -stdin/-input)\n");
+    fprintf(stderr,"-pcrpid pid Take the PCRs for -pace from pid (default: the first PID with a PCR)\n");
+    fprintf(stderr,"-cbr kbit/s With -pace, send at a constant bitrate, padding with null packets\n");
+    fprintf(stderr,"-batch N    Read up to N packets per read() (default %d, 1 = one read per packet)\n",INGEST_DEFAULT_PACKETS);
+    fprintf(stderr,"-threads N  Read, route and send in separate threads, with N egress threads\n");
+    fprintf(stderr,"-affinity l Pin the threads to CPUs: ingest,route,egress1,... (- for any CPU)\n");
 
 
     fprintf(stderr,"\n-analyse    Perform a simple analysis of the bitrates of the PIDs in the transport stream\n");
+    fprintf(stderr,"-report n   With -analyse, report the bitrate, CC errors, scrambling and PCRs of\n");
+    fprintf(stderr,"            each PID every n seconds, as comma separated lines, until stopped\n");
+    fprintf(stderr,"-monitor    Count the TR 101 290 first and second priority errors as it streams\n");
+    fprintf(stderr,"-stats file Write the counters of every stage to file, for Prometheus\n");
+    fprintf(stderr,"-statsint n Rewrite the -stats file every n seconds (default %d)\n",STATS_SECS);
 
     fprintf(stderr,"\n");
     fprintf(stderr,"NOTE: Use pid1=8192 to broadcast whole TS stream from a budget card\n");
     return(-1);
   } else {
-    pids[0]=0;
-    npids=1;
     pestype=DMX_PES_OTHER;  // Default PES type
     for (i=1;i<argc;i++) {
       if (strcmp(argv[i],"-ps")==0) {
@@ -993,16 +2538,95 @@ int main(int argc, char **argv)
       } else if (strcmp(argv[i],"-analyse")==0) {
         do_analyse=1;
         output_type=RTP_NONE;
-        if (secs==-1) { secs=10; }
+      } else if (strcmp(argv[i],"-monitor")==0) {
+        monitoring=1;
+      } else if (strcmp(argv[i],"-stats")==0) {
+        i++;
+        stats_file=argv[i];
+      } else if (strcmp(argv[i],"-statsint")==0) {
+        i++;
+        stats_secs=atoi(argv[i]);
+        if (stats_secs < 1) stats_secs = 1;
+      } else if (strcmp(argv[i],"-report")==0) {
+        i++;
+        report_secs=atoi(argv[i]);
       } else if(strcmp(argv[i],"-stdin")==0) {
-        use_stdin = 1;
+        ad->input = "-";
+      } else if((strcmp(argv[i],"-adapter")==0) || (strcmp(argv[i],"-input")==0)) {
+        /* The first one just says what the default adapter is */
+        save_tuning(ad, freq, srate);
+        if ((adapter_cnt > 1) || (map_cnt > 0) || (ad->npids > 1) || (ad->input != NULL))
+          ad = new_adapter(0, NULL);
+        freq = 0;
+        if (argv[i][1]=='a') {
+          ad->card=atoi(argv[++i]);
+        } else {
+          ad->input=argv[++i];
+        }
+      } else if (strcmp(argv[i],"-gso")==0) {
+        use_gso=1;
+      } else if (strcmp(argv[i],"-nack")==0) {
+        i++;
+        nack_ms=atoi(argv[i]);
+        if ((nack_ms < 1) || (nack_ms > 10000)) {
+          fprintf(stderr,"ERROR: -nack needs the ms to keep, up to 10000\n");
+          exit(1);
+        }
+      } else if (strcmp(argv[i],"-fec")==0) {
+        i++;
+        if (fec_parse_matrix(argv[i],&fec_l,&fec_d) < 0) {
+          fprintf(stderr,"ERROR: -fec needs LxD, L from 1 to %d, D from 4 to %d, L x D at most %d\n",
+                  FEC_MAX_L,FEC_MAX_D,FEC_MAX_LD);
+          exit(1);
+        }
+      } else if (strcmp(argv[i],"-discont")==0) {
+        mark_discont=1;
+      } else if (strcmp(argv[i],"-uring")==0) {
+        use_uring=1;
+      } else if (strcmp(argv[i],"-direct")==0) {
+        use_direct=1;
+      } else if (strcmp(argv[i],"-pace")==0) {
+        pacing=1;
+      } else if (strcmp(argv[i],"-pcrpid")==0) {
+        i++;
+        pcr_pid=atoi(argv[i]);
+        pacing=1;
+      } else if (strcmp(argv[i],"-cbr")==0) {
+        i++;
+        cbr=atol(argv[i]);
+        if (cbr <= 0) {
+          fprintf(stderr,"ERROR: -cbr needs a bitrate in kbit/s\n");
+          exit(1);
+        }
+        pacing=1;
+      } else if (strcmp(argv[i],"-batch")==0) {
+        i++;
+        batch=atoi(argv[i]);
+        if ((batch < 1) || (batch > INGEST_MAX_PACKETS)) {
+          fprintf(stderr,"ERROR: -batch must be between 1 and %d packets\n",INGEST_MAX_PACKETS);
+          exit(1);
+        }
+      } else if (strcmp(argv[i],"-threads")==0) {
+        i++;
+        threads=atoi(argv[i]);
+        if ((threads < 1) || (threads > MAX_EGRESS_THREADS)) {
+          fprintf(stderr,"ERROR: -threads must be between 1 and %d\n",MAX_EGRESS_THREADS);
+          exit(1);
+        }
+      } else if (strcmp(argv[i],"-affinity")==0) {
+        i++;
+        ncpus=parse_cpu_list(argv[i],cpus,2+MAX_EGRESS_THREADS);
+        if (ncpus < 0) {
+          fprintf(stderr,"ERROR: -affinity needs a comma separated list of CPUs\n");
+          exit(1);
+        }
       } else if (strcmp(argv[i],"-i")==0) {
         if(pids_map != NULL) {
 	  fprintf(stderr, "ERROR! -i and -r can't be used with -o and -net.  Use -net instead\n");
 	  exit(1);
 	}
         i++;
-        strcpy(ipOut,argv[i]);
+        snprintf(ipOut,sizeof(ipOut),"%s",argv[i]);
       } else if(strcmp(argv[i],"-auto")==0) {
         modulation = QAM_AUTO;
         TransmissionMode = TRANSMISSION_MODE_AUTO;
@@ -1020,37 +2644,32 @@ int main(int argc, char **argv)
         i++;
         portOut=atoi(argv[i]);
       } else if (strcmp(argv[i],"-net")==0) {
-        char *tmp;
+        char addr[RTP_ADDR_LEN];
+        int port;
         i++;
-	tmp = strchr(argv[i], ':');
-	if((tmp == NULL) || (tmp - argv[i] > 19)) {
+	if(rtp_splitaddr(argv[i], addr, sizeof(addr), &port) < 0) {
 	  fprintf(stderr, "No valid IP:port found after -net switch, discarding\n");
 	} else {
-	  int len = (int) (tmp - argv[i]);
-	  char addr[20];
-	  int port;
-          strncpy(ipOut, argv[i], len);
-	  ipOut[len] = 0;
-	  strncpy(addr, argv[i], len);
-	  addr[len] = 0;
-	  port = portOut = atoi(tmp+1);
+          strcpy(ipOut, addr);
+	  portOut = port;
 	  
 	  
           pids_map = (pids_map_t*) realloc(pids_map, sizeof(pids_map_t) * (map_cnt+1));
 	  if(pids_map != NULL) {
+	    memset(&pids_map[map_cnt], 0, sizeof(pids_map_t));
 	    map_cnt++;
             pids_map[map_cnt-1].pid_cnt = 0;
             pids_map[map_cnt-1].progs_cnt = 0;
             pids_map[map_cnt-1].start_time=start_time;
             pids_map[map_cnt-1].end_time=end_time;
-            for(j=0; j < MAX_CHANNELS; j++) pids_map[map_cnt-1].pids[j] = -1;
+            for(j=0; j < MAX_USER_PIDS; j++) pids_map[map_cnt-1].pids[j] = -1;
             pids_map[map_cnt-1].filename = NULL;
-	    strncpy(pids_map[map_cnt-1].net, addr, len);
-	    pids_map[map_cnt-1].net[len] = 0;
+            pids_map[map_cnt-1].shift = NULL;
+            pids_map[map_cnt-1].adapter = ad - adapters;
+	    strcpy(pids_map[map_cnt-1].net, addr);
 	    pids_map[map_cnt-1].port = port;
-	    pids_map[map_cnt-1].pos = 0;
 	 
-	    pids_map[map_cnt-1].socket = makesocket(addr,port,ttl,&(pids_map[map_cnt-1].sOut));
+	    pids_map[map_cnt-1].socket = makesocket(addr,port,ttl,&(pids_map[map_cnt-1].sOut),&netopts);
     	    initrtp(&(pids_map[map_cnt-1].hdr),(output_type==RTP_TS ? 33 : 34), streamtype);
     	    output_type = MAP_TS;
 	  } else
@@ -1122,9 +2741,9 @@ int main(int argc, char **argv)
         secs=atoi(argv[i]);
       } else if (strcmp(argv[i],"-c")==0) {
         i++;
-        card=atoi(argv[i]);
-        if ((card < 0) || (card > 3)) {
-          fprintf(stderr,"ERROR: card parameter must be between 0 and 4\n");
+        ad->card=atoi(argv[i]);
+        if (ad->card < 0) {
+          fprintf(stderr,"ERROR: card parameter must be 0 or more\n");
         }
       } else if (strcmp(argv[i],"-v")==0) {
         pestype=DMX_PES_VIDEO;
@@ -1240,6 +2859,28 @@ int main(int argc, char **argv)
       } else if (strcmp(argv[i],"-ttl")==0) {
         i++;
 	ttl = atoi(argv[i]);
+      } else if (strcmp(argv[i],"-if")==0) {
+        i++;
+        netopts.iface = argv[i];
+      } else if (strcmp(argv[i],"-sndbuf")==0) {
+        i++;
+        netopts.sndbuf = atoi(argv[i]);
+      } else if (strcmp(argv[i],"-dscp")==0) {
+        i++;
+        netopts.dscp = atoi(argv[i]);
+        if ((netopts.dscp < 0) || (netopts.dscp > 63)) {
+          fprintf(stderr,"ERROR: -dscp must be between 0 and 63\n");
+          exit(1);
+        }
+      } else if (strcmp(argv[i],"-prio")==0) {
+        i++;
+        netopts.priority = atoi(argv[i]);
+        if ((netopts.priority < 0) || (netopts.priority > 6)) {
+          fprintf(stderr,"ERROR: -prio must be between 0 and 6\n");
+          exit(1);
+        }
+      } else if (strcmp(argv[i],"-noloop")==0) {
+        netopts.noloop = 1;
       } else if (strcmp(argv[i],"-from")==0) {
         i++;
         if (map_cnt) {
@@ -1255,6 +2896,30 @@ int main(int argc, char **argv)
           end_time=atoi(argv[i])*60;
           secs=end_time;
         }
+      } else if (strstr(argv[i], "-shift:")==argv[i] && strlen(argv[i]) > 7) {
+        char *dir = strdup(&argv[i][7]);
+        int mb = 0, nseg = 0;
+        if ((ch = strchr(dir, ':')) != NULL) {
+          *ch++ = 0;
+          mb = atoi(ch);
+          if ((ch = strchr(ch, ':')) != NULL)
+            nseg = atoi(ch+1);
+        }
+        pids_map = (pids_map_t*) realloc(pids_map, sizeof(pids_map_t) * (map_cnt+1));
+        if (pids_map != NULL)
+          memset(&pids_map[map_cnt], 0, sizeof(pids_map_t));
+        if (pids_map != NULL && (pids_map[map_cnt].shift = tshift_new(dir, mb, nseg)) != NULL) {
+          map_cnt++;
+          pids_map[map_cnt-1].pid_cnt = 0;
+          pids_map[map_cnt-1].progs_cnt = 0;
+          pids_map[map_cnt-1].start_time=start_time;
+          pids_map[map_cnt-1].end_time=end_time;
+          for(j=0; j < MAX_USER_PIDS; j++) pids_map[map_cnt-1].pids[j] = -1;
+          pids_map[map_cnt-1].filename = dir;
+          pids_map[map_cnt-1].adapter = ad - adapters;
+          output_type = MAP_TS;
+        } else
+          fprintf(stderr, "Couldn't alloc enough memory for -shift:%s, discarding\n", dir);
       } else if (strstr(argv[i], "-o:")==argv[i]) {
         if (strlen(argv[i]) > 3) {
 	  char * fname;
@@ -1265,12 +2930,16 @@ int main(int argc, char **argv)
 	    strcpy(fname, &argv[i][3]);
             pids_map = (pids_map_t*) realloc(pids_map, sizeof(pids_map_t) * (map_cnt+1));
 	    if(pids_map != NULL) {
+	      memset(&pids_map[map_cnt], 0, sizeof(pids_map_t));
 	      map_cnt++;
               pids_map[map_cnt-1].pid_cnt = 0;
+              pids_map[map_cnt-1].progs_cnt = 0;
               pids_map[map_cnt-1].start_time=start_time;
               pids_map[map_cnt-1].end_time=end_time;
-              for(j=0; j < MAX_CHANNELS; j++) pids_map[map_cnt-1].pids[j] = -1;
+              for(j=0; j < MAX_USER_PIDS; j++) pids_map[map_cnt-1].pids[j] = -1;
               pids_map[map_cnt-1].filename = fname;
+              pids_map[map_cnt-1].shift = NULL;
+              pids_map[map_cnt-1].adapter = ad - adapters;
 
               output_type = MAP_TS;
 	    } else
@@ -1291,17 +2960,17 @@ int main(int argc, char **argv)
           if(selection_mode == PID_MODE) {
           // block for the map
           found = 0;
-          for (j=0;j<MAX_CHANNELS;j++) {
+          for (j=0;j<pids_map[map_cnt-1].pid_cnt;j++) {
             if(pids_map[map_cnt-1].pids[j] == pid) found = 1;
           }
-          if (found == 0) {
+          if (found == 0 && pids_map[map_cnt-1].pid_cnt < MAX_USER_PIDS-1) {
             if(pids_map[map_cnt-1].pid_cnt==0) {
               pids_map[map_cnt-1].pids[0]=0;
               pids_map[map_cnt-1].pid_cnt++;
             }
             if(pid==8192) {
               fprintf(stderr, "Adding whole transport stream to map n. %d\n", map_cnt-1);
-              setallbits(USER_PIDS);
+              setallbits(ad->USER_PIDS);
             }
             pids_map[map_cnt-1].pids[pids_map[map_cnt-1].pid_cnt] = pid;
             pids_map[map_cnt-1].pid_cnt++;
@@ -1311,8 +2980,8 @@ int main(int argc, char **argv)
           // block for the map
           int is_progname = is_string(argv[i]);
           pids_map_t *map = &(pids_map[map_cnt-1]);
-          stream_whole_TS=1;
-          setallbits(USER_PIDS);
+          ad->whole_ts=1;
+          setallbits(ad->USER_PIDS);
           found = 0;
           if(is_progname) {
             for(j=0;j<map->prognames_cnt;j++) {
@@ -1327,10 +2996,10 @@ int main(int argc, char **argv)
             }
           }
           else {
-          for (j=0;j<MAX_CHANNELS;j++) {
+          for (j=0;j<pids_map[map_cnt-1].progs_cnt;j++) {
             if(pids_map[map_cnt-1].progs[j] == pid) found = 1;
           }
-          if(found == 0)
+          if(found == 0 && pids_map[map_cnt-1].progs_cnt < MAX_USER_PIDS)
             pids_map[map_cnt-1].progs[pids_map[map_cnt-1].progs_cnt++] = pid;
         }
         }
@@ -1339,17 +3008,17 @@ int main(int argc, char **argv)
         if(selection_mode == PID_MODE) {
         // block for the list of pids to demux
         found = 0;
-        for (j=0;j<npids;j++) {
-          if(pids[j] == pid) found = 1;
+        for (j=0;j<ad->npids;j++) {
+          if(ad->pids[j] == pid) found = 1;
         }
         if (found==0) {
-          if (npids == MAX_CHANNELS) {
-            fprintf(stderr,"\nSorry, you can only set up to %d filters.\n\n",MAX_CHANNELS);
+          if (ad->npids == MAX_USER_PIDS) {
+            fprintf(stderr,"\nSorry, you can only select up to %d PIDs.\n\n",MAX_USER_PIDS);
             return(-1);
           } else {
-            pestypes[npids]=pestype;
+            ad->pestypes[ad->npids]=pestype;
             pestype=DMX_PES_OTHER;
-            pids[npids++]=pid;
+            ad->pids[ad->npids++]=pid;
             if (pid2!=-1) {
               hi_mappids[pid]=pid2>>8;
               lo_mappids[pid]=pid2&0xff;
@@ -1362,26 +3031,59 @@ int main(int argc, char **argv)
     }
   }
 
-  if ((output_type==RTP_PS) && (npids!=3)) {
+  save_tuning(ad, freq, srate);
+
+  /* A one-off analysis takes 10 seconds, reports go on until stopped */
+  if (do_analyse && secs==-1 && report_secs==0) { secs=10; }
+
+  if ((adapter_cnt > 1) && (output_type!=MAP_TS)) {
+    fprintf(stderr,"ERROR: more than one adapter needs -o: or -net outputs.\n");
+    exit(1);
+  }
+
+  if (pacing && (adapter_cnt > 1 || (output_type!=RTP_TS && output_type!=MAP_TS))) {
+    fprintf(stderr,"ERROR: -pace works with a single input and TS output.\n");
+    exit(1);
+  }
+  if ((fec_l || nack_ms) && streamtype!=RTP) {
+    fprintf(stderr,"ERROR: -fec and -nack need RTP output, not -udp.\n");
+    exit(1);
+  }
+  if (cbr && output_type!=RTP_TS) {
+    fprintf(stderr,"ERROR: -cbr needs a single output, not -o: or -net.\n");
+    exit(1);
+  }
+  if (pacing)
+    pacer_init(&pacer, pcr_pid, cbr*1000);
+
+  if ((output_type==RTP_PS) && (adapters[0].npids!=3)) {
     fprintf(stderr,"ERROR: PS requires exactly two PIDS - video and audio.\n");
     exit(1);
   }
 
+  /* Reading files, there's no hurry, so a recording waits for the disk
+     rather than dropping packets */
+  rec_policy = REC_WAIT;
+  for (j=0;j<adapter_cnt;j++) {
+    if (!is_file(&adapters[j])) rec_policy = REC_DROP;
+  }
   for (i=0;i<map_cnt;i++) {
-    if(pids_map[i].filename) {
-    FILE *f;
-    f = fopen(pids_map[i].filename, "w+b");
-    if (f != NULL) {
-      pids_map[i].fd = fileno(f);
-      make_nonblock(pids_map[i].fd);
+    if (pids_map[i].shift) {
+      if (tshift_open(pids_map[i].shift, use_direct, use_uring, rec_policy) == 0)
+        fprintf(stderr, "Time-shifting into %s, %d segments of %lld MB\n", pids_map[i].filename,
+                pids_map[i].shift->nseg, (long long)(pids_map[i].shift->seg_size / REC_BLOCK));
+      else
+        fprintf(stderr, "Couldn't open %s, errno:%d\n", pids_map[i].filename, errno);
+    } else if(pids_map[i].filename) {
+    if (record_open(&pids_map[i].rec, pids_map[i].filename, use_direct, use_uring, rec_policy) == 0) {
       fprintf(stderr, "Open file %s\n", pids_map[i].filename);
     } else {
-      pids_map[i].fd = -1;
-      fprintf(stderr, "Couldn't open file %s, errno:%d\n", pids_map[map_cnt-1].filename, errno);
+      fprintf(stderr, "Couldn't open file %s, errno:%d\n", pids_map[i].filename, errno);
     }
   }
   }
-  update_bitmaps();
+  for (i=0;i<adapter_cnt;i++)
+    update_bitmaps(&adapters[i]);
 
   if (signal(SIGHUP, SignalHandler) == SIG_IGN) signal(SIGHUP, SIG_IGN);
   if (signal(SIGINT, SignalHandler) == SIG_IGN) signal(SIGINT, SIG_IGN);
@@ -1389,10 +3091,13 @@ int main(int argc, char **argv)
   if (signal(SIGALRM, SignalHandler) == SIG_IGN) signal(SIGALRM, SIG_IGN);
   alarm(ALARM_TIME);
 
-  if (freq!=0 && !use_stdin) {
-    if (open_fe(&fd_frontend)) {
-      fprintf(stderr,"Tuning to %ld Hz\n",freq);
-      i=tune_it(fd_frontend,freq,srate,pol,tone,specInv,diseqc,modulation,HP_CodeRate,TransmissionMode,guardInterval,bandWidth, LP_CodeRate, hier);
+  for (j=0;j<adapter_cnt;j++) {
+    ad=&adapters[j];
+    if (ad->freq!=0 && !is_file(ad)) {
+      if (open_fe(&ad->fd_frontend, ad->card)) {
+        fprintf(stderr,"Tuning adapter %d to %ld Hz\n",ad->card,ad->freq);
+        i=tune_adapter(ad);
+      }
     }
   }
 
@@ -1401,57 +3106,57 @@ int main(int argc, char **argv)
   if(map_cnt > 0)
     fprintf(stderr, "\n");
   for (i=0;i<map_cnt;i++) {
+    pids_map[i].packets = 0;
+    if(pids_map[i].filename == NULL) {
+      egress_init(&pids_map[i].eg, pids_map[i].socket, &pids_map[i].sOut, &pids_map[i].hdr, use_gso);
+      if (fec_l && pids_map[i].hdr.type == RTP && egress_fec(&pids_map[i].eg, fec_l, fec_d) < 0)
+        return -1;
+      if (nack_ms && pids_map[i].hdr.type == RTP && egress_nack(&pids_map[i].eg, nack_ms) < 0)
+        return -1;
+    }
     if ((secs==-1) || (secs < pids_map[i].end_time)) { secs=pids_map[i].end_time; }
     if(pids_map[i].filename != NULL)
     	fprintf(stderr,"MAP %d, file %s: From %ld secs, To %ld secs, %d PIDs - ",i,pids_map[i].filename,pids_map[i].start_time,pids_map[i].end_time,pids_map[i].pid_cnt);
     else
         fprintf(stderr,"MAP %d, addr %s:%d From %ld secs, To %ld secs, %d PIDs - ",i,pids_map[i].net,pids_map[i].port,pids_map[i].start_time,pids_map[i].end_time,pids_map[i].pid_cnt);
-    for (j=0;j<MAX_CHANNELS;j++) { if (pids_map[i].pids[j]!=-1) fprintf(stderr," %d",pids_map[i].pids[j]); }
+    for (j=0;j<pids_map[i].pid_cnt;j++) { if (pids_map[i].pids[j]!=-1) fprintf(stderr," %d",pids_map[i].pids[j]); }
     fprintf(stderr,"\n");
   }
   
   fprintf(stderr,"dvbstream will stop after %d seconds (%d minutes)\n",secs,secs/60);
 
-  if(stream_whole_TS) {
-    npids=1;
-    pids[0] = 8192;
-  }
-  else
-  for(i=0; i<npids; i++) {
-    if(pids[i] == 8192) {
-      npids = 1;
-      pids[0] = 8192;
+  n=0;
+  for (j=0;j<adapter_cnt;j++) {
+    ad=&adapters[j];
+    if(ad->whole_ts) {
+      ad->npids=1;
+      ad->pids[0] = 8192;
     }
-  }
-  if(use_stdin) {
-    fd_dvr = fileno(stdin);
-  } else {
-  for (i=0;i<npids;i++) {  
-    if((fd[i] = open(demuxdev[card],O_RDWR|O_NONBLOCK)) < 0){
-      fprintf(stderr,"FD %i: ",i);
-      perror("DEMUX DEVICE: ");
+    else
+    for(i=0; i<ad->npids; i++) {
+      if(ad->pids[i] == 8192) {
+        ad->npids = 1;
+        ad->pids[0] = 8192;
+      }
+    }
+    if (open_adapter(ad) < 0)
       return -1;
+    n+=ad->npids;
+    if (monitoring) {
+      if ((ad->mon = malloc(sizeof(tr_monitor_t))) == NULL || tr_init(ad->mon) < 0)
+        return -1;
+      ad->psi.check_repeats = 1;   // a bad CRC is an error even on a repeat
     }
   }
 
-  if((fd_dvr = open(dvrdev[card],O_RDONLY|O_NONBLOCK)) < 0){
-    perror("DVR DEVICE: ");
-    return -1;
-  }
-
-  /* Now we set the filters */
-  for (i=0;i<npids;i++) {
-    set_ts_filt(fd[i],pids[i],pestypes[i]);
-    setbit(USER_PIDS, pids[i]);
-  }
-  }
-
   gettimeofday(&tv,(struct timezone*) NULL);
   real_start_time=tv.tv_sec;
   now=0;
 
   if (do_analyse) {
     fprintf(stderr,"Analysing PIDS\n");
+    if (analyser_init(&analyser, report_secs, stdout) < 0)
+      return -1;
   } else {
     if (to_stdout) {
       fprintf(stderr,"Output to stdout\n");
@@ -1461,12 +3166,19 @@ int main(int argc, char **argv)
       fprintf(stderr,"Using %s:%d:%d\n",ipOut,portOut,ttl);
 
       /* Init RTP */
-      socketOut = makesocket(ipOut,portOut,ttl,&sOut);
+      socketOut = makesocket(ipOut,portOut,ttl,&sOut,&netopts);
       #warning WHAT SHOULD THE PAYLOAD TYPE BE FOR "MPEG-2 PS" ?
       initrtp(&hdr,(output_type==RTP_TS ? 33 : 34), streamtype);
+      egress_init(&ts_egress,socketOut,&sOut,&hdr,use_gso);
+      if (fec_l && hdr.type == RTP && egress_fec(&ts_egress,fec_l,fec_d) < 0)
+        return -1;
+      if (nack_ms && hdr.type == RTP && egress_nack(&ts_egress,nack_ms) < 0)
+        return -1;
+      if (output_type==RTP_PS && pspkt_init(&ps_out,&ts_egress,&hdr,MAX_RTP_SIZE) < 0)
+        return -1;
       fprintf(stderr,"version=%X\n",hdr.b.v);
     }
-    fprintf(stderr,"Streaming %d stream%s\n",npids,(npids==1 ? "" : "s"));
+    fprintf(stderr,"Streaming %d stream%s\n",n,(n==1 ? "" : "s"));
   }
 
   if (output_type==RTP_PS) {
@@ -1475,148 +3187,123 @@ int main(int argc, char **argv)
   }
 
   /* Read packets */
-  free_bytes = buf;
-
-#ifdef ENABLE_TELNET
-  /* Setup socket to accept input from a client */
-  gethostname(hostname, sizeof(hostname));
-  if ((hp = gethostbyname(hostname)) == NULL) {
-    fprintf(stderr, "%s: host unknown.\n", hostname);
-    exit(1);
+  for (j=0;j<adapter_cnt;j++) {
+    if (ingest_init(&adapters[j].ingest, adapters[j].fd_dvr, batch) < 0) {
+      return -1;
+    }
+    if (use_uring)
+      ingest_use_uring(&adapters[j].ingest);
   }
-  if ((socketIn = socket(PF_INET, SOCK_STREAM, 0)) < 0) {
-    perror("server: socket");
-    exit(1);
+  cur = &adapters[0];
+  for (i=0;i<map_cnt;i++) {
+    if (pids_map[i].filename) {
+      pids_map[i].iov = malloc((cur->ingest.size / TS_SIZE + 1) * sizeof(struct iovec));
+      pids_map[i].niov = 0;
+    }
   }
-  setsockopt(socketIn,SOL_SOCKET,SO_REUSEADDR,&ReUseAddr,sizeof(ReUseAddr));
-
-  name.sin_family = AF_INET;
-  name.sin_port = htons(port);
-  name.sin_addr.s_addr = htonl(INADDR_ANY);
-  if (bind(socketIn,(struct sockaddr* )&name,sizeof(name)) < 0) {
-    perror("server: bind");
-    exit(1);
+  if (to_stdout) {
+    stdout_iov = malloc((cur->ingest.size / TS_SIZE + 1) * sizeof(struct iovec));
+    stdout_niov = 0;
   }
 
-  make_nonblock(socketIn);
-
-  if (listen(socketIn, 1) < 0) {
-    perror("server: listen");
+#ifdef ENABLE_TELNET
+  /* Accept commands from telnet clients */
+  gethostname(hostname, sizeof(hostname));
+  snprintf(greeting, sizeof(greeting), "220-DVBSTREAM - %s\r\nDONE\r\n", hostname);
+  if (control_init(&control, port, greeting, telnet_command) < 0)
     exit(1);
-  }
+  for (j=0;j<adapter_cnt;j++)
+    adapters[j].pid_packets = calloc(8192, sizeof(uint64_t));
+  stats_start = monotonic_ns();
 #endif
 
-  connectionOpen=0;
-  ns=-1;
-  pfds[0].fd=fd_dvr;
-  pfds[0].events=POLLIN|POLLPRI;
-  pfds[1].events=POLLIN|POLLPRI;
-
-  while ( !Interrupted) {
-    /* Poll the open file descriptors */
-    if (ns==-1) {
-        poll(pfds,1,500);
-    } else {
-        pfds[1].fd=ns;  // This can change
-        poll(pfds,2,500);
-    }
-
-    process_telnet();  // See if there is an incoming telnet connection
-
-    if (output_type==RTP_TS) {
-      /* Attempt to read 188 bytes from /dev/ost/dvr */
-      if ((bytes_read = read(fd_dvr,free_bytes,PACKET_SIZE)) > 0) {
-        if (bytes_read!=PACKET_SIZE) {
-          fprintf(stderr,"No bytes left to read - aborting\n");
-          break;
-        }
-
-        pid=((free_bytes[1]&0x1f) << 8) | (free_bytes[2]);
-        free_bytes[1]=(free_bytes[1]&0xe0)|hi_mappids[pid];
-        free_bytes[2]=lo_mappids[pid];
-        free_bytes+=bytes_read;
-
-        // If there isn't enough room for 1 more packet, then send it.
-        if ((free_bytes+PACKET_SIZE-buf)>MAX_RTP_SIZE) {
-          hdr.timestamp = getmsec()*90;
-          if (to_stdout) {
-            write(1, buf, free_bytes-buf);
-          } else {
-            sendrtp2(socketOut,&sOut,&hdr,buf,free_bytes-buf);
-          }
-          free_bytes = buf;
-        }
-        count++;
-      }
-    } else if (output_type==RTP_PS) {
-       if (read(fd_dvr,buf,TS_SIZE) > 0) {
-         my_ts_to_ps((uint8_t*)buf, pids[1], pids[2]);
-       } else if(use_stdin) break;
-    } else if(output_type==MAP_TS) {
-       int bytes_read;
-       bytes_read = read(fd_dvr, buf, TS_SIZE);
-       if(bytes_read > 0) {
-         if(buf[0] == 0x47) {
-           int pid, i;
-
-           pid = ((buf[1] & 0x1f) << 8) | buf[2];
-           if(getbit(SI_PIDS, pid)) parse_ts_packet(buf);
-           if (pids_map != NULL)        {
-             for (i = 0; i < map_cnt; i++) {
-               if ( ((pids_map[i].start_time==-1) || (pids_map[i].start_time <= now))
-		    && ((pids_map[i].end_time==-1) || (pids_map[i].end_time >= now))) {
-                 if(getbit(pids_map[i].pidmap, pid)) {
-                     errno = 0;
-		     if(pids_map[i].filename)
-                        write(pids_map[i].fd, buf, TS_SIZE);
-		     else {
-		        if((pids_map[i].pos + PACKET_SIZE) > MAX_RTP_SIZE) {
-        		    hdr.timestamp = getmsec()*90;
-		    	    sendrtp2(pids_map[i].socket, &(pids_map[i].sOut), &(pids_map[i].hdr), pids_map[i].buf, pids_map[i].pos);
-			    pids_map[i].pos = 0;
-			} 
-			
-			memcpy(&(pids_map[i].buf[pids_map[i].pos]), buf, bytes_read);
-			pids_map[i].pos += bytes_read;
-		     }
-                 }
-               }
-             }
-           }
-         } else {
-           fprintf(stderr, "NON 0X47\n");
-         }
-       }
-       else if(use_stdin) break;
-    } else {
-      if (do_analyse) {
-        if (read(fd_dvr,buf,TS_SIZE) > 0) {
-          pid=((buf[1]&0x1f) << 8) | (buf[2]);
-          counts[pid]++;
-        }
-      }
+  if (threads > 0) {
+    egress_threads = threads;
+    lossless = 1;
+    for (j=0;j<adapter_cnt;j++) {
+      if (!is_file(&adapters[j])) lossless = 0;
     }
-    if ((secs!=-1) && (secs <=now)) { Interrupted=1; }
+    args.output_type = output_type;
+    args.do_analyse = do_analyse;
+    if (run_pipeline(&args, cpus, ncpus, secs) < 0)
+      return -1;
+  } else {
+    run_loop(output_type, do_analyse, secs);
+    for (i = 0; i < output_count(output_type); i++)
+      output_finish(i);
   }
 
   if (Interrupted) {
     fprintf(stderr,"Caught signal %d - closing cleanly.\n",Interrupted);
   }
+  stats_poll(1);
+
+  for (j=0;j<adapter_cnt;j++) {
+    ad=&adapters[j];
+    if (adapter_cnt > 1) {
+      if (is_file(ad))
+        fprintf(stderr,"adapter %d (%s):\n",j,ad->input);
+      else
+        fprintf(stderr,"adapter %d (card %d):\n",j,ad->card);
+    }
+    ingest_report(&ad->ingest, stderr);
+    ingest_free(&ad->ingest);
+    if (ad->soft_demux)
+      demux_report(&ad->demux, stderr, "demux");
+    if (ad->psi.sections > 0)
+      fprintf(stderr,"psi: %llu sections, %llu repeats skipped, %llu CRC errors, %llu new table versions, %llu lost to missing packets\n",
+              (unsigned long long)ad->psi.sections,(unsigned long long)ad->psi.unchanged,
+              (unsigned long long)ad->psi.crc_errors,(unsigned long long)ad->psi.versions,
+              (unsigned long long)ad->psi.discontinuities);
+    if (ad->mon) {
+      tr_alarms_t al;
+      int k;
+
+      monitor_alarms(ad, &al);
+      fprintf(stderr,"TR 101 290:");
+      for (k = 0; k < TR_ALARMS; k++)
+        fprintf(stderr," %s %llu",tr_alarm_names[k],(unsigned long long)al.n[k]);
+      fprintf(stderr,"\n");
+      tr_free(ad->mon);
+      free(ad->mon);
+    }
+    demux_free(&ad->demux);
+    free(ad->pid_packets);
+  }
+  if (pacing)
+    pacer_report(&pacer, stderr);
+  if (output_type==RTP_PS && !to_stdout) {
+    pspkt_flush(&ps_out);
+    pspkt_report(&ps_out, stderr);
+    pspkt_free(&ps_out);
+  }
+  if ((output_type==RTP_TS || output_type==RTP_PS) && !to_stdout && !do_analyse) {
+    egress_report(&ts_egress, stderr, ipOut);
+  }
+  for (i=0;i<map_cnt;i++) {
+    if (pids_map[i].filename == NULL) {
+      egress_report(&pids_map[i].eg, stderr, (char *)pids_map[i].net);
+    } else if (pids_map[i].shift) {
+      tshift_close(pids_map[i].shift);
+      tshift_report(pids_map[i].shift, stderr);
+    } else if (pids_map[i].rec.fd >= 0) {
+      record_close(&pids_map[i].rec);
+      record_report(&pids_map[i].rec, stderr);
+    }
+  }
 
-  if (ns!=-1) close(ns);
-  close(socketIn);
+  control_free(&control);
 
   if (!to_stdout && !map_cnt) close(socketOut);
-  if(!use_stdin) {
-    for (i=0;i<npids;i++) close(fd[i]);
-    close(fd_dvr);
-    close(fd_frontend);
-  }
+  for (j=0;j<adapter_cnt;j++)
+    close_adapter(&adapters[j]);
 
-  if (do_analyse) {
+  if (do_analyse && report_secs) {
+    analyser_report(&analyser);
+  } else if (do_analyse) {
     for (i=0;i<8192;i++) {
-      if (counts[i]) {
-        f=(counts[i]*184.0*8.0)/(secs*1024.0*1024.0);
+      if (analyser.packets[i]) {
+        f=(analyser.packets[i]*188.0*8.0)/(secs*1024.0*1024.0);
         if (f >= 1.0) {
           fprintf(stdout,"%d,%.3f Mbit/s\n",i,f);
         } else {
@@ -1625,6 +3312,13 @@ int main(int argc, char **argv)
       }
     }
   }
+  if (do_analyse) {
+    for (i=0;i<8192;i++) {
+      if (analyser.cc_errors[i])
+        fprintf(stderr,"PID %d: %u CC errors\n",i,analyser.cc_errors[i]);
+    }
+    analyser_free(&analyser);
+  }
 
   return(0);
 }
@@ -0,0 +1,533 @@
+/*
+ * egress.c: batched sending of RTP/UDP datagrams.
+ *
+ * Datagrams for a destination are queued as iovec lists - the RTP header
+ * in one, the TS packets in the others - and sent together with one
+ * sendmmsg() call per flush, normally once per batch read from the DVR.
+ * With -gso the whole queue is handed to the kernel as a single UDP
+ * segmentation offload send when the kernel supports it.
+ *
+ * RTP destinations also get an RTCP sender report every RTCP_INTERVAL
+ * seconds, on the next port up, so receivers can tie the timestamps to
+ * the wall clock.  With FEC on, the FEC packets each datagram completes
+ * are sent after the flush that sent it, on ports 2 and 4 up.
+ *
+ * With retransmission on, each datagram is copied into the history as
+ * it is queued, and after each flush the NACKs that have come back to
+ * the socket are answered from it.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <netinet/udp.h>
+#include <sys/time.h>
+
+#include "egress.h"
+#include "pcrclock.h"
+
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+
+/* Limits on a single GSO send */
+#define GSO_MAX_SEGMENTS 64
+#define GSO_MAX_BYTES 65000
+
+void egress_init(egress_t *eg, int fd, struct sockaddr_storage *addr, struct rtpheader *hdr, int gso)
+{
+  memset(eg, 0, sizeof(egress_t));
+  eg->fd = fd;
+  eg->addr = *addr;
+  eg->hdr = hdr;
+  eg->gso = gso;
+  eg->rtcp_addr = *addr;
+  rtp_setport(&eg->rtcp_addr, rtp_getport(addr) + 1);
+}
+
+int egress_fec(egress_t *eg, int l, int d)
+{
+  int i;
+
+  if ((eg->fec = fec_enc_new(l, d)) == NULL)
+    return -1;
+  for (i = 0; i < 2; i++) {
+    eg->fec_addr[i] = eg->addr;
+    rtp_setport(&eg->fec_addr[i], rtp_getport(&eg->addr) + (i ? FEC_ROW_PORT : FEC_COLUMN_PORT));
+  }
+  return 0;
+}
+
+int egress_nack(egress_t *eg, int ms)
+{
+  if ((eg->rtx = rtx_new(ms)) == NULL)
+    return -1;
+  return 0;
+}
+
+static int has_rtp_header(egress_t *eg)
+{
+  return (eg->hdr != NULL) && (eg->hdr->type == RTP);
+}
+
+/* Append len bytes at data to the datagram being built */
+void egress_add(egress_t *eg, uint8_t *data, int len)
+{
+  struct iovec *iov = eg->iov[eg->queued];
+
+  if (eg->len == 0)
+    eg->born[eg->queued] = eg->read_ns;
+  if (eg->niov == 0 && has_rtp_header(eg))
+    eg->niov = 1;     /* slot for the header, filled in by egress_end() */
+
+  /* Packets that are next to each other in memory share an iovec */
+  if (eg->len > 0 && (uint8_t *)iov[eg->niov-1].iov_base + iov[eg->niov-1].iov_len == data) {
+    iov[eg->niov-1].iov_len += len;
+  } else {
+    if (eg->niov == EGRESS_MAX_IOV) {
+      egress_end(eg);
+      eg->born[eg->queued] = eg->read_ns;
+    }
+    iov = eg->iov[eg->queued];
+    if (eg->niov == 0 && has_rtp_header(eg))
+      eg->niov = 1;
+    iov[eg->niov].iov_base = data;
+    iov[eg->niov].iov_len = len;
+    eg->niov++;
+  }
+  eg->len += len;
+}
+
+/* Send the FEC packets made so far */
+static void send_fec(egress_t *eg)
+{
+  fec_enc_t *f = eg->fec;
+  struct mmsghdr msgs[FEC_QUEUE];
+  struct iovec iov[FEC_QUEUE];
+  int i, r, sent = 0;
+
+  for (i = 0; i < f->nout; i++) {
+    iov[i].iov_base = f->out[i];
+    iov[i].iov_len = f->out_len[i];
+    memset(&msgs[i], 0, sizeof(struct mmsghdr));
+    msgs[i].msg_hdr.msg_name = &eg->fec_addr[f->out_row[i]];
+    msgs[i].msg_hdr.msg_namelen = rtp_addrlen(&eg->addr);
+    msgs[i].msg_hdr.msg_iov = &iov[i];
+    msgs[i].msg_hdr.msg_iovlen = 1;
+  }
+  while (sent < f->nout) {
+    r = sendmmsg(eg->fd, &msgs[sent], f->nout - sent, 0);
+    eg->syscalls++;
+    if (r < 0) {
+      if (errno == EINTR) continue;
+      if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+        eg->eagain += f->nout - sent;
+        break;
+      }
+      eg->errors++;
+      sent++;
+      continue;
+    }
+    eg->fec_sent += r;
+    sent += r;
+  }
+  f->nout = 0;
+}
+
+/* Answer the NACKs that have come in.  To a unicast destination, only
+   those from it count. */
+static void serve_nacks(egress_t *eg)
+{
+  uint8_t buf[RTX_MAX], *data;
+  uint16_t seqs[RTX_NACK_MAX];
+  struct mmsghdr msgs[RTX_NACK_MAX];
+  struct iovec iov[RTX_NACK_MAX];
+  struct sockaddr_storage from;
+  socklen_t fromlen;
+  int64_t now = monotonic_ns();
+  int i, n, len, cnt, sent, r;
+
+  for (;;) {
+    fromlen = sizeof(from);
+    len = recvfrom(eg->fd, buf, sizeof(buf), MSG_DONTWAIT, (struct sockaddr *)&from, &fromlen);
+    if (len < 0)
+      return;
+    if (!rtp_ismulticast(&eg->addr) && !rtp_samehost(&from, &eg->addr))
+      continue;
+    if ((n = rtx_parse_nack(buf, len, seqs, RTX_NACK_MAX)) == 0)
+      continue;
+    eg->nacks++;
+
+    cnt = 0;
+    for (i = 0; i < n; i++) {
+      if ((len = rtx_find(eg->rtx, seqs[i], now, &data)) == 0) {
+        eg->rtx_missed++;
+        continue;
+      }
+      iov[cnt].iov_base = data;
+      iov[cnt].iov_len = len;
+      memset(&msgs[cnt], 0, sizeof(struct mmsghdr));
+      msgs[cnt].msg_hdr.msg_name = &eg->addr;
+      msgs[cnt].msg_hdr.msg_namelen = rtp_addrlen(&eg->addr);
+      msgs[cnt].msg_hdr.msg_iov = &iov[cnt];
+      msgs[cnt].msg_hdr.msg_iovlen = 1;
+      cnt++;
+    }
+    sent = 0;
+    while (sent < cnt) {
+      r = sendmmsg(eg->fd, &msgs[sent], cnt - sent, 0);
+      eg->syscalls++;
+      if (r < 0) {
+        if (errno == EINTR) continue;
+        if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+          eg->eagain += cnt - sent;
+          break;
+        }
+        eg->errors++;
+        sent++;
+        continue;
+      }
+      eg->retransmits += r;
+      sent += r;
+    }
+  }
+}
+
+/* Finish the datagram being built and queue it */
+void egress_end(egress_t *eg)
+{
+  struct mmsghdr *m = &eg->msgs[eg->queued];
+  int q = eg->queued;
+  int size = eg->len;
+
+  if (eg->len == 0)
+    return;
+
+  /* The slab now belongs to a queued datagram.  Holds only happen right
+     after a flush, so at most one is waiting for release. */
+  if (eg->held != NULL) {
+    eg->release = eg->held;
+    eg->held = NULL;
+  }
+
+  if (has_rtp_header(eg)) {
+    eg->iov[q][0].iov_base = eg->rtp[q];
+    eg->iov[q][0].iov_len = rtp_pack_header(eg->hdr, eg->rtp[q]);
+    eg->hdr->b.sequence++;
+    size += eg->iov[q][0].iov_len;
+    if (eg->rtx != NULL)
+      rtx_store(eg->rtx, (eg->rtp[q][2] << 8) | eg->rtp[q][3], eg->iov[q], eg->niov, monotonic_ns());
+    if (eg->fec != NULL) {
+      unsigned char *h = eg->rtp[q];
+
+      if (eg->fec->nout > FEC_QUEUE - 2)
+        send_fec(eg);
+      fec_enc_add(eg->fec, (h[2] << 8) | h[3],
+                  (uint32_t)h[4] << 24 | h[5] << 16 | h[6] << 8 | h[7], h[1] & 0x7f,
+                  &eg->iov[q][1], eg->niov - 1);
+    }
+  }
+
+  memset(m, 0, sizeof(struct mmsghdr));
+  m->msg_hdr.msg_name = &eg->addr;
+  m->msg_hdr.msg_namelen = rtp_addrlen(&eg->addr);
+  m->msg_hdr.msg_iov = eg->iov[q];
+  m->msg_hdr.msg_iovlen = eg->niov;
+  eg->size[q] = size;
+  eg->queued++;
+  eg->niov = 0;
+  eg->len = 0;
+
+  if (eg->queued == EGRESS_QUEUE)
+    egress_flush(eg);
+}
+
+/* Make sure the datagram being built survives the caller reusing its read
+   buffer.  Must only be called with nothing queued, i.e. straight after
+   egress_flush().  If its packets all come from slab (and perhaps the
+   carry buffer) a reference to slab is taken; otherwise, or if slab is
+   NULL, the payload is copied into the egress' own carry buffer. */
+void egress_hold(egress_t *eg, slab_t *slab)
+{
+  struct iovec *iov = eg->iov[eg->queued];
+  int i, first, pos;
+
+  if (eg->len == 0)
+    return;
+
+  if (slab != NULL) {
+    if (eg->held == slab)
+      return;
+    if (eg->held == NULL) {
+      slab_ref(slab);
+      eg->held = slab;
+      return;
+    }
+  }
+
+  first = has_rtp_header(eg) ? 1 : 0;
+  if ((eg->niov == first + 1) && (iov[first].iov_base == eg->carry))
+    return;
+
+  /* Anything already held is at the front of carry and in order, so
+     moving everything down to the start never overwrites unread data */
+  pos = 0;
+  for (i = first; i < eg->niov; i++) {
+    memmove(&eg->carry[pos], iov[i].iov_base, iov[i].iov_len);
+    pos += iov[i].iov_len;
+  }
+  iov[first].iov_base = eg->carry;
+  iov[first].iov_len = pos;
+  eg->niov = first + 1;
+  if (eg->held != NULL) {
+    slab_put(eg->held);
+    eg->held = NULL;
+  }
+}
+
+/* Datagrams first to last-1 have just been sent */
+static void sent_latency(egress_t *eg, int first, int last, int64_t now)
+{
+  int i;
+
+  for (i = first; i < last; i++) {
+    if (eg->born[i])
+      latency_add(&eg->latency, now - eg->born[i]);
+  }
+}
+
+/* Send the queue as UDP GSO super-datagrams.  Returns 0 if everything was
+   handed to the kernel, -1 if GSO can't be used for this queue. */
+static int gso_flush(egress_t *eg, int64_t now)
+{
+  struct iovec iov[GSO_MAX_SEGMENTS * EGRESS_MAX_IOV];
+  char control[CMSG_SPACE(sizeof(uint16_t))];
+  struct msghdr msg;
+  struct cmsghdr *cm;
+  uint16_t seg;
+  int i, j, start, n, niov, bytes, r;
+
+  seg = eg->size[0];
+  for (i = 0; i < eg->queued - 1; i++) {
+    if (eg->size[i] != seg)
+      return -1;
+  }
+  if (eg->size[eg->queued-1] > seg)
+    return -1;
+
+  start = 0;
+  while (start < eg->queued) {
+    niov = 0;
+    bytes = 0;
+    for (n = 0; start + n < eg->queued && n < GSO_MAX_SEGMENTS; n++) {
+      if (bytes + eg->size[start+n] > GSO_MAX_BYTES) break;
+      for (j = 0; j < eg->msgs[start+n].msg_hdr.msg_iovlen; j++)
+        iov[niov++] = eg->msgs[start+n].msg_hdr.msg_iov[j];
+      bytes += eg->size[start+n];
+    }
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = &eg->addr;
+    msg.msg_namelen = rtp_addrlen(&eg->addr);
+    msg.msg_iov = iov;
+    msg.msg_iovlen = niov;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    cm = CMSG_FIRSTHDR(&msg);
+    cm->cmsg_level = SOL_UDP;
+    cm->cmsg_type = UDP_SEGMENT;
+    cm->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+    memcpy(CMSG_DATA(cm), &seg, sizeof(uint16_t));
+
+    r = sendmsg(eg->fd, &msg, 0);
+    eg->syscalls++;
+    if (r < 0) {
+      if (errno == EINTR) continue;
+      if ((start == 0) && (eg->gso_sends == 0) &&
+          ((errno == EINVAL) || (errno == EIO) || (errno == ENOPROTOOPT) || (errno == EOPNOTSUPP))) {
+        fprintf(stderr, "egress: UDP GSO not supported here (%s), using sendmmsg()\n", strerror(errno));
+        eg->gso = 0;
+        return -1;
+      }
+      if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+        eg->eagain += n;
+      } else {
+        eg->errors += n;
+      }
+    } else {
+      eg->gso_sends++;
+      eg->datagrams += n;
+      eg->bytes += r;
+      sent_latency(eg, start, start + n, now);
+    }
+    start += n;
+  }
+  return 0;
+}
+
+/* The datagram being built lives in the slot after the queue - move it
+   to the front once the queue has been sent. */
+static void restart_queue(egress_t *eg)
+{
+  /* A full queue leaves no datagram being built, and no slot for one */
+  if (eg->niov > 0) {
+    memcpy(eg->iov[0], eg->iov[eg->queued], eg->niov * sizeof(struct iovec));
+    eg->born[0] = eg->born[eg->queued];
+  }
+  eg->queued = 0;
+  if (eg->release != NULL) {
+    slab_put(eg->release);
+    eg->release = NULL;
+  }
+}
+
+/* "dvbstream@host", the CNAME in our sender reports */
+static const char *cname(void)
+{
+  static char name[64];
+
+  if (name[0] == 0) {
+    strcpy(name, "dvbstream@");
+    gethostname(name + 10, sizeof(name) - 11);
+    name[sizeof(name) - 1] = 0;
+  }
+  return name;
+}
+
+/* Send a sender report if one is due */
+static void send_sr(egress_t *eg)
+{
+  unsigned char buf[RTCP_MAX_LEN];
+  struct rtcp_sr sr;
+  struct timeval tv;
+  int len;
+
+  gettimeofday(&tv, NULL);
+  if (tv.tv_sec < eg->next_sr)
+    return;
+  eg->next_sr = tv.tv_sec + RTCP_INTERVAL;
+
+  sr.ssrc = eg->hdr->ssrc;
+  sr.ntp_sec = tv.tv_sec + 2208988800U;          /* NTP counts from 1900 */
+  sr.ntp_frac = (unsigned int)(((uint64_t)tv.tv_usec << 32) / 1000000);
+  sr.rtp_ts = eg->hdr->timestamp;
+  sr.packets = eg->datagrams;
+  sr.octets = eg->bytes - eg->datagrams * RTP_HEADER_LEN;
+  len = rtcp_pack_sr(&sr, cname(), buf);
+  if (sendto(eg->fd, buf, len, 0, (struct sockaddr *)&eg->rtcp_addr, rtp_addrlen(&eg->rtcp_addr)) == len)
+    eg->srs++;
+}
+
+/* Send everything queued.  Returns the number of datagrams sent. */
+int egress_flush(egress_t *eg)
+{
+  int sent, r, i;
+  uint64_t before = eg->datagrams;
+  int64_t now;
+
+  if (eg->queued == 0)
+    return 0;
+
+  now = monotonic_ns();
+  if (eg->gso && gso_flush(eg, now) == 0) {
+    if (has_rtp_header(eg))
+      send_sr(eg);
+    if (eg->fec != NULL && eg->fec->nout > 0)
+      send_fec(eg);
+    if (eg->rtx != NULL)
+      serve_nacks(eg);
+    restart_queue(eg);
+    return eg->datagrams - before;
+  }
+
+  sent = 0;
+  while (sent < eg->queued) {
+    r = sendmmsg(eg->fd, &eg->msgs[sent], eg->queued - sent, 0);
+    eg->syscalls++;
+    if (r < 0) {
+      if (errno == EINTR) continue;
+      if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+        /* Socket buffer is full - drop the rest of this flush */
+        eg->eagain += eg->queued - sent;
+        break;
+      }
+      /* e.g. ECONNREFUSED from a unicast receiver: skip one datagram */
+      eg->errors++;
+      sent++;
+      continue;
+    }
+    for (i = sent; i < sent + r; i++) {
+      eg->bytes += eg->msgs[i].msg_len;
+    }
+    eg->datagrams += r;
+    sent_latency(eg, sent, sent + r, now);
+    sent += r;
+  }
+  if (has_rtp_header(eg))
+    send_sr(eg);
+  if (eg->fec != NULL && eg->fec->nout > 0)
+    send_fec(eg);
+  if (eg->rtx != NULL)
+    serve_nacks(eg);
+  restart_queue(eg);
+  return eg->datagrams - before;
+}
+
+void egress_report(egress_t *eg, FILE *f, const char *name)
+{
+  fprintf(f, "egress %s: %llu datagrams, %llu bytes in %llu send calls (%.1f per call)%s\n",
+          name, (unsigned long long)eg->datagrams, (unsigned long long)eg->bytes,
+          (unsigned long long)eg->syscalls,
+          eg->syscalls ? (double)eg->datagrams / eg->syscalls : 0.0,
+          eg->gso_sends ? ", UDP GSO" : "");
+  if (eg->srs)
+    fprintf(f, "egress %s: %llu RTCP sender reports, SSRC %08x\n",
+            name, (unsigned long long)eg->srs, (unsigned int)eg->hdr->ssrc);
+  if (eg->fec != NULL)
+    fprintf(f, "egress %s: %llu FEC packets for a %dx%d matrix (%llu column, %llu row)\n",
+            name, (unsigned long long)eg->fec_sent, eg->fec->l, eg->fec->d,
+            (unsigned long long)eg->fec->packets[0], (unsigned long long)eg->fec->packets[1]);
+  if (eg->rtx != NULL)
+    fprintf(f, "egress %s: %llu NACKs, %llu datagrams sent again, %llu asked for too late (%.0f ms kept)\n",
+            name, (unsigned long long)eg->nacks, (unsigned long long)eg->retransmits,
+            (unsigned long long)eg->rtx_missed, eg->rtx->keep_ns / 1e6);
+  if (eg->errors || eg->eagain) {
+    fprintf(f, "egress %s: %llu send errors, %llu datagrams dropped on EAGAIN\n",
+            name, (unsigned long long)eg->errors, (unsigned long long)eg->eagain);
+  }
+}
+
+/* writev() the whole of iov[] to fd, coping with short writes and with
+   more than IOV_MAX entries.  Returns 0, or -1 on error. */
+int write_iov(int fd, struct iovec *iov, int cnt)
+{
+  int n, r;
+
+  while (cnt > 0) {
+    n = (cnt > IOV_MAX) ? IOV_MAX : cnt;
+    r = writev(fd, iov, n);
+    if (r < 0) {
+      if (errno == EINTR) continue;
+      return -1;
+    }
+    /* Step over whatever was written */
+    while (cnt > 0 && r >= (int)iov->iov_len) {
+      r -= iov->iov_len;
+      iov++;
+      cnt--;
+    }
+    if (r > 0) {
+      iov->iov_base = (char *)iov->iov_base + r;
+      iov->iov_len -= r;
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,92 @@
+#ifndef _EGRESS_H
+#define _EGRESS_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <netinet/in.h>
+#include <sys/socket.h>   /* struct mmsghdr needs _GNU_SOURCE */
+
+#include "rtp.h"
+#include "ingest.h"
+#include "stats.h"
+#include "fec.h"
+#include "rtx.h"
+
+/* RTP header + the 7 TS packets that fit in an Ethernet MTU, with a
+   little room to spare for callers that split a packet. */
+#define EGRESS_MAX_IOV 10
+
+/* Datagrams queued per destination before a flush is forced */
+#define EGRESS_QUEUE 64
+
+#define EGRESS_CARRY 1500
+
+/* Datagrams bound for one destination socket.  Each datagram is built up
+   as a list of iovecs pointing at the caller's data and is only sent when
+   egress_flush() is called, so the data must stay put until then - see
+   egress_hold(), which keeps a half built datagram's packets alive across
+   reads by referencing their slab. */
+typedef struct {
+  int fd;
+  struct sockaddr_storage addr;
+  struct rtpheader *hdr;     /* NULL or hdr->type == UDP: no RTP header */
+  int gso;                   /* try UDP_SEGMENT when flushing */
+
+  struct mmsghdr msgs[EGRESS_QUEUE];
+  struct iovec iov[EGRESS_QUEUE][EGRESS_MAX_IOV];
+  unsigned char rtp[EGRESS_QUEUE][RTP_HEADER_LEN];
+  int size[EGRESS_QUEUE];    /* bytes in each datagram, header included */
+  int64_t born[EGRESS_QUEUE];  /* when its first packet was read, 0: unknown */
+  int queued;                /* complete datagrams waiting in msgs[] */
+
+  int niov;                  /* iovecs of the datagram being built */
+  int len;                   /* its payload length so far */
+  int64_t read_ns;           /* set by the caller: when the packets it is
+                                adding were read (monotonic_ns()) */
+
+  unsigned char carry[EGRESS_CARRY];
+  slab_t *held;              /* slab referenced by the datagram being built */
+  slab_t *release;           /* slab to let go of after the next flush */
+
+  struct sockaddr_storage rtcp_addr;   /* RTP port + 1, for sender reports */
+  time_t next_sr;
+
+  fec_enc_t *fec;            /* NULL: no FEC */
+  struct sockaddr_storage fec_addr[2];   /* RTP port + 2 for columns, + 4 for rows */
+
+  rtx_history_t *rtx;        /* NULL: no retransmission */
+
+  /* statistics */
+  uint64_t datagrams;
+  uint64_t bytes;
+  uint64_t syscalls;
+  uint64_t errors;
+  uint64_t eagain;
+  uint64_t gso_sends;
+  uint64_t srs;              /* RTCP sender reports sent */
+  uint64_t fec_sent;         /* FEC packets sent */
+  uint64_t nacks;            /* NACKs received */
+  uint64_t retransmits;      /* datagrams sent again for them */
+  uint64_t rtx_missed;       /* asked for, but no longer kept */
+  latency_t latency;         /* from reading a datagram's first packet to
+                                handing the datagram to the kernel */
+} egress_t;
+
+void egress_init(egress_t *eg, int fd, struct sockaddr_storage *addr, struct rtpheader *hdr, int gso);
+/* Send SMPTE 2022-1 FEC for an L x D matrix along with the RTP stream.
+   Returns 0, or -1 if there is no memory for it. */
+int egress_fec(egress_t *eg, int l, int d);
+/* Keep what is sent for ms, and send it again when a receiver asks with
+   a NACK.  Returns 0, or -1 if there is no memory for it. */
+int egress_nack(egress_t *eg, int ms);
+void egress_add(egress_t *eg, uint8_t *data, int len);
+void egress_end(egress_t *eg);
+void egress_hold(egress_t *eg, slab_t *slab);
+int egress_flush(egress_t *eg);
+void egress_report(egress_t *eg, FILE *f, const char *name);
+
+int write_iov(int fd, struct iovec *iov, int cnt);
+
+#endif
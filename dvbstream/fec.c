@@ -0,0 +1,196 @@
+/*
+ * fec.c: SMPTE 2022-1 row and column XOR FEC (see fec.h).
+ *
+ * The XOR works on whole vectors, 32 bytes at a time, which the compiler
+ * turns into SSE2 - or AVX2 where the CPU has it, picked when the
+ * program starts - and the bytes left over one by one.  Each FEC
+ * packet's payload is built up as its media packets go out, so nothing
+ * has to be kept of them.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "fec.h"
+
+typedef uint8_t vec_t __attribute__((vector_size(32)));
+
+#if defined(__x86_64__) && defined(__GNUC__) && !defined(__clang__)
+#define XOR_CLONES __attribute__((target_clones("avx2", "default")))
+#else
+#define XOR_CLONES
+#endif
+
+XOR_CLONES
+void fec_xor(uint8_t *dst, const uint8_t *src, int len)
+{
+  vec_t a, b;
+  int i;
+
+  for (i = 0; i + (int)sizeof(vec_t) <= len; i += sizeof(vec_t)) {
+    memcpy(&a, dst + i, sizeof(a));
+    memcpy(&b, src + i, sizeof(b));
+    a ^= b;
+    memcpy(dst + i, &a, sizeof(a));
+  }
+  for (; i < len; i++)
+    dst[i] ^= src[i];
+}
+
+void fec_pack(const fec_header_t *h, uint8_t *buf)
+{
+  buf[0] = h->snbase >> 8;
+  buf[1] = h->snbase & 0xff;
+  buf[2] = h->length >> 8;
+  buf[3] = h->length & 0xff;
+  buf[4] = 0x80 | (h->pt & 0x7f);     // E: always set
+  buf[5] = buf[6] = buf[7] = 0;       // mask
+  buf[8] = h->ts >> 24;
+  buf[9] = h->ts >> 16;
+  buf[10] = h->ts >> 8;
+  buf[11] = h->ts & 0xff;
+  buf[12] = h->row ? 0x40 : 0;        // X 0, type 0 (XOR), index 0
+  buf[13] = h->offset;
+  buf[14] = h->na;
+  buf[15] = 0;                        // SNBase ext
+}
+
+int fec_parse(const uint8_t *buf, int len, fec_header_t *h)
+{
+  if (len < FEC_HEADER_LEN)
+    return -1;
+  if (buf[12] & 0xbf)                 // an extension, or not XOR
+    return -1;
+  h->snbase = (buf[0] << 8) | buf[1];
+  h->length = (buf[2] << 8) | buf[3];
+  h->pt = buf[4] & 0x7f;
+  h->ts = (uint32_t)buf[8] << 24 | buf[9] << 16 | buf[10] << 8 | buf[11];
+  h->row = (buf[12] >> 6) & 1;
+  h->offset = buf[13];
+  h->na = buf[14];
+  if (h->offset == 0 || h->na == 0)
+    return -1;
+  return 0;
+}
+
+int fec_parse_matrix(const char *s, int *l, int *d)
+{
+  if (sscanf(s, "%dx%d", l, d) != 2)
+    return -1;
+  if (*l < 1 || *l > FEC_MAX_L || *d < 4 || *d > FEC_MAX_D || *l * *d > FEC_MAX_LD)
+    return -1;
+  return 0;
+}
+
+fec_enc_t *fec_enc_new(int l, int d)
+{
+  fec_enc_t *f;
+
+  if ((f = calloc(1, sizeof(fec_enc_t))) == NULL)
+    return NULL;
+  f->l = l;
+  f->d = d;
+  return f;
+}
+
+void fec_enc_free(fec_enc_t *f)
+{
+  free(f);
+}
+
+/* Add a packet of len bytes to what the FEC packet holds */
+static void acc_add(fec_acc_t *a, int first, const struct iovec *iov, int cnt,
+                    int len, uint32_t ts, int pt)
+{
+  int i, pos = 0;
+
+  if (first) {
+    for (i = 0; i < cnt; i++) {
+      memcpy(a->data + pos, iov[i].iov_base, iov[i].iov_len);
+      pos += iov[i].iov_len;
+    }
+    a->len = len;
+    a->length = len;
+    a->pt = pt;
+    a->ts = ts;
+    return;
+  }
+  if (len > a->len) {
+    memset(a->data + a->len, 0, len - a->len);
+    a->len = len;
+  }
+  for (i = 0; i < cnt; i++) {
+    fec_xor(a->data + pos, iov[i].iov_base, iov[i].iov_len);
+    pos += iov[i].iov_len;
+  }
+  a->length ^= len;
+  a->pt ^= pt;
+  a->ts ^= ts;
+}
+
+/* Queue the FEC packet for a finished row or column */
+static void emit(fec_enc_t *f, fec_acc_t *a, int row, uint16_t snbase, uint32_t ts)
+{
+  uint8_t *b = f->out[f->nout];
+  fec_header_t h;
+  uint16_t seq = f->seq[row]++;
+
+  b[0] = 0x80;
+  b[1] = FEC_PT;
+  b[2] = seq >> 8;
+  b[3] = seq & 0xff;
+  b[4] = ts >> 24;
+  b[5] = ts >> 16;
+  b[6] = ts >> 8;
+  b[7] = ts & 0xff;
+  b[8] = b[9] = b[10] = b[11] = 0;    // SSRC
+
+  h.snbase = snbase;
+  h.length = a->length;
+  h.pt = a->pt;
+  h.ts = a->ts;
+  h.row = row;
+  h.offset = row ? 1 : f->l;
+  h.na = row ? f->l : f->d;
+  fec_pack(&h, b + 12);
+  memcpy(b + 12 + FEC_HEADER_LEN, a->data, a->len);
+  f->out_len[f->nout] = 12 + FEC_HEADER_LEN + a->len;
+  f->out_row[f->nout] = row;
+  f->nout++;
+  f->packets[row]++;
+}
+
+void fec_enc_add(fec_enc_t *f, uint16_t seq, uint32_t ts, int pt,
+                 const struct iovec *iov, int cnt)
+{
+  int i, r, c, len = 0;
+
+  for (i = 0; i < cnt; i++)
+    len += iov[i].iov_len;
+  if (len > FEC_MAX_PAYLOAD) {
+    /* Can't be protected: start a new matrix after it */
+    f->skipped++;
+    f->n = 0;
+    return;
+  }
+
+  r = f->n / f->l;
+  c = f->n % f->l;
+  if (f->n == 0)
+    f->base = seq;
+  acc_add(&f->col[c], r == 0, iov, cnt, len, ts, pt);
+  acc_add(&f->row, c == 0, iov, cnt, len, ts, pt);
+
+  if (c == f->l - 1)
+    emit(f, &f->row, 1, seq - c, ts);
+  if (r == f->d - 1)
+    emit(f, &f->col[c], 0, f->base + c, ts);
+  if (++f->n == f->l * f->d)
+    f->n = 0;
+}
@@ -0,0 +1,95 @@
+#ifndef _FEC_H
+#define _FEC_H
+
+#include <stdint.h>
+#include <sys/uio.h>
+
+/* SMPTE 2022-1 forward error correction for RTP TS streams.  The media
+   packets are laid out row by row in a matrix L packets wide and D deep;
+   each column, and each row if there is row FEC, is protected by a FEC
+   packet holding the XOR of their payloads, lengths, payload types and
+   timestamps.  Any one packet missing from a column or row can be put
+   back from the others and its FEC packet.
+
+   The FEC packets go in RTP packets of their own, payload type FEC_PT,
+   column FEC to the media port + 2 and row FEC to the media port + 4.
+   After the RTP header comes the FEC header:
+
+     SNBase low (16) | length recovery (16)
+     E (1) | PT recovery (7) | mask (24)
+     TS recovery (32)
+     X (1) | D (1) | type (3) | index (3) | offset (8) | NA (8) | SNBase ext (8)
+
+   and then the XOR of the payloads, zero padded to the longest. */
+
+#define FEC_HEADER_LEN 16
+#define FEC_PT 96
+#define FEC_COLUMN_PORT 2       /* added to the media port */
+#define FEC_ROW_PORT 4
+
+#define FEC_MAX_L 20
+#define FEC_MAX_D 20
+#define FEC_MAX_LD 100          /* L x D */
+#define FEC_MAX_PAYLOAD 1460    /* of a protected packet */
+
+typedef struct {
+  uint16_t snbase;              /* the first packet protected */
+  uint16_t length;              /* the XORs of the protected packets' ... */
+  uint8_t pt;
+  uint32_t ts;
+  int row;                      /* row FEC (D bit), rather than column */
+  int offset;                   /* between the packets protected: L for columns, 1 for rows */
+  int na;                       /* how many there are: D for columns, L for rows */
+} fec_header_t;
+
+/* dst ^= src, for len bytes */
+void fec_xor(uint8_t *dst, const uint8_t *src, int len);
+
+void fec_pack(const fec_header_t *h, uint8_t *buf);
+/* The FEC header at buf.  Returns -1 if it isn't one we can use. */
+int fec_parse(const uint8_t *buf, int len, fec_header_t *h);
+
+/* "LxD", as given to -fec.  Returns 0, or -1 if it is out of range. */
+int fec_parse_matrix(const char *s, int *l, int *d);
+
+/* The sender's side.  Each media packet sent is added with
+   fec_enc_add(), and the FEC packets it completes are left in out[]
+   until the caller has sent them and set nout back to 0.  A packet
+   completes at most one row and one column, so there is always room for
+   two more while nout <= FEC_QUEUE - 2. */
+
+#define FEC_QUEUE 64
+#define FEC_PACKET_MAX (12 + FEC_HEADER_LEN + FEC_MAX_PAYLOAD)
+
+typedef struct {
+  uint8_t data[FEC_MAX_PAYLOAD];
+  int len;                      /* bytes of data so far, the rest are 0 */
+  uint16_t length;
+  uint8_t pt;
+  uint32_t ts;
+} fec_acc_t;
+
+typedef struct {
+  int l, d;
+  int n;                        /* packets of the matrix so far */
+  uint16_t base;                /* sequence number of its first packet */
+  fec_acc_t col[FEC_MAX_L];
+  fec_acc_t row;
+  uint16_t seq[2];              /* of the column and row FEC streams */
+
+  uint8_t out[FEC_QUEUE][FEC_PACKET_MAX];
+  int out_len[FEC_QUEUE];
+  int out_row[FEC_QUEUE];       /* which stream it belongs to */
+  int nout;
+
+  uint64_t packets[2];          /* column and row FEC packets made */
+  uint64_t skipped;             /* media packets too big to protect */
+} fec_enc_t;
+
+fec_enc_t *fec_enc_new(int l, int d);
+void fec_enc_free(fec_enc_t *f);
+/* One media packet, sequence number seq, with its payload in iov */
+void fec_enc_add(fec_enc_t *f, uint16_t seq, uint32_t ts, int pt,
+                 const struct iovec *iov, int cnt);
+
+#endif
@@ -0,0 +1,90 @@
+/*
+ * followcheck.c: checks that an output of dvbstream followed a program
+ * whose PMT moved one of its PIDs, for "make check".
+ *
+ * Reads the output TS on stdin.  The arguments are the PIDs the moving
+ * stream should be found on, in order (from "tsgen -churn" the audio
+ * PID goes back and forth between two).  Each must take over from the
+ * one before, with the continuity counter running on from the last
+ * packet on the old PID - so none were lost at the change - and none
+ * on the old PID after it.  No other PID may have a CC error either.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#define TS_SIZE 188
+#define MAX_MOVES 16
+
+static int cc[8192];             /* the last of each PID, or -1 */
+
+int main(int argc, char **argv)
+{
+  uint8_t p[TS_SIZE];
+  int moves[MAX_MOVES], nmoves, s = 0, pid, c, k, moving, stream_cc = -1;
+  uint64_t n = 0;
+  int failed = 0;
+
+  if (argc < 3 || argc - 1 > MAX_MOVES) {
+    fprintf(stderr, "usage: followcheck pid pid... < output.ts\n");
+    return 1;
+  }
+  nmoves = argc - 1;
+  for (k = 0; k < nmoves; k++)
+    moves[k] = atoi(argv[k + 1]);
+  memset(cc, 0xff, sizeof(cc));
+
+  while (fread(p, TS_SIZE, 1, stdin) == 1) {
+    n++;
+    if (p[0] != 0x47) {
+      fprintf(stderr, "followcheck: lost sync at packet %llu\n", (unsigned long long)n);
+      return 1;
+    }
+    pid = ((p[1] & 0x1f) << 8) | p[2];
+    c = p[3] & 0x0f;
+
+    for (moving = 0, k = 0; k < nmoves; k++) {
+      if (moves[k] == pid) moving = 1;
+    }
+    if (moving) {
+      if (pid != moves[s]) {
+        if (s + 1 < nmoves && pid == moves[s + 1]) {
+          s++;
+          printf("followcheck: on PID %d from packet %llu\n", pid, (unsigned long long)n);
+        } else {
+          if (failed++ < 10)
+            fprintf(stderr, "followcheck: packet %llu on PID %d, not %d\n",
+                    (unsigned long long)n, pid, moves[s]);
+          continue;
+        }
+      }
+      if (stream_cc >= 0 && c != ((stream_cc + 1) & 0x0f)) {
+        if (failed++ < 10)
+          fprintf(stderr, "followcheck: packet %llu on PID %d has CC %d after %d\n",
+                  (unsigned long long)n, pid, c, stream_cc);
+      }
+      stream_cc = c;
+    } else if ((p[3] & 0x10) && cc[pid] >= 0 && c != ((cc[pid] + 1) & 0x0f) && c != cc[pid]) {
+      if (failed++ < 10)
+        fprintf(stderr, "followcheck: packet %llu on PID %d has CC %d after %d\n",
+                (unsigned long long)n, pid, c, cc[pid]);
+    }
+    if (p[3] & 0x10)
+      cc[pid] = c;
+  }
+
+  if (s != nmoves - 1) {
+    fprintf(stderr, "followcheck: the stream got to PID %d, not %d\n", moves[s], moves[nmoves - 1]);
+    failed++;
+  }
+  printf("followcheck: %llu packets, %d moves of %d, %d errors\n",
+         (unsigned long long)n, s, nmoves - 1, failed);
+  return failed ? 1 : 0;
+}
@@ -0,0 +1,394 @@
+/*
+ * ingest.c: batched reading of a transport stream from the DVR device
+ * or a file/pipe.
+ *
+ * Rather than issuing one read() per 188 byte packet, the stream is read
+ * in large chunks and handed to the caller as an array of packets.  The
+ * packets are found by the framer (tsframe.c), so 192 and 204 byte
+ * streams work and lost sync is recovered.  A packet split across two
+ * reads is carried over to the start of the buffer before the next read.
+ *
+ * With io_uring (make URING=1, ingest_use_uring()) the next read is
+ * queued as soon as a batch has been framed, into a fresh slab, so the
+ * kernel fills it while the caller is busy with the batch.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include "ingest.h"
+
+#define INGEST_ALIGN 4096
+
+/* The pool's free list is shared between the thread reading the stream
+   and whoever drops the last reference on a slab, so it is protected by
+   a spinlock - it is only ever held for a couple of pointer updates. */
+static void pool_lock(slab_pool_t *pool)
+{
+  while (__atomic_test_and_set(&pool->lock, __ATOMIC_ACQUIRE))
+    ;
+}
+
+static void pool_unlock(slab_pool_t *pool)
+{
+  __atomic_clear(&pool->lock, __ATOMIC_RELEASE);
+}
+
+/* Take a slab from the pool, allocating a new one if none is free.  The
+   caller owns the one reference it comes with. */
+slab_t *slab_get(slab_pool_t *pool)
+{
+  slab_t *s;
+  void *p;
+
+  pool_lock(pool);
+  s = pool->free;
+  if (s != NULL)
+    pool->free = s->next;
+  pool_unlock(pool);
+
+  if (s == NULL) {
+    s = malloc(sizeof(slab_t));
+    if (s == NULL)
+      return NULL;
+    if (posix_memalign(&p, INGEST_ALIGN, pool->size) != 0) {
+      free(s);
+      return NULL;
+    }
+    s->buf = p;
+    s->pool = pool;
+    __atomic_add_fetch(&pool->allocated, 1, __ATOMIC_RELAXED);
+  }
+  s->refs = 1;
+  s->next = NULL;
+  return s;
+}
+
+void slab_ref(slab_t *s)
+{
+  __atomic_add_fetch(&s->refs, 1, __ATOMIC_RELAXED);
+}
+
+void slab_put(slab_t *s)
+{
+  slab_pool_t *pool = s->pool;
+
+  if (__atomic_sub_fetch(&s->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+    pool_lock(pool);
+    s->next = pool->free;
+    pool->free = s;
+    pool_unlock(pool);
+  }
+}
+
+int slab_shared(slab_t *s)
+{
+  return __atomic_load_n(&s->refs, __ATOMIC_ACQUIRE) > 1;
+}
+
+int ingest_init(ingest_t *in, int fd, int packets)
+{
+  if (packets < 1) packets = 1;
+  if (packets > INGEST_MAX_PACKETS) packets = INGEST_MAX_PACKETS;
+
+  memset(in, 0, sizeof(ingest_t));
+  in->fd = fd;
+  in->chunk = packets * TS_PACKET_SIZE;
+  /* Room for a chunk on top of whatever the framer couldn't use yet */
+  in->size = in->chunk + TS_SYNC_WINDOW;
+  in->pool.size = in->size;
+  in->slab = slab_get(&in->pool);
+  if (in->slab == NULL) {
+    fprintf(stderr, "ingest: couldn't allocate %d byte buffer\n", in->size);
+    return -1;
+  }
+  in->buf = in->slab->buf;
+  ts_framer_init(&in->framer);
+  in->pkts = malloc((in->size / TS_PACKET_SIZE + 1) * sizeof(uint8_t *));
+  if (in->pkts == NULL) {
+    slab_put(in->slab);
+    return -1;
+  }
+  return 0;
+}
+
+/* How much to ask for with len bytes already in the buffer */
+static int read_size(ingest_t *in, int len)
+{
+  int want = in->size - len;
+
+  return (want > in->chunk) ? in->chunk : want;
+}
+
+/* Frame the n bytes just read on top of what was in the buffer */
+static int frame_read(ingest_t *in, int n)
+{
+  in->bytes += n;
+  in->len += n;
+  in->npkts = ts_frame(&in->framer, in->buf, in->len, in->pkts,
+                       in->size / TS_PACKET_SIZE + 1, &in->used);
+  in->packets += in->npkts;
+  return in->npkts;
+}
+
+#ifdef HAVE_URING
+/* Queue the next read into a fresh slab, after the partial packet left
+   at the end of the current batch. */
+static void read_ahead(ingest_t *in)
+{
+  struct io_uring_sqe *sqe;
+  slab_t *s;
+  int tail = in->len - in->used;
+
+  if ((s = slab_get(&in->pool)) == NULL)
+    return;
+  if (tail > 0)
+    memcpy(s->buf, in->buf + in->used, tail);
+  if ((sqe = uring_sqe(in->ring)) == NULL) {
+    slab_put(s);
+    return;
+  }
+  sqe->opcode = IORING_OP_READ;
+  sqe->fd = in->fd;
+  sqe->addr = (unsigned long)(s->buf + tail);
+  sqe->len = read_size(in, tail);
+  sqe->off = (uint64_t)-1;        // from the current file position
+  if (uring_submit(in->ring, 0) < 0) {
+    slab_put(s);
+    return;
+  }
+  in->next = s;
+  in->next_len = tail;
+  in->pending = 1;
+  in->reads++;
+}
+
+static int ingest_read_uring(ingest_t *in)
+{
+  struct io_uring_cqe *cqe;
+  int n;
+
+  if (in->eof)
+    return -1;
+  if (!in->pending) {
+    read_ahead(in);
+    if (!in->pending)
+      return -1;
+  }
+  if ((cqe = uring_cqe(in->ring)) == NULL) {
+    /* Still being read - the packets of the last batch stay valid */
+    in->npkts = 0;
+    in->cur = 0;
+    return 0;
+  }
+  n = cqe->res;
+  uring_cqe_seen(in->ring);
+  in->pending = 0;
+
+  /* The read went into in->next, which becomes the current slab */
+  slab_put(in->slab);
+  in->slab = in->next;
+  in->buf = in->slab->buf;
+  in->len = in->next_len;
+  in->next = NULL;
+  in->used = 0;
+  in->npkts = 0;
+  in->cur = 0;
+
+  if (n == 0) {
+    in->eof = 1;
+    return -1;
+  }
+  if (n < 0) {
+    if ((n == -EAGAIN) || (n == -EINTR))
+      return 0;
+    if (n == -EOVERFLOW) {
+      fprintf(stderr, "ingest: DVR buffer overflow, packets lost\n");
+      return 0;
+    }
+    errno = -n;
+    perror("ingest: read");
+    return -1;
+  }
+
+  frame_read(in, n);
+  read_ahead(in);
+  return in->npkts;
+}
+#endif
+
+/* Read the next chunk.  Returns the number of complete packets now in
+   in->pkts (possibly 0 if nothing was available), or -1 at end of
+   stream or on a fatal read error.  The packets stay valid until the
+   next call, or for as long as a reference is held on in->slab. */
+int ingest_read(ingest_t *in)
+{
+  int n;
+  slab_t *s;
+
+#ifdef HAVE_URING
+  if (in->ring != NULL)
+    return ingest_read_uring(in);
+#endif
+
+  /* Keep the partial packet left over from the last read.  If an output
+     still holds packets of the last batch, read into a fresh slab. */
+  if (slab_shared(in->slab) && (s = slab_get(&in->pool)) != NULL) {
+    in->len -= in->used;
+    if (in->len > 0)
+      memcpy(s->buf, in->buf + in->used, in->len);
+    slab_put(in->slab);
+    in->slab = s;
+    in->buf = s->buf;
+  } else if (in->used > 0) {
+    in->len -= in->used;
+    if (in->len > 0)
+      memmove(in->buf, in->buf + in->used, in->len);
+  }
+  in->used = 0;
+  in->npkts = 0;
+  in->cur = 0;
+
+  if (in->eof)
+    return -1;
+
+  n = read(in->fd, in->buf + in->len, read_size(in, in->len));
+  in->reads++;
+  if (n == 0) {
+    in->eof = 1;
+    return -1;
+  }
+  if (n < 0) {
+    if ((errno == EAGAIN) || (errno == EINTR))
+      return 0;
+    if (errno == EOVERFLOW) {
+      fprintf(stderr, "ingest: DVR buffer overflow, packets lost\n");
+      return 0;
+    }
+    perror("ingest: read");
+    return -1;
+  }
+
+  return frame_read(in, n);
+}
+
+/* Return the next packet, reading more of the stream when the current
+   batch is used up.  For tools that handle one packet at a time from a
+   blocking descriptor.  Returns NULL at end of stream. */
+uint8_t *ingest_next(ingest_t *in)
+{
+  while (in->cur >= in->npkts) {
+    if (ingest_read(in) < 0)
+      return NULL;
+  }
+  return in->pkts[in->cur++];
+}
+
+/* Read through io_uring from now on.  The descriptor is made blocking,
+   as a read on a non-blocking one would just fail with EAGAIN instead
+   of waiting in the kernel; callers wait for the ring's descriptor
+   (ingest_poll_fd()) instead of the stream's.  Returns -1 if io_uring
+   isn't available, in which case read() carries on being used. */
+int ingest_use_uring(ingest_t *in)
+{
+#ifdef HAVE_URING
+  int flags;
+
+  in->ring = malloc(sizeof(uring_t));
+  if (in->ring == NULL || uring_init(in->ring, 4) < 0) {
+    fprintf(stderr, "ingest: can't use io_uring, using read()\n");
+    free(in->ring);
+    in->ring = NULL;
+    return -1;
+  }
+  flags = fcntl(in->fd, F_GETFL);
+  if (flags >= 0 && (flags & O_NONBLOCK))
+    fcntl(in->fd, F_SETFL, flags & ~O_NONBLOCK);
+  return 0;
+#else
+  fprintf(stderr, "ingest: built without io_uring support (make URING=1)\n");
+  return -1;
+#endif
+}
+
+/* The descriptor to wait on before calling ingest_read() */
+int ingest_poll_fd(ingest_t *in)
+{
+#ifdef HAVE_URING
+  if (in->ring != NULL)
+    return in->ring->fd;
+#endif
+  return in->fd;
+}
+
+void ingest_report(ingest_t *in, FILE *f)
+{
+  uint64_t saved;
+
+  saved = (in->packets > in->reads) ? in->packets - in->reads : 0;
+  fprintf(f, "ingest: %llu packets (%llu bytes) in %llu read() calls, %d byte chunks\n",
+          (unsigned long long)in->packets, (unsigned long long)in->bytes,
+          (unsigned long long)in->reads, in->chunk);
+  fprintf(f, "ingest: one read() per packet would have needed %llu calls - saved %llu (%.1f%%)\n",
+          (unsigned long long)in->packets, (unsigned long long)saved,
+          in->packets ? (100.0 * saved) / in->packets : 0.0);
+  fprintf(f, "ingest: %d byte packets, %llu resyncs, %llu bytes discarded, %d buffers\n",
+          in->framer.pktsize, (unsigned long long)in->framer.resyncs,
+          (unsigned long long)in->framer.discarded, in->pool.allocated);
+}
+
+/* Free the ingest and its free slabs.  Slabs still referenced elsewhere
+   are left to their holders. */
+void ingest_free(ingest_t *in)
+{
+  slab_t *s;
+#ifdef HAVE_URING
+  struct io_uring_cqe *cqe;
+#endif
+
+#ifdef HAVE_URING
+  if (in->ring != NULL) {
+    /* Don't free the slab under a read that is still in flight */
+    if (in->pending) {
+      struct io_uring_sqe *sqe = uring_sqe(in->ring);
+
+      if (sqe != NULL) {
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->addr = 0;            // the read's user_data
+        sqe->user_data = 1;
+      }
+      while (in->pending && uring_submit(in->ring, 1) >= 0) {
+        while ((cqe = uring_cqe(in->ring)) != NULL) {
+          if (cqe->user_data == 0)
+            in->pending = 0;
+          uring_cqe_seen(in->ring);
+        }
+      }
+      slab_put(in->next);
+      in->next = NULL;
+    }
+    uring_free(in->ring);
+    free(in->ring);
+    in->ring = NULL;
+  }
+#endif
+  free(in->pkts);
+  in->pkts = NULL;
+  slab_put(in->slab);
+  in->slab = NULL;
+  in->buf = NULL;
+  while ((s = in->pool.free) != NULL) {
+    in->pool.free = s->next;
+    free(s->buf);
+    free(s);
+  }
+}
@@ -0,0 +1,76 @@
+#ifndef _INGEST_H
+#define _INGEST_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "tsframe.h"
+#include "uring.h"
+
+#define TS_PACKET_SIZE 188
+
+/* Packets per read() - 348*188 = 65424 bytes, just under 64 KiB.
+   A batch of 1 packet gives the old one-read-per-packet behaviour. */
+#define INGEST_DEFAULT_PACKETS 348
+#define INGEST_MAX_PACKETS 1394   /* ~256 KiB */
+
+/* A reference counted read buffer.  Outputs that want to send packets
+   from a batch after the next read take a reference on the batch's slab
+   instead of copying the packets; the slab goes back to its pool when
+   the last reference is dropped.  References may be taken and dropped
+   from any thread. */
+typedef struct slab {
+  uint8_t *buf;
+  int refs;
+  struct slab_pool *pool;
+  struct slab *next;   /* free list */
+} slab_t;
+
+typedef struct slab_pool {
+  int size;            /* bytes per slab */
+  slab_t *free;
+  char lock;           /* guards free */
+  int allocated;
+} slab_pool_t;
+
+slab_t *slab_get(slab_pool_t *pool);
+void slab_ref(slab_t *s);
+void slab_put(slab_t *s);
+int slab_shared(slab_t *s);
+
+typedef struct {
+  int fd;
+  slab_pool_t pool;
+  slab_t *slab;        /* slab holding the current batch */
+  uint8_t *buf;        /* slab->buf, page aligned */
+  int size;            /* size of buf in bytes */
+  int chunk;           /* most bytes asked for in one read() */
+  int len;             /* bytes currently held in buf */
+  int used;            /* bytes of buf covered by the last batch */
+  int eof;
+  ts_framer_t framer;
+  uint8_t **pkts;      /* the packets of the last batch */
+  int npkts;
+  int cur;             /* next packet for ingest_next() */
+#ifdef HAVE_URING
+  uring_t *ring;       /* reads go through io_uring, one batch ahead */
+  slab_t *next;        /* slab the read ahead is filling */
+  int next_len;        /* bytes carried over into it */
+  int pending;         /* the read ahead is in flight */
+#endif
+
+  /* statistics */
+  uint64_t reads;      /* read() calls issued */
+  uint64_t bytes;
+  uint64_t packets;
+} ingest_t;
+
+int ingest_init(ingest_t *in, int fd, int packets);
+int ingest_read(ingest_t *in);
+uint8_t *ingest_next(ingest_t *in);
+int ingest_use_uring(ingest_t *in);
+int ingest_poll_fd(ingest_t *in);
+void ingest_report(ingest_t *in, FILE *f);
+void ingest_free(ingest_t *in);
+
+#endif
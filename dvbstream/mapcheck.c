@@ -0,0 +1,172 @@
+/*
+ * mapcheck.c: checks through the telnet interface that MAP n ADD and
+ * MAP n REMOVE don't leak demux filters, for "make check".
+ *
+ * Run by bench/mapfd.sh with the pid of a dvbstream built with TELNET
+ * that is reading a virtual card (DVB_VIRTUAL), whose filters are real
+ * file descriptors.  PIDs are added to map 0 and taken out again many
+ * times over, and the process must have no more descriptors at the end
+ * than it had at the start.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define PORT 12345
+#define CYCLES 200
+#define BATCH 4         /* PIDs added before they are all taken out */
+
+static int sock;
+static char buf[4096];
+static int buf_len;
+
+/* The descriptors process pid has open */
+static int fd_count(int pid)
+{
+  char path[64];
+  struct dirent *e;
+  DIR *d;
+  int n = 0;
+
+  snprintf(path, sizeof(path), "/proc/%d/fd", pid);
+  if ((d = opendir(path)) == NULL)
+    return -1;
+  while ((e = readdir(d)) != NULL) {
+    if (e->d_name[0] != '.') n++;
+  }
+  closedir(d);
+  return n;
+}
+
+/* Read up to the DONE that ends a reply.  Returns -1 if the reply has
+   an error line or the connection goes. */
+static int reply(const char *cmd)
+{
+  char *end, *line;
+  int n, err = 0;
+
+  for (;;) {
+    buf[buf_len] = 0;
+    while ((end = strstr(buf, "\r\n")) != NULL) {
+      *end = 0;
+      line = buf;
+      if (strncmp(line, "550-", 4) == 0) {
+        fprintf(stderr, "mapcheck: %s: %s\n", cmd, line + 4);
+        err = -1;
+      }
+      n = strcmp(line, "DONE");
+      buf_len -= end + 2 - buf;
+      memmove(buf, end + 2, buf_len + 1);
+      if (n == 0)
+        return err;
+    }
+    if ((n = read(sock, buf + buf_len, sizeof(buf) - 1 - buf_len)) <= 0) {
+      fprintf(stderr, "mapcheck: %s: the connection closed\n", cmd);
+      return -1;
+    }
+    buf_len += n;
+  }
+}
+
+static int command(const char *fmt, int arg)
+{
+  char cmd[64];
+
+  snprintf(cmd, sizeof(cmd), fmt, arg);
+  strcat(cmd, "\r\n");
+  if (write(sock, cmd, strlen(cmd)) < 0)
+    return -1;
+  cmd[strlen(cmd) - 2] = 0;
+  return reply(cmd);
+}
+
+/* Wait up to a second for the count to drop to n: the virtual card
+   closes its end of a filter once it has seen ours go */
+static int settled(int pid, int n)
+{
+  int i, now = -1;
+
+  for (i = 0; i < 100; i++) {
+    if ((now = fd_count(pid)) <= n)
+      break;
+    usleep(10000);
+  }
+  return now;
+}
+
+int main(int argc, char **argv)
+{
+  struct sockaddr_in sin;
+  int pid, i, k, before, during = 0, after, failed = 0;
+
+  if (argc != 2) {
+    fprintf(stderr, "usage: mapcheck pid\n");
+    return 1;
+  }
+  pid = atoi(argv[1]);
+
+  memset(&sin, 0, sizeof(sin));
+  sin.sin_family = AF_INET;
+  sin.sin_port = htons(PORT);
+  sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  for (i = 0; i < 50; i++) {
+    sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (connect(sock, (struct sockaddr *)&sin, sizeof(sin)) == 0)
+      break;
+    close(sock);
+    usleep(100000);
+  }
+  if (i == 50) {
+    perror("mapcheck: connect");
+    return 1;
+  }
+  if (reply("greeting") < 0)
+    return 1;
+
+  /* The SI filters open once the PAT has come: wait for them */
+  before = fd_count(pid);
+  for (i = 0; i < 50; i++) {
+    usleep(100000);
+    if ((k = fd_count(pid)) == before && i >= 5)
+      break;
+    before = k;
+  }
+  for (i = 0; i < CYCLES; i++) {
+    for (k = 0; k < BATCH; k++) {
+      if (command("MAP 0 ADD %d", 300 + k) < 0)
+        return 1;
+    }
+    if (i == 0)
+      during = fd_count(pid);
+    for (k = 0; k < BATCH; k++) {
+      if (command("MAP 0 REMOVE %d", 300 + k) < 0)
+        return 1;
+    }
+  }
+  after = settled(pid, before);
+
+  /* Each filter is a socket pair in the virtual card */
+  if (during < before + BATCH) {
+    fprintf(stderr, "mapcheck: MAP ADD opened %d descriptors for %d PIDs\n", during - before, BATCH);
+    failed++;
+  }
+  if (after != before) {
+    fprintf(stderr, "mapcheck: %d descriptors before, %d after\n", before, after);
+    failed++;
+  }
+  printf("mapcheck: %d MAP ADD/REMOVE cycles of %d PIDs, %d descriptors before and %d after, %d errors\n",
+         CYCLES, BATCH, before, after, failed);
+  close(sock);
+  return failed ? 1 : 0;
+}
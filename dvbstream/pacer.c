@@ -0,0 +1,115 @@
+/*
+ * pacer.c: sending a transport stream at the rate it was broadcast at.
+ *
+ * Used with -pace when playing a recording in with -stdin/-input, which
+ * would otherwise go out as fast as it can be read.  Packets are given
+ * departure times on CLOCK_MONOTONIC from the PCRs in the stream, and the
+ * caller sleeps until a packet is due before sending it.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "pacer.h"
+
+uint8_t null_packet[188] = { 0x47, 0x1f, 0xff, 0x10 };
+
+void pacer_init(pacer_t *p, int pcr_pid, long bitrate)
+{
+  memset(p, 0, sizeof(pacer_t));
+  pcr_clock_init(&p->clock, pcr_pid);
+  if (bitrate > 0)
+    p->slot_ns = 188LL * 8 * 1000000000LL / bitrate;
+  memset(null_packet + 4, 0xff, sizeof(null_packet) - 4);
+}
+
+/* Work out when pkt should be sent.  Returns its departure time, or 0 if
+   there's nothing to go by yet and it should just be sent. */
+int64_t pacer_stamp(pacer_t *p, uint8_t *pkt)
+{
+  return pcr_clock_stamp(&p->clock, pkt);
+}
+
+/* CBR: if there's a free slot before the one a packet due at due would
+   go in, take it for a null packet and return its departure time,
+   otherwise return 0 */
+int64_t pacer_null_slot(pacer_t *p, int64_t due)
+{
+  int64_t t;
+
+  if (due == 0 || p->next_slot == 0 || p->next_slot + p->slot_ns > due)
+    return 0;
+  t = p->next_slot;
+  p->next_slot += p->slot_ns;
+  p->nulls++;
+  return t;
+}
+
+/* CBR: the departure time of the slot for a packet due at due */
+int64_t pacer_slot(pacer_t *p, int64_t due)
+{
+  int64_t t, now;
+
+  if (p->next_slot == 0) {
+    p->next_slot = due ? due : monotonic_ns();
+  } else if (due != 0) {
+    if (p->next_slot > due + p->slot_ns)
+      p->overruns++;
+    now = monotonic_ns();
+    if (now - p->next_slot > PCR_RESYNC_NS) {
+      p->next_slot = now;
+      p->resyncs++;
+    }
+  }
+  t = p->next_slot;
+  p->next_slot += p->slot_ns;
+  return t;
+}
+
+/* Is a packet due at due early enough to be worth waiting for? */
+int pacer_early(pacer_t *p, int64_t due)
+{
+  int64_t d;
+
+  if (due == 0)
+    return 0;
+  d = due - monotonic_ns();
+  if (d > PACE_SLACK_NS)
+    return 1;
+  if (-d > PACE_SLACK_NS) {
+    p->late++;
+    if (-d > p->max_late_ns)
+      p->max_late_ns = -d;
+  }
+  return 0;
+}
+
+void pacer_wait(pacer_t *p, int64_t due)
+{
+  struct timespec ts;
+
+  ts.tv_sec = due / 1000000000LL;
+  ts.tv_nsec = due % 1000000000LL;
+  p->waits++;
+  /* A signal cuts the wait short, so ^C still works */
+  clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+}
+
+void pacer_report(pacer_t *p, FILE *f)
+{
+  fprintf(f, "pacer: %llu packets, %llu PCRs on PID %d, %llu waits, %llu resyncs\n",
+          (unsigned long long)p->clock.pkt, (unsigned long long)p->clock.pcrs, p->clock.pcr_pid,
+          (unsigned long long)p->waits, (unsigned long long)(p->clock.resyncs + p->resyncs));
+  fprintf(f, "pacer: %llu packets more than %lld ms late (worst %.1f ms)",
+          (unsigned long long)p->late, PACE_SLACK_NS / 1000000, p->max_late_ns / 1e6);
+  if (p->slot_ns)
+    fprintf(f, ", %llu null packets inserted, %llu packets missed their slot",
+            (unsigned long long)p->nulls, (unsigned long long)p->overruns);
+  fprintf(f, "\n");
+}
@@ -0,0 +1,43 @@
+#ifndef _PACER_H
+#define _PACER_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "pcrclock.h"
+
+/* Don't bother sleeping for less than this */
+#define PACE_SLACK_NS 1000000LL
+
+/* Works out when each packet of a transport stream should be sent, so a
+   recording can be played out at the rate it was broadcast at.  The
+   departure times come from the stream's PCRs (pcrclock.c).
+
+   With a constant bitrate the packets are also placed in fixed slots of
+   one packet time each, and the slots with no packet due in them are
+   filled with null packets. */
+typedef struct {
+  pcr_clock_t clock;
+  int64_t slot_ns;             /* CBR: one packet time, or 0 */
+  int64_t next_slot;           /* CBR: departure of the next free slot */
+
+  /* statistics */
+  uint64_t nulls;              /* null packets inserted */
+  uint64_t waits;
+  uint64_t resyncs;            /* CBR slots restarted after a stall */
+  uint64_t late;               /* packets sent well after their time */
+  int64_t max_late_ns;
+  uint64_t overruns;           /* CBR: packets that missed their slot */
+} pacer_t;
+
+void pacer_init(pacer_t *p, int pcr_pid, long bitrate);
+int64_t pacer_stamp(pacer_t *p, uint8_t *pkt);
+int64_t pacer_null_slot(pacer_t *p, int64_t due);
+int64_t pacer_slot(pacer_t *p, int64_t due);
+int pacer_early(pacer_t *p, int64_t due);
+void pacer_wait(pacer_t *p, int64_t due);
+void pacer_report(pacer_t *p, FILE *f);
+
+extern uint8_t null_packet[188];
+
+#endif
@@ -0,0 +1,146 @@
+/*
+ * packetiser.c: turning the -ps program stream into RTP datagrams.
+ *
+ * The remuxer hands over a pack header, then each PES packet, in pieces
+ * of any size.  They are copied into a ring of MAX_RTP_SIZE slots and a
+ * slot is queued on the egress as soon as it is full, straight from the
+ * ring, so nothing is ever moved up or copied a second time.  The ring
+ * is flushed before it can wrap, which bounds the memory used to
+ * PSPKT_SLOTS datagrams whatever the size of the PES bursts.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "packetiser.h"
+
+/* Until the first pack header, stamp datagrams with the time of day,
+   as dvbstream always used to */
+static uint32_t clock_90khz(void)
+{
+  struct timeval tv;
+
+  gettimeofday(&tv, NULL);
+  return ((tv.tv_sec % 1000000) * 1000 + tv.tv_usec / 1000) * 90;
+}
+
+/* If buf starts with a pack header, store the low 32 bits of its SCR
+   base (90 kHz) in *scr and return 1 */
+int pspkt_scr(uint8_t *buf, int count, uint32_t *scr)
+{
+  uint64_t s;
+
+  if (count < 9 || buf[0] != 0x00 || buf[1] != 0x00 || buf[2] != 0x01 || buf[3] != 0xba)
+    return 0;
+  if ((buf[4] & 0xc0) == 0x40) {
+    /* MPEG-2: 01 SCR[32..30] 1 SCR[29..15] 1 SCR[14..0] 1 ext */
+    s = ((uint64_t)(buf[4] & 0x38) << 27) | ((uint64_t)(buf[4] & 0x03) << 28)
+      | ((uint64_t)buf[5] << 20) | ((uint64_t)(buf[6] & 0xf8) << 12)
+      | ((uint64_t)(buf[6] & 0x03) << 13) | ((uint64_t)buf[7] << 5)
+      | (buf[8] >> 3);
+  } else if ((buf[4] & 0xf0) == 0x20) {
+    /* MPEG-1: 0010 SCR[32..30] 1 SCR[29..15] 1 SCR[14..0] 1 */
+    s = ((uint64_t)(buf[4] & 0x0e) << 29) | ((uint64_t)buf[5] << 22)
+      | ((uint64_t)(buf[6] & 0xfe) << 14) | ((uint64_t)buf[7] << 7)
+      | (buf[8] >> 1);
+  } else {
+    return 0;
+  }
+  *scr = (uint32_t)s;
+  return 1;
+}
+
+int pspkt_init(ps_packetiser_t *ps, egress_t *eg, struct rtpheader *hdr, int payload)
+{
+  memset(ps, 0, sizeof(ps_packetiser_t));
+  ps->eg = eg;
+  ps->hdr = hdr;
+  ps->payload = payload;
+  ps->ring = malloc(PSPKT_SLOTS * payload);
+  if (ps->ring == NULL) {
+    fprintf(stderr, "packetiser: couldn't allocate %d byte ring\n", PSPKT_SLOTS * payload);
+    return -1;
+  }
+  return 0;
+}
+
+/* Queue the full slot at the head of the ring */
+static void send_slot(ps_packetiser_t *ps)
+{
+  ps->hdr->timestamp = ps->hdr->ts_offset + ps->ts[ps->head];
+  egress_add(ps->eg, ps->ring + ps->head * ps->payload, ps->payload);
+  egress_end(ps->eg);
+  ps->datagrams++;
+  ps->queued++;
+  ps->head = (ps->head + 1) % PSPKT_SLOTS;
+  ps->fill = 0;
+
+  /* The next slot may still be waiting to be sent */
+  if (ps->queued == PSPKT_SLOTS) {
+    ps->wraps++;
+    pspkt_flush(ps);
+  }
+}
+
+/* Add count bytes of program stream.  A pack header is only recognised
+   at the start of a call, which is how the remuxer writes them. */
+void pspkt_write(ps_packetiser_t *ps, uint8_t *buf, int count)
+{
+  uint32_t scr;
+  int n, pack;
+
+  if ((pack = pspkt_scr(buf, count, &scr))) {
+    ps->scr = scr;
+    ps->have_scr = 1;
+    ps->packs++;
+    if (ps->fill > 0 && !ps->has_scr[ps->head]) {
+      ps->ts[ps->head] = scr;
+      ps->has_scr[ps->head] = 1;
+    }
+  }
+  ps->bytes += count;
+
+  while (count > 0) {
+    if (ps->fill == 0) {
+      ps->ts[ps->head] = ps->have_scr ? ps->scr : clock_90khz();
+      ps->has_scr[ps->head] = pack;   /* the pack header starts the slot */
+    }
+    pack = 0;
+    n = ps->payload - ps->fill;
+    if (n > count) n = count;
+    memcpy(ps->ring + ps->head * ps->payload + ps->fill, buf, n);
+    ps->fill += n;
+    buf += n;
+    count -= n;
+    if (ps->fill == ps->payload)
+      send_slot(ps);
+  }
+}
+
+/* Send the full datagrams.  A partly filled one waits for more data. */
+void pspkt_flush(ps_packetiser_t *ps)
+{
+  egress_flush(ps->eg);
+  ps->queued = 0;
+}
+
+void pspkt_report(ps_packetiser_t *ps, FILE *f)
+{
+  fprintf(f, "packetiser: %llu bytes of PS in %llu datagrams, %llu pack headers, %llu ring wraps, %d byte ring\n",
+          (unsigned long long)ps->bytes, (unsigned long long)ps->datagrams,
+          (unsigned long long)ps->packs, (unsigned long long)ps->wraps,
+          PSPKT_SLOTS * ps->payload);
+}
+
+void pspkt_free(ps_packetiser_t *ps)
+{
+  free(ps->ring);
+  ps->ring = NULL;
+}
@@ -0,0 +1,52 @@
+#ifndef _PACKETISER_H
+#define _PACKETISER_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "rtp.h"
+#include "egress.h"
+
+/* Datagrams the ring holds.  Full datagrams are queued on the egress
+   straight from their slot, so the ring must not wrap before the queue
+   has been flushed - one slot per queue entry. */
+#define PSPKT_SLOTS EGRESS_QUEUE
+
+/* Slices the program stream written by the mpegtools remuxer into fixed
+   size RTP payloads.  The stream is copied once, into a ring of datagram
+   sized slots, and each slot is sent from where it is when it fills up,
+   so the memory used is fixed however large the PES packets are.
+
+   Each datagram is stamped with the SCR of the first pack header that
+   starts in it, or failing that the last SCR seen, so the RTP timestamps
+   follow the stream's clock rather than the time it was sent at. */
+typedef struct {
+  egress_t *eg;
+  struct rtpheader *hdr;
+  int payload;                 /* bytes per datagram */
+  uint8_t *ring;               /* PSPKT_SLOTS slots of payload bytes */
+  uint32_t ts[PSPKT_SLOTS];    /* RTP timestamp of each slot */
+  int has_scr[PSPKT_SLOTS];    /* slot has its own pack header */
+  int head;                    /* slot being filled */
+  int fill;                    /* bytes in it */
+  int queued;                  /* full slots handed to the egress */
+
+  uint32_t scr;                /* last SCR seen (90 kHz, low 32 bits) */
+  int have_scr;
+
+  /* statistics */
+  uint64_t bytes;
+  uint64_t datagrams;
+  uint64_t packs;              /* pack headers seen */
+  uint64_t wraps;              /* flushes forced by a full ring */
+} ps_packetiser_t;
+
+int pspkt_init(ps_packetiser_t *ps, egress_t *eg, struct rtpheader *hdr, int payload);
+void pspkt_write(ps_packetiser_t *ps, uint8_t *buf, int count);
+void pspkt_flush(ps_packetiser_t *ps);
+void pspkt_report(ps_packetiser_t *ps, FILE *f);
+void pspkt_free(ps_packetiser_t *ps);
+
+int pspkt_scr(uint8_t *buf, int count, uint32_t *scr);
+
+#endif
@@ -0,0 +1,91 @@
+/*
+ * pcrclock.c: timing the packets of a transport stream from its PCRs.
+ *
+ * Used to pace recordings played in with -pace and for the RTP
+ * timestamps, which RFC 2250 says should follow the PCR.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include <string.h>
+#include <time.h>
+
+#include "pcrclock.h"
+
+void pcr_clock_init(pcr_clock_t *c, int pcr_pid)
+{
+  memset(c, 0, sizeof(pcr_clock_t));
+  c->pcr_pid = pcr_pid;
+}
+
+int64_t monotonic_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* The PCR of a packet, in 27 MHz ticks */
+int get_pcr(uint8_t *buf, int64_t *pcr, int *discontinuity)
+{
+  int64_t base;
+
+  if (!(buf[3] & 0x20) || buf[4] < 7 || !(buf[5] & 0x10))
+    return 0;
+  base = ((int64_t)buf[6] << 25) | (buf[7] << 17) | (buf[8] << 9) | (buf[9] << 1) | (buf[10] >> 7);
+  *pcr = base * 300 + (((buf[10] & 1) << 8) | buf[11]);
+  *discontinuity = buf[5] & 0x80;
+  return 1;
+}
+
+/* When packet n is due, going by the last PCR */
+static int64_t due_time(pcr_clock_t *c, uint64_t n)
+{
+  return c->t_last + (int64_t)((n - c->pkt_last) * c->ns_per_pkt);
+}
+
+/* The time of the next packet of the stream, pkt, on CLOCK_MONOTONIC, or
+   0 if there hasn't been a PCR to go by yet */
+int64_t pcr_clock_stamp(pcr_clock_t *c, uint8_t *pkt)
+{
+  int pid = ((pkt[1] & 0x1f) << 8) | pkt[2];
+  uint64_t n = c->pkt++;
+  int64_t pcr, gap, t, now;
+  int disc;
+
+  if (!get_pcr(pkt, &pcr, &disc))
+    return c->have_pcr ? due_time(c, n) : 0;
+  if (c->pcr_pid == -1)
+    c->pcr_pid = pid;
+  else if (pid != c->pcr_pid)
+    return c->have_pcr ? due_time(c, n) : 0;
+  c->pcrs++;
+
+  now = monotonic_ns();
+  if (!c->have_pcr) {
+    t = now;
+    c->have_pcr = 1;
+  } else {
+    gap = (pcr - c->pcr_last + PCR_WRAP) % PCR_WRAP;
+    if (disc || gap == 0 || gap > PCR_MAX_GAP) {
+      /* A new timebase: carry on at the rate we had */
+      t = due_time(c, n);
+      c->resyncs++;
+    } else {
+      t = c->t_last + gap * 1000 / 27;
+      c->ns_per_pkt = (double)(gap * 1000 / 27) / (n - c->pkt_last);
+    }
+  }
+  if (now - t > PCR_RESYNC_NS) {
+    t = now;
+    c->resyncs++;
+  }
+  c->pcr_last = pcr;
+  c->pkt_last = n;
+  c->t_last = t;
+  return t;
+}
@@ -0,0 +1,39 @@
+#ifndef _PCRCLOCK_H
+#define _PCRCLOCK_H
+
+#include <stdint.h>
+
+/* 27 MHz PCR ticks */
+#define PCR_HZ 27000000LL
+#define PCR_WRAP (((int64_t)1 << 33) * 300)
+#define PCR_MAX_GAP PCR_HZ  /* more than this between PCRs is a jump */
+
+/* A packet due this long ago means the input stalled - carry on from
+   now rather than sending everything in a burst to catch up */
+#define PCR_RESYNC_NS 500000000LL
+
+/* The time line of a transport stream, recovered from the PCRs of one
+   PID.  Each PCR pins its packet to a point on CLOCK_MONOTONIC, and the
+   packets after it are spaced out at the rate measured between the last
+   two PCRs.  Discontinuities carry on from where the stream was, so the
+   times only ever go forwards. */
+typedef struct {
+  int pcr_pid;                 /* -1: the first PID that carries a PCR */
+  int have_pcr;
+  int64_t pcr_last;            /* last PCR, */
+  uint64_t pkt_last;           /* the packet it was in */
+  int64_t t_last;              /* and its time */
+  double ns_per_pkt;           /* from the last two PCRs, 0 until then */
+  uint64_t pkt;                /* packets seen */
+
+  /* statistics */
+  uint64_t pcrs;
+  uint64_t resyncs;
+} pcr_clock_t;
+
+void pcr_clock_init(pcr_clock_t *c, int pcr_pid);
+int64_t pcr_clock_stamp(pcr_clock_t *c, uint8_t *pkt);
+int64_t monotonic_ns(void);
+int get_pcr(uint8_t *buf, int64_t *pcr, int *discontinuity);
+
+#endif
@@ -0,0 +1,211 @@
+/*
+ * pipeline.c: the pieces of dvbstream's threaded mode (-threads).
+ *
+ * Ingest, routing and egress run in their own threads and pass batches
+ * of packets to each other through single producer, single consumer
+ * rings.  Only pointers to the packets go through the rings; the packets
+ * stay in the ingest slab they were read into, and every batch holds a
+ * reference on its slab until the consumer is done with it.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sched.h>
+#include <signal.h>
+#include <time.h>
+
+#include "pipeline.h"
+
+/* Spins before an idle stage starts sleeping, and how long it sleeps */
+#define IDLE_SPINS 64
+#define IDLE_SLEEP_NS 200000
+
+int spsc_init(spsc_ring_t *r, int slots, int max, int with_outs)
+{
+  int i;
+
+  memset(r, 0, sizeof(spsc_ring_t));
+  if (slots < 2 || (slots & (slots - 1)) != 0)
+    return -1;
+  r->slots = calloc(slots, sizeof(batch_t));
+  if (r->slots == NULL)
+    return -1;
+  r->mask = slots - 1;
+  r->max = max;
+  for (i = 0; i < slots; i++) {
+    r->slots[i].pkts = malloc(max * sizeof(uint8_t *));
+    if (r->slots[i].pkts == NULL)
+      return -1;
+    if (with_outs) {
+      r->slots[i].outs = malloc(max * sizeof(int));
+      r->slots[i].stamps = malloc(max * sizeof(uint32_t));
+      if (r->slots[i].outs == NULL || r->slots[i].stamps == NULL)
+        return -1;
+    }
+  }
+  return 0;
+}
+
+/* Producer: the next free slot, or NULL if the ring is full */
+batch_t *spsc_claim(spsc_ring_t *r)
+{
+  unsigned int tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+
+  if (r->head - tail > r->mask) {
+    r->full++;
+    return NULL;
+  }
+  return &r->slots[r->head & r->mask];
+}
+
+/* Producer: hand the claimed slot to the consumer */
+void spsc_publish(spsc_ring_t *r)
+{
+  unsigned int used;
+
+  r->batches++;
+  r->packets += r->slots[r->head & r->mask].n;
+  __atomic_store_n(&r->head, r->head + 1, __ATOMIC_RELEASE);
+  used = r->head - __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+  if (used > r->highwater)
+    r->highwater = used;
+}
+
+/* Consumer: the oldest published batch, or NULL if there is none */
+batch_t *spsc_peek(spsc_ring_t *r)
+{
+  unsigned int head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+
+  if (head == r->tail)
+    return NULL;
+  return &r->slots[r->tail & r->mask];
+}
+
+/* Consumer: give the slot from spsc_peek() back to the producer */
+void spsc_release(spsc_ring_t *r)
+{
+  __atomic_store_n(&r->tail, r->tail + 1, __ATOMIC_RELEASE);
+}
+
+/* Producer: no more batches will follow */
+void spsc_close(spsc_ring_t *r)
+{
+  __atomic_store_n(&r->closed, 1, __ATOMIC_RELEASE);
+}
+
+/* Consumer: true once the ring is closed and everything in it has been
+   taken */
+int spsc_done(spsc_ring_t *r)
+{
+  if (!__atomic_load_n(&r->closed, __ATOMIC_ACQUIRE))
+    return 0;
+  return spsc_peek(r) == NULL;
+}
+
+unsigned int spsc_occupancy(spsc_ring_t *r)
+{
+  return __atomic_load_n(&r->head, __ATOMIC_ACQUIRE)
+         - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+}
+
+void spsc_report(spsc_ring_t *r, FILE *f, const char *name)
+{
+  fprintf(f, "ring %s: %llu batches, %llu packets, %llu dropped, full %llu times, %u/%u slots in use (peak %u)\n",
+          name, (unsigned long long)r->batches, (unsigned long long)r->packets,
+          (unsigned long long)r->dropped, (unsigned long long)r->full,
+          spsc_occupancy(r), r->mask + 1, r->highwater);
+}
+
+void spsc_free(spsc_ring_t *r)
+{
+  int i;
+
+  if (r->slots == NULL)
+    return;
+  for (i = 0; i <= r->mask; i++) {
+    free(r->slots[i].pkts);
+    free(r->slots[i].outs);
+    free(r->slots[i].stamps);
+  }
+  free(r->slots);
+  r->slots = NULL;
+}
+
+/* Called by a stage with nothing to do.  Spin for a little while in case
+   work turns up straight away, then sleep in short naps.  *spins is
+   reset by the caller whenever it finds work. */
+void spsc_idle(int *spins)
+{
+  struct timespec ts;
+
+  if ((*spins)++ < IDLE_SPINS) {
+    sched_yield();
+    return;
+  }
+  ts.tv_sec = 0;
+  ts.tv_nsec = IDLE_SLEEP_NS;
+  nanosleep(&ts, NULL);
+}
+
+/* Parse a comma separated list of CPU numbers, "-" meaning no affinity.
+   Returns the number of entries or -1 on a syntax error. */
+int parse_cpu_list(char *s, int *cpus, int max)
+{
+  int n = 0;
+  char *end;
+
+  while (*s && n < max) {
+    if (*s == '-') {
+      cpus[n++] = -1;
+      s++;
+    } else {
+      cpus[n++] = strtol(s, &end, 10);
+      if (end == s || cpus[n-1] < 0)
+        return -1;
+      s = end;
+    }
+    if (*s == ',')
+      s++;
+    else if (*s)
+      return -1;
+  }
+  return n;
+}
+
+/* Start a stage thread, pinned to cpu unless it is -1.  Signals are left
+   to the main thread. */
+int start_thread(pthread_t *t, void *(*fn)(void *), void *arg, int cpu)
+{
+  pthread_attr_t attr;
+  sigset_t all, old;
+  cpu_set_t set;
+  int r;
+
+  pthread_attr_init(&attr);
+  if (cpu >= 0) {
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+  }
+  sigfillset(&all);
+  pthread_sigmask(SIG_BLOCK, &all, &old);
+  r = pthread_create(t, &attr, fn, arg);
+  if (r == EINVAL && cpu >= 0) {
+    fprintf(stderr, "Can't run a thread on CPU %d, leaving it unpinned\n", cpu);
+    r = pthread_create(t, NULL, fn, arg);
+  }
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+  pthread_attr_destroy(&attr);
+  if (r != 0) {
+    fprintf(stderr, "Couldn't start thread: %s\n", strerror(r));
+    return -1;
+  }
+  return 0;
+}
@@ -0,0 +1,65 @@
+#ifndef _PIPELINE_H
+#define _PIPELINE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "ingest.h"
+
+/* Batches each ring can hold - must be a power of two */
+#define SPSC_SLOTS 64
+
+/* A batch of packets passed from one pipeline stage to the next.  The
+   packets live in slab, which the batch holds a reference on.  outs[]
+   and stamps[] are only used on the rings feeding the egress threads,
+   where they say which output each packet is for and its RTP timestamp.
+   read_ns is when the packets were read, for the latency figures. */
+typedef struct {
+  slab_t *slab;
+  int n;
+  int64_t read_ns;
+  uint8_t **pkts;
+  int *outs;
+  uint32_t *stamps;
+} batch_t;
+
+/* Lock-free single producer, single consumer ring of batches.  The
+   producer fills the slot returned by spsc_claim() and makes it visible
+   with spsc_publish(); the consumer does the same with spsc_peek() and
+   spsc_release().  head and tail are each only written by one side and
+   live on separate cache lines. */
+typedef struct {
+  batch_t *slots;
+  unsigned int mask;
+  int max;                   /* packets per batch */
+
+  unsigned int head __attribute__((aligned(64)));  /* producer */
+  unsigned int tail __attribute__((aligned(64)));  /* consumer */
+  int closed;
+
+  /* statistics, kept by the producer */
+  uint64_t batches __attribute__((aligned(64)));
+  uint64_t packets;
+  uint64_t dropped;          /* packets thrown away because the ring was full */
+  uint64_t full;             /* times the producer found the ring full */
+  unsigned int highwater;    /* most slots ever in use */
+} spsc_ring_t;
+
+int spsc_init(spsc_ring_t *r, int slots, int max, int with_outs);
+batch_t *spsc_claim(spsc_ring_t *r);
+void spsc_publish(spsc_ring_t *r);
+batch_t *spsc_peek(spsc_ring_t *r);
+void spsc_release(spsc_ring_t *r);
+void spsc_close(spsc_ring_t *r);
+int spsc_done(spsc_ring_t *r);
+unsigned int spsc_occupancy(spsc_ring_t *r);
+void spsc_report(spsc_ring_t *r, FILE *f, const char *name);
+void spsc_free(spsc_ring_t *r);
+
+void spsc_idle(int *spins);
+
+int parse_cpu_list(char *s, int *cpus, int max);
+int start_thread(pthread_t *t, void *(*fn)(void *), void *arg, int cpu);
+
+#endif
@@ -0,0 +1,222 @@
+/*
+ * pscheck.c: checks the -ps packetiser for "make check".
+ *
+ * A program stream of large PES bursts (100 to 400 kbytes, written in
+ * pieces of any size the way the remuxer writes them, enough to wrap the
+ * ring many times) is put through pspkt_write() and sent over the
+ * loopback.  Every datagram that comes back must carry the next payload
+ * bytes of the stream, unchanged, with the SCR of the first pack header
+ * that starts in it or else the last one before it as its timestamp -
+ * including pack headers that start a datagram with another following
+ * in the same one.  The packetiser's memory must not grow.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "packetiser.h"
+
+#define PAYLOAD 1400
+#define BURSTS 60
+#define PACK_LEN 14
+#define MAX_PACKS (BURSTS * 3)
+
+static uint8_t *stream;         /* what is written */
+static int len;
+static int pack_pos[MAX_PACKS];  /* where each pack header starts */
+static uint32_t pack_scr[MAX_PACKS];
+static int npacks;
+
+static int datagrams, rxpos, seq = -1;   /* received so far */
+static int failed;
+
+/* Append an MPEG-2 pack header with SCR base scr */
+static void add_pack(uint32_t scr)
+{
+  uint8_t *p = stream + len;
+  uint64_t s = scr;
+
+  p[0] = 0x00; p[1] = 0x00; p[2] = 0x01; p[3] = 0xba;
+  p[4] = 0x44 | ((s >> 27) & 0x38) | ((s >> 28) & 0x03);
+  p[5] = s >> 20;
+  p[6] = 0x04 | ((s >> 12) & 0xf8) | ((s >> 13) & 0x03);
+  p[7] = s >> 5;
+  p[8] = 0x04 | ((s << 3) & 0xf8);
+  p[9] = 0x01; p[10] = 0x89; p[11] = 0xc3; p[12] = 0xf8; p[13] = 0x00;
+  pack_pos[npacks] = len;
+  pack_scr[npacks++] = scr;
+  len += PACK_LEN;
+}
+
+/* Append n bytes of video PES.  The bytes after the start code are never
+   0, so no piece of it can look like a pack header. */
+static void add_pes(int n)
+{
+  uint8_t *p = stream + len;
+  int i;
+
+  p[0] = 0x00; p[1] = 0x00; p[2] = 0x01; p[3] = 0xe0;
+  for (i = 4; i < n; i++)
+    p[i] = 1 + rand() % 255;
+  len += n;
+}
+
+/* The timestamp datagram d should have */
+static uint32_t expected_ts(int d)
+{
+  int k, last = -1;
+
+  for (k = 0; k < npacks && pack_pos[k] < (d + 1) * PAYLOAD; k++) {
+    if (pack_pos[k] >= d * PAYLOAD)
+      return pack_scr[k];
+    last = k;
+  }
+  return last >= 0 ? pack_scr[last] : 0;
+}
+
+/* Take the datagrams that have come and check each against the stream.
+   Returns -1 if one is missing or doesn't match. */
+static int receive(int rx, struct rtpheader *hdr)
+{
+  uint8_t buf[2048];
+  uint32_t ts;
+  int n;
+
+  while ((n = recv(rx, buf, sizeof(buf), MSG_DONTWAIT)) > 0) {
+    n -= RTP_HEADER_LEN;
+    if (seq >= 0 && ((buf[2] << 8) | buf[3]) != ((seq + 1) & 0xffff)) {
+      fprintf(stderr, "pscheck: datagram %d lost\n", datagrams);
+      return -1;
+    }
+    seq = (buf[2] << 8) | buf[3];
+    if (n != PAYLOAD || memcmp(buf + RTP_HEADER_LEN, stream + rxpos, n) != 0) {
+      fprintf(stderr, "pscheck: datagram %d (%d bytes) doesn't match the stream at %d\n",
+              datagrams, n, rxpos);
+      return -1;
+    }
+    ts = ((uint32_t)buf[4] << 24 | buf[5] << 16 | buf[6] << 8 | buf[7]) - (uint32_t)hdr->ts_offset;
+    if (ts != expected_ts(datagrams)) {
+      if (failed < 10)
+        fprintf(stderr, "pscheck: datagram %d stamped %u, not %u\n", datagrams, ts, expected_ts(datagrams));
+      failed++;
+    }
+    rxpos += n;
+    datagrams++;
+  }
+  return 0;
+}
+
+static long maxrss(void)
+{
+  struct rusage ru;
+
+  getrusage(RUSAGE_SELF, &ru);
+  return ru.ru_maxrss;
+}
+
+int main(int argc, char **argv)
+{
+  struct sockaddr_storage addr;
+  struct sockaddr_in *sin = (struct sockaddr_in *)&addr;
+  socklen_t alen = sizeof(struct sockaddr_in);
+  struct rtpheader hdr;
+  ps_packetiser_t ps;
+  egress_t eg;
+  uint32_t scr = 0;
+  int rx, tx, b, k, pos, piece, size, writes = 0;
+  long rss;
+
+  srand(1);
+  stream = malloc((BURSTS + 1) * (400 * 1024 + 4 * PAYLOAD));
+  if (stream == NULL)
+    return 1;
+
+  /* Each burst starts with a pack header.  Every fourth time the stream
+     is first padded to a datagram boundary so the header starts one,
+     and another pack and a short PES follow in the same datagram. */
+  for (b = 0; b < BURSTS; b++) {
+    if (b % 4 == 1) {
+      if (len % PAYLOAD != 0)
+        add_pes(PAYLOAD - len % PAYLOAD < 8 ? 2 * PAYLOAD - len % PAYLOAD : PAYLOAD - len % PAYLOAD);
+      add_pack(scr += 1800);
+      add_pes(100);
+    }
+    add_pack(scr += 3600);
+    add_pes(100 * 1024 + rand() % (300 * 1024));
+  }
+
+  rx = socket(AF_INET, SOCK_DGRAM, 0);
+  tx = socket(AF_INET, SOCK_DGRAM, 0);
+  memset(&addr, 0, sizeof(addr));
+  sin->sin_family = AF_INET;
+  sin->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  size = 4 * 1024 * 1024;
+  setsockopt(rx, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+  if (bind(rx, (struct sockaddr *)sin, alen) < 0 || getsockname(rx, (struct sockaddr *)sin, &alen) < 0) {
+    perror("pscheck: bind");
+    return 1;
+  }
+
+  initrtp(&hdr, 34, RTP);
+  egress_init(&eg, tx, &addr, &hdr, 0);
+  if (pspkt_init(&ps, &eg, &hdr, PAYLOAD) < 0)
+    return 1;
+  rss = maxrss();
+
+  for (pos = 0; pos < len; pos += piece) {
+    /* Pack headers on their own, the PES in pieces of up to 64 kbytes */
+    for (k = 0; k < npacks && pack_pos[k] <= pos; k++)
+      ;
+    if (k > 0 && pack_pos[k-1] == pos)
+      piece = PACK_LEN;
+    else
+      piece = 1 + rand() % 65536;
+    if (k < npacks && pos + piece > pack_pos[k])
+      piece = pack_pos[k] - pos;
+    if (pos + piece > len)
+      piece = len - pos;
+    pspkt_write(&ps, stream + pos, piece);
+    if (ps.queued >= PSPKT_SLOTS || eg.queued >= EGRESS_QUEUE) {
+      fprintf(stderr, "pscheck: %d datagrams held at %d bytes\n", ps.queued, pos);
+      failed++;
+    }
+    /* dvbstream flushes once per read, after many writes */
+    if (++writes % 16 == 0)
+      pspkt_flush(&ps);
+
+    if (receive(rx, &hdr) < 0)
+      return 1;
+  }
+
+  pspkt_flush(&ps);
+  if (receive(rx, &hdr) < 0)
+    return 1;
+  if (datagrams != len / PAYLOAD) {
+    fprintf(stderr, "pscheck: %d of %d datagrams came\n", datagrams, len / PAYLOAD);
+    failed++;
+  }
+  if (ps.wraps == 0) {
+    fprintf(stderr, "pscheck: the ring never wrapped\n");
+    failed++;
+  }
+  if (maxrss() - rss > 1024) {
+    fprintf(stderr, "pscheck: memory grew by %ld kbytes\n", maxrss() - rss);
+    failed++;
+  }
+  printf("pscheck: %d bytes in %d pack headers, %d datagrams, %llu ring wraps, %d errors\n",
+         len, npacks, datagrams, (unsigned long long)ps.wraps, failed);
+  pspkt_free(&ps);
+  return failed ? 1 : 0;
+}
@@ -0,0 +1,251 @@
+/*
+ * psi.c: collecting and checking the PSI/SI sections of a transport stream.
+ *
+ * The PAT, PMTs and SDT are repeated several times a second but hardly
+ * ever change.  Each table keeps the sections of its current version, so
+ * a repeat is recognised from its header and CRC field and dropped
+ * before anything else is done with it; only a new or changed section
+ * has its CRC32 checked and is handed on for parsing.  Tables that span
+ * several sections are only reported once all of them have arrived.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "psi.h"
+
+#define TS_PACKET 188
+#define CRC_POLY 0x04c11db7
+
+/* MPEG-2 CRC32 (ISO 13818-1 annex A), eight bytes at a time: crc_table[k]
+   is the CRC of a byte followed by k zero bytes */
+static uint32_t crc_table[8][256];
+static int crc_ready = 0;
+
+static void crc_init(void)
+{
+  uint32_t c;
+  int i, j, k;
+
+  for (i = 0; i < 256; i++) {
+    c = (uint32_t)i << 24;
+    for (j = 0; j < 8; j++)
+      c = (c << 1) ^ ((c & 0x80000000) ? CRC_POLY : 0);
+    crc_table[0][i] = c;
+  }
+  for (k = 1; k < 8; k++) {
+    for (i = 0; i < 256; i++) {
+      c = crc_table[k-1][i];
+      crc_table[k][i] = (c << 8) ^ crc_table[0][c >> 24];
+    }
+  }
+  crc_ready = 1;
+}
+
+/* 0 for a section with a good CRC32 at its end */
+uint32_t psi_crc32(const uint8_t *p, int len)
+{
+  uint32_t crc = 0xffffffff, a;
+
+  if (!crc_ready)
+    crc_init();
+  while (len >= 8) {
+    a = crc ^ ((uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3]);
+    crc = crc_table[7][a >> 24] ^ crc_table[6][(a >> 16) & 0xff]
+        ^ crc_table[5][(a >> 8) & 0xff] ^ crc_table[4][a & 0xff]
+        ^ crc_table[3][p[4]] ^ crc_table[2][p[5]]
+        ^ crc_table[1][p[6]] ^ crc_table[0][p[7]];
+    p += 8;
+    len -= 8;
+  }
+  while (len-- > 0)
+    crc = (crc << 8) ^ crc_table[0][(crc >> 24) ^ *p++];
+  return crc;
+}
+
+void psi_assembler_init(psi_assembler_t *a, psi_stats_t *stats)
+{
+  a->pos = 0;
+  a->need = 0;
+  a->cc = -1;
+  a->stats = stats;
+}
+
+/* Add up to len bytes to the section being collected, handing it to cb
+   once it is complete.  Returns how many bytes were used. */
+static int collect(psi_assembler_t *a, uint8_t *p, int len, psi_section_cb cb, void *arg)
+{
+  int n, used = 0;
+
+  for (;;) {
+    n = (a->pos < 3 ? 3 : a->need) - a->pos;
+    if (n > len - used) n = len - used;
+    memcpy(a->buf + a->pos, p + used, n);
+    a->pos += n;
+    used += n;
+    if (a->pos < 3)
+      return used;
+    if (a->pos == 3) {
+      a->need = 3 + (((a->buf[1] & 0x0f) << 8) | a->buf[2]);
+      if (a->need > PSI_SECTION_MAX) {
+        a->pos = 0;
+        return len;
+      }
+    }
+    if (a->pos < a->need) {
+      if (used == len)
+        return used;
+      continue;
+    }
+    a->pos = 0;
+    cb(arg, a->buf, a->need);
+    return used;
+  }
+}
+
+/* Feed one TS packet of the PID.  Returns the number of sections
+   completed. */
+int psi_packet(psi_assembler_t *a, uint8_t *pkt, psi_section_cb cb, void *arg)
+{
+  int af, cc, l, ptr, n = 0;
+
+  af = (pkt[3] >> 4) & 0x03;
+  if (!(af & 1))              // no payload
+    return 0;
+  l = 4;
+  if (af == 3)
+    l += pkt[4] + 1;
+  if (l >= TS_PACKET)
+    return 0;
+
+  cc = pkt[3] & 0x0f;
+  if (cc == a->cc)            // a repeated packet
+    return 0;
+  if (a->cc >= 0 && cc != ((a->cc + 1) & 0x0f) && a->pos > 0) {
+    a->pos = 0;               // lost the middle of a section
+    if (a->stats) a->stats->discontinuities++;
+  }
+  a->cc = cc;
+
+  if (!(pkt[1] & 0x40)) {
+    /* Carries on with the section started earlier, if there is one */
+    if (a->pos > 0 && collect(a, pkt + l, TS_PACKET - l, cb, arg) > 0 && a->pos == 0)
+      n++;
+    return n;
+  }
+
+  /* The pointer field says where the first new section starts; the
+     bytes before it finish the previous one */
+  ptr = pkt[l++];
+  if (l + ptr >= TS_PACKET) {
+    a->pos = 0;
+    return 0;
+  }
+  if (a->pos > 0) {
+    collect(a, pkt + l, ptr, cb, arg);
+    if (a->pos == 0) n++;
+    a->pos = 0;
+  }
+  l += ptr;
+  while (l < TS_PACKET && pkt[l] != 0xff) {
+    l += collect(a, pkt + l, TS_PACKET - l, cb, arg);
+    if (a->pos > 0)           // runs on into the next packet
+      break;
+    n++;
+  }
+  return n;
+}
+
+void psi_table_init(psi_table_t *t, int table_id, int ext, psi_stats_t *stats)
+{
+  memset(t, 0, sizeof(psi_table_t));
+  t->table_id = table_id;
+  t->ext = ext;
+  t->version = -1;
+  t->stats = stats;
+}
+
+static void drop_sections(psi_table_t *t)
+{
+  int i;
+
+  for (i = 0; i < PSI_MAX_SECTIONS; i++) {
+    free(t->sec[i]);
+    t->sec[i] = NULL;
+    t->len[i] = 0;
+  }
+  t->cnt = 0;
+  t->complete = 0;
+}
+
+/* Add a complete section to the table */
+int psi_table_add(psi_table_t *t, uint8_t *sec, int len)
+{
+  int ext, version, num, last;
+  uint8_t *p;
+
+  if (len < 12 || sec[0] != t->table_id || !(sec[1] & 0x80))
+    return PSI_INCOMPLETE;
+  ext = (sec[3] << 8) | sec[4];
+  if (t->ext >= 0 && ext != t->ext)
+    return PSI_INCOMPLETE;
+  if (!(sec[5] & 1))          // not valid yet
+    return PSI_INCOMPLETE;
+
+  version = (sec[5] >> 1) & 0x1f;
+  num = sec[6];
+  last = sec[7];
+  if (num > last)
+    return PSI_BAD;
+  if (t->stats) t->stats->sections++;
+
+  /* Monitoring wants every CRC error, repeats or not */
+  if (t->stats && t->stats->check_repeats && psi_crc32(sec, len) != 0) {
+    t->stats->crc_errors++;
+    return PSI_BAD;
+  }
+
+  /* A repeat of a section we have: the CRC field is as good as a
+     checksum over the whole thing */
+  if (version == t->version && last == t->last_section && t->sec[num] != NULL
+      && t->len[num] == len && memcmp(t->sec[num] + len - 4, sec + len - 4, 4) == 0) {
+    if (t->stats) t->stats->unchanged++;
+    return t->complete ? PSI_UNCHANGED : PSI_INCOMPLETE;
+  }
+
+  if (psi_crc32(sec, len) != 0) {
+    if (t->stats) t->stats->crc_errors++;
+    return PSI_BAD;
+  }
+
+  if (version != t->version || last != t->last_section) {
+    drop_sections(t);
+    t->version = version;
+    t->last_section = last;
+    if (t->stats) t->stats->versions++;
+  }
+  if ((p = realloc(t->sec[num], len)) == NULL)
+    return PSI_BAD;
+  if (t->sec[num] == NULL)
+    t->cnt++;
+  memcpy(p, sec, len);
+  t->sec[num] = p;
+  t->len[num] = len;
+
+  if (t->cnt == t->last_section + 1) {
+    t->complete = 1;
+    return PSI_CHANGED;
+  }
+  return PSI_INCOMPLETE;
+}
+
+void psi_table_free(psi_table_t *t)
+{
+  drop_sections(t);
+  t->version = -1;
+}
@@ -0,0 +1,63 @@
+#ifndef _PSI_H
+#define _PSI_H
+
+#include <stdint.h>
+
+/* Longest section: 3 bytes of header and a 12 bit length (private
+   sections), PSI tables stop at 1024 */
+#define PSI_SECTION_MAX 4096
+#define PSI_MAX_SECTIONS 256
+
+/* What psi_table_add() made of a section */
+#define PSI_BAD -1             /* CRC error or nonsense */
+#define PSI_INCOMPLETE 0       /* not for this table, or more to come */
+#define PSI_UNCHANGED 1        /* the table is as it was */
+#define PSI_CHANGED 2          /* a new version of the table is complete */
+
+typedef struct {
+  uint64_t sections;           /* sections given to the tables */
+  uint64_t unchanged;          /* skipped as already seen */
+  uint64_t crc_errors;
+  uint64_t versions;           /* new versions of tables */
+  uint64_t discontinuities;    /* sections lost to missing packets */
+  int check_repeats;           /* set: check the CRC of repeats too */
+} psi_stats_t;
+
+/* Gathers the sections carried on one PID from its TS packets.  Several
+   sections may start in one packet, and a section may run over many. */
+typedef struct {
+  uint8_t buf[PSI_SECTION_MAX];
+  int pos;                     /* bytes of the section so far, 0: none */
+  int need;                    /* its length, once known */
+  int cc;                      /* continuity counter of the last packet */
+  psi_stats_t *stats;
+} psi_assembler_t;
+
+typedef int (*psi_section_cb)(void *arg, uint8_t *sec, int len);
+
+/* A table made of one or more sections.  The sections of the current
+   version are kept, so one that is repeated - as they all are, several
+   times a second - is recognised by its header and CRC and skipped
+   without being checked or parsed again. */
+typedef struct {
+  int table_id;
+  int ext;                     /* table_id_extension wanted, -1: any */
+  int version;                 /* of the sections held, -1: none */
+  int last_section;
+  int cnt;                     /* sections held */
+  int complete;
+  uint8_t *sec[PSI_MAX_SECTIONS];
+  int len[PSI_MAX_SECTIONS];
+  psi_stats_t *stats;
+} psi_table_t;
+
+uint32_t psi_crc32(const uint8_t *p, int len);
+
+void psi_assembler_init(psi_assembler_t *a, psi_stats_t *stats);
+int psi_packet(psi_assembler_t *a, uint8_t *pkt, psi_section_cb cb, void *arg);
+
+void psi_table_init(psi_table_t *t, int table_id, int ext, psi_stats_t *stats);
+int psi_table_add(psi_table_t *t, uint8_t *sec, int len);
+void psi_table_free(psi_table_t *t);
+
+#endif
@@ -0,0 +1,376 @@
+/*
+ * record.c: writing -o: recordings to disk in large blocks.
+ *
+ * Packets for a recording are gathered into REC_BLOCK byte, page aligned
+ * blocks and each block is written with a single request, so the disk
+ * sees a few large writes instead of a 188 byte write() per packet.
+ * Short writes are continued where they stopped.
+ *
+ * Built with "make URING=1" and run with -uring, the blocks are written
+ * with io_uring from registered buffers, so the caller never waits for
+ * the disk until all REC_BLOCKS blocks are in flight.  What happens then
+ * is the recording's policy: REC_WAIT waits for a write to finish,
+ * REC_DROP throws packets away and counts them.
+ *
+ * A recording can be carried on in a new file (record_reopen()) to
+ * split it into pieces, and the disk space for each file can be taken
+ * up front (record_preallocate()) so a file written a little at a time
+ * alongside others isn't fragmented; what is left over is given back
+ * when the file is closed.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include "record.h"
+
+/* Open filename for the recording, from the start */
+static int open_file(recorder_t *rec, char *filename)
+{
+  int flags = O_WRONLY|O_CREAT|O_TRUNC;
+
+  rec->filename = filename;
+  rec->offset = 0;
+  rec->direct = 0;
+  if (rec->want_direct) {
+    rec->fd = open(filename, flags|O_DIRECT, 0644);
+    if (rec->fd >= 0) {
+      rec->direct = rec->opened_direct = 1;
+    } else if (errno == EINVAL) {
+      fprintf(stderr, "%s: O_DIRECT not supported here, using buffered writes\n", filename);
+      rec->want_direct = 0;
+    }
+  }
+  if (!rec->direct)
+    rec->fd = open(filename, flags, 0644);
+  if (rec->fd < 0)
+    return -1;
+  if (rec->prealloc > 0)
+    fallocate(rec->fd, FALLOC_FL_KEEP_SIZE, 0, rec->prealloc);
+  return 0;
+}
+
+int record_open(recorder_t *rec, char *filename, int direct, int use_uring, int policy)
+{
+  int i;
+  void *p;
+
+  memset(rec, 0, sizeof(recorder_t));
+  rec->policy = policy;
+  rec->want_direct = direct;
+  if (open_file(rec, filename) < 0)
+    return -1;
+
+  /* Writing synchronously, one block is all it takes */
+  rec->nblocks = 1;
+#ifdef HAVE_URING
+  if (use_uring) {
+    rec->ring = malloc(sizeof(uring_t));
+    if (rec->ring == NULL || uring_init(rec->ring, REC_BLOCKS) < 0) {
+      fprintf(stderr, "%s: can't use io_uring, writing synchronously\n", filename);
+      free(rec->ring);
+      rec->ring = NULL;
+    } else {
+      rec->async = 1;
+      rec->nblocks = REC_BLOCKS;
+    }
+  }
+#else
+  if (use_uring)
+    fprintf(stderr, "%s: built without io_uring support (make URING=1)\n", filename);
+#endif
+
+  for (i = 0; i < rec->nblocks; i++) {
+    if (posix_memalign(&p, REC_ALIGN, REC_BLOCK) != 0) {
+      record_close(rec);
+      return -1;
+    }
+    rec->blocks[i].buf = p;
+  }
+
+#ifdef HAVE_URING
+  if (rec->async) {
+    struct iovec iov[REC_BLOCKS];
+
+    for (i = 0; i < rec->nblocks; i++) {
+      iov[i].iov_base = rec->blocks[i].buf;
+      iov[i].iov_len = REC_BLOCK;
+    }
+    rec->fixed = (uring_register_buffers(rec->ring, iov, rec->nblocks) == 0);
+  }
+#endif
+  return 0;
+}
+
+off_t record_tell(recorder_t *rec)
+{
+  return rec->offset + rec->blocks[rec->cur].len;
+}
+
+off_t record_written(recorder_t *rec)
+{
+  off_t off = rec->offset;
+  int i;
+
+  for (i = 0; i < rec->nblocks; i++) {
+    if (rec->blocks[i].busy && rec->blocks[i].offset < off)
+      off = rec->blocks[i].offset;
+  }
+  return off;
+}
+
+void record_preallocate(recorder_t *rec, off_t bytes)
+{
+  rec->prealloc = bytes;
+  if (rec->fd >= 0 && rec->offset == 0 && bytes > 0)
+    fallocate(rec->fd, FALLOC_FL_KEEP_SIZE, 0, bytes);
+}
+
+/* A short O_DIRECT write leaves the rest of the block unaligned, so carry
+   on without O_DIRECT */
+static void drop_direct(recorder_t *rec)
+{
+  int flags;
+
+  if (!rec->direct)
+    return;
+  flags = fcntl(rec->fd, F_GETFL);
+  fcntl(rec->fd, F_SETFL, flags & ~O_DIRECT);
+  rec->direct = 0;
+}
+
+/* Write the rest of block b and wait for it */
+static void write_sync(recorder_t *rec, rec_block_t *b)
+{
+  int r;
+
+  while (b->done < b->len) {
+    r = pwrite(rec->fd, b->buf + b->done, b->len - b->done, b->offset + b->done);
+    rec->writes++;
+    if (r < 0) {
+      if (errno == EINTR || errno == EAGAIN) continue;
+      if (errno == EINVAL && rec->direct) {
+        drop_direct(rec);
+        continue;
+      }
+      perror(rec->filename);
+      rec->errors++;
+      break;
+    }
+    if (r < b->len - b->done) {
+      rec->short_writes++;
+      drop_direct(rec);
+    }
+    b->done += r;
+    rec->bytes += r;
+  }
+  b->len = b->done = 0;
+}
+
+#ifdef HAVE_URING
+/* Queue the rest of block b.  Returns -1 if the ring can't take it. */
+static int submit_block(recorder_t *rec, rec_block_t *b)
+{
+  struct io_uring_sqe *sqe = uring_sqe(rec->ring);
+
+  if (sqe == NULL)
+    return -1;
+  sqe->opcode = rec->fixed ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+  sqe->fd = rec->fd;
+  sqe->addr = (unsigned long)(b->buf + b->done);
+  sqe->len = b->len - b->done;
+  sqe->off = b->offset + b->done;
+  sqe->buf_index = b - rec->blocks;
+  sqe->user_data = b - rec->blocks;
+  rec->writes++;
+  return uring_submit(rec->ring, 0) < 0 ? -1 : 0;
+}
+#endif
+
+/* Start writing block b at the current end of the recording */
+static void start_block(recorder_t *rec, rec_block_t *b)
+{
+  b->offset = rec->offset;
+  b->done = 0;
+  rec->offset += b->len;
+#ifdef HAVE_URING
+  if (rec->ring != NULL && submit_block(rec, b) == 0) {
+    b->busy = 1;
+    rec->inflight++;
+    return;
+  }
+#endif
+  write_sync(rec, b);
+}
+
+/* Deal with the writes that have finished */
+void record_poll(recorder_t *rec)
+{
+#ifdef HAVE_URING
+  struct io_uring_cqe *cqe;
+  rec_block_t *b;
+  int res;
+
+  if (rec->ring == NULL)
+    return;
+  while ((cqe = uring_cqe(rec->ring)) != NULL) {
+    b = &rec->blocks[cqe->user_data];
+    res = cqe->res;
+    uring_cqe_seen(rec->ring);
+
+    if (res < 0) {
+      if (res == -EINVAL && rec->direct) {
+        drop_direct(rec);
+      } else if (res != -EINTR && res != -EAGAIN) {
+        errno = -res;
+        perror(rec->filename);
+        rec->errors++;
+        b->done = b->len;         // give up on the block
+      }
+    } else {
+      if (res < b->len - b->done) {
+        rec->short_writes++;
+        drop_direct(rec);
+      }
+      b->done += res;
+      rec->bytes += res;
+    }
+
+    if (b->done < b->len && submit_block(rec, b) == 0)
+      continue;
+    if (b->done < b->len)
+      write_sync(rec, b);
+    b->len = b->done = 0;
+    b->busy = 0;
+    rec->inflight--;
+  }
+#endif
+}
+
+/* Wait until block b has been written */
+static void wait_block(recorder_t *rec, rec_block_t *b)
+{
+  while (b->busy) {
+#ifdef HAVE_URING
+    if (uring_submit(rec->ring, 1) < 0)
+      break;
+#endif
+    record_poll(rec);
+  }
+}
+
+/* Add packets to the recording.  They are copied, so the caller may
+   reuse the memory straight away. */
+void record_write(recorder_t *rec, struct iovec *iov, int cnt)
+{
+  rec_block_t *b, *next;
+  int i, len, n, room;
+  uint8_t *p;
+
+  if (rec->fd < 0)
+    return;
+  if (rec->inflight)
+    record_poll(rec);
+
+  for (i = 0; i < cnt; i++) {
+    p = iov[i].iov_base;
+    len = iov[i].iov_len;
+    b = &rec->blocks[rec->cur];
+    next = &rec->blocks[(rec->cur + 1) % rec->nblocks];
+
+    /* Don't start a packet we can't finish */
+    if (b->busy || (len > REC_BLOCK - b->len && next->busy)) {
+      if (rec->policy == REC_DROP) {
+        rec->dropped++;
+        continue;
+      }
+      rec->waits++;
+      wait_block(rec, b);
+      if (len > REC_BLOCK - b->len)
+        wait_block(rec, next);
+    }
+
+    while (len > 0) {
+      room = REC_BLOCK - b->len;
+      n = (len < room) ? len : room;
+      memcpy(b->buf + b->len, p, n);
+      b->len += n;
+      p += n;
+      len -= n;
+      if (b->len == REC_BLOCK) {
+        start_block(rec, b);
+        rec->cur = (rec->cur + 1) % rec->nblocks;
+        b = &rec->blocks[rec->cur];
+      }
+    }
+  }
+}
+
+/* Write whatever is left and close the file */
+static void finish_file(recorder_t *rec)
+{
+  rec_block_t *b;
+  int i;
+
+  if (rec->fd < 0)
+    return;
+  for (i = 0; i < rec->nblocks; i++)
+    wait_block(rec, &rec->blocks[i]);
+  b = &rec->blocks[rec->cur];
+  if (b->len > 0) {
+    /* The last block is usually a partial one */
+    drop_direct(rec);
+    b->offset = rec->offset;
+    b->done = 0;
+    rec->offset += b->len;
+    write_sync(rec, b);
+  }
+  /* Give back what was preallocated and not used */
+  if (rec->prealloc > rec->offset && ftruncate(rec->fd, rec->offset) < 0)
+    rec->errors++;
+  close(rec->fd);
+  rec->fd = -1;
+}
+
+int record_reopen(recorder_t *rec, char *filename)
+{
+  finish_file(rec);
+  rec->cur = 0;
+  return open_file(rec, filename);
+}
+
+void record_close(recorder_t *rec)
+{
+  int i;
+
+  finish_file(rec);
+#ifdef HAVE_URING
+  if (rec->ring != NULL) {
+    uring_free(rec->ring);
+    free(rec->ring);
+    rec->ring = NULL;
+  }
+#endif
+  for (i = 0; i < rec->nblocks; i++) {
+    free(rec->blocks[i].buf);
+    rec->blocks[i].buf = NULL;
+  }
+}
+
+void record_report(recorder_t *rec, FILE *f)
+{
+  fprintf(f, "record %s: %llu bytes in %llu writes (%s%s), %llu short writes, %llu packets dropped, waited %llu times, %llu errors\n",
+          rec->filename, (unsigned long long)rec->bytes, (unsigned long long)rec->writes,
+          rec->async ? "io_uring" : "sync", rec->opened_direct ? ", O_DIRECT" : "",
+          (unsigned long long)rec->short_writes, (unsigned long long)rec->dropped,
+          (unsigned long long)rec->waits, (unsigned long long)rec->errors);
+}
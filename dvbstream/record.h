@@ -0,0 +1,78 @@
+#ifndef _RECORD_H
+#define _RECORD_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "uring.h"
+
+/* Recordings are written in blocks of REC_BLOCK bytes, aligned for
+   O_DIRECT.  With io_uring up to REC_BLOCKS of them can be in flight. */
+#define REC_BLOCK (1024*1024)
+#define REC_BLOCKS 8
+#define REC_ALIGN 4096
+
+/* What to do when every block is waiting to be written */
+#define REC_DROP 0           /* throw the new packets away */
+#define REC_WAIT 1           /* wait for the disk */
+
+typedef struct {
+  uint8_t *buf;
+  int len;                   /* bytes in the block */
+  int done;                  /* bytes of it already written */
+  off_t offset;              /* where it goes in the file */
+  int busy;                  /* being written */
+} rec_block_t;
+
+/* A file being recorded.  Packets are copied into the current block and
+   the block is written once it is full - synchronously, or with
+   io_uring queued behind the blocks already on their way to the disk. */
+typedef struct {
+  int fd;
+  char *filename;
+  int want_direct;           /* asked for O_DIRECT */
+  int opened_direct;         /* opened with O_DIRECT */
+  int direct;                /* still using it */
+  int policy;
+  int async;                 /* writing through io_uring */
+  int fixed;                 /* blocks registered with the ring */
+  rec_block_t blocks[REC_BLOCKS];
+  int nblocks;               /* in use: REC_BLOCKS with io_uring, else 1 */
+  int cur;                   /* block being filled */
+  off_t offset;              /* file offset of the block being filled */
+  int inflight;
+  off_t prealloc;            /* disk space taken for each file */
+#ifdef HAVE_URING
+  uring_t *ring;
+#else
+  void *ring;
+#endif
+
+  /* statistics */
+  uint64_t bytes;            /* written to the file */
+  uint64_t writes;           /* write requests issued */
+  uint64_t short_writes;     /* writes that had to be continued */
+  uint64_t dropped;          /* packets thrown away */
+  uint64_t waits;            /* times we had to wait for a free block */
+  uint64_t errors;
+} recorder_t;
+
+int record_open(recorder_t *rec, char *filename, int direct, int use_uring, int policy);
+void record_write(recorder_t *rec, struct iovec *iov, int cnt);
+void record_poll(recorder_t *rec);
+void record_close(recorder_t *rec);
+/* How far into the file the packets written so far go */
+off_t record_tell(recorder_t *rec);
+/* How much of the file is on the disk: not the block being filled, nor
+   any still in flight */
+off_t record_written(recorder_t *rec);
+/* Take bytes of disk for the file up front, and for each one after */
+void record_preallocate(recorder_t *rec, off_t bytes);
+/* Finish the file and carry on in filename.  Returns 0, or -1 if it
+   can't be opened (and the packets are then thrown away). */
+int record_reopen(recorder_t *rec, char *filename);
+void record_report(recorder_t *rec, FILE *f);
+
+#endif
@@ -6,7 +6,13 @@
 #include <stdio.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <arpa/inet.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <netdb.h>
+#include <net/if.h>
+#include <sys/time.h>
 
 /* MPEG-2 TS RTP stack */
 
@@ -53,6 +59,22 @@
 */
 
 
+/* A random number that differs between outputs and between runs, unlike
+   rand() unseeded - two senders with the same SSRC confuse receivers */
+unsigned int rtp_random(void) {
+  static int fd = -2;
+  unsigned int r;
+  struct timeval tv;
+
+  if (fd == -2)
+    fd = open("/dev/urandom", O_RDONLY);
+  if (fd >= 0 && read(fd, &r, sizeof(r)) == sizeof(r))
+    return r;
+  gettimeofday(&tv, NULL);
+  srand(tv.tv_sec ^ tv.tv_usec ^ getpid() ^ rand());
+  return rand();
+}
+
 void initrtp(struct rtpheader *foo,int pt, int type) { /* fill in the MPEG-2 TS deefaults */
   /* Note: MPEG-2 TS defines a timestamping base frequency of 90000 Hz. */
   foo->b.v=2;
@@ -61,14 +83,15 @@ void initrtp(struct rtpheader *foo,int pt, int type) { /* fill in the MPEG-2 TS
   foo->b.cc=0;
   foo->b.m=0;
   foo->b.pt=pt;
-  foo->b.sequence=rand() & 65535;
-  foo->timestamp=rand();
-  foo->ssrc=rand();
+  foo->b.sequence=rtp_random() & 65535;
+  foo->ts_offset=rtp_random();
+  foo->timestamp=foo->ts_offset;
+  foo->ssrc=rtp_random();
   foo->type = type;
 }
 
 /* Send a single RTP packet, converting the RTP header to network byte order. */
-int sendrtp(int fd, struct sockaddr_in *sSockAddr, struct rtpheader *foo, char *data, int len) {
+int sendrtp(int fd, struct sockaddr_storage *sSockAddr, struct rtpheader *foo, char *data, int len) {
   char *buf=(char*)alloca(len+sizeof(struct rtpheader));
   int *cast=(int *)foo;
   int *outcast=(int *)buf;
@@ -76,7 +99,7 @@ int sendrtp(int fd, struct sockaddr_in *sSockAddr, struct rtpheader *foo, char *
   outcast[1]=htonl(cast[1]);
   memmove(outcast+2,data,len);
   fprintf(stderr,"v=%x %x\n",foo->b.v,buf[0]);
-  return sendto(fd,buf,len+3,0,(struct sockaddr *)sSockAddr,sizeof(*sSockAddr));
+  return sendto(fd,buf,len+3,0,(struct sockaddr *)sSockAddr,rtp_addrlen(sSockAddr));
 }
 
 int getrtp2(int fd, struct rtpheader *rh, char** data, int* lengthData) {
@@ -108,6 +131,8 @@ int getrtp2(int fd, struct rtpheader *rh, char** data, int* lengthData) {
   intP = 0;
   memcpy(charP,&buf[4],4);
   rh->timestamp = ntohl(intP);
+  memcpy(charP,&buf[8],4);
+  rh->ssrc = ntohl(intP);
 
   headerSize = 12 + 4*rh->b.cc; /* in bytes */
 
@@ -120,14 +145,12 @@ int getrtp2(int fd, struct rtpheader *rh, char** data, int* lengthData) {
 }
 
 
-/* Send a single RTP packet, converting the RTP header to network byte order. */
-int sendrtp2(int fd, struct sockaddr_in *sSockAddr, struct rtpheader *foo, char *data, int len) {
-  char *buf;
+/* Write the RTP header in network byte order into buf, which must hold at
+   least RTP_HEADER_LEN bytes.  Returns the header size. */
+int rtp_pack_header(struct rtpheader *foo, unsigned char *buf) {
   unsigned int intP;
   char* charP = (char*) &intP;
-  int headerSize;
-  if(foo->type == RTP) {
-  buf=(char*)alloca(len+72);
+
   buf[0]  = 0x00;
   buf[0] |= ((((char) foo->b.v)<<6)&0xc0);
   buf[0] |= ((((char) foo->b.p)<<5)&0x20);
@@ -140,22 +163,130 @@ int sendrtp2(int fd, struct sockaddr_in *sSockAddr, struct rtpheader *foo, char
   memcpy(&buf[2],charP+2,2);
   intP = htonl(foo->timestamp);
   memcpy(&buf[4],&intP,4);
-  /* SSRC: not implemented */
-  buf[8]  = 0x0f;
-  buf[9]  = 0x0f;
-  buf[10] = 0x0f;
-  buf[11] = 0x0f;
-  headerSize = 12 + 4*foo->b.cc; /* in bytes */
-  memcpy(buf+headerSize,data,len);
+  intP = htonl(foo->ssrc);
+  memcpy(&buf[8],&intP,4);
+
+  //  fprintf(stderr,"Sending rtp: v=%x p=%x x=%x cc=%x m=%x pt=%x seq=%x ts=%x\n",foo->b.v,foo->b.p,foo->b.x,foo->b.cc,foo->b.m,foo->b.pt,foo->b.sequence,foo->timestamp);
+
+  return 12 + 4*foo->b.cc; /* in bytes */
+}
+
+static void put32(unsigned char *p, unsigned int v) {
+  p[0] = v >> 24; p[1] = v >> 16; p[2] = v >> 8; p[3] = v;
+}
+
+static unsigned int get32(unsigned char *p) {
+  return ((unsigned int)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
 
-  //  fprintf(stderr,"Sending rtp: v=%x p=%x x=%x cc=%x m=%x pt=%x seq=%x ts=%x lgth=%d\n",foo->b.v,foo->b.p,foo->b.x,foo->b.cc,foo->b.m,foo->b.pt,foo->b.sequence,foo->timestamp,len+headerSize);
+/* Build an RTCP compound packet - a sender report and a CNAME - in buf,
+   which must hold RTCP_MAX_LEN bytes.  Returns its length. */
+int rtcp_pack_sr(struct rtcp_sr *sr, const char *cname, unsigned char *buf) {
+  int n, len = strlen(cname);
+
+  if (len > RTCP_MAX_LEN - 42) len = RTCP_MAX_LEN - 42;
+  buf[0] = 0x80;                /* V=2, no reception reports */
+  buf[1] = RTCP_SR;
+  buf[2] = 0;
+  buf[3] = 6;                   /* length in words - 1 */
+  put32(buf+4, sr->ssrc);
+  put32(buf+8, sr->ntp_sec);
+  put32(buf+12, sr->ntp_frac);
+  put32(buf+16, sr->rtp_ts);
+  put32(buf+20, sr->packets);
+  put32(buf+24, sr->octets);
+
+  put32(buf+32, sr->ssrc);
+  buf[36] = 1;                  /* CNAME */
+  buf[37] = len;
+  memcpy(buf+38, cname, len);
+  n = 38 + len;
+  /* The items end with a zero, padded out to a word */
+  do {
+    buf[n++] = 0;
+  } while (n % 4);
+  buf[28] = 0x81;               /* V=2, one chunk */
+  buf[29] = RTCP_SDES;
+  buf[30] = 0;
+  buf[31] = (n - 28) / 4 - 1;
+  return n;
+}
 
-  foo->b.sequence++;
-  } else {	//UDP
-    buf = data;
-    headerSize = 0;
+/* Pick the sender report out of an RTCP packet.  Returns 0 if there was
+   one. */
+int rtcp_parse_sr(unsigned char *buf, int len, struct rtcp_sr *sr) {
+  int n;
+
+  while (len >= 4) {
+    n = ((buf[2] << 8) | buf[3]) * 4 + 4;
+    if ((buf[0] & 0xc0) != 0x80 || n > len)
+      return -1;
+    if (buf[1] == RTCP_SR && n >= 28) {
+      sr->ssrc = get32(buf+4);
+      sr->ntp_sec = get32(buf+8);
+      sr->ntp_frac = get32(buf+12);
+      sr->rtp_ts = get32(buf+16);
+      sr->packets = get32(buf+20);
+      sr->octets = get32(buf+24);
+      return 0;
+    }
+    buf += n;
+    len -= n;
   }
-  return sendto(fd,buf,len+headerSize,0,(struct sockaddr *)sSockAddr,sizeof(*sSockAddr));
+  return -1;
+}
+
+/* Account for a packet that arrived at now (seconds since 1970) */
+void rtp_stats_update(struct rtp_stats *st, struct rtpheader *rh, double now) {
+  double sent;
+  int arrival, transit, d;
+
+  /* RFC 3550 6.4.1, both times in 90 kHz units */
+  arrival = (int)(unsigned int)(long long)(now * 90000);
+  transit = arrival - rh->timestamp;
+  if (st->have_ts) {
+    d = transit - st->transit;
+    if (d < 0) d = -d;
+    st->jitter += (d - st->jitter) / 16.0;
+  }
+  st->transit = transit;
+  st->have_ts = 1;
+
+  /* The sender's wall clock time for this timestamp, from its last
+     report.  Only meaningful if the two clocks are in step. */
+  if (st->have_sr && rh->ssrc == (int)st->sr.ssrc) {
+    sent = (st->sr.ntp_sec - 2208988800U) + st->sr.ntp_frac / 4294967296.0
+         + (int)(rh->timestamp - st->sr.rtp_ts) / 90000.0;
+    st->latency = now - sent;
+    if (st->latency > st->max_latency)
+      st->max_latency = st->latency;
+  }
+}
+
+/* Send a single RTP packet.  The header and the payload go to the kernel
+   as separate iovecs, so the payload is never copied. */
+int sendrtp2(int fd, struct sockaddr_storage *sSockAddr, struct rtpheader *foo, char *data, int len) {
+  unsigned char buf[RTP_HEADER_LEN];
+  struct iovec iov[2];
+  struct msghdr msg;
+  int n=0;
+
+  if(foo->type == RTP) {
+    iov[n].iov_base = buf;
+    iov[n].iov_len = rtp_pack_header(foo,buf);
+    n++;
+    foo->b.sequence++;
+  }
+  iov[n].iov_base = data;
+  iov[n].iov_len = len;
+  n++;
+
+  memset(&msg,0,sizeof(msg));
+  msg.msg_name = sSockAddr;
+  msg.msg_namelen = rtp_addrlen(sSockAddr);
+  msg.msg_iov = iov;
+  msg.msg_iovlen = n;
+  return sendmsg(fd,&msg,0);
 }
 
 
@@ -172,66 +303,250 @@ int getrtp(int fd, struct rtpheader *rh, char** data, int* lengthData) {
   return(0);
 }
 
+/* Addresses: IPv4 or IPv6, told apart by their family */
+
+socklen_t rtp_addrlen(const struct sockaddr_storage *a) {
+  return a->ss_family == AF_INET6 ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in);
+}
+
+int rtp_getport(const struct sockaddr_storage *a) {
+  if (a->ss_family == AF_INET6)
+    return ntohs(((struct sockaddr_in6 *)a)->sin6_port);
+  return ntohs(((struct sockaddr_in *)a)->sin_port);
+}
+
+void rtp_setport(struct sockaddr_storage *a, int port) {
+  if (a->ss_family == AF_INET6)
+    ((struct sockaddr_in6 *)a)->sin6_port = htons(port);
+  else
+    ((struct sockaddr_in *)a)->sin_port = htons(port);
+}
+
+int rtp_ismulticast(const struct sockaddr_storage *a) {
+  if (a->ss_family == AF_INET6)
+    return IN6_IS_ADDR_MULTICAST(&((struct sockaddr_in6 *)a)->sin6_addr);
+  return IN_MULTICAST(ntohl(((struct sockaddr_in *)a)->sin_addr.s_addr));
+}
+
+/* Whether a and b are the same host, whatever their ports */
+int rtp_samehost(const struct sockaddr_storage *a, const struct sockaddr_storage *b) {
+  if (a->ss_family != b->ss_family)
+    return 0;
+  if (a->ss_family == AF_INET6)
+    return memcmp(&((struct sockaddr_in6 *)a)->sin6_addr, &((struct sockaddr_in6 *)b)->sin6_addr,
+                  sizeof(struct in6_addr)) == 0;
+  return ((struct sockaddr_in *)a)->sin_addr.s_addr == ((struct sockaddr_in *)b)->sin_addr.s_addr;
+}
+
+/* a as "addr:port", or "[addr]:port" for IPv6, in buf of size len */
+char *rtp_addrstr(const struct sockaddr_storage *a, char *buf, int len) {
+  char host[INET6_ADDRSTRLEN];
+
+  if (a->ss_family == AF_INET6) {
+    inet_ntop(AF_INET6, &((struct sockaddr_in6 *)a)->sin6_addr, host, sizeof(host));
+    snprintf(buf, len, "[%s]:%d", host, rtp_getport(a));
+  } else {
+    inet_ntop(AF_INET, &((struct sockaddr_in *)a)->sin_addr, host, sizeof(host));
+    snprintf(buf, len, "%s:%d", host, rtp_getport(a));
+  }
+  return buf;
+}
+
+/* A numeric IPv4 or IPv6 address (with %interface for a link-local one)
+   and a port.  Returns 0, or -1 if it isn't an address. */
+int rtp_parseaddr(const char *szAddr, unsigned short port, struct sockaddr_storage *a) {
+  struct addrinfo hints, *res;
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_DGRAM;
+  hints.ai_flags = AI_NUMERICHOST;
+  if (getaddrinfo(szAddr, NULL, &hints, &res) != 0)
+    return -1;
+  memset(a, 0, sizeof(*a));
+  memcpy(a, res->ai_addr, res->ai_addrlen);
+  freeaddrinfo(res);
+  rtp_setport(a, port);
+  return 0;
+}
+
+/* "addr:port", or "[addr]:port" for IPv6, split into addr (of size
+   len) and port.  Returns 0, or -1 if there is no port or addr is
+   too long. */
+int rtp_splitaddr(const char *s, char *addr, int len, int *port) {
+  const char *end, *colon;
+
+  if (s[0] == '[') {
+    s++;
+    if ((end = strchr(s, ']')) == NULL || end[1] != ':')
+      return -1;
+    colon = end + 1;
+  } else {
+    if ((colon = strrchr(s, ':')) == NULL)
+      return -1;
+    end = colon;
+  }
+  if (end - s >= len || colon[1] == 0)
+    return -1;
+  memcpy(addr, s, end - s);
+  addr[end - s] = 0;
+  *port = atoi(colon + 1);
+  return 0;
+}
+
+static void bad_setsockopt(const char *what) {
+  fprintf(stderr,"setsockopt %s failed: %s\n", what, strerror(errno));
+  exit(1);
+}
+
+/* Set a socket buffer, saying so if the kernel gives less than asked
+   for (it doubles the size, and caps it at net.core.[rw]mem_max) */
+static void set_buffer(int fd, int opt, int size, const char *what) {
+  int got = 0;
+  socklen_t len = sizeof(got);
+
+  if (setsockopt(fd, SOL_SOCKET, opt, &size, sizeof(size)) < 0)
+    bad_setsockopt(what);
+  if (getsockopt(fd, SOL_SOCKET, opt, &got, &len) == 0 && got / 2 < size)
+    fprintf(stderr,"%s is only %d bytes - raise net.core.%s_max\n", what, got / 2,
+            opt == SO_RCVBUF ? "rmem" : "wmem");
+}
+
 /* create a sender socket. */
-int makesocket(char *szAddr,unsigned short port,int TTL,struct sockaddr_in *sSockAddr) {
-  int          iRet, iLoop = 1;
-  struct       sockaddr_in sin;
-  char         cTtl = (char)TTL;
-  char         cLoop=0;
+int makesocket(char *szAddr,unsigned short port,int TTL,struct sockaddr_storage *sSockAddr,
+               const struct netopts *opts) {
+  static const struct netopts defaults = NETOPTS_DEFAULT;
+  int          iRet, iLoop = 1, ifindex = 0, v6;
+  int          iSocket;
 
-  int iSocket = socket( AF_INET, SOCK_DGRAM, 0 );
+  if (opts == NULL)
+    opts = &defaults;
+  if (rtp_parseaddr(szAddr, port, sSockAddr) < 0) {
+    fprintf(stderr,"%s is not an IPv4 or IPv6 address\n", szAddr);
+    exit(1);
+  }
+  v6 = sSockAddr->ss_family == AF_INET6;
+  if (opts->iface != NULL && (ifindex = if_nametoindex(opts->iface)) == 0) {
+    fprintf(stderr,"No network interface %s\n", opts->iface);
+    exit(1);
+  }
 
+  iSocket = socket(sSockAddr->ss_family, SOCK_DGRAM, 0);
   if (iSocket < 0) {
     fprintf(stderr,"socket() failed.\n");
     exit(1);
   }
 
-  sSockAddr->sin_family = sin.sin_family = AF_INET;
-  sSockAddr->sin_port = sin.sin_port = htons(port);
-  sSockAddr->sin_addr.s_addr = inet_addr(szAddr);
-
   iRet = setsockopt(iSocket, SOL_SOCKET, SO_REUSEADDR, &iLoop, sizeof(int));
   if (iRet < 0) {
     fprintf(stderr,"setsockopt SO_REUSEADDR failed\n");
     exit(1);
   }
 
-  iRet = setsockopt(iSocket, IPPROTO_IP, IP_MULTICAST_TTL, &cTtl, sizeof(char));
-  if (iRet < 0) {
-    fprintf(stderr,"setsockopt IP_MULTICAST_TTL failed.  multicast in kernel?\n");
-    exit(1);
+  if (rtp_ismulticast(sSockAddr)) {
+    int loop = !opts->noloop;
+
+    if (v6) {
+      iRet = setsockopt(iSocket, IPPROTO_IPV6, IPV6_MULTICAST_HOPS, &TTL, sizeof(TTL));
+    } else {
+      char cTtl = (char)TTL;
+      iRet = setsockopt(iSocket, IPPROTO_IP, IP_MULTICAST_TTL, &cTtl, sizeof(char));
+    }
+    if (iRet < 0) {
+      fprintf(stderr,"setsockopt IP_MULTICAST_TTL failed.  multicast in kernel?\n");
+      exit(1);
+    }
+
+    if (v6) {
+      iRet = setsockopt(iSocket, IPPROTO_IPV6, IPV6_MULTICAST_LOOP, &loop, sizeof(loop));
+    } else {
+      char cLoop = loop;
+      iRet = setsockopt(iSocket, IPPROTO_IP, IP_MULTICAST_LOOP, &cLoop, sizeof(char));
+    }
+    if (iRet < 0) {
+      fprintf(stderr,"setsockopt IP_MULTICAST_LOOP failed.  multicast in kernel?\n");
+      exit(1);
+    }
+
+    if (ifindex) {
+      if (v6) {
+        iRet = setsockopt(iSocket, IPPROTO_IPV6, IPV6_MULTICAST_IF, &ifindex, sizeof(ifindex));
+      } else {
+        struct ip_mreqn mreq;
+        memset(&mreq, 0, sizeof(mreq));
+        mreq.imr_ifindex = ifindex;
+        iRet = setsockopt(iSocket, IPPROTO_IP, IP_MULTICAST_IF, &mreq, sizeof(mreq));
+      }
+      if (iRet < 0)
+        bad_setsockopt("IP_MULTICAST_IF");
+    }
+  } else if (ifindex) {
+    /* Unicast goes where the routing table says, unless tied to a device */
+    if (setsockopt(iSocket, SOL_SOCKET, SO_BINDTODEVICE, opts->iface, strlen(opts->iface) + 1) < 0)
+      bad_setsockopt("SO_BINDTODEVICE (needs CAP_NET_RAW)");
   }
 
-  cLoop = 1;	/* !? */
-  iRet = setsockopt(iSocket, IPPROTO_IP, IP_MULTICAST_LOOP,
-                    &cLoop, sizeof(char));
-  if (iRet < 0) {
-    fprintf(stderr,"setsockopt IP_MULTICAST_LOOP failed.  multicast in kernel?\n");
-    exit(1);
+  if (opts->sndbuf > 0)
+    set_buffer(iSocket, SO_SNDBUF, opts->sndbuf, "SO_SNDBUF");
+  if (opts->rcvbuf > 0)
+    set_buffer(iSocket, SO_RCVBUF, opts->rcvbuf, "SO_RCVBUF");
+  if (opts->dscp >= 0) {
+    int tos = opts->dscp << 2;
+    if (v6)
+      iRet = setsockopt(iSocket, IPPROTO_IPV6, IPV6_TCLASS, &tos, sizeof(tos));
+    else
+      iRet = setsockopt(iSocket, IPPROTO_IP, IP_TOS, &tos, sizeof(tos));
+    if (iRet < 0)
+      bad_setsockopt("IP_TOS");
   }
+  if (opts->priority >= 0 &&
+      setsockopt(iSocket, SOL_SOCKET, SO_PRIORITY, &opts->priority, sizeof(opts->priority)) < 0)
+    bad_setsockopt("SO_PRIORITY");
 
   return iSocket;
 }
 
-/* create a receiver socket, i.e. join the multicast group. */
-int makeclientsocket(char *szAddr,unsigned short port,int TTL,struct sockaddr_in *sSockAddr) {
-  int socket=makesocket(szAddr,port,TTL,sSockAddr);
-  struct ip_mreq blub;
-  struct sockaddr_in sin;
-  unsigned int tempaddr;
-  sin.sin_family=AF_INET;
-  sin.sin_port=htons(port);
-  sin.sin_addr.s_addr=inet_addr(szAddr);
-  if (bind(socket,(struct sockaddr *)&sin,sizeof(sin))) {
+/* create a receiver socket, i.e. join the multicast group - only the
+   traffic from opts->source if one is given (SSM, IGMPv3 or MLDv2). */
+int makeclientsocket(char *szAddr,unsigned short port,int TTL,struct sockaddr_storage *sSockAddr,
+                     const struct netopts *opts) {
+  int socket=makesocket(szAddr,port,TTL,sSockAddr,opts);
+  int level = sSockAddr->ss_family == AF_INET6 ? IPPROTO_IPV6 : IPPROTO_IP;
+  unsigned int ifindex = 0;
+
+  if (bind(socket,(struct sockaddr *)sSockAddr,rtp_addrlen(sSockAddr))) {
     perror("bind failed");
     exit(1);
   }
-  tempaddr=inet_addr(szAddr);
-  if ((ntohl(tempaddr) >> 28) == 0xe) {
-    blub.imr_multiaddr.s_addr = inet_addr(szAddr);
-    blub.imr_interface.s_addr = 0;
-    if (setsockopt(socket,IPPROTO_IP,IP_ADD_MEMBERSHIP,&blub,sizeof(blub))) {
-      perror("setsockopt IP_ADD_MEMBERSHIP failed (multicast kernel?)");
+  if (opts != NULL && opts->iface != NULL)
+    ifindex = if_nametoindex(opts->iface);
+  if (opts != NULL && opts->source != NULL) {
+    struct group_source_req gsr;
+
+    if (!rtp_ismulticast(sSockAddr)) {
+      fprintf(stderr,"A source can only be given for a multicast group\n");
+      exit(1);
+    }
+    memset(&gsr, 0, sizeof(gsr));
+    gsr.gsr_interface = ifindex;
+    memcpy(&gsr.gsr_group, sSockAddr, rtp_addrlen(sSockAddr));
+    if (rtp_parseaddr(opts->source, 0, &gsr.gsr_source) < 0 ||
+        gsr.gsr_source.ss_family != sSockAddr->ss_family) {
+      fprintf(stderr,"%s is not a source address for %s\n", opts->source, szAddr);
+      exit(1);
+    }
+    if (setsockopt(socket, level, MCAST_JOIN_SOURCE_GROUP, &gsr, sizeof(gsr))) {
+      perror("setsockopt MCAST_JOIN_SOURCE_GROUP failed (IGMPv3/MLDv2 in kernel?)");
+      exit(1);
+    }
+  } else if (rtp_ismulticast(sSockAddr)) {
+    struct group_req gr;
+
+    memset(&gr, 0, sizeof(gr));
+    gr.gr_interface = ifindex;
+    memcpy(&gr.gr_group, sSockAddr, rtp_addrlen(sSockAddr));
+    if (setsockopt(socket, level, MCAST_JOIN_GROUP, &gr, sizeof(gr))) {
+      perror("setsockopt MCAST_JOIN_GROUP failed (multicast kernel?)");
       exit(1);
     }
   }
@@ -2,10 +2,15 @@
 #define _RTP_H
 
 #include <sys/socket.h>
+#include <netinet/in.h>
+#include <net/if.h>
 
 enum {RTP_PS,RTP_TS,RTP_NONE,MAP_TS};
 enum {RTP, UDP};
 
+/* Largest header written by rtp_pack_header() - no CSRCs are used */
+#define RTP_HEADER_LEN 12
+
 struct rtpbits {
   unsigned int v:2;           /* version: 2 */
   unsigned int p:1;           /* is there padding appended: 0 */
@@ -21,15 +26,75 @@ struct rtpheader {	/* in network byte order */
   int timestamp;	/* start: random */
   int ssrc;		/* random */
   int type;		/* RTP or UDP */
+  unsigned int ts_offset;	/* random, added to the stream's 90 kHz clock */
+};
+
+/* RTCP sender reports, sent to the RTP port + 1 */
+#define RTCP_SR 200
+#define RTCP_SDES 202
+#define RTCP_INTERVAL 5	/* seconds between sender reports */
+#define RTCP_MAX_LEN 128
+
+struct rtcp_sr {
+  unsigned int ssrc;
+  unsigned int ntp_sec;		/* wall clock time of the report */
+  unsigned int ntp_frac;
+  unsigned int rtp_ts;		/* the same time in RTP timestamp units */
+  unsigned int packets;		/* sent so far */
+  unsigned int octets;		/* of payload sent so far */
+};
+
+/* Receiver side: RFC 3550 interarrival jitter, and the latency from
+   the sender's clock to ours once a sender report has been seen */
+struct rtp_stats {
+  int have_ts;
+  int transit;			/* arrival - timestamp, 90 kHz */
+  double jitter;		/* 90 kHz units */
+  int have_sr;
+  struct rtcp_sr sr;
+  double latency;		/* seconds, of the last packet */
+  double max_latency;
 };
 
 
 void initrtp(struct rtpheader *foo,int pt, int type); /* fill in the MPEG-2 TS deefaults */
-int sendrtp(int fd, struct sockaddr_in *sSockAddr, struct rtpheader *foo, char *data, int len);
+int sendrtp(int fd, struct sockaddr_storage *sSockAddr, struct rtpheader *foo, char *data, int len);
 int getrtp2(int fd, struct rtpheader *rh, char** data, int* lengthData);
-int sendrtp2(int fd, struct sockaddr_in *sSockAddr, struct rtpheader *foo, char *data, int len);
+int sendrtp2(int fd, struct sockaddr_storage *sSockAddr, struct rtpheader *foo, char *data, int len);
+int rtp_pack_header(struct rtpheader *foo, unsigned char *buf);
+unsigned int rtp_random(void);
+int rtcp_pack_sr(struct rtcp_sr *sr, const char *cname, unsigned char *buf);
+int rtcp_parse_sr(unsigned char *buf, int len, struct rtcp_sr *sr);
+void rtp_stats_update(struct rtp_stats *st, struct rtpheader *rh, double now);
 int getrtp(int fd, struct rtpheader *rh, char** data, int* lengthData);
-int makesocket(char *szAddr,unsigned short port,int TTL,struct sockaddr_in *sSockAddr);
-int makeclientsocket(char *szAddr,unsigned short port,int TTL,struct sockaddr_in *sSockAddr);
+
+/* How a socket is set up.  NULL, or NETOPTS_DEFAULT, leaves everything
+   to the kernel except that multicast is looped back to this host. */
+struct netopts {
+  const char *iface;		/* interface for multicast (or to bind unicast to), NULL: routed */
+  const char *source;		/* receive only from this source (SSM), NULL: any */
+  int sndbuf;			/* bytes, 0: the kernel's default */
+  int rcvbuf;
+  int dscp;			/* DiffServ code point, -1: leave */
+  int priority;			/* SO_PRIORITY, -1: leave */
+  int noloop;			/* don't loop multicast back */
+};
+#define NETOPTS_DEFAULT { NULL, NULL, 0, 0, -1, -1, 0 }
+
+/* Longest address string, IPv6 with %interface */
+#define RTP_ADDR_LEN (INET6_ADDRSTRLEN + IF_NAMESIZE)
+
+socklen_t rtp_addrlen(const struct sockaddr_storage *a);
+int rtp_getport(const struct sockaddr_storage *a);
+void rtp_setport(struct sockaddr_storage *a, int port);
+int rtp_ismulticast(const struct sockaddr_storage *a);
+int rtp_samehost(const struct sockaddr_storage *a, const struct sockaddr_storage *b);
+char *rtp_addrstr(const struct sockaddr_storage *a, char *buf, int len);
+int rtp_parseaddr(const char *szAddr, unsigned short port, struct sockaddr_storage *a);
+int rtp_splitaddr(const char *s, char *addr, int len, int *port);
+int makesocket(char *szAddr,unsigned short port,int TTL,struct sockaddr_storage *sSockAddr,
+               const struct netopts *opts);
+int makeclientsocket(char *szAddr,unsigned short port,int TTL,struct sockaddr_storage *sSockAddr,
+                     const struct netopts *opts);
 
 #endif
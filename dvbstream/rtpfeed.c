@@ -35,29 +35,43 @@
 #include <fcntl.h>
 #include <getopt.h>
 #include <unistd.h>
+#include <errno.h>
 
 #include "rtp.h"
+#include "rtprecv.h"
+#include "fec.h"
 
 // DVB includes:
 #include <linux/dvb/dmx.h>
 #include <linux/dvb/frontend.h>
 
 
-void dumprtp(int socket, int fd_dvr) {
-  char* buf;
-  struct rtpheader rh;
-  int lengthData;
-  int written;
+void dumprtp(int socket, int fd_dvr, int fec_col, int fec_row) {
+  rtprecv_t *r;
+  rtprecv_pkt_t **pkts;
 
-  while(1) {
-    getrtp2(socket,&rh, &buf,&lengthData);
-
-    written = 0;
-    while(written < lengthData){
-	written += write(fd_dvr,buf+written, lengthData-written);
-    }//end while
+  if((r = rtprecv_new(socket, 0)) == NULL){
+    fprintf(stderr,"rtpfeed: out of memory\n");
+    exit(1);
+  }
+  if(fec_col >= 0 && rtprecv_fec(r, fec_col, fec_row) < 0){
+    fprintf(stderr,"rtpfeed: out of memory\n");
+    exit(1);
+  }
 
+  while(1) {
+    // a batch of packets, in order, to the DVR in one write
+    if(rtprecv_get(r, &pkts) < 0){
+      if(errno == EINTR) continue;
+      perror("rtpfeed: socket read error");
+      break;
+    }
+    if(rtprecv_write(r, fd_dvr) < 0){
+      perror("DVR DEVICE: ");
+      break;
+    }
   }//end while
+  rtprecv_free(r);
 }// end dumprtp
 
 
@@ -89,8 +103,10 @@ int main(int argc, char *argv[]) {
   uint16_t vpid = 0;
   uint16_t apid = 0;
 
-  struct sockaddr_in si;
+  struct sockaddr_storage si;
+  struct netopts opts = NETOPTS_DEFAULT;
   int socketIn;
+  int fec = 0, socketCol = -1, socketRow = -1;
 
   char *ip = "224.0.1.2";
   int port = 5004;
@@ -101,6 +117,9 @@ int main(int argc, char *argv[]) {
     {"port", required_argument, NULL, 'p'},
     {"vpid", required_argument, NULL, 'v'},
     {"apid", required_argument, NULL, 'a'},
+    {"fec", no_argument, NULL, 'f'},
+    {"source", required_argument, NULL, 's'},
+    {"interface", required_argument, NULL, 'i'},
     {"help", no_argument, NULL, 'h'},
     {0}
   };
@@ -110,7 +129,7 @@ int main(int argc, char *argv[]) {
 
   fprintf(stderr,"*** rtpfeed 0.1 ***\n");
 
-  while((c = getopt_long(argc, argv, "g:p:v:a:h",long_options, &option_index))!=-1)
+  while((c = getopt_long(argc, argv, "g:p:v:a:fs:i:h",long_options, &option_index))!=-1)
   {
     switch(c)
     {
@@ -126,8 +145,20 @@ int main(int argc, char *argv[]) {
     case 'a':
       apid = atoi(optarg);
       break;
+    case 'f':
+      fec = 1;
+      break;
+    case 's':
+      opts.source = optarg;
+      break;
+    case 'i':
+      opts.iface = optarg;
+      break;
     case 'h':
-      fprintf(stderr,"Usage: %s [-g group] [-p port] [-v video PID] [-a audio PID] \n",argv[0]);
+      fprintf(stderr,"Usage: %s [-g group] [-p port] [-v video PID] [-a audio PID] [-f] [-s source] [-i interface]\n",argv[0]);
+      fprintf(stderr,"  -f, --fec  recover lost packets with the SMPTE 2022-1 FEC on port+2 and port+4\n");
+      fprintf(stderr,"  -s, --source  take the group (IPv4 or IPv6) only from this source (SSM)\n");
+      fprintf(stderr,"  -i, --interface  join the group on this interface\n");
       exit(1);
     }// end switch
   }// end while
@@ -158,8 +189,12 @@ int main(int argc, char *argv[]) {
     set_ts_filt(fda, apid, 2);
   }// end if
 
-  socketIn  = makeclientsocket(ip,port,2,&si);
-  dumprtp(socketIn, fd_dvr);
+  socketIn  = makeclientsocket(ip,port,2,&si,&opts);
+  if(fec){
+    socketCol = makeclientsocket(ip,port+FEC_COLUMN_PORT,2,&si,&opts);
+    socketRow = makeclientsocket(ip,port+FEC_ROW_PORT,2,&si,&opts);
+  }
+  dumprtp(socketIn, fd_dvr, socketCol, socketRow);
 
   close(socketIn);
   return(0);
@@ -0,0 +1,769 @@
+/*
+ * rtprecv.c: batched receiving of an RTP stream, put back in order
+ * (see rtprecv.h).
+ *
+ * Each packet goes into the window at its sequence number.  The window
+ * starts at the next packet due: whatever is there in a row from the
+ * start is handed on, and the start moves past it.  A packet too far
+ * ahead for the window pushes the start on, giving up whatever had not
+ * come by then.  A packet from before the start is a duplicate if that
+ * sequence number was handed on, and late if it was given up.
+ *
+ * With FEC the packets handed on are kept a while longer, as the FEC for
+ * a column needs every packet of it.  Each FEC packet that comes is held
+ * until the packets it protects are all there, or one of them has been
+ * given up; if only one is missing it is rebuilt and put in the window.
+ *
+ * With NACKs, each time round the packets missing between the start of
+ * the window and the latest one seen are looked for, and those not
+ * asked for lately go in a NACK.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "rtprecv.h"
+#include "fec.h"
+#include "rtx.h"
+
+#define SLOTS (RTPRECV_BATCH + RTPRECV_WINDOW)
+#define HISTORY 1024           /* sequence numbers remembered behind the window */
+#define RESTART 1024           /* a jump this far is a new stream */
+#define RCVBUF (4 << 20)
+
+/* With FEC: packets kept once handed on, and FEC packets held */
+#define KEEP 1024
+#define FEC_STORE 64
+
+/* The widest window, and the most slots it can take */
+#define WINDOW_MAX RTPRECV_NACK_WINDOW
+#define MAX_SLOTS (RTPRECV_BATCH + 2 * WINDOW_MAX + KEEP)
+
+/* All must divide 65536, so that a sequence number keeps its place
+   when the numbers wrap */
+#if (65536 % RTPRECV_WINDOW) || (65536 % RTPRECV_FEC_WINDOW) || (65536 % RTPRECV_NACK_WINDOW) || \
+    (65536 % HISTORY) || (65536 % KEEP)
+#error The windows, HISTORY and KEEP must be powers of 2
+#endif
+/* Nothing in the window, or handed on in one go, is pushed out of kept[] */
+#if KEEP < WINDOW_MAX + RTPRECV_BATCH || HISTORY < WINDOW_MAX
+#error KEEP or HISTORY is too small
+#endif
+
+typedef struct {
+  int used;
+  unsigned int age;            /* the oldest goes when there's no room */
+  fec_header_t h;
+  uint8_t *data;               /* the XOR of the payloads */
+  int len;
+} fecpkt_t;
+
+struct rtprecv {
+  int fd;
+  int flags;
+  int slots;                   /* SLOTS, or more with FEC or NACKs */
+  int window;                  /* RTPRECV_WINDOW, or wider with FEC or NACKs */
+  int hold_ms;
+  uint8_t *slab;               /* slots datagrams of RTPRECV_MAX bytes */
+  rtprecv_pkt_t pkt[MAX_SLOTS];
+  int free[MAX_SLOTS];
+  int nfree;
+  uint8_t in_ready[MAX_SLOTS]; /* handed on by this rtprecv_get() */
+
+  int win[WINDOW_MAX];         /* slot of each sequence number, -1: none yet */
+  int held;                    /* packets in the window */
+  int started;
+  uint16_t next;               /* the start of the window */
+  uint16_t highest;            /* the latest sequence number seen */
+  uint8_t passed[HISTORY / 8]; /* handed on, rather than given up */
+  int64_t gap_since;           /* the start has been missing since, 0: it isn't */
+
+  rtprecv_pkt_t *ready[MAX_SLOTS]; /* returned by the last rtprecv_get() */
+  int nready;
+
+  int fec_fd[2];               /* column and row FEC, -1: none */
+  int kept[KEEP];              /* slot of each sequence number handed on, -1: none */
+  fecpkt_t *fec;               /* FEC_STORE of them, NULL: no FEC */
+  uint8_t *fec_slab;
+  unsigned int fec_age;
+
+  int nack;                    /* NACKs on */
+  int64_t nack_retry;          /* ns between NACKs for a packet */
+  int64_t nack_next[WINDOW_MAX];  /* when a missing packet may be asked for again */
+  uint8_t nack_tries[WINDOW_MAX];
+  struct sockaddr_storage peer;   /* where the stream comes from */
+  socklen_t peerlen;
+  uint32_t ssrc, media_ssrc;
+  struct sockaddr_storage from[RTPRECV_BATCH];
+
+  struct mmsghdr msgs[RTPRECV_BATCH];
+  struct iovec iov[RTPRECV_BATCH];
+  int msg_slot[RTPRECV_BATCH];
+  char ctrl[RTPRECV_BATCH][CMSG_SPACE(sizeof(struct timespec))];
+  struct iovec wiov[MAX_SLOTS];
+
+  rtprecv_stats_t stats;
+};
+
+static int64_t now_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* A high bitrate stream fills the default buffer in a few ms, so make
+   it at least RCVBUF - unless it has been made bigger already */
+static void grow_rcvbuf(int fd)
+{
+  int size = 0;
+  socklen_t len = sizeof(size);
+
+  if (getsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, &len) == 0 && size >= 2 * RCVBUF)
+    return;                         // the kernel reports twice what was set
+  size = RCVBUF;
+  setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+}
+
+rtprecv_t *rtprecv_new(int fd, int flags)
+{
+  rtprecv_t *r;
+  int i, on = 1;
+
+  if ((r = calloc(1, sizeof(rtprecv_t))) == NULL)
+    return NULL;
+  if ((r->slab = malloc(SLOTS * RTPRECV_MAX)) == NULL) {
+    free(r);
+    return NULL;
+  }
+  r->fd = fd;
+  r->flags = flags;
+  r->slots = SLOTS;
+  r->window = RTPRECV_WINDOW;
+  r->hold_ms = RTPRECV_HOLD_MS;
+  r->fec_fd[0] = r->fec_fd[1] = -1;
+  for (i = 0; i < SLOTS; i++)
+    r->free[r->nfree++] = i;
+  for (i = 0; i < WINDOW_MAX; i++)
+    r->win[i] = -1;
+
+  grow_rcvbuf(fd);
+  if ((flags & RTPRECV_ARRIVAL) && setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on)) < 0)
+    r->flags &= ~RTPRECV_ARRIVAL;
+  return r;
+}
+
+void rtprecv_free(rtprecv_t *r)
+{
+  if (r == NULL)
+    return;
+  free(r->fec);
+  free(r->fec_slab);
+  free(r->slab);
+  free(r);
+}
+
+/* Room for a wider window (and for kept packets, with FEC) */
+static int resize(rtprecv_t *r, int window)
+{
+  uint8_t *slab;
+  int i, slots;
+
+  if (window < r->window)
+    window = r->window;
+  slots = RTPRECV_BATCH + 2 * window + ((r->fec != NULL) ? KEEP : 0);
+  if ((slab = realloc(r->slab, (size_t)slots * RTPRECV_MAX)) == NULL)
+    return -1;
+  r->slab = slab;
+  r->slots = slots;
+  r->window = window;
+  r->nfree = 0;
+  for (i = 0; i < slots; i++)
+    r->free[r->nfree++] = i;
+  return 0;
+}
+
+int rtprecv_fec(rtprecv_t *r, int col_fd, int row_fd)
+{
+  int i;
+
+  if ((r->fec = calloc(FEC_STORE, sizeof(fecpkt_t))) == NULL ||
+      (r->fec_slab = malloc(FEC_STORE * RTPRECV_MAX)) == NULL ||
+      resize(r, RTPRECV_FEC_WINDOW) < 0) {
+    free(r->fec);
+    r->fec = NULL;
+    return -1;
+  }
+  for (i = 0; i < FEC_STORE; i++)
+    r->fec[i].data = r->fec_slab + i * RTPRECV_MAX;
+  for (i = 0; i < KEEP; i++)
+    r->kept[i] = -1;
+  if (!r->nack && r->hold_ms < RTPRECV_FEC_HOLD_MS)
+    r->hold_ms = RTPRECV_FEC_HOLD_MS;   // NACKs have their own
+  r->fec_fd[0] = col_fd;
+  r->fec_fd[1] = row_fd;
+  for (i = 0; i < 2; i++) {
+    if (r->fec_fd[i] >= 0)
+      grow_rcvbuf(r->fec_fd[i]);
+  }
+  return 0;
+}
+
+int rtprecv_nack(rtprecv_t *r, int ms)
+{
+  if (resize(r, RTPRECV_NACK_WINDOW) < 0)
+    return -1;
+  r->nack = 1;
+  r->hold_ms = ms;
+  r->nack_retry = ms * 1000000LL / 4;
+  r->ssrc = (uint32_t)now_ns() ^ ((uint32_t)getpid() << 16);
+  return 0;
+}
+
+const rtprecv_stats_t *rtprecv_stats(rtprecv_t *r)
+{
+  return &r->stats;
+}
+
+static void put_slot(rtprecv_t *r, int k)
+{
+  r->free[r->nfree++] = k;
+}
+
+/* The length of the RTP header at b, and in *len that of the datagram
+   less any padding.  Returns -1 if it isn't RTP. */
+static int header_len(const uint8_t *b, int *len)
+{
+  int hl;
+
+  if (*len < 12 || (b[0] >> 6) != 2)
+    return -1;
+  hl = 12 + 4 * (b[0] & 0x0f);
+  if (b[0] & 0x10) {          // a header extension
+    if (hl + 4 > *len)
+      return -1;
+    hl += 4 + 4 * ((b[hl+2] << 8) | b[hl+3]);
+  }
+  if (b[0] & 0x20)            // padding, its length in the last byte
+    *len -= b[*len-1];
+  if (hl > *len)
+    return -1;
+  return hl;
+}
+
+/* The header of the datagram in slot k.  Returns -1 if it isn't RTP. */
+static int parse(rtprecv_t *r, int k, int len)
+{
+  rtprecv_pkt_t *p = &r->pkt[k];
+  uint8_t *b = r->slab + k * RTPRECV_MAX;
+  int hl;
+
+  if ((hl = header_len(b, &len)) < 0)
+    return -1;
+
+  p->pt = b[1] & 0x7f;
+  p->marker = b[1] >> 7;
+  p->seq = (b[2] << 8) | b[3];
+  p->timestamp = (uint32_t)b[4] << 24 | b[5] << 16 | b[6] << 8 | b[7];
+  p->ssrc = (uint32_t)b[8] << 24 | b[9] << 16 | b[10] << 8 | b[11];
+  p->data = b + hl;
+  p->len = len - hl;
+  return 0;
+}
+
+/* Move the start of the window on by one, handing on the packet there
+   or, if it hasn't come, giving it up */
+static void advance(rtprecv_t *r, int count_lost)
+{
+  int i = r->next % r->window, h = r->next % HISTORY, k = r->next % KEEP;
+
+  if (r->win[i] >= 0) {
+    r->ready[r->nready++] = &r->pkt[r->win[i]];
+    r->in_ready[r->win[i]] = 1;
+    if (r->fec != NULL) {
+      /* Whatever was kept in its place goes, unless it is also on its
+         way out now */
+      if (r->kept[k] >= 0 && !r->in_ready[r->kept[k]])
+        put_slot(r, r->kept[k]);
+      r->kept[k] = r->win[i];
+    }
+    r->win[i] = -1;
+    r->held--;
+    r->passed[h / 8] |= 1 << (h % 8);
+  } else {
+    if (count_lost) r->stats.lost++;
+    r->passed[h / 8] &= ~(1 << (h % 8));
+  }
+  r->nack_next[i] = 0;
+  r->nack_tries[i] = 0;
+  r->next++;
+}
+
+static void drain(rtprecv_t *r)
+{
+  while (r->win[r->next % r->window] >= 0)
+    advance(r, 1);
+}
+
+/* A packet into the window */
+static void place(rtprecv_t *r, int k)
+{
+  rtprecv_pkt_t *p = &r->pkt[k];
+  int d, h;
+
+  if (!r->started) {
+    r->started = 1;
+    r->next = r->highest = p->seq;
+  }
+  d = (int16_t)(p->seq - r->next);
+  if (d <= -RESTART || d >= RESTART) {
+    /* The sender has started again: hand on what there is */
+    while (r->held > 0)
+      advance(r, 0);
+    r->next = r->highest = p->seq;
+    r->stats.restarts++;
+    d = 0;
+  } else if (d < 0) {
+    h = p->seq % HISTORY;
+    if (d > -HISTORY && (r->passed[h / 8] & (1 << (h % 8))))
+      r->stats.duplicates++;
+    else
+      r->stats.late++;
+    put_slot(r, k);
+    return;
+  }
+
+  while (d >= r->window) {
+    advance(r, 1);
+    d--;
+  }
+  if (r->win[p->seq % r->window] >= 0) {
+    r->stats.duplicates++;
+    put_slot(r, k);
+    return;
+  }
+  if ((int16_t)(p->seq - r->highest) < 0)
+    r->stats.reordered++;
+  else
+    r->highest = p->seq;
+  if (r->nack_tries[p->seq % r->window] > 0)
+    r->stats.retransmitted++;
+  r->win[p->seq % r->window] = k;
+  r->held++;
+  drain(r);
+}
+
+/* The packet with sequence number seq, if it is in the window or kept */
+static rtprecv_pkt_t *find(rtprecv_t *r, uint16_t seq)
+{
+  int d = (int16_t)(seq - r->next), k;
+
+  if (d >= 0)
+    k = (d < r->window) ? r->win[seq % r->window] : -1;
+  else
+    k = r->kept[seq % KEEP];
+  return (k >= 0 && r->pkt[k].seq == seq) ? &r->pkt[k] : NULL;
+}
+
+/* Rebuild seq, the one packet missing of those e protects */
+static int rebuild(rtprecv_t *r, fecpkt_t *e, uint16_t seq)
+{
+  rtprecv_pkt_t *p, *q;
+  struct timespec ts;
+  uint8_t *b;
+  uint16_t length = e->h.length;
+  uint32_t timestamp = e->h.ts, ssrc = 0;
+  int j, k, pt = e->h.pt;
+
+  if (r->nfree == 0)
+    return -1;
+  k = r->free[--r->nfree];
+  b = r->slab + k * RTPRECV_MAX;
+  memcpy(b, e->data, e->len);
+  for (j = 0; j < e->h.na; j++) {
+    if ((uint16_t)(e->h.snbase + j * e->h.offset) == seq)
+      continue;
+    q = find(r, e->h.snbase + j * e->h.offset);
+    if (q->len > e->len)
+      goto bad;
+    fec_xor(b, q->data, q->len);
+    length ^= q->len;
+    pt ^= q->pt;
+    timestamp ^= q->timestamp;
+    ssrc = q->ssrc;
+  }
+  if (length > e->len)
+    goto bad;
+
+  clock_gettime(CLOCK_REALTIME, &ts);
+  p = &r->pkt[k];
+  p->seq = seq;
+  p->timestamp = timestamp;
+  p->ssrc = ssrc;
+  p->pt = pt & 0x7f;
+  p->marker = 0;
+  p->arrival = ts.tv_sec + ts.tv_nsec / 1e9;
+  p->data = b;
+  p->len = length;
+  r->win[seq % r->window] = k;
+  r->held++;
+  r->stats.recovered++;
+  return 0;
+
+bad:
+  put_slot(r, k);
+  return -1;
+}
+
+/* Use what FEC there is.  A FEC packet is done with once all its packets
+   are there, or one of them has been given up. */
+static void recover(rtprecv_t *r)
+{
+  fecpkt_t *e;
+  uint16_t seq, missing_seq = 0;
+  int i, j, d, missing, gone, again;
+
+  do {
+    again = 0;
+    for (i = 0; i < FEC_STORE; i++) {
+      e = &r->fec[i];
+      if (!e->used)
+        continue;
+      missing = gone = 0;
+      for (j = 0; j < e->h.na && !gone; j++) {
+        seq = e->h.snbase + j * e->h.offset;
+        if (find(r, seq) != NULL)
+          continue;
+        d = (int16_t)(seq - r->next);
+        if (d < 0)
+          gone = 1;
+        missing++;
+        missing_seq = seq;
+      }
+      if (gone || missing == 0) {
+        e->used = 0;
+      } else if (missing == 1 && (int16_t)(missing_seq - r->highest) < 0) {
+        /* Only once a later packet has come: it may just not have been
+           read yet */
+        if (rebuild(r, e, missing_seq) == 0)
+          again = 1;
+        e->used = 0;
+      }
+    }
+  } while (again);
+  drain(r);
+}
+
+/* Take the FEC packets that have come in on fd */
+static void receive_fec(rtprecv_t *r, int fd)
+{
+  fecpkt_t *e;
+  int i, n, hl;
+
+  for (;;) {
+    /* A free place, or the oldest */
+    e = &r->fec[0];
+    for (i = 0; i < FEC_STORE && e->used; i++) {
+      if (!r->fec[i].used || r->fec[i].age < e->age)
+        e = &r->fec[i];
+    }
+    n = recv(fd, e->data, RTPRECV_MAX, MSG_DONTWAIT | MSG_TRUNC);
+    if (n < 0)
+      return;
+    if (n > RTPRECV_MAX || (hl = header_len(e->data, &n)) < 0 ||
+        fec_parse(e->data + hl, n - hl, &e->h) < 0 ||
+        e->h.offset * (e->h.na - 1) >= r->window) {
+      r->stats.bad++;
+      e->used = 0;
+      continue;
+    }
+    r->stats.fec++;
+    hl += FEC_HEADER_LEN;
+    e->len = n - hl;
+    memmove(e->data, e->data + hl, e->len);
+    e->used = 1;
+    e->age = r->fec_age++;
+  }
+}
+
+/* Take what has come in, a batch at a time */
+static int receive(rtprecv_t *r)
+{
+  struct cmsghdr *cm;
+  struct timespec ts;
+  double arrival;
+  int i, k, n, got, len;
+
+  n = (r->nfree < RTPRECV_BATCH) ? r->nfree : RTPRECV_BATCH;
+  for (i = 0; i < n; i++) {
+    k = r->free[--r->nfree];
+    r->msg_slot[i] = k;
+    r->iov[i].iov_base = r->slab + k * RTPRECV_MAX;
+    r->iov[i].iov_len = RTPRECV_MAX;
+    memset(&r->msgs[i].msg_hdr, 0, sizeof(struct msghdr));
+    r->msgs[i].msg_hdr.msg_iov = &r->iov[i];
+    r->msgs[i].msg_hdr.msg_iovlen = 1;
+    if (r->nack) {
+      r->msgs[i].msg_hdr.msg_name = &r->from[i];
+      r->msgs[i].msg_hdr.msg_namelen = sizeof(r->from[i]);
+    }
+    if (r->flags & RTPRECV_ARRIVAL) {
+      r->msgs[i].msg_hdr.msg_control = r->ctrl[i];
+      r->msgs[i].msg_hdr.msg_controllen = sizeof(r->ctrl[i]);
+    }
+  }
+  got = recvmmsg(r->fd, r->msgs, n, MSG_DONTWAIT, NULL);
+  if (got < 0) {
+    for (i = n - 1; i >= 0; i--)
+      put_slot(r, r->msg_slot[i]);
+    return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+  }
+  r->stats.calls++;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  arrival = ts.tv_sec + ts.tv_nsec / 1e9;
+
+  for (i = 0; i < got; i++) {
+    k = r->msg_slot[i];
+    len = r->msgs[i].msg_len;
+    if ((r->msgs[i].msg_hdr.msg_flags & MSG_TRUNC) || parse(r, k, len) < 0) {
+      r->stats.bad++;
+      put_slot(r, k);
+      continue;
+    }
+    r->pkt[k].arrival = arrival;
+    if (r->flags & RTPRECV_ARRIVAL) {
+      for (cm = CMSG_FIRSTHDR(&r->msgs[i].msg_hdr); cm != NULL; cm = CMSG_NXTHDR(&r->msgs[i].msg_hdr, cm)) {
+        if (cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_TIMESTAMPNS) {
+          memcpy(&ts, CMSG_DATA(cm), sizeof(ts));
+          r->pkt[k].arrival = ts.tv_sec + ts.tv_nsec / 1e9;
+        }
+      }
+    }
+    if (r->nack) {
+      memcpy(&r->peer, &r->from[i], r->msgs[i].msg_hdr.msg_namelen);
+      r->peerlen = r->msgs[i].msg_hdr.msg_namelen;
+      r->media_ssrc = r->pkt[k].ssrc;
+    }
+    r->stats.datagrams++;
+    r->stats.bytes += r->pkt[k].len;
+    place(r, k);
+  }
+  for (i = n - 1; i >= got; i--)
+    put_slot(r, r->msg_slot[i]);
+  return got;
+}
+
+/* Ask for the packets missing from the window that are due to be asked
+   for */
+static void send_nacks(rtprecv_t *r, int64_t now)
+{
+  uint16_t seqs[RTX_NACK_MAX];
+  uint8_t buf[20 + 4 * RTX_NACK_MAX];
+  int d, i, n = 0, span = (int16_t)(r->highest - r->next), len;
+
+  for (d = 0; d < span && n < RTX_NACK_MAX; d++) {
+    i = (uint16_t)(r->next + d) % r->window;
+    if (r->win[i] >= 0 || r->nack_next[i] > now)
+      continue;
+    seqs[n++] = r->next + d;
+    r->nack_next[i] = now + r->nack_retry;
+    if (r->nack_tries[i] < 255)
+      r->nack_tries[i]++;
+  }
+  if (n == 0 || r->peerlen == 0)
+    return;
+  len = rtx_pack_nack(buf, r->ssrc, r->media_ssrc, seqs, n);
+  if (sendto(r->fd, buf, len, 0, (struct sockaddr *)&r->peer, r->peerlen) == len) {
+    r->stats.nacks++;
+    r->stats.nacked += n;
+  }
+}
+
+/* The packets last handed out are finished with, unless they are kept
+   for the FEC */
+static void release(rtprecv_t *r)
+{
+  int i, k;
+
+  for (i = 0; i < r->nready; i++) {
+    k = r->ready[i] - r->pkt;
+    r->in_ready[k] = 0;
+    if (r->fec == NULL || r->kept[r->ready[i]->seq % KEEP] != k)
+      put_slot(r, k);
+  }
+  r->nready = 0;
+}
+
+/* Something is missing: wait so long for it, then carry on without it,
+   asking for it again meanwhile with NACKs.  Returns how many ms to wait
+   for it, 0 if it has just been given up, or -1 if nothing is missing. */
+static int wait_gap(rtprecv_t *r)
+{
+  int64_t t, left;
+  int timeout;
+
+  if (r->held == 0)
+    return -1;
+  t = now_ns();
+  if (r->gap_since == 0)
+    r->gap_since = t;
+  left = r->gap_since + r->hold_ms * 1000000LL - t;
+  if (left <= 0) {
+    while (r->win[r->next % r->window] < 0)
+      advance(r, 1);
+    drain(r);
+    r->gap_since = 0;
+    return 0;
+  }
+  timeout = left / 1000000 + 1;
+  if (r->nack) {
+    send_nacks(r, t);
+    if (timeout > r->nack_retry / 1000000 + 1)
+      timeout = r->nack_retry / 1000000 + 1;
+  }
+  return timeout;
+}
+
+int rtprecv_fds(rtprecv_t *r, int *fds)
+{
+  int k, n = 0;
+
+  fds[n++] = r->fd;
+  for (k = 0; k < 2; k++) {
+    if (r->fec != NULL && r->fec_fd[k] >= 0)
+      fds[n++] = r->fec_fd[k];
+  }
+  return n;
+}
+
+/* Take what has come on the sockets marked ready in pfd[] (see
+   rtprecv_fds() for the order) */
+static int take(rtprecv_t *r, struct pollfd *pfd, int n)
+{
+  uint16_t start = r->next;
+  int k, any = 0;
+
+  if (pfd[0].revents && receive(r) < 0)
+    return -1;
+  if (r->fec != NULL) {
+    for (k = 0; k < n; k++) {
+      any |= pfd[k].revents;
+      if (k > 0 && (pfd[k].revents & POLLIN))
+        receive_fec(r, pfd[k].fd);
+    }
+    if (any)
+      recover(r);
+  }
+  if (r->next != start || r->held == 0)
+    r->gap_since = 0;       // a new gap, if any
+  return 0;
+}
+
+int rtprecv_get(rtprecv_t *r, rtprecv_pkt_t ***pkts)
+{
+  struct pollfd pfd[3];
+  int fds[3];
+  int i, n, timeout;
+
+  release(r);
+  while (r->nready == 0) {
+    if ((timeout = wait_gap(r)) == 0)
+      continue;
+    n = rtprecv_fds(r, fds);
+    for (i = 0; i < n; i++) {
+      pfd[i].fd = fds[i];
+      pfd[i].events = POLLIN;
+      pfd[i].revents = 0;
+    }
+    if (poll(pfd, n, timeout) < 0)
+      return -1;
+    if (take(r, pfd, n) < 0)
+      return -1;
+  }
+  *pkts = r->ready;
+  return r->nready;
+}
+
+int rtprecv_step(rtprecv_t *r, rtprecv_pkt_t ***pkts)
+{
+  struct pollfd pfd[3];
+  int fds[3];
+  int i, n;
+
+  release(r);
+  n = rtprecv_fds(r, fds);
+  for (i = 0; i < n; i++) {
+    pfd[i].fd = fds[i];
+    pfd[i].revents = POLLIN;
+  }
+  if (take(r, pfd, n) < 0)
+    return -1;
+  while (r->nready == 0 && wait_gap(r) == 0)
+    ;
+  *pkts = r->ready;
+  return r->nready;
+}
+
+int rtprecv_timeout(rtprecv_t *r)
+{
+  int64_t left;
+
+  if (r->held == 0)
+    return -1;
+  if (r->gap_since == 0)
+    return 0;
+  left = r->gap_since + r->hold_ms * 1000000LL - now_ns();
+  if (left <= 0)
+    return 0;
+  if (r->nack && left > r->nack_retry)
+    left = r->nack_retry;
+  return left / 1000000 + 1;
+}
+
+int rtprecv_write(rtprecv_t *r, int fd)
+{
+  struct iovec *iov = r->wiov;
+  int i, n, cnt = 0;
+  ssize_t w;
+
+  for (i = 0; i < r->nready; i++) {
+    if (r->ready[i]->len > 0) {
+      iov[cnt].iov_base = r->ready[i]->data;
+      iov[cnt].iov_len = r->ready[i]->len;
+      cnt++;
+    }
+  }
+  while (cnt > 0) {
+    n = (cnt > IOV_MAX) ? IOV_MAX : cnt;
+    w = writev(fd, iov, n);
+    if (w < 0) {
+      if (errno == EINTR) continue;
+      return -1;
+    }
+    /* Step over whatever was written */
+    while (cnt > 0 && w >= (ssize_t)iov->iov_len) {
+      w -= iov->iov_len;
+      iov++;
+      cnt--;
+    }
+    if (w > 0) {
+      iov->iov_base = (char *)iov->iov_base + w;
+      iov->iov_len -= w;
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,102 @@
+#ifndef _RTPRECV_H
+#define _RTPRECV_H
+
+#include <stdint.h>
+
+/* Receiving an RTP stream in batches.  Datagrams are taken from the
+   socket RTPRECV_BATCH at a time with recvmmsg() into buffers allocated
+   once, and put back in sequence order through a window of
+   RTPRECV_WINDOW packets, so that packets the network has swapped round
+   come out in order.  A missing packet is waited for until the window
+   moves past it or for RTPRECV_HOLD_MS, and then given up as lost.
+
+   The packets rtprecv_get() returns stay where they are until the next
+   call, so their payloads can be written out together.
+
+   With SMPTE 2022-1 FEC (see fec.h) the FEC packets are read as well,
+   and a packet missing from a row or column is rebuilt from the rest as
+   soon as it is the only one missing.  The window is then wide enough
+   for a whole matrix and a missing packet is waited for longer, since
+   the FEC for the first row only comes after the last.
+
+   With NACKs, the packets found missing are asked for again with RTCP
+   NACKs (see rtx.h) sent back to where the stream comes from, again
+   every quarter of the wait, until they come or are given up. */
+
+#define RTPRECV_BATCH 64        /* datagrams per recvmmsg() */
+#define RTPRECV_WINDOW 64       /* reorder window, in packets */
+#define RTPRECV_HOLD_MS 20      /* longest wait for a missing packet */
+#define RTPRECV_MAX 2048        /* largest datagram taken */
+#define RTPRECV_FEC_WINDOW 256  /* with FEC */
+#define RTPRECV_FEC_HOLD_MS 500
+#define RTPRECV_NACK_WINDOW 512 /* with NACKs */
+
+/* Flags */
+#define RTPRECV_ARRIVAL 1       /* kernel receive times for each packet */
+
+typedef struct {
+  uint16_t seq;
+  uint32_t timestamp;
+  uint32_t ssrc;
+  int pt;
+  int marker;
+  double arrival;               /* seconds since 1970, with RTPRECV_ARRIVAL */
+  uint8_t *data;                /* the payload */
+  int len;
+} rtprecv_pkt_t;
+
+typedef struct {
+  uint64_t datagrams;           /* received */
+  uint64_t bytes;               /* of payload */
+  uint64_t calls;               /* recvmmsg() calls that returned datagrams */
+  uint64_t lost;                /* never came, or came too late to be used,
+                                   and couldn't be rebuilt */
+  uint64_t late;                /* came after they were given up */
+  uint64_t duplicates;
+  uint64_t reordered;           /* came before an earlier one, and were put right */
+  uint64_t restarts;            /* jumps in sequence taken as a new stream */
+  uint64_t bad;                 /* not RTP, or truncated */
+  uint64_t fec;                 /* FEC packets received */
+  uint64_t recovered;           /* missing packets rebuilt from the FEC */
+  uint64_t nacks;               /* NACKs sent */
+  uint64_t nacked;              /* packets asked for in them */
+  uint64_t retransmitted;       /* packets that came after being asked for */
+} rtprecv_stats_t;
+
+typedef struct rtprecv rtprecv_t;
+
+rtprecv_t *rtprecv_new(int fd, int flags);
+void rtprecv_free(rtprecv_t *r);
+
+/* Read FEC from col_fd and row_fd (-1 for either there isn't) and
+   recover lost packets with it.  Call before the first rtprecv_get().
+   Returns 0, or -1 if there isn't the memory. */
+int rtprecv_fec(rtprecv_t *r, int col_fd, int row_fd);
+
+/* Ask for lost packets with NACKs, and wait up to ms for each.  Call
+   before the first rtprecv_get().  Returns 0, or -1 if there isn't the
+   memory. */
+int rtprecv_nack(rtprecv_t *r, int ms);
+
+/* Wait for the next packets in order.  Returns how many there are, in
+   *pkts, or -1 on an error (errno EINTR if a signal came). */
+int rtprecv_get(rtprecv_t *r, rtprecv_pkt_t ***pkts);
+
+/* For an event loop that waits on many streams: the sockets to wait
+   on (up to 3) in fds[], and how many there are */
+int rtprecv_fds(rtprecv_t *r, int *fds);
+/* Read whatever has come, without waiting, and return the packets now
+   in order like rtprecv_get() - possibly none */
+int rtprecv_step(rtprecv_t *r, rtprecv_pkt_t ***pkts);
+/* How many ms until rtprecv_step() should be called even if nothing
+   comes (to give up on a missing packet, or ask for it again), or -1 */
+int rtprecv_timeout(rtprecv_t *r);
+
+/* Write the payloads of the packets rtprecv_get() or rtprecv_step()
+   last returned to fd, with as few writes as it takes.  Returns 0, or
+   -1 on an error. */
+int rtprecv_write(rtprecv_t *r, int fd);
+
+const rtprecv_stats_t *rtprecv_stats(rtprecv_t *r);
+
+#endif
@@ -0,0 +1,144 @@
+/*
+ * rtx.c: the retransmit history and RTCP generic NACKs (see rtx.h).
+ *
+ * A NACK names each lost packet by a sequence number (PID) and a
+ * bitmask (BLP) of which of the 16 after it are lost too, so a run of
+ * losses takes one entry per 17 packets.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "rtx.h"
+
+rtx_history_t *rtx_new(int ms)
+{
+  rtx_history_t *h;
+  int want = (int)((int64_t)ms * RTX_RATE / 1000);
+
+  if ((h = calloc(1, sizeof(rtx_history_t))) == NULL)
+    return NULL;
+  h->slots = 64;
+  while (h->slots < want && h->slots < 65536)
+    h->slots *= 2;
+  h->keep_ns = ms * 1000000LL;
+  h->slot = calloc(h->slots, sizeof(rtx_slot_t));
+  h->buf = malloc((size_t)h->slots * RTX_MAX);
+  if (h->slot == NULL || h->buf == NULL) {
+    rtx_free(h);
+    return NULL;
+  }
+  return h;
+}
+
+void rtx_free(rtx_history_t *h)
+{
+  if (h == NULL)
+    return;
+  free(h->slot);
+  free(h->buf);
+  free(h);
+}
+
+void rtx_store(rtx_history_t *h, uint16_t seq, const struct iovec *iov, int cnt, int64_t now)
+{
+  int i = seq & (h->slots - 1), j, len = 0;
+  uint8_t *b = h->buf + (size_t)i * RTX_MAX;
+
+  for (j = 0; j < cnt; j++) {
+    if (len + iov[j].iov_len > RTX_MAX) {
+      h->slot[i].len = 0;             // too big to keep
+      return;
+    }
+    memcpy(b + len, iov[j].iov_base, iov[j].iov_len);
+    len += iov[j].iov_len;
+  }
+  h->slot[i].seq = seq;
+  h->slot[i].len = len;
+  h->slot[i].sent = now;
+}
+
+int rtx_find(rtx_history_t *h, uint16_t seq, int64_t now, uint8_t **data)
+{
+  int i = seq & (h->slots - 1);
+  rtx_slot_t *s = &h->slot[i];
+
+  if (s->len == 0 || s->seq != seq || now - s->sent > h->keep_ns)
+    return 0;
+  *data = h->buf + (size_t)i * RTX_MAX;
+  return s->len;
+}
+
+static void put32(uint8_t *b, uint32_t v)
+{
+  b[0] = v >> 24;
+  b[1] = v >> 16;
+  b[2] = v >> 8;
+  b[3] = v;
+}
+
+int rtx_pack_nack(uint8_t *buf, uint32_t ssrc, uint32_t media_ssrc, const uint16_t *seqs, int n)
+{
+  int i = 0, len = 20, words;
+  uint16_t pid, blp, d;
+
+  buf[0] = 0x80;                      // V=2, no report blocks
+  buf[1] = RTCP_RR;
+  buf[2] = 0;
+  buf[3] = 1;
+  put32(buf + 4, ssrc);
+
+  while (i < n) {
+    pid = seqs[i++];
+    blp = 0;
+    while (i < n && (d = (uint16_t)(seqs[i] - pid)) >= 1 && d <= 16) {
+      blp |= 1 << (d - 1);
+      i++;
+    }
+    buf[len] = pid >> 8;
+    buf[len+1] = pid & 0xff;
+    buf[len+2] = blp >> 8;
+    buf[len+3] = blp & 0xff;
+    len += 4;
+  }
+  words = (len - 8) / 4 - 1;
+  buf[8] = 0x80 | RTCP_NACK_FMT;
+  buf[9] = RTCP_RTPFB;
+  buf[10] = words >> 8;
+  buf[11] = words & 0xff;
+  put32(buf + 12, ssrc);
+  put32(buf + 16, media_ssrc);
+  return len;
+}
+
+int rtx_parse_nack(const uint8_t *buf, int len, uint16_t *seqs, int max)
+{
+  int n, i, b, cnt = 0;
+  uint16_t pid, blp;
+
+  while (len >= 4) {
+    n = ((buf[2] << 8) | buf[3]) * 4 + 4;
+    if ((buf[0] & 0xc0) != 0x80 || n > len)
+      break;
+    if (buf[1] == RTCP_RTPFB && (buf[0] & 0x1f) == RTCP_NACK_FMT) {
+      for (i = 12; i + 4 <= n; i += 4) {
+        pid = (buf[i] << 8) | buf[i+1];
+        blp = (buf[i+2] << 8) | buf[i+3];
+        if (cnt < max)
+          seqs[cnt++] = pid;
+        for (b = 0; b < 16; b++) {
+          if ((blp & (1 << b)) && cnt < max)
+            seqs[cnt++] = pid + b + 1;
+        }
+      }
+    }
+    buf += n;
+    len -= n;
+  }
+  return cnt;
+}
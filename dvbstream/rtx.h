@@ -0,0 +1,54 @@
+#ifndef _RTX_H
+#define _RTX_H
+
+#include <stdint.h>
+#include <sys/uio.h>
+
+/* Retransmission of lost RTP datagrams on request.  The receiver sends
+   RFC 4585 generic NACKs back to the address the stream comes from, and
+   the sender answers them with the datagrams as first sent, from a
+   history of those it sent in the last so many ms.
+
+   The history is a ring of slots, one per sequence number modulo its
+   size, so a datagram is found with one lookup and the memory it takes
+   is fixed when it is made: enough for the time asked for at up to
+   RTX_RATE datagrams a second, beyond which it holds less. */
+
+#define RTX_MAX 1500            /* largest datagram kept */
+#define RTX_RATE 5000           /* datagrams a second, about 50 Mbit/s */
+#define RTX_NACK_MAX 256        /* sequence numbers in one NACK */
+
+#define RTCP_RR 201
+#define RTCP_RTPFB 205          /* transport layer feedback */
+#define RTCP_NACK_FMT 1         /* generic NACK */
+
+typedef struct {
+  uint16_t seq;
+  int len;                      /* 0: empty */
+  int64_t sent;                 /* monotonic ns */
+} rtx_slot_t;
+
+typedef struct {
+  int slots;                    /* a power of 2 */
+  int64_t keep_ns;
+  rtx_slot_t *slot;
+  uint8_t *buf;                 /* slots x RTX_MAX */
+} rtx_history_t;
+
+rtx_history_t *rtx_new(int ms);
+void rtx_free(rtx_history_t *h);
+/* Keep the datagram in iov (header included), sent at now */
+void rtx_store(rtx_history_t *h, uint16_t seq, const struct iovec *iov, int cnt, int64_t now);
+/* The datagram seq, if it is still kept and was sent no longer ago than
+   the history lasts.  Returns its length, or 0. */
+int rtx_find(rtx_history_t *h, uint16_t seq, int64_t now, uint8_t **data);
+
+/* An empty receiver report and a NACK for the n sequence numbers in
+   seqs[] (in order) in buf, which must have room for 20 + 4 * n bytes.
+   Returns its length. */
+int rtx_pack_nack(uint8_t *buf, uint32_t ssrc, uint32_t media_ssrc, const uint16_t *seqs, int n);
+/* The sequence numbers asked for by the NACKs in an RTCP packet, up to
+   max of them.  Returns how many there are. */
+int rtx_parse_nack(const uint8_t *buf, int len, uint16_t *seqs, int max);
+
+#endif
@@ -0,0 +1,385 @@
+/*
+ * secfilt.c: section filters on a transport stream, matched in software
+ * as a DVB demux matches them (see secfilt.h).
+ *
+ * A PID with filters has its filters listed by the table_id they take,
+ * with a list of its own for those that take more than one, so a
+ * section is only ever tried against the filters that could want it.
+ * Each filter's filter, mask and mode bytes are laid out beforehand as
+ * they fall in the section, and compared eight bytes at a time.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "secfilt.h"
+
+#define TS_PACKET 188
+#define ALL_PIDS 8192
+#define SECTION_MAX (3 + 0x0fff)
+
+/* The section bytes the filter bytes fall on (0 and 3 to 17), rounded
+   up to whole words */
+#define MATCH_WORDS 3
+
+typedef union {
+  uint8_t b[MATCH_WORDS * 8];
+  uint64_t w[MATCH_WORDS];
+} match_t;
+
+struct secfilt_filter {
+  int pid;
+  int table_id;              /* -1: takes more than one */
+  int flags;
+  int words;                 /* of the section to compare */
+  int negative;              /* has bits that must differ */
+  match_t value;
+  match_t pos;               /* bits that must be as in value */
+  match_t neg;               /* bits of which one must differ */
+  psi_section_cb cb;
+  void *arg;
+  int dead;                  /* removed while sections were going out */
+  struct secfilt_filter *next;
+  struct secfilt_filter *next_dead;
+};
+
+/* The filters of one PID, and the section being gathered from it */
+typedef struct {
+  secfilt_filter_t *table[256];
+  secfilt_filter_t *any;
+  int filters;
+  uint8_t *buf;
+  int pos;                   /* bytes of the section so far, 0: none */
+  int need;                  /* its length, once known */
+  int skip;                  /* bytes still to come of a section nobody wants */
+  int cc;
+} pidfilt_t;
+
+struct secfilt {
+  pidfilt_t *pids[ALL_PIDS];
+  psi_stats_t *stats;
+  int busy;                  /* in secfilt_packet() */
+  secfilt_filter_t *dead;    /* to be unlinked once it returns */
+};
+
+secfilt_t *secfilt_new(psi_stats_t *stats)
+{
+  secfilt_t *s;
+
+  if ((s = calloc(1, sizeof(secfilt_t))) == NULL)
+    return NULL;
+  s->stats = stats;
+  return s;
+}
+
+static void free_pid(pidfilt_t *pf)
+{
+  secfilt_filter_t *f, *next;
+  int i;
+
+  for (i = 0; i <= 256; i++) {
+    for (f = (i < 256) ? pf->table[i] : pf->any; f != NULL; f = next) {
+      next = f->next;
+      free(f);
+    }
+  }
+  free(pf->buf);
+  free(pf);
+}
+
+void secfilt_free(secfilt_t *s)
+{
+  int pid;
+
+  if (s == NULL)
+    return;
+  for (pid = 0; pid < ALL_PIDS; pid++) {
+    if (s->pids[pid] != NULL)
+      free_pid(s->pids[pid]);
+  }
+  free(s);
+}
+
+secfilt_filter_t *secfilt_add(secfilt_t *s, int pid, const uint8_t *filter,
+                              const uint8_t *mask, const uint8_t *mode,
+                              int flags, psi_section_cb cb, void *arg)
+{
+  secfilt_filter_t *f, **head;
+  pidfilt_t *pf;
+  uint8_t md;
+  int i, j;
+
+  if (pid < 0 || pid >= ALL_PIDS)
+    return NULL;
+  if ((pf = s->pids[pid]) == NULL) {
+    if ((pf = calloc(1, sizeof(pidfilt_t))) == NULL)
+      return NULL;
+    pf->cc = -1;
+    s->pids[pid] = pf;
+  }
+  if ((f = calloc(1, sizeof(secfilt_filter_t))) == NULL)
+    return NULL;
+  f->pid = pid;
+  f->flags = flags;
+  f->cb = cb;
+  f->arg = arg;
+  for (i = 0; i < SECFILT_SIZE; i++) {
+    j = (i == 0) ? 0 : i + 2;
+    md = (mode != NULL) ? mode[i] : 0;
+    f->value.b[j] = filter[i];
+    f->pos.b[j] = mask[i] & ~md;
+    f->neg.b[j] = mask[i] & md;
+    if (mask[i])
+      f->words = j / 8 + 1;
+    if (mask[i] & md)
+      f->negative = 1;
+  }
+  f->table_id = (mask[0] == 0xff && (mode == NULL || mode[0] == 0)) ? filter[0] : -1;
+
+  head = (f->table_id >= 0) ? &pf->table[f->table_id] : &pf->any;
+  f->next = *head;
+  *head = f;
+  pf->filters++;
+  return f;
+}
+
+secfilt_filter_t *secfilt_add_table(secfilt_t *s, int pid, int table_id, int ext,
+                                    int flags, psi_section_cb cb, void *arg)
+{
+  uint8_t filter[SECFILT_SIZE], mask[SECFILT_SIZE];
+
+  memset(filter, 0, sizeof(filter));
+  memset(mask, 0, sizeof(mask));
+  filter[0] = table_id;
+  mask[0] = 0xff;
+  if (ext >= 0) {
+    filter[1] = ext >> 8;
+    filter[2] = ext & 0xff;
+    mask[1] = mask[2] = 0xff;
+  }
+  return secfilt_add(s, pid, filter, mask, NULL, flags, cb, arg);
+}
+
+static void unlink_filter(secfilt_t *s, secfilt_filter_t *f)
+{
+  pidfilt_t *pf = s->pids[f->pid];
+  secfilt_filter_t **fp;
+
+  fp = (f->table_id >= 0) ? &pf->table[f->table_id] : &pf->any;
+  while (*fp != NULL && *fp != f)
+    fp = &(*fp)->next;
+  if (*fp == NULL)
+    return;
+  *fp = f->next;
+  if (--pf->filters == 0) {
+    free(pf->buf);
+    free(pf);
+    s->pids[f->pid] = NULL;
+  }
+  free(f);
+}
+
+/* While sections are being handed out the lists are left as they are,
+   and the filter is only marked */
+void secfilt_remove(secfilt_t *s, secfilt_filter_t *f)
+{
+  if (f == NULL || f->dead)
+    return;
+  if (s->busy) {
+    f->dead = 1;
+    f->next_dead = s->dead;
+    s->dead = f;
+    return;
+  }
+  unlink_filter(s, f);
+}
+
+int secfilt_wants(secfilt_t *s, int pid)
+{
+  return pid >= 0 && pid < ALL_PIDS && s->pids[pid] != NULL;
+}
+
+static int match(secfilt_filter_t *f, const match_t *h)
+{
+  uint64_t x, diff = 0;
+  int i;
+
+  for (i = 0; i < f->words; i++) {
+    x = h->w[i] ^ f->value.w[i];
+    if (x & f->pos.w[i])
+      return 0;
+    diff |= x & f->neg.w[i];
+  }
+  return !f->negative || diff;
+}
+
+/* Could a section with this table_id get through? */
+static int wanted(pidfilt_t *pf, int table_id)
+{
+  return pf->table[table_id] != NULL || pf->any != NULL;
+}
+
+/* A complete section to the filters that take it */
+static int deliver(secfilt_t *s, pidfilt_t *pf, uint8_t *sec, int len)
+{
+  secfilt_filter_t *f;
+  match_t head;
+  int i, n = 0, crc = -1;     // -1: not checked yet, 0: bad, 1: good
+
+  memset(&head, 0, sizeof(head));
+  memcpy(head.b, sec, (len < (int)sizeof(head.b)) ? len : (int)sizeof(head.b));
+  for (i = 0; i < 2; i++) {
+    for (f = (i == 0) ? pf->table[sec[0]] : pf->any; f != NULL; f = f->next) {
+      if (f->dead || !match(f, &head))
+        continue;
+      if ((f->flags & SECFILT_CRC) && (sec[1] & 0x80)) {
+        if (crc < 0) {
+          crc = (psi_crc32(sec, len) == 0);
+          if (!crc && s->stats) s->stats->crc_errors++;
+        }
+        if (!crc)
+          continue;
+      }
+      f->cb(f->arg, sec, len);
+      n++;
+    }
+  }
+  return n;
+}
+
+/* Start gathering a section from the len bytes at p, which are all
+   there is of it in this packet */
+static int start_section(pidfilt_t *pf, uint8_t *p, int len, int need)
+{
+  if (pf->buf == NULL && (pf->buf = malloc(SECTION_MAX)) == NULL)
+    return 0;
+  memcpy(pf->buf, p, len);
+  pf->pos = len;
+  pf->need = need;
+  return len;
+}
+
+/* The next len bytes of the section being gathered (or skipped) */
+static int carry_on(secfilt_t *s, pidfilt_t *pf, uint8_t *p, int len)
+{
+  int n;
+
+  if (pf->skip > 0) {
+    pf->skip -= (len < pf->skip) ? len : pf->skip;
+    return 0;
+  }
+  if (pf->pos < 3) {
+    /* The header was split too: now for the length */
+    n = 3 - pf->pos;
+    if (n > len) n = len;
+    memcpy(pf->buf + pf->pos, p, n);
+    pf->pos += n;
+    p += n;
+    len -= n;
+    if (pf->pos < 3)
+      return 0;
+    pf->need = 3 + (((pf->buf[1] & 0x0f) << 8) | pf->buf[2]);
+    if (!wanted(pf, pf->buf[0])) {
+      pf->pos = 0;
+      pf->skip = pf->need - 3;
+      pf->skip -= (len < pf->skip) ? len : pf->skip;
+      return 0;
+    }
+  }
+  n = pf->need - pf->pos;
+  if (n > len) n = len;
+  memcpy(pf->buf + pf->pos, p, n);
+  pf->pos += n;
+  if (pf->pos < pf->need)
+    return 0;
+  pf->pos = 0;
+  return deliver(s, pf, pf->buf, pf->need);
+}
+
+static void sweep(secfilt_t *s)
+{
+  secfilt_filter_t *f;
+
+  while ((f = s->dead) != NULL) {
+    s->dead = f->next_dead;
+    unlink_filter(s, f);
+  }
+}
+
+int secfilt_packet(secfilt_t *s, uint8_t *pkt)
+{
+  pidfilt_t *pf = s->pids[((pkt[1] & 0x1f) << 8) | pkt[2]];
+  int af, cc, l, ptr, left, need, n = 0;
+
+  if (pf == NULL)
+    return 0;
+  af = (pkt[3] >> 4) & 0x03;
+  if (!(af & 1) || (pkt[1] & 0x80))   // no payload, or a transport error
+    return 0;
+  l = 4;
+  if (af == 3)
+    l += pkt[4] + 1;
+  if (l >= TS_PACKET)
+    return 0;
+
+  cc = pkt[3] & 0x0f;
+  if (cc == pf->cc)           // a repeated packet
+    return 0;
+  if (pf->cc >= 0 && cc != ((pf->cc + 1) & 0x0f)) {
+    if (pf->pos > 0 && s->stats)
+      s->stats->discontinuities++;
+    pf->pos = pf->skip = 0;   // lost the middle of a section
+  }
+  pf->cc = cc;
+
+  s->busy++;
+  if (!(pkt[1] & 0x40)) {
+    if (pf->pos > 0 || pf->skip > 0)
+      n += carry_on(s, pf, pkt + l, TS_PACKET - l);
+    goto out;
+  }
+
+  /* The pointer field says where the first new section starts; the
+     bytes before it finish the previous one */
+  ptr = pkt[l++];
+  if (l + ptr >= TS_PACKET) {
+    pf->pos = pf->skip = 0;
+    goto out;
+  }
+  if (pf->pos > 0 || pf->skip > 0)
+    n += carry_on(s, pf, pkt + l, ptr);
+  pf->pos = pf->skip = 0;
+  l += ptr;
+
+  /* Sections that end in this packet are passed on from it as they are */
+  while (l < TS_PACKET && pkt[l] != 0xff) {
+    left = TS_PACKET - l;
+    if (left < 3) {
+      start_section(pf, pkt + l, left, 0);
+      break;
+    }
+    need = 3 + (((pkt[l+1] & 0x0f) << 8) | pkt[l+2]);
+    if (!wanted(pf, pkt[l])) {
+      if (need > left) {
+        pf->skip = need - left;
+        break;
+      }
+    } else if (need <= left) {
+      n += deliver(s, pf, pkt + l, need);
+    } else {
+      start_section(pf, pkt + l, left, need);
+      break;
+    }
+    l += need;
+  }
+
+out:
+  if (--s->busy == 0 && s->dead != NULL)
+    sweep(s);
+  return n;
+}
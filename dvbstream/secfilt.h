@@ -0,0 +1,50 @@
+#ifndef _SECFILT_H
+#define _SECFILT_H
+
+#include <stdint.h>
+
+#include "psi.h"
+
+/* Section filters as a DVB demux has them, in software: any number of
+   filters, each on a PID with up to SECFILT_SIZE bytes of filter, mask
+   and mode.  filter[0] is matched against the table_id and filter[i]
+   against byte i + 2 of the section, so filter[1] and [2] cover the
+   table_id_extension.  Where a mode bit is 0 the section must have the
+   filter's bit; of the bits with mode 1 at least one must differ.
+
+   The packets of a PID are only looked at if it has a filter, and a
+   section starting is only collected if one of the PID's filters could
+   take its table_id.  A section that lies within one packet is handed
+   on where it is; only those that run over several are copied. */
+
+#define SECFILT_SIZE 16        /* as DMX_FILTER_SIZE */
+
+/* Flags */
+#define SECFILT_CRC 1          /* only sections with a good CRC32 (if they have one) */
+
+typedef struct secfilt_filter secfilt_filter_t;
+typedef struct secfilt secfilt_t;
+
+/* stats, if given, counts discontinuities and CRC errors */
+secfilt_t *secfilt_new(psi_stats_t *stats);
+void secfilt_free(secfilt_t *s);
+
+/* filter, mask and mode hold SECFILT_SIZE bytes; mode may be NULL (all
+   0).  cb is called with each section that gets through; it may add and
+   remove filters, including its own. */
+secfilt_filter_t *secfilt_add(secfilt_t *s, int pid, const uint8_t *filter,
+                              const uint8_t *mask, const uint8_t *mode,
+                              int flags, psi_section_cb cb, void *arg);
+/* The filter for table_id (and table_id_extension, if ext >= 0) */
+secfilt_filter_t *secfilt_add_table(secfilt_t *s, int pid, int table_id, int ext,
+                                    int flags, psi_section_cb cb, void *arg);
+void secfilt_remove(secfilt_t *s, secfilt_filter_t *f);
+
+/* Does the PID have a filter? */
+int secfilt_wants(secfilt_t *s, int pid);
+
+/* Feed one TS packet.  Returns the number of sections passed to
+   filters. */
+int secfilt_packet(secfilt_t *s, uint8_t *pkt);
+
+#endif
@@ -0,0 +1,113 @@
+/*
+ * stats.c: the counters of dvbstream's stages, in the Prometheus text
+ * format, for the telnet METRICS command and the -stats file.
+ *
+ * Each stage keeps its own counters in its own struct, and only the
+ * thread running the stage writes them, so counting costs an add and
+ * nothing else.  They are gathered up here only when somebody asks,
+ * with relaxed atomic loads so a reader in another thread never sees a
+ * torn value.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "stats.h"
+
+#define LOAD(x) __atomic_load_n(&(x), __ATOMIC_RELAXED)
+
+void latency_add(latency_t *l, int64_t ns)
+{
+  uint64_t us = (ns > 0) ? ns / 1000 : 0;
+  int b = 0;
+
+  if (us > 0)
+    b = 64 - __builtin_clzll(us);   // us < 2^b
+  if (b >= LATENCY_BUCKETS)
+    b = LATENCY_BUCKETS - 1;
+  l->buckets[b]++;
+  l->count++;
+  l->sum_ns += (ns > 0) ? ns : 0;
+}
+
+void stats_family(FILE *f, const char *name, const char *type, const char *help)
+{
+  fprintf(f, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+void stats_value(FILE *f, const char *name, const char *labels, uint64_t v)
+{
+  if (labels != NULL && labels[0])
+    fprintf(f, "%s{%s} %llu\n", name, labels, (unsigned long long)v);
+  else
+    fprintf(f, "%s %llu\n", name, (unsigned long long)v);
+}
+
+/* Each of the fields, for each of the n structs at objs[], labelled
+   labels[] */
+void stats_fields(FILE *f, const stats_field_t *fields, int nfields,
+                  void **objs, char **labels, int n)
+{
+  int i, k;
+
+  if (n == 0)
+    return;
+  for (k = 0; k < nfields; k++) {
+    stats_family(f, fields[k].name, fields[k].gauge ? "gauge" : "counter", fields[k].help);
+    for (i = 0; i < n; i++)
+      stats_value(f, fields[k].name, labels[i],
+                  LOAD(*(uint64_t *)((char *)objs[i] + fields[k].off)));
+  }
+}
+
+/* A histogram of latencies, in seconds as Prometheus likes them */
+void stats_latency(FILE *f, const char *name, const char *help,
+                   latency_t **l, char **labels, int n)
+{
+  uint64_t cum;
+  int i, b;
+
+  if (n == 0)
+    return;
+  stats_family(f, name, "histogram", help);
+  for (i = 0; i < n; i++) {
+    cum = 0;
+    for (b = 0; b < LATENCY_BUCKETS; b++) {
+      cum += LOAD(l[i]->buckets[b]);
+      if (b < LATENCY_BUCKETS - 1)
+        fprintf(f, "%s_bucket{%s%sle=\"%.9g\"} %llu\n", name, labels[i], labels[i][0] ? "," : "",
+                (double)(1ULL << b) / 1e6, (unsigned long long)cum);
+      else
+        fprintf(f, "%s_bucket{%s%sle=\"+Inf\"} %llu\n", name, labels[i], labels[i][0] ? "," : "",
+                (unsigned long long)cum);
+    }
+    fprintf(f, "%s_sum{%s} %.9f\n", name, labels[i], LOAD(l[i]->sum_ns) / 1e9);
+    fprintf(f, "%s_count{%s} %llu\n", name, labels[i], (unsigned long long)LOAD(l[i]->count));
+  }
+}
+
+/* Replace path with text, so a reader never sees half of it */
+int stats_write_file(const char *path, const char *text, size_t len)
+{
+  char tmp[1024];
+  int fd, r;
+
+  snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+  if ((fd = open(tmp, O_WRONLY|O_CREAT|O_TRUNC, 0644)) < 0)
+    return -1;
+  r = write(fd, text, len);
+  close(fd);
+  if (r != (int)len || rename(tmp, path) < 0) {
+    unlink(tmp);
+    return -1;
+  }
+  return 0;
+}
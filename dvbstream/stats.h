@@ -0,0 +1,37 @@
+#ifndef _STATS_H
+#define _STATS_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Latencies in powers of two from 1 us: bucket i counts those under
+   2^i us, the last one everything longer (4.2 s and up) */
+#define LATENCY_BUCKETS 24
+
+typedef struct {
+  uint64_t buckets[LATENCY_BUCKETS];
+  uint64_t count;
+  uint64_t sum_ns;
+} latency_t;
+
+void latency_add(latency_t *l, int64_t ns);
+
+/* One counter of a struct, for writing out the same counter of several
+   of them: name, what it counts, and where it is in the struct */
+typedef struct {
+  const char *name;
+  const char *help;
+  size_t off;
+  int gauge;                   /* goes down as well as up */
+} stats_field_t;
+
+void stats_family(FILE *f, const char *name, const char *type, const char *help);
+void stats_value(FILE *f, const char *name, const char *labels, uint64_t v);
+void stats_fields(FILE *f, const stats_field_t *fields, int nfields,
+                  void **objs, char **labels, int n);
+void stats_latency(FILE *f, const char *name, const char *help,
+                   latency_t **l, char **labels, int n);
+int stats_write_file(const char *path, const char *text, size_t len);
+
+#endif
@@ -0,0 +1,384 @@
+/*
+ * timeshift.c: time-shift recordings (-shift:), a ring of segment files
+ * with an index of where each moment of the stream went.
+ *
+ * The packets go through a recorder_t like any other recording, so they
+ * are written in the same large blocks, and in threaded mode by the
+ * egress thread that owns the output - never by the thread reading the
+ * stream.  When the segment being written is full the recorder carries
+ * on in the next one (record_reopen()), going back to the first after
+ * the last, and the index entries for the segment being rewritten are
+ * dropped.
+ *
+ * The index is two rings of entries in stream order - every PCR, and
+ * every random access point - so the entries, and their times, only
+ * ever go forwards and a time is found by binary search.  The index is
+ * updated as the packets are written and a SEEK never has to read the
+ * files.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "timeshift.h"
+#include "pcrclock.h"
+
+#define TS_SIZE 188
+#define INDEX_START 1024             /* entries, to begin with */
+#define INDEX_MAX (1 << 22)          /* and at most */
+
+static int64_t realtime_ns(void)
+{
+  struct timespec t;
+
+  clock_gettime(CLOCK_REALTIME, &t);
+  return (int64_t)t.tv_sec * 1000000000LL + t.tv_nsec;
+}
+
+tshift_t *tshift_new(char *dir, int mb, int nseg)
+{
+  tshift_t *ts;
+  int i;
+
+  if (mb <= 0) mb = SHIFT_MB;
+  if (nseg <= 0) nseg = SHIFT_SEGMENTS;
+  if (nseg > SHIFT_MAX_SEGMENTS) nseg = SHIFT_MAX_SEGMENTS;
+  /* Each segment at least a block, and a whole number of them */
+  if (mb < nseg) mb = nseg;
+
+  ts = calloc(1, sizeof(tshift_t));
+  if (ts == NULL)
+    return NULL;
+  ts->dir = dir;
+  ts->nseg = nseg;
+  ts->seg_size = (off_t)(mb / nseg) * REC_BLOCK;
+  ts->names = calloc(nseg, sizeof(char *));
+  ts->seg_len = calloc(nseg, sizeof(off_t));
+  if (ts->names == NULL || ts->seg_len == NULL)
+    goto fail;
+  for (i = 0; i < nseg; i++) {
+    ts->names[i] = malloc(strlen(dir) + 16);
+    if (ts->names[i] == NULL)
+      goto fail;
+    sprintf(ts->names[i], "%s/shift%03d.ts", dir, i);
+  }
+  ts->rec.fd = -1;
+  ts->pcr_pid = -1;
+  pthread_mutex_init(&ts->lock, NULL);
+  return ts;
+
+fail:
+  if (ts->names != NULL) {
+    for (i = 0; i < nseg; i++)
+      free(ts->names[i]);
+  }
+  free(ts->names);
+  free(ts->seg_len);
+  free(ts);
+  return NULL;
+}
+
+int tshift_open(tshift_t *ts, int direct, int use_uring, int policy)
+{
+  int i;
+
+  if (mkdir(ts->dir, 0755) < 0 && errno != EEXIST)
+    return -1;
+  /* Leftovers from an earlier run would look like part of this one */
+  for (i = 1; i < ts->nseg; i++)
+    unlink(ts->names[i]);
+  if (record_open(&ts->rec, ts->names[0], direct, use_uring, policy) < 0)
+    return -1;
+  record_preallocate(&ts->rec, ts->seg_size);
+  return 0;
+}
+
+/* Add an entry to the end of an index, making room if need be */
+static void index_add(tshift_t *ts, shift_index_t *ix, shift_entry_t *e)
+{
+  shift_entry_t *n;
+  uint64_t i;
+
+  if (ix->tail - ix->head == ix->size) {
+    if (ix->size < INDEX_MAX
+        && (n = malloc(sizeof(shift_entry_t) * (ix->size ? ix->size * 2 : INDEX_START))) != NULL) {
+      for (i = ix->head; i < ix->tail; i++)
+        n[i - ix->head] = ix->e[i & (ix->size - 1)];
+      free(ix->e);
+      ix->e = n;
+      ix->tail -= ix->head;
+      ix->head = 0;
+      ix->size = ix->size ? ix->size * 2 : INDEX_START;
+    } else if (ix->size == 0) {
+      ts->index_lost++;
+      return;
+    } else {
+      /* No more room for it: forget the oldest */
+      ix->head++;
+      ts->index_lost++;
+    }
+  }
+  ix->e[ix->tail & (ix->size - 1)] = *e;
+  ix->tail++;
+}
+
+/* Drop the entries for segments older than seg */
+static void index_expire(shift_index_t *ix, uint64_t seg)
+{
+  while (ix->head < ix->tail && ix->e[ix->head & (ix->size - 1)].seg < seg)
+    ix->head++;
+}
+
+/* The last entry at or before time, or the first if they are all later.
+   Returns -1 if the index is empty. */
+static int64_t index_find(shift_index_t *ix, int64_t time)
+{
+  uint64_t lo, hi, mid;
+
+  if (ix->head == ix->tail)
+    return -1;
+  lo = ix->head;
+  hi = ix->tail;
+  while (hi - lo > 1) {
+    mid = lo + (hi - lo) / 2;
+    if (ix->e[mid & (ix->size - 1)].time <= time)
+      lo = mid;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+/* The PTS of the PES packet starting in pkt, or -1 */
+static int64_t get_pts(uint8_t *pkt, uint8_t **es)
+{
+  uint8_t *p = pkt + 4, *end = pkt + TS_SIZE;
+
+  *es = NULL;
+  if (!(pkt[1] & 0x40))
+    return -1;
+  if (pkt[3] & 0x20)
+    p += p[0] + 1;
+  if (p + 14 > end || p[0] != 0 || p[1] != 0 || p[2] != 1)
+    return -1;
+  /* Streams without the optional header, such as padding */
+  if (p[3] == 0xbc || p[3] == 0xbe || p[3] == 0xbf || p[3] == 0xf0
+      || p[3] == 0xf1 || p[3] == 0xff || p[3] == 0xf2 || p[3] == 0xf8)
+    return -1;
+  if ((p[6] & 0xc0) != 0x80)
+    return -1;
+  if (p + 9 + p[8] < end)
+    *es = p + 9 + p[8];
+  if (!(p[7] & 0x80))
+    return -1;
+  return ((int64_t)(p[9] & 0x0e) << 29) | (p[10] << 22) | ((p[11] & 0xfe) << 14)
+    | (p[12] << 7) | (p[13] >> 1);
+}
+
+/* Whether a video access unit that can be decoded on its own starts in
+   the packet: flagged by the multiplexer, or an MPEG-2 sequence header
+   or GOP, or an H.264 SPS, at the start of the PES payload */
+static int is_rap(uint8_t *pkt, uint8_t *es)
+{
+  uint8_t *end = pkt + TS_SIZE;
+
+  if ((pkt[3] & 0x20) && pkt[4] > 0 && (pkt[5] & 0x40))
+    return 1;
+  if (es == NULL || es + 5 > end)
+    return 0;
+  if (es[0] != 0 || es[1] != 0)
+    return 0;
+  if (es[2] == 0) {                  /* 4 byte H.264 start code */
+    es++;
+    if (es + 5 > end) return 0;
+  }
+  if (es[2] != 1)
+    return 0;
+  if (es[3] == 0xb3 || es[3] == 0xb8)
+    return 1;
+  /* H.264: an access unit delimiter may come first */
+  if ((es[3] & 0x1f) == 9) {
+    es += 5;
+    while (es + 4 <= end && !(es[0] == 0 && es[1] == 0 && es[2] == 1))
+      es++;
+    if (es + 4 > end)
+      return 0;
+  }
+  return (es[3] & 0x1f) == 7 && !(es[3] & 0x80);
+}
+
+/* Follow the PCRs to keep the stream's time.  Returns 1 if pkt has one. */
+static int track_pcr(tshift_t *ts, uint8_t *pkt, int pid, int64_t *pcr)
+{
+  int64_t delta;
+  int disc;
+
+  if (ts->pcr_pid >= 0 && pid != ts->pcr_pid)
+    return 0;
+  if (!get_pcr(pkt, pcr, &disc))
+    return 0;
+  if (ts->pcr_pid < 0)
+    ts->pcr_pid = pid;
+  /* tshift_now() reads the time from the routing thread */
+  pthread_mutex_lock(&ts->lock);
+  if (!ts->have_pcr) {
+    ts->have_pcr = 1;
+    ts->start = ts->time = realtime_ns();
+  } else {
+    delta = *pcr - ts->pcr_last;
+    if (delta < 0) delta += PCR_WRAP;
+    /* A jump: carry on from where the stream was */
+    if (disc || delta > PCR_MAX_GAP) {
+      ts->discontinuities++;
+      delta = 0;
+    }
+    ts->ticks += delta;
+    ts->time = ts->start + ts->ticks / 27 * 1000;
+  }
+  pthread_mutex_unlock(&ts->lock);
+  ts->pcr_last = *pcr;
+  return 1;
+}
+
+/* Finish the segment being written and start the next.  The entries of
+   the segment about to be rewritten go first, and the finished one is
+   only given to SEEK once all of it is on the disk. */
+static void next_segment(tshift_t *ts)
+{
+  uint64_t seg = ts->seg + 1;
+  off_t len;
+  int n = seg % ts->nseg;
+
+  if (seg >= (uint64_t)ts->nseg) {
+    pthread_mutex_lock(&ts->lock);
+    index_expire(&ts->pcrs, seg - ts->nseg + 1);
+    index_expire(&ts->raps, seg - ts->nseg + 1);
+    pthread_mutex_unlock(&ts->lock);
+  }
+
+  len = record_tell(&ts->rec);
+  if (record_reopen(&ts->rec, ts->names[n]) < 0)
+    perror(ts->names[n]);
+
+  pthread_mutex_lock(&ts->lock);
+  ts->seg_len[ts->seg % ts->nseg] = len;
+  ts->seg = seg;
+  ts->written = 0;
+  pthread_mutex_unlock(&ts->lock);
+}
+
+void tshift_write(tshift_t *ts, struct iovec *iov, int cnt)
+{
+  shift_entry_t e;
+  uint8_t *pkt, *es;
+  int64_t pcr;
+  int i, from, pid, has_pcr, rap;
+
+  from = 0;
+  for (i = 0; i < cnt; i++) {
+    pkt = iov[i].iov_base;
+    pid = ((pkt[1] & 0x1f) << 8) | pkt[2];
+    has_pcr = track_pcr(ts, pkt, pid, &pcr);
+    e.pts = get_pts(pkt, &es);
+    rap = ts->have_pcr && is_rap(pkt, es);
+
+    if (record_tell(&ts->rec) + (off_t)(i - from + 1) * TS_SIZE > ts->seg_size) {
+      record_write(&ts->rec, iov + from, i - from);
+      from = i;
+      next_segment(ts);
+    }
+    if (!has_pcr && !rap)
+      continue;
+
+    /* Everything before it written, to know exactly where it goes */
+    record_write(&ts->rec, iov + from, i - from);
+    from = i;
+    e.time = ts->time;
+    e.pcr = has_pcr ? pcr : -1;
+    e.seg = ts->seg;
+    e.pos = record_tell(&ts->rec);
+    pthread_mutex_lock(&ts->lock);
+    if (has_pcr)
+      index_add(ts, &ts->pcrs, &e);
+    if (rap)
+      index_add(ts, &ts->raps, &e);
+    pthread_mutex_unlock(&ts->lock);
+  }
+  record_write(&ts->rec, iov + from, cnt - from);
+
+  pthread_mutex_lock(&ts->lock);
+  ts->written = record_written(&ts->rec);
+  pthread_mutex_unlock(&ts->lock);
+}
+
+int tshift_seek(tshift_t *ts, int64_t time, shift_entry_t *at, int *rap, shift_part_t *parts)
+{
+  shift_index_t *ix;
+  int64_t i;
+  uint64_t s;
+  int n = 0;
+
+  pthread_mutex_lock(&ts->lock);
+  *rap = (ts->raps.head != ts->raps.tail);
+  ix = *rap ? &ts->raps : &ts->pcrs;
+  i = index_find(ix, time);
+  /* Not past what is on the disk */
+  while (i >= 0 && ix->e[i & (ix->size - 1)].seg == ts->seg
+         && ix->e[i & (ix->size - 1)].pos >= ts->written)
+    i = ((uint64_t)i > ix->head) ? i - 1 : -1;
+  if (i >= 0) {
+    *at = ix->e[i & (ix->size - 1)];
+    for (s = at->seg; s <= ts->seg; s++) {
+      parts[n].file = ts->names[s % ts->nseg];
+      parts[n].offset = (s == at->seg) ? at->pos : 0;
+      parts[n].length = ((s == ts->seg) ? ts->written : ts->seg_len[s % ts->nseg]) - parts[n].offset;
+      n++;
+    }
+  }
+  pthread_mutex_unlock(&ts->lock);
+  return n;
+}
+
+int64_t tshift_now(tshift_t *ts)
+{
+  int64_t t;
+
+  pthread_mutex_lock(&ts->lock);
+  t = ts->have_pcr ? ts->time : 0;
+  pthread_mutex_unlock(&ts->lock);
+  return t;
+}
+
+void tshift_close(tshift_t *ts)
+{
+  record_close(&ts->rec);
+  pthread_mutex_lock(&ts->lock);
+  ts->written = ts->rec.offset;
+  pthread_mutex_unlock(&ts->lock);
+}
+
+void tshift_report(tshift_t *ts, FILE *f)
+{
+  uint64_t nseg = ts->seg < (uint64_t)ts->nseg ? ts->seg + 1 : ts->nseg;
+
+  fprintf(f, "shift %s: %llu segments of %lld MB, %llu in the ring, %.1f s indexed, %llu PCRs and %llu random access points, %llu discontinuities, %llu index entries lost\n",
+          ts->dir, (unsigned long long)ts->seg + 1, (long long)(ts->seg_size / REC_BLOCK),
+          (unsigned long long)nseg,
+          ts->pcrs.head < ts->pcrs.tail
+            ? (ts->pcrs.e[(ts->pcrs.tail - 1) & (ts->pcrs.size - 1)].time
+               - ts->pcrs.e[ts->pcrs.head & (ts->pcrs.size - 1)].time) / 1e9 : 0.0,
+          (unsigned long long)(ts->pcrs.tail - ts->pcrs.head),
+          (unsigned long long)(ts->raps.tail - ts->raps.head),
+          (unsigned long long)ts->discontinuities, (unsigned long long)ts->index_lost);
+  record_report(&ts->rec, f);
+}
@@ -0,0 +1,99 @@
+#ifndef _TIMESHIFT_H
+#define _TIMESHIFT_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "record.h"
+
+/* A time-shift recording (-shift:).  The stream goes round a ring of
+   segment files, dir/shift000.ts and on, each rewritten in turn once
+   they are all full, and an index kept in memory says where in them
+   each moment of the stream is, so that it can be played from any time
+   still in the ring without reading the files.
+
+   The index has an entry for each PCR of one PID (the first to carry
+   PCRs) and, apart from those, one for each random access point: a
+   packet flagged as one in its adaptation field, or the start of a PES
+   packet that begins with an MPEG-2 sequence header or an H.264 SPS.
+   Each entry has the time the stream had got to, going by its PCRs from
+   the wall clock time of the first, and the PTS if the packet starts a
+   PES packet.  The entries are kept in time order and dropped as their
+   segment is rewritten, so a time is found by binary search. */
+
+#define SHIFT_MB 1024                /* the ring, by default */
+#define SHIFT_SEGMENTS 16
+#define SHIFT_MAX_SEGMENTS 1000
+
+typedef struct {
+  int64_t time;                      /* ns since 1970 */
+  int64_t pcr;                       /* 27 MHz, -1: none */
+  int64_t pts;                       /* 90 kHz, -1: none */
+  uint64_t seg;                      /* the segment, counting from the first */
+  off_t pos;                         /* where the packet is in it */
+} shift_entry_t;
+
+typedef struct {
+  shift_entry_t *e;
+  uint64_t size;                     /* a power of 2 */
+  uint64_t head, tail;               /* entries [head, tail) */
+} shift_index_t;
+
+/* Part of a segment file to read */
+typedef struct {
+  const char *file;
+  off_t offset;
+  off_t length;
+} shift_part_t;
+
+typedef struct {
+  char *dir;
+  int nseg;
+  off_t seg_size;
+  char **names;                      /* of the segment files */
+  off_t *seg_len;                    /* of each, once it is finished */
+  recorder_t rec;
+  uint64_t seg;                      /* the segment being written */
+  off_t written;                     /* how much of it is on the disk */
+
+  /* SEEK comes from the routing thread while an egress thread writes */
+  pthread_mutex_t lock;
+  shift_index_t pcrs;
+  shift_index_t raps;
+
+  int pcr_pid;                       /* -1: the first PID with a PCR */
+  int have_pcr;
+  int64_t pcr_last;                  /* as it was in the stream */
+  int64_t ticks;                     /* 27 MHz since the first PCR */
+  int64_t start;                     /* wall clock at the first PCR, ns */
+  int64_t time;                      /* where the stream has got to */
+
+  /* statistics */
+  uint64_t discontinuities;
+  uint64_t index_lost;               /* entries there was no memory for */
+} tshift_t;
+
+/* A ring of mb MB in nseg segment files in dir (made if need be) */
+tshift_t *tshift_new(char *dir, int mb, int nseg);
+int tshift_open(tshift_t *ts, int direct, int use_uring, int policy);
+/* Add TS packets to the recording, and index them */
+void tshift_write(tshift_t *ts, struct iovec *iov, int cnt);
+void tshift_close(tshift_t *ts);
+void tshift_report(tshift_t *ts, FILE *f);
+
+/* Where the stream is at time (ns since 1970): the random access point
+   at or before it - or the PCR, if there are no random access points -
+   in *at, and the parts of the segment files to read from there to the
+   end of what is on the disk in parts[], which must have room for the
+   number of segments.  A time before the oldest still recorded gives
+   the oldest, and one after the last on the disk the last.  Returns
+   how many parts there are, or 0 if nothing on the disk has been
+   indexed yet. */
+int tshift_seek(tshift_t *ts, int64_t time, shift_entry_t *at, int *rap, shift_part_t *parts);
+/* The time the stream has got to, or 0 before the first PCR */
+int64_t tshift_now(tshift_t *ts);
+
+#endif
@@ -0,0 +1,180 @@
+/*
+ * tr101290.c: first and second priority checks of ETSI TR 101 290
+ * (-monitor), on the packets dvbstream reads anyway.
+ *
+ * The continuity counters and the PCR values are checked by the
+ * analyser (analyse.c).  Here the packets' arrival times are kept for
+ * the PIDs that matter - the PAT, the PMTs, and the PCR and elementary
+ * streams they list, as dvbstream's own PSI parsing finds them - so
+ * tr_poll() can tell when one has been missing too long.  Sync losses
+ * and CRC errors come from the ingest framer and the PSI engine.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "tr101290.h"
+
+#define TS_SIZE 188
+
+const char *tr_alarm_names[TR_ALARMS] = {
+  "sync_loss", "pat_error", "cc_error", "pmt_error", "pid_error",
+  "transport_error", "crc_error", "pcr_repetition_error",
+  "pcr_discontinuity_error", "pcr_accuracy_error", "pts_error"
+};
+
+int tr_init(tr_monitor_t *m)
+{
+  memset(m, 0, sizeof(tr_monitor_t));
+  return analyser_init(&m->an, 0, stderr);
+}
+
+/* The PIDs to watch have changed: kind[] says what each one is now.
+   Those just added get one period's grace. */
+void tr_watch(tr_monitor_t *m, uint8_t *kind, int64_t now)
+{
+  int pid;
+
+  for (pid = 0; pid < ANALYSE_PIDS; pid++) {
+    if (kind[pid] & ~m->kind[pid]) {
+      m->last[pid] = m->last_table[pid] = m->last_pcr[pid] = now;
+      m->last_pts[pid] = 0;
+    }
+    m->kind[pid] = kind[pid];
+  }
+}
+
+/* Count one error if it has been longer than limit since *last.  The
+   period starts again, so an absence counts once per period. */
+static void late(uint64_t *errors, int64_t *last, int64_t limit, int64_t now)
+{
+  if (now - *last > limit) {
+    (*errors)++;
+    *last = now;
+  }
+}
+
+/* A packet starting a section: the table_id, or -1 */
+static int table_id(uint8_t *pkt, int l)
+{
+  l += pkt[l] + 1;              // the pointer field
+  return (l < TS_SIZE) ? pkt[l] : -1;
+}
+
+/* A packet starting a PES packet: whether it has a PTS */
+static int has_pts(uint8_t *pkt, int l)
+{
+  if (l + 9 > TS_SIZE || pkt[l] != 0 || pkt[l+1] != 0 || pkt[l+2] != 1)
+    return 0;
+  switch (pkt[l+3]) {
+  case 0xbc: case 0xbe: case 0xbf:     // no PES header to have one in
+  case 0xf0: case 0xf1: case 0xf2: case 0xf8: case 0xff:
+    return 0;
+  }
+  return (pkt[l+7] & 0x80) != 0;
+}
+
+/* The packets that start something in a watched PID */
+static void start_packet(tr_monitor_t *m, int pid, uint8_t *pkt, int64_t now)
+{
+  int l = 4;
+
+  if (pkt[3] & 0x20)
+    l += pkt[4] + 1;
+  if (l >= TS_SIZE)
+    return;
+  if (m->kind[pid] & TR_PAT) {
+    if (table_id(pkt, l) == 0x00) {
+      late(&m->alarms.n[TR_PAT_ERROR], &m->last_table[pid], TR_PAT_NS, now);
+      m->last_table[pid] = now;
+    } else {
+      m->alarms.n[TR_PAT_ERROR]++;    // something else on PID 0
+    }
+  }
+  if ((m->kind[pid] & TR_PMT) && table_id(pkt, l) == 0x02) {
+    late(&m->alarms.n[TR_PMT_ERROR], &m->last_table[pid], TR_PAT_NS, now);
+    m->last_table[pid] = now;
+  }
+  if ((m->kind[pid] & TR_ES) && has_pts(pkt, l)) {
+    if (m->last_pts[pid])
+      late(&m->alarms.n[TR_PTS_ERROR], &m->last_pts[pid], TR_PTS_NS, now);
+    m->last_pts[pid] = now;
+  }
+}
+
+/* Take in a batch of packets, which arrived at now */
+void tr_batch(tr_monitor_t *m, uint8_t **pkts, int n, int64_t now)
+{
+  uint8_t *p;
+  int i, pid;
+
+  analyse_batch(&m->an, pkts, n);
+  for (i = 0; i < n; i++) {
+    p = pkts[i];
+    m->alarms.n[TR_TRANSPORT_ERROR] += p[1] >> 7;
+    pid = ((p[1] & 0x1f) << 8) | p[2];
+    if (!m->kind[pid])
+      continue;
+    m->last[pid] = now;
+    if ((m->kind[pid] & (TR_PAT|TR_PMT)) && (p[3] >> 6)) {
+      /* The tables mustn't be scrambled */
+      if (m->kind[pid] & TR_PAT) m->alarms.n[TR_PAT_ERROR]++;
+      else m->alarms.n[TR_PMT_ERROR]++;
+    }
+    if (p[1] & 0x40)
+      start_packet(m, pid, p, now);
+    if ((m->kind[pid] & TR_PCR) && (p[3] & 0x20) && p[4] > 0 && (p[5] & 0x10)) {
+      late(&m->alarms.n[TR_PCR_REPETITION_ERROR], &m->last_pcr[pid], TR_PCR_REP_NS, now);
+      m->last_pcr[pid] = now;
+    }
+  }
+}
+
+/* Count what has been missing for too long */
+void tr_poll(tr_monitor_t *m, int64_t now)
+{
+  int pid;
+
+  for (pid = 0; pid < ANALYSE_PIDS; pid++) {
+    if (!m->kind[pid]) continue;
+    if (m->kind[pid] & TR_PAT)
+      late(&m->alarms.n[TR_PAT_ERROR], &m->last_table[pid], TR_PAT_NS, now);
+    if (m->kind[pid] & TR_PMT)
+      late(&m->alarms.n[TR_PMT_ERROR], &m->last_table[pid], TR_PAT_NS, now);
+    if (m->kind[pid] & TR_PCR)
+      late(&m->alarms.n[TR_PCR_REPETITION_ERROR], &m->last_pcr[pid], TR_PCR_REP_NS, now);
+    if (m->kind[pid] & TR_ES) {
+      late(&m->alarms.n[TR_PID_ERROR], &m->last[pid], TR_PID_NS, now);
+      if (m->last_pts[pid])
+        late(&m->alarms.n[TR_PTS_ERROR], &m->last_pts[pid], TR_PTS_NS, now);
+    }
+  }
+}
+
+/* The counts so far, less the sync losses and CRC errors, which are
+   counted elsewhere */
+void tr_alarms(tr_monitor_t *m, tr_alarms_t *al)
+{
+  analyse_pcr_t *r;
+  int pid;
+
+  *al = m->alarms;
+  for (pid = 0; pid < ANALYSE_PIDS; pid++) {
+    al->n[TR_CC_ERROR] += m->an.cc_errors[pid];
+    if ((r = m->an.pcr[pid]) != NULL) {
+      al->n[TR_PCR_DISCONTINUITY_ERROR] += r->jumps;
+      al->n[TR_PCR_ACCURACY_ERROR] += r->inaccurate;
+    }
+  }
+}
+
+void tr_free(tr_monitor_t *m)
+{
+  analyser_free(&m->an);
+}
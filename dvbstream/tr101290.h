@@ -0,0 +1,68 @@
+#ifndef _TR101290_H
+#define _TR101290_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "analyse.h"
+
+/* ETSI TR 101 290 limits */
+#define TR_PAT_NS 500000000LL        /* PAT and each PMT at least this often */
+#define TR_PCR_REP_NS 40000000LL     /* PCRs of a program (jumps: 100 ms, in analyse.c) */
+#define TR_PTS_NS 700000000LL        /* PTS of each elementary stream */
+#define TR_PID_NS 5000000000LL       /* packets of each PID in a PMT */
+#define TR_PCR_ACCURACY_NS 500
+
+/* What a PID is to the monitor */
+#define TR_PAT 1
+#define TR_PMT 2
+#define TR_ES 4
+#define TR_PCR 8
+
+/* The errors counted, first and second priority.  The errors that are
+   about something being missing count once for each period it is
+   missing for. */
+enum {
+  TR_SYNC_LOSS,
+  TR_PAT_ERROR,
+  TR_CC_ERROR,
+  TR_PMT_ERROR,
+  TR_PID_ERROR,
+
+  TR_TRANSPORT_ERROR,
+  TR_CRC_ERROR,
+  TR_PCR_REPETITION_ERROR,
+  TR_PCR_DISCONTINUITY_ERROR,
+  TR_PCR_ACCURACY_ERROR,
+  TR_PTS_ERROR,
+  TR_ALARMS
+};
+
+extern const char *tr_alarm_names[TR_ALARMS];
+
+typedef struct {
+  uint64_t n[TR_ALARMS];
+} tr_alarms_t;
+
+/* The monitor of one transport stream.  The continuity counters and PCR
+   values are looked after by an analyser (analyse.c); the monitor adds
+   the timing of the tables, PCRs and PTSs, which it takes from the
+   packets' arrival times. */
+typedef struct {
+  analyser_t an;
+  uint8_t kind[ANALYSE_PIDS];
+  int64_t last[ANALYSE_PIDS];        /* last packet of a watched PID */
+  int64_t last_table[ANALYSE_PIDS];  /* last PAT/PMT section start */
+  int64_t last_pcr[ANALYSE_PIDS];
+  int64_t last_pts[ANALYSE_PIDS];    /* 0: no PTS seen on it */
+  tr_alarms_t alarms;                /* the counts kept here */
+} tr_monitor_t;
+
+int tr_init(tr_monitor_t *m);
+void tr_watch(tr_monitor_t *m, uint8_t *kind, int64_t now);
+void tr_batch(tr_monitor_t *m, uint8_t **pkts, int n, int64_t now);
+void tr_poll(tr_monitor_t *m, int64_t now);
+void tr_alarms(tr_monitor_t *m, tr_alarms_t *al);
+void tr_free(tr_monitor_t *m);
+
+#endif
@@ -2,21 +2,29 @@
    multiplexed TS.  Specify the PID on the command-line 
 
    Updated 29th January 2003 - Added some error checking and reporting.
+
+   The input is framed by tsframe.c, so 192 and 204 byte streams are
+   accepted and the filter resynchronises after corrupt data instead of
+   giving up.
 */
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 
+#include "ingest.h"
+
 int main(int argc, char **argv)
 {
-  int pid,n;
+  int pid;
   int filters[8192];
   unsigned int i=0;
   unsigned int j=0;
-  unsigned char buf[188];
+  unsigned char *buf;
   unsigned char my_cc[8192];
   int errors=0;
+  int n;
+  ingest_t in;
 
   for (i=0;i<8192;i++) { filters[i]=0; my_cc[i]=0xff;}
 
@@ -28,14 +36,13 @@ int main(int argc, char **argv)
     }
   }
 
-  n=fread(buf,1,188,stdin);
-  i=1;
-  while (n==188) {
-    if (buf[0]!=0x47) {
-      // TO DO: Re-sync.
-      fprintf(stderr,"FATAL ERROR IN STREAM AT PACKET %d\n",i);
-      exit;
-    }
+  if (ingest_init(&in,0,INGEST_DEFAULT_PACKETS) < 0) {
+    exit(1);
+  }
+
+  i=0;
+  while ((buf=ingest_next(&in))!=NULL) {
+    i++;
     pid=(((buf[1] & 0x1f) << 8) | buf[2]);
     if (my_cc[pid]==0xff) my_cc[pid]=buf[3]&0x0f;
     if (filters[pid]==1) {
@@ -49,7 +56,7 @@ int main(int argc, char **argv)
         j++;
       } else {
         fprintf(stderr,"FATAL ERROR - CAN NOT WRITE PACKET %d\n",i);
-        exit;
+        exit(1);
       }
       if (my_cc[pid]==0x0f) {
         my_cc[pid]=0;
@@ -57,10 +64,12 @@ int main(int argc, char **argv)
         my_cc[pid]++;
       }
     }
-    n=fread(buf,1,188,stdin);
-    i++;
   }
   fprintf(stderr,"Read %d packets, wrote %d.\n",i,j);
   fprintf(stderr,"%d incontinuity errors.\n",errors);
+  if (in.framer.resyncs || in.framer.discarded) {
+    fprintf(stderr,"Lost sync %llu times, %llu bytes discarded.\n",
+            (unsigned long long)in.framer.resyncs,(unsigned long long)in.framer.discarded);
+  }
   return(0);
 }
@@ -0,0 +1,171 @@
+/*
+ * tsbench.c: runs one benchmark case for bench/bench.sh and prints a
+ * line of figures for it.
+ *
+ *   tsbench -name case -i input.ts [-p packets] [-o output] [-u port] -- command args...
+ *
+ * The command is run with the input on stdin and its stdout on the
+ * output (default /dev/null).  With -u a UDP socket on 127.0.0.1:port
+ * takes whatever the command sends there, and counts it.
+ *
+ * The CPU time comes from wait4(), and the read and write system calls
+ * from /proc/self/io: a child's counts are added to its parent's when it
+ * is reaped, so the difference across the run is the command's.  Socket
+ * sends and receives are not counted there, but dvbstream counts its
+ * own (see -stats).
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+/* read and write system calls so far, of this process and the children
+   it has reaped */
+static void syscalls(uint64_t *r, uint64_t *w)
+{
+  char line[128];
+  FILE *f;
+
+  *r = *w = 0;
+  if ((f = fopen("/proc/self/io", "r")) == NULL)
+    return;
+  while (fgets(line, sizeof(line), f) != NULL) {
+    sscanf(line, "syscr: %llu", (unsigned long long *)r);
+    sscanf(line, "syscw: %llu", (unsigned long long *)w);
+  }
+  fclose(f);
+}
+
+static double now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int udp_sink(int port)
+{
+  struct sockaddr_in addr;
+  int fd, size = 8 << 20;
+
+  if ((fd = socket(AF_INET, SOCK_DGRAM, 0)) < 0)
+    return -1;
+  setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    close(fd);
+    return -1;
+  }
+  fcntl(fd, F_SETFL, O_NONBLOCK);
+  return fd;
+}
+
+static void usage(void)
+{
+  fprintf(stderr, "Usage: tsbench -name case -i input.ts [-p packets] [-o output] [-u port] [-e stderr] -- command args...\n");
+  exit(2);
+}
+
+int main(int argc, char **argv)
+{
+  static char buf[65536];
+  char *name = "-", *input = NULL, *output = "/dev/null", *errors = "/dev/null";
+  uint64_t r0, w0, r1, w1, datagrams = 0;
+  struct rusage ru;
+  struct pollfd pfd;
+  struct stat st;
+  double t0, secs, cpu, bytes, packets = 0;
+  int i, port = 0, sink = -1, status = 0, fd;
+  pid_t pid;
+
+  for (i = 1; i < argc && strcmp(argv[i], "--") != 0; i++) {
+    if (i + 1 >= argc) usage();
+    if (strcmp(argv[i], "-name") == 0) name = argv[++i];
+    else if (strcmp(argv[i], "-i") == 0) input = argv[++i];
+    else if (strcmp(argv[i], "-o") == 0) output = argv[++i];
+    else if (strcmp(argv[i], "-e") == 0) errors = argv[++i];
+    else if (strcmp(argv[i], "-u") == 0) port = atoi(argv[++i]);
+    else if (strcmp(argv[i], "-p") == 0) packets = atof(argv[++i]);
+    else usage();
+  }
+  if (input == NULL || i + 1 >= argc || stat(input, &st) < 0)
+    usage();
+  argv += i + 1;
+
+  if (port && (sink = udp_sink(port)) < 0) {
+    perror("tsbench: UDP sink");
+    return 1;
+  }
+
+  syscalls(&r0, &w0);
+  t0 = now();
+  if ((pid = fork()) == 0) {
+    if ((fd = open(input, O_RDONLY)) < 0 || dup2(fd, 0) < 0) _exit(127);
+    if ((fd = open(output, O_WRONLY|O_CREAT|O_TRUNC, 0644)) < 0 || dup2(fd, 1) < 0) _exit(127);
+    if ((fd = open(errors, O_WRONLY|O_CREAT|O_TRUNC, 0644)) < 0 || dup2(fd, 2) < 0) _exit(127);
+    execvp(argv[0], argv);
+    _exit(127);
+  }
+  if (pid < 0) {
+    perror("tsbench: fork");
+    return 1;
+  }
+
+  /* Drain the sink while the command runs, and a little after */
+  pfd.fd = sink;
+  pfd.events = POLLIN;
+  for (;;) {
+    if (wait4(pid, &status, (sink >= 0) ? WNOHANG : 0, &ru) == pid)
+      break;
+    if (poll(&pfd, 1, 10) > 0) {
+      while (recv(sink, buf, sizeof(buf), 0) > 0)
+        datagrams++;
+    }
+  }
+  secs = now() - t0;
+  syscalls(&r1, &w1);
+  if (sink >= 0) {
+    while (poll(&pfd, 1, 50) > 0 && recv(sink, buf, sizeof(buf), 0) > 0)
+      datagrams++;
+    close(sink);
+  }
+  if (!WIFEXITED(status) || WEXITSTATUS(status) == 127) {
+    fprintf(stderr, "tsbench: %s: %s failed\n", name, argv[0]);
+    return 1;
+  }
+
+  cpu = ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6
+        + ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+  bytes = st.st_size;
+  if (packets == 0)
+    packets = bytes / 188;
+  /* case, packets/s, MB/s, seconds, CPU seconds per Gbit, read and write
+     calls (with the few the program loader makes), UDP datagrams received */
+  printf("%-20s %12.0f %9.1f %9.3f %8.2f %9llu %9llu %9llu\n", name,
+         packets / secs, bytes / secs / 1e6,
+         secs, bytes > 0 ? cpu / (bytes * 8 / 1e9) : 0.0,
+         (unsigned long long)(r1 - r0 - 1), (unsigned long long)(w1 - w0),
+         (unsigned long long)datagrams);
+  return 0;
+}
@@ -0,0 +1,145 @@
+/*
+ * tsframe.c: transport stream packet framing and resynchronisation.
+ *
+ * The framer is given a buffer of raw stream data and returns pointers to
+ * the 188 byte transport packets inside it - nothing is copied.  Before
+ * it trusts a packet size it wants TS_SYNC_CHECK sync bytes exactly one
+ * packet apart, so a stray 0x47 in the payload can't fool it.  When a
+ * sync byte is missing it drops back to searching, counting the bytes it
+ * throws away.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include <string.h>
+
+#include "tsframe.h"
+
+static const int ts_sizes[] = { 188, 192, 204 };
+#define TS_NSIZES (sizeof(ts_sizes)/sizeof(ts_sizes[0]))
+
+/* Offset of the sync byte in a packet of the given size.  M2TS puts its
+   4 byte arrival timestamp in front of the TS packet. */
+static int sync_offset(int pktsize)
+{
+  return (pktsize == 192) ? 4 : 0;
+}
+
+void ts_framer_init(ts_framer_t *fr)
+{
+  memset(fr, 0, sizeof(ts_framer_t));
+}
+
+/* Check for TS_SYNC_CHECK sync bytes, pktsize apart, starting at q.
+   Returns 1 if they are all there, 0 if one is missing and -1 if the
+   buffer ends before all of them could be checked. */
+static int check_sync(uint8_t *buf, int len, int q, int pktsize)
+{
+  int k;
+
+  for (k = 1; k < TS_SYNC_CHECK; k++) {
+    if (q + k * pktsize >= len)
+      return -1;
+    if (buf[q + k * pktsize] != TS_SYNC_BYTE)
+      return 0;
+  }
+  return 1;
+}
+
+/* Search buf[pos..len) for a position the framer can lock onto.  Returns
+   1 and sets *sync and *size on success, 0 if there is no candidate at
+   all, or -1 if a candidate at *sync needs more data to be confirmed. */
+static int find_sync(ts_framer_t *fr, uint8_t *buf, int pos, int len, int *sync, int *size)
+{
+  uint8_t *p;
+  int q, i, r, pending;
+
+  while (pos < len) {
+    p = memchr(buf + pos, TS_SYNC_BYTE, len - pos);
+    if (p == NULL)
+      return 0;
+    q = p - buf;
+
+    pending = 0;
+    /* Try the size we had before losing sync first */
+    if (fr->pktsize) {
+      r = check_sync(buf, len, q, fr->pktsize);
+      if (r > 0) {
+        *sync = q;
+        *size = fr->pktsize;
+        return 1;
+      }
+      if (r < 0) pending = 1;
+    }
+    for (i = 0; i < TS_NSIZES; i++) {
+      if (ts_sizes[i] == fr->pktsize) continue;
+      r = check_sync(buf, len, q, ts_sizes[i]);
+      if (r > 0) {
+        *sync = q;
+        *size = ts_sizes[i];
+        return 1;
+      }
+      if (r < 0) pending = 1;
+    }
+    if (pending) {
+      *sync = q;
+      return -1;
+    }
+    pos = q + 1;
+  }
+  return 0;
+}
+
+/* Frame up to max packets from buf.  The start of each 188 byte TS packet
+   is stored in pkts[] and the number of packets is returned.  *used is
+   set to the number of bytes the caller may discard; the rest must be
+   passed in again, at the start of the next buffer, once more data has
+   arrived. */
+int ts_frame(ts_framer_t *fr, uint8_t *buf, int len, uint8_t **pkts, int max, int *used)
+{
+  int n = 0;
+  int pos = 0;   /* start of the next packet when locked */
+  int q, size, r, skip;
+
+  while (n < max) {
+    if (fr->locked) {
+      if (pos + fr->pktsize > len)
+        break;
+      q = pos + fr->offset;
+      if (buf[q] == TS_SYNC_BYTE) {
+        pkts[n++] = buf + q;
+        pos += fr->pktsize;
+        continue;
+      }
+      fr->locked = 0;
+      fr->resyncs++;
+    }
+
+    r = find_sync(fr, buf, pos, len, &q, &size);
+    if (r <= 0) {
+      skip = (r == 0) ? len : q;
+      fr->discarded += skip - pos;
+      pos = skip;
+      break;
+    }
+
+    fr->pktsize = size;
+    fr->offset = sync_offset(size);
+    fr->locked = 1;
+    skip = q - fr->offset;
+    if (skip > pos)
+      fr->discarded += skip - pos;
+
+    /* check_sync() has already seen the following packet, so the whole
+       of this one is in the buffer. */
+    pkts[n++] = buf + q;
+    pos = q - fr->offset + fr->pktsize;
+  }
+
+  fr->packets += n;
+  *used = pos;
+  return n;
+}
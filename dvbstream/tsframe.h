@@ -0,0 +1,33 @@
+#ifndef _TSFRAME_H
+#define _TSFRAME_H
+
+#include <stdint.h>
+
+#define TS_SYNC_BYTE 0x47
+
+/* Number of consecutive sync bytes, one packet apart, that must be seen
+   before the framer locks onto a packet size and alignment. */
+#define TS_SYNC_CHECK 5
+
+/* Bytes needed to prove lock for the largest supported packet size */
+#define TS_SYNC_WINDOW (TS_SYNC_CHECK * 204)
+
+/* Finds the 188 byte transport packets in a byte stream of 188 byte
+   (plain TS), 192 byte (M2TS: 4 byte timestamp + TS) or 204 byte
+   (TS + 16 Reed-Solomon bytes) packets.  The packet size is detected
+   from the stream and the framer realigns itself if sync is lost. */
+typedef struct {
+  int pktsize;         /* 188, 192 or 204 - 0 until first lock */
+  int offset;          /* offset of the sync byte inside a packet */
+  int locked;
+
+  /* statistics */
+  uint64_t packets;
+  uint64_t resyncs;    /* times sync was lost and searched for again */
+  uint64_t discarded;  /* bytes skipped while searching for sync */
+} ts_framer_t;
+
+void ts_framer_init(ts_framer_t *fr);
+int ts_frame(ts_framer_t *fr, uint8_t *buf, int len, uint8_t **pkts, int max, int *used);
+
+#endif
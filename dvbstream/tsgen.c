@@ -0,0 +1,380 @@
+/*
+ * tsgen.c: writes a synthetic transport stream to stdout, for the
+ * benchmarks (make bench) and for testing without a DVB card.
+ *
+ * The stream is a multiplex of several programs at a constant bitrate,
+ * with a PAT, PMTs and an SDT every 100 ms, a PCR on each program's video PID
+ * every 30 ms (exactly where the bitrate puts it) and a PES packet with
+ * a PTS starting every 32 packets of each elementary stream.  Options
+ * add many more PIDs, new PAT/PMT versions that move the audio PIDs
+ * about, PCRs further apart, corrupted packets, and 192 or 204 byte
+ * packets.  The same
+ * options and seed always give the same stream.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "psi.h"
+
+#define TS_SIZE 188
+#define MAX_PROGS 64
+#define MAX_DATA_PIDS 4000
+#define MAX_ES (MAX_PROGS * 2 + MAX_DATA_PIDS)
+#define PMT_MAX_ES 190           /* keeps a PMT in one 1024 byte section */
+#define QUEUE_PKTS 512           /* room for the PAT and every PMT */
+
+#define PSI_MS 100
+#define PCR_MS 30
+#define PES_PACKETS 32
+
+typedef struct {
+  int pid;
+  int stream_type;
+  int program;               /* index into progs[] */
+  uint8_t cc;
+  int count;                 /* packets sent */
+} es_t;
+
+typedef struct {
+  int number;
+  int pmt_pid;
+  int video, audio;          /* indexes into es[] */
+  uint8_t pmt_cc;
+  double next_pcr;           /* seconds */
+} prog_t;
+
+static prog_t progs[MAX_PROGS];
+static es_t es[MAX_ES];
+static int nprogs = 8, nes = 0;
+static int version = 0;
+static uint8_t pat_cc = 0, sdt_cc = 0;
+
+static uint8_t queue[QUEUE_PKTS][TS_SIZE];   /* PSI packets waiting to go out */
+static int queued = 0, qpos = 0;
+
+static uint64_t seed = 1;
+
+static uint32_t rnd(void)
+{
+  seed ^= seed << 13;
+  seed ^= seed >> 7;
+  seed ^= seed << 17;
+  return (uint32_t)(seed >> 16);
+}
+
+/* Split a section into TS packets on pid and queue them */
+static void queue_section(int pid, uint8_t *cc, uint8_t *sec, int len)
+{
+  uint8_t *p;
+  int pos = 0, n, first = 1;
+
+  while (pos < len && queued < QUEUE_PKTS) {
+    p = queue[queued++];
+    memset(p, 0xff, TS_SIZE);
+    p[0] = 0x47;
+    p[1] = (first ? 0x40 : 0) | (pid >> 8);
+    p[2] = pid & 0xff;
+    p[3] = 0x10 | (*cc & 0x0f);
+    *cc = (*cc + 1) & 0x0f;
+    n = TS_SIZE - 4;
+    if (first) {
+      p[4] = 0;               // pointer_field
+      n--;
+    }
+    if (n > len - pos) n = len - pos;
+    memcpy(p + TS_SIZE - (first ? 183 : 184), sec + pos, n);
+    pos += n;
+    first = 0;
+  }
+}
+
+/* Fill in the section length and CRC of a section of len bytes so far */
+static int end_section(uint8_t *sec, int len)
+{
+  uint32_t crc;
+
+  sec[1] = 0xb0 | ((len + 4 - 3) >> 8);
+  sec[2] = (len + 4 - 3) & 0xff;
+  crc = psi_crc32(sec, len);
+  sec[len++] = crc >> 24;
+  sec[len++] = crc >> 16;
+  sec[len++] = crc >> 8;
+  sec[len++] = crc;
+  return len;
+}
+
+static void queue_psi(void)
+{
+  uint8_t sec[1024];
+  char name[16];
+  int p, e, len, n;
+
+  queued = qpos = 0;
+  sec[0] = 0x00;
+  sec[3] = 0; sec[4] = 1;                        // transport_stream_id
+  sec[5] = 0xc1 | ((version & 0x1f) << 1);
+  sec[6] = sec[7] = 0;
+  len = 8;
+  for (p = 0; p < nprogs; p++) {
+    sec[len++] = progs[p].number >> 8;
+    sec[len++] = progs[p].number & 0xff;
+    sec[len++] = 0xe0 | (progs[p].pmt_pid >> 8);
+    sec[len++] = progs[p].pmt_pid & 0xff;
+  }
+  len = end_section(sec, len);
+  queue_section(0, &pat_cc, sec, len);
+
+  /* SDT: the programs are called "Service 1" and so on, as many as fit */
+  sec[0] = 0x42;
+  sec[3] = 0; sec[4] = 1;                        // transport_stream_id
+  sec[5] = 0xc1 | ((version & 0x1f) << 1);
+  sec[6] = sec[7] = 0;
+  sec[8] = 0; sec[9] = 1;                        // original_network_id
+  sec[10] = 0xff;
+  len = 11;
+  for (p = 0; p < nprogs && len < 1000 - 40; p++) {
+    n = snprintf(name, sizeof(name), "Service %d", progs[p].number);
+    sec[len++] = progs[p].number >> 8;
+    sec[len++] = progs[p].number & 0xff;
+    sec[len++] = 0xfc;
+    sec[len++] = 0x80;                           // running, and the
+    sec[len++] = 2 + 3 + 5 + n;                  // descriptors' length
+    sec[len++] = 0x48;                           // service_descriptor
+    sec[len++] = 3 + 5 + n;
+    sec[len++] = 0x01;                           // digital television
+    sec[len++] = 5;
+    memcpy(sec + len, "tsgen", 5);
+    len += 5;
+    sec[len++] = n;
+    memcpy(sec + len, name, n);
+    len += n;
+  }
+  len = end_section(sec, len);
+  queue_section(0x11, &sdt_cc, sec, len);
+
+  for (p = 0; p < nprogs; p++) {
+    sec[0] = 0x02;
+    sec[3] = progs[p].number >> 8;
+    sec[4] = progs[p].number & 0xff;
+    sec[5] = 0xc1 | ((version & 0x1f) << 1);
+    sec[6] = sec[7] = 0;
+    sec[8] = 0xe0 | (es[progs[p].video].pid >> 8);   // PCR_PID
+    sec[9] = es[progs[p].video].pid & 0xff;
+    sec[10] = 0xf0; sec[11] = 0;
+    len = 12;
+    for (e = 0; e < nes; e++) {
+      if (es[e].program != p) continue;
+      sec[len++] = es[e].stream_type;
+      sec[len++] = 0xe0 | (es[e].pid >> 8);
+      sec[len++] = es[e].pid & 0xff;
+      sec[len++] = 0xf0;
+      sec[len++] = 0;
+    }
+    len = end_section(sec, len);
+    queue_section(progs[p].pmt_pid, &progs[p].pmt_cc, sec, len);
+  }
+}
+
+/* What each PES packet starts with: an MPEG-2 sequence header (720x576,
+   4:3, 25 fps, 6 Mbit/s) or an MPEG-1 layer II frame header (256 kbit/s,
+   48 kHz), enough for the mpegtools converters to take the streams */
+static const uint8_t video_start[12] = { 0, 0, 1, 0xb3, 0x2d, 0x02, 0x40, 0x23, 0x0e, 0xa6, 0x20, 0 };
+static const uint8_t audio_start[4] = { 0xff, 0xfd, 0xc4, 0x04 };
+
+/* A packet of elementary stream e at time t, with a PCR if pcr >= 0 */
+static void es_packet(uint8_t *p, es_t *s, double t, int64_t pcr)
+{
+  int64_t pts = (int64_t)(t * 90000) & 0x1ffffffffLL;
+  int l = 4, i;
+
+  p[0] = 0x47;
+  p[1] = ((s->count % PES_PACKETS) == 0 ? 0x40 : 0) | (s->pid >> 8);
+  p[2] = s->pid & 0xff;
+  p[3] = 0x10 | s->cc;
+  s->cc = (s->cc + 1) & 0x0f;
+  if (pcr >= 0) {
+    int64_t base = (pcr / 300) & 0x1ffffffffLL, ext = pcr % 300;
+
+    p[3] |= 0x20;
+    p[4] = 7;
+    p[5] = 0x10;
+    p[6] = base >> 25;
+    p[7] = base >> 17;
+    p[8] = base >> 9;
+    p[9] = base >> 1;
+    p[10] = ((base & 1) << 7) | 0x7e | (ext >> 8);
+    p[11] = ext & 0xff;
+    l = 12;
+  }
+  if (p[1] & 0x40) {
+    p[l] = 0; p[l+1] = 0; p[l+2] = 1;
+    p[l+3] = (s->stream_type == 0x02) ? 0xe0 : 0xc0;
+    p[l+4] = 0; p[l+5] = 0;               // unbounded
+    p[l+6] = 0x80; p[l+7] = 0x80; p[l+8] = 5;
+    p[l+9] = 0x21 | ((pts >> 29) & 0x0e);
+    p[l+10] = pts >> 22;
+    p[l+11] = 0x01 | ((pts >> 14) & 0xfe);
+    p[l+12] = pts >> 7;
+    p[l+13] = 0x01 | ((pts << 1) & 0xfe);
+    l += 14;
+  }
+  for (i = l; i < TS_SIZE; i++)
+    p[i] = (uint8_t)(i + s->count);
+  if ((p[1] & 0x40) && s->stream_type == 0x02)
+    memcpy(p + l, video_start, sizeof(video_start));
+  else if ((p[1] & 0x40) && s->stream_type == 0x04)
+    memcpy(p + l, audio_start, sizeof(audio_start));
+  s->count++;
+}
+
+/* New versions of the PAT and PMTs: every program's audio swaps between
+   two PIDs */
+static void churn(void)
+{
+  int p;
+
+  version++;
+  for (p = 0; p < nprogs; p++)
+    es[progs[p].audio].pid ^= 0x08;
+  queue_psi();
+}
+
+/* Write a packet as it should go out: damaged now and then, and with
+   the extra bytes of the larger packet sizes */
+static void emit(uint8_t *pkt, int size, int corrupt, int64_t pcr_now)
+{
+  uint8_t p[TS_SIZE], pre[4], junk[7];
+  int i;
+
+  memcpy(p, pkt, TS_SIZE);
+  if (corrupt > 0 && rnd() % corrupt == 0) {
+    switch (rnd() % 5) {
+    case 0: p[4 + rnd() % (TS_SIZE - 4)] ^= 0xff; break;     // bit errors
+    case 1: p[0] = 0x46; break;                              // lost sync
+    case 2: return;                                          // lost packet
+    case 3: p[1] |= 0x80; break;                             // transport_error_indicator
+    case 4:                                                  // garbage in between
+      for (i = 0; i < 7; i++) junk[i] = rnd();
+      fwrite(junk, 1, 7, stdout);
+      break;
+    }
+  }
+  if (size == 192) {
+    pre[0] = (pcr_now >> 24) & 0x3f;     // 30 bit arrival time stamp
+    pre[1] = pcr_now >> 16;
+    pre[2] = pcr_now >> 8;
+    pre[3] = pcr_now;
+    fwrite(pre, 1, 4, stdout);
+  }
+  fwrite(p, 1, TS_SIZE, stdout);
+  if (size == 204) {
+    memset(p, 0, 16);                    // no real Reed-Solomon bytes
+    fwrite(p, 1, 16, stdout);
+  }
+}
+
+static void usage(void)
+{
+  fprintf(stderr,"Usage: tsgen [options] > file.ts\n\n");
+  fprintf(stderr,"-n packets  Packets to write (default 100000)\n");
+  fprintf(stderr,"-rate kbit  Bitrate the PCRs and tables are timed for (default 20000)\n");
+  fprintf(stderr,"-progs n    Programs, each with a video and an audio PID (default 8, max %d)\n",MAX_PROGS);
+  fprintf(stderr,"-pids n     Add n more data PIDs, spread over the programs (max %d)\n",MAX_DATA_PIDS);
+  fprintf(stderr,"-pcr ms     PCRs of each program every ms (default %d)\n",PCR_MS);
+  fprintf(stderr,"-churn ms   New PAT and PMT versions, moving the audio PIDs, every ms\n");
+  fprintf(stderr,"-corrupt n  Damage one packet in n, on average\n");
+  fprintf(stderr,"-size n     188, 192 (M2TS) or 204 (with RS bytes) byte packets\n");
+  fprintf(stderr,"-seed n     Seed for the corruption\n");
+}
+
+int main(int argc, char **argv)
+{
+  static char obuf[1 << 20];
+  int64_t n = 100000, i, pcr;
+  double rate = 20000e3, t, pkt_secs, next_psi = 0, next_churn = 0, churn_secs = 0;
+  double pcr_secs = PCR_MS / 1000.0;
+  int ndata = 0, corrupt = 0, size = 188, p, e, rr = 0;
+  uint8_t pkt[TS_SIZE];
+
+  for (i = 1; i < argc; i++) {
+    if (i + 1 >= argc) { usage(); return 1; }
+    if (strcmp(argv[i],"-n")==0) n = atoll(argv[++i]);
+    else if (strcmp(argv[i],"-rate")==0) rate = atof(argv[++i]) * 1000;
+    else if (strcmp(argv[i],"-progs")==0) nprogs = atoi(argv[++i]);
+    else if (strcmp(argv[i],"-pids")==0) ndata = atoi(argv[++i]);
+    else if (strcmp(argv[i],"-pcr")==0) pcr_secs = atoi(argv[++i]) / 1000.0;
+    else if (strcmp(argv[i],"-churn")==0) churn_secs = atoi(argv[++i]) / 1000.0;
+    else if (strcmp(argv[i],"-corrupt")==0) corrupt = atoi(argv[++i]);
+    else if (strcmp(argv[i],"-size")==0) size = atoi(argv[++i]);
+    else if (strcmp(argv[i],"-seed")==0) seed = atoll(argv[++i]) | 1;
+    else { usage(); return 1; }
+  }
+  if (nprogs < 1 || nprogs > MAX_PROGS || ndata < 0 || ndata > MAX_DATA_PIDS
+      || pcr_secs <= 0 || (ndata + nprogs - 1) / nprogs + 2 > PMT_MAX_ES || rate <= 0
+      || (size != 188 && size != 192 && size != 204)) {
+    usage();
+    return 1;
+  }
+  setvbuf(stdout, obuf, _IOFBF, sizeof(obuf));
+
+  /* Program p: PMT on 0x100 + 0x10 p, video and audio next to it; the
+     data PIDs from 0x1000 */
+  for (p = 0; p < nprogs; p++) {
+    progs[p].number = p + 1;
+    progs[p].pmt_pid = 0x100 + 0x10 * p;
+    progs[p].video = nes;
+    es[nes].pid = progs[p].pmt_pid + 1;
+    es[nes].stream_type = 0x02;
+    es[nes++].program = p;
+    progs[p].audio = nes;
+    es[nes].pid = progs[p].pmt_pid + 2;
+    es[nes].stream_type = 0x04;
+    es[nes++].program = p;
+  }
+  for (e = 0; e < ndata; e++) {
+    es[nes].pid = 0x1000 + e;
+    es[nes].stream_type = 0x06;
+    es[nes++].program = e % nprogs;
+  }
+
+  pkt_secs = TS_SIZE * 8 / rate;
+  next_churn = churn_secs;
+  for (i = 0; i < n; i++) {
+    t = i * pkt_secs;
+    pcr = (int64_t)(t * 27000000.0);
+    if (churn_secs > 0 && t >= next_churn) {
+      churn();
+      next_churn += churn_secs;
+      next_psi = t + PSI_MS / 1000.0;
+    } else if (t >= next_psi && qpos == queued) {
+      queue_psi();
+      next_psi += PSI_MS / 1000.0;
+    }
+
+    if (qpos < queued) {
+      emit(queue[qpos++], size, corrupt, pcr);
+      continue;
+    }
+    for (p = 0; p < nprogs; p++) {
+      if (t >= progs[p].next_pcr) break;
+    }
+    if (p < nprogs) {
+      es_packet(pkt, &es[progs[p].video], t, pcr);
+      progs[p].next_pcr += pcr_secs;
+    } else {
+      es_packet(pkt, &es[rr], t, -1);
+      rr = (rr + 1) % nes;
+    }
+    emit(pkt, size, corrupt, pcr);
+  }
+  fflush(stdout);
+  return 0;
+}
@@ -34,6 +34,7 @@
 #include <linux/dvb/frontend.h>
 
 #include "tune.h"
+#include "dvbdev.h"
 
 
 void print_status(FILE* fd,fe_status_t festatus) {
@@ -56,14 +57,14 @@ struct diseqc_cmd {
 static int diseqc_send_msg(int fd, fe_sec_voltage_t v, struct diseqc_cmd *cmd,
 		     fe_sec_tone_mode_t t, unsigned char sat_no)
 {
-   if(ioctl(fd, FE_SET_TONE, SEC_TONE_OFF) < 0)
+   if(dvbdev_ioctl(fd, FE_SET_TONE, SEC_TONE_OFF) < 0)
    	return -1;
-   if(ioctl(fd, FE_SET_VOLTAGE, v) < 0)
+   if(dvbdev_ioctl(fd, FE_SET_VOLTAGE, v) < 0)
    	return -1;
    usleep(15 * 1000);
    if(sat_no >= 1 && sat_no <= 4)	//1.x compatible equipment
    {
-    if(ioctl(fd, FE_DISEQC_SEND_MASTER_CMD, &cmd->cmd) < 0)
+    if(dvbdev_ioctl(fd, FE_DISEQC_SEND_MASTER_CMD, &cmd->cmd) < 0)
    	return -1;
     usleep(cmd->wait * 1000);
     usleep(15 * 1000);
@@ -71,11 +72,11 @@ static int diseqc_send_msg(int fd, fe_sec_voltage_t v, struct diseqc_cmd *cmd,
    else	//A or B simple diseqc
    {
     fprintf(stderr, "SETTING SIMPLE %c BURST\n", sat_no);
-    if(ioctl(fd, FE_DISEQC_SEND_BURST, (sat_no == 'B' ? SEC_MINI_B : SEC_MINI_A)) < 0)
+    if(dvbdev_ioctl(fd, FE_DISEQC_SEND_BURST, (sat_no == 'B' ? SEC_MINI_B : SEC_MINI_A)) < 0)
    	return -1;
     usleep(15 * 1000);
    }
-   if(ioctl(fd, FE_SET_TONE, t) < 0)
+   if(dvbdev_ioctl(fd, FE_SET_TONE, t) < 0)
    	return -1;
 
    return 0;
@@ -109,10 +110,10 @@ static int do_diseqc(int fd, unsigned char sat_no, int polv, int hi_lo)
     {
 	fprintf(stderr, "Setting only tone %s and voltage %dV\n", (hi_lo ? "ON" : "OFF"), (polv ? 13 : 18));
 	
-	if(ioctl(fd, FE_SET_VOLTAGE, (polv ? SEC_VOLTAGE_13 : SEC_VOLTAGE_18)) < 0)
+	if(dvbdev_ioctl(fd, FE_SET_VOLTAGE, (polv ? SEC_VOLTAGE_13 : SEC_VOLTAGE_18)) < 0)
    	    return -1;
 	    
-	if(ioctl(fd, FE_SET_TONE, (hi_lo ? SEC_TONE_ON : SEC_TONE_OFF)) < 0)
+	if(dvbdev_ioctl(fd, FE_SET_TONE, (hi_lo ? SEC_TONE_ON : SEC_TONE_OFF)) < 0)
    	    return -1;
 	
 	usleep(15 * 1000);
@@ -128,7 +129,7 @@ int check_status(int fd_frontend,int type, struct dvb_frontend_parameters* fepar
   int locks=0, ok=0;
   time_t tm1, tm2;
 
-  if (ioctl(fd_frontend,FE_SET_FRONTEND,feparams) < 0) {
+  if (dvbdev_ioctl(fd_frontend,FE_SET_FRONTEND,feparams) < 0) {
     perror("ERROR tuning channel\n");
     return -1;
   }
@@ -142,7 +143,7 @@ int check_status(int fd_frontend,int type, struct dvb_frontend_parameters* fepar
     festatus = 0;
     if (poll(pfd,1,3000) > 0){
       if (pfd[0].revents & POLLPRI){
-        if(ioctl(fd_frontend,FE_READ_STATUS,&festatus) >= 0)
+        if(dvbdev_ioctl(fd_frontend,FE_READ_STATUS,&festatus) >= 0)
           if(festatus & FE_HAS_LOCK)
 	    locks++;
       }
@@ -154,7 +155,7 @@ int check_status(int fd_frontend,int type, struct dvb_frontend_parameters* fepar
   }
 
   if (festatus & FE_HAS_LOCK) {
-      if(ioctl(fd_frontend,FE_GET_FRONTEND,feparams) >= 0) {
+      if(dvbdev_ioctl(fd_frontend,FE_GET_FRONTEND,feparams) >= 0) {
         switch(type) {
          case FE_OFDM:
            fprintf(stderr,"Event:  Frequency: %d\n",feparams->frequency);
@@ -182,19 +183,19 @@ int check_status(int fd_frontend,int type, struct dvb_frontend_parameters* fepar
       }
 
       strength=0;
-      if(ioctl(fd_frontend,FE_READ_BER,&strength) >= 0)
+      if(dvbdev_ioctl(fd_frontend,FE_READ_BER,&strength) >= 0)
         fprintf(stderr,"Bit error rate: %d\n",strength);
 
       strength=0;
-      if(ioctl(fd_frontend,FE_READ_SIGNAL_STRENGTH,&strength) >= 0)
+      if(dvbdev_ioctl(fd_frontend,FE_READ_SIGNAL_STRENGTH,&strength) >= 0)
         fprintf(stderr,"Signal strength: %d\n",strength);
 
       strength=0;
-      if(ioctl(fd_frontend,FE_READ_SNR,&strength) >= 0)
+      if(dvbdev_ioctl(fd_frontend,FE_READ_SNR,&strength) >= 0)
         fprintf(stderr,"SNR: %d\n",strength);
       
       strength=0;
-      if(ioctl(fd_frontend,FE_READ_UNCORRECTED_BLOCKS,&strength) >= 0)
+      if(dvbdev_ioctl(fd_frontend,FE_READ_UNCORRECTED_BLOCKS,&strength) >= 0)
         fprintf(stderr,"UNC: %d\n",strength);
 
       print_status(stderr,festatus);
@@ -211,7 +212,7 @@ int tune_it(int fd_frontend, unsigned int freq, unsigned int srate, char pol, in
   struct dvb_frontend_parameters feparams;
   struct dvb_frontend_info fe_info;
 
-  if ( (res = ioctl(fd_frontend,FE_GET_INFO, &fe_info) < 0)){
+  if ( (res = dvbdev_ioctl(fd_frontend,FE_GET_INFO, &fe_info) < 0)){
      perror("FE_GET_INFO: ");
      return -1;
   }
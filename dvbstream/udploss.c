@@ -0,0 +1,174 @@
+/*
+ * udploss.c: a UDP relay that loses packets, for trying out the FEC
+ * and NACK recovery on a loopback.
+ *
+ *   udploss [-loss percent] [-burst n] [-seed n] [-idle secs] port dest_ip dest_port
+ *
+ * Whatever comes to 127.0.0.1 on port, port+2 and port+4 (the RTP stream
+ * and its column and row FEC) is passed on to the same ports above
+ * dest_port, except that each datagram starts a loss of burst datagrams
+ * (default 1) on its port with the given chance.  The losses follow from
+ * the seed, so a run can be repeated.  Datagrams coming back from the
+ * destination, such as NACKs, go back to where the stream came from and
+ * are never lost.  It stops once nothing has come for idle seconds
+ * (default 2) after the first datagram, or on SIGINT, and says how many
+ * it passed on and dropped.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define PORTS 3                 /* RTP, column FEC, row FEC */
+#define RCVBUF (4 << 20)
+
+static const char *names[PORTS] = { "RTP", "column FEC", "row FEC" };
+static volatile int stop = 0;
+
+static void on_signal(int sig)
+{
+  stop = 1;
+}
+
+/* xorshift64*, so the losses don't depend on the C library */
+static uint64_t rnd_state;
+
+static double rnd(void)
+{
+  rnd_state ^= rnd_state >> 12;
+  rnd_state ^= rnd_state << 25;
+  rnd_state ^= rnd_state >> 27;
+  return (double)((rnd_state * 2685821657736338717ULL) >> 11) / (double)(1ULL << 53);
+}
+
+static int listen_on(int port)
+{
+  struct sockaddr_in addr;
+  int fd, size = RCVBUF;
+
+  if ((fd = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
+    perror("udploss: socket");
+    exit(1);
+  }
+  setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    perror("udploss: bind");
+    exit(1);
+  }
+  return fd;
+}
+
+int main(int argc, char *argv[])
+{
+  struct sockaddr_in dest[PORTS], src[PORTS], from;
+  socklen_t fromlen;
+  struct pollfd pfd[PORTS];
+  uint64_t passed[PORTS], dropped[PORTS], back[PORTS];
+  int burst_left[PORTS];
+  unsigned char buf[65536];
+  double loss = 0;
+  int burst = 1, idle = 2, started = 0;
+  int i, n, port, dport;
+
+  rnd_state = 1;
+  for (i = 1; i < argc && argv[i][0] == '-'; i++) {
+    if (strcmp(argv[i], "-loss") == 0 && i + 1 < argc) {
+      loss = atof(argv[++i]) / 100;
+    } else if (strcmp(argv[i], "-burst") == 0 && i + 1 < argc) {
+      burst = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "-seed") == 0 && i + 1 < argc) {
+      rnd_state = strtoull(argv[++i], NULL, 0) * 0x9e3779b97f4a7c15ULL + 1;
+    } else if (strcmp(argv[i], "-idle") == 0 && i + 1 < argc) {
+      idle = atoi(argv[++i]);
+    } else {
+      break;
+    }
+  }
+  if (argc - i != 3 || burst < 1 || idle < 1) {
+    fprintf(stderr, "Usage: %s [-loss percent] [-burst n] [-seed n] [-idle secs] port dest_ip dest_port\n", argv[0]);
+    exit(1);
+  }
+  port = atoi(argv[i]);
+  dport = atoi(argv[i+2]);
+
+  for (n = 0; n < PORTS; n++) {
+    pfd[n].fd = listen_on(port + 2 * n);
+    pfd[n].events = POLLIN;
+    memset(&dest[n], 0, sizeof(dest[n]));
+    dest[n].sin_family = AF_INET;
+    dest[n].sin_port = htons(dport + 2 * n);
+    if (inet_aton(argv[i+1], &dest[n].sin_addr) == 0) {
+      fprintf(stderr, "udploss: bad address %s\n", argv[i+1]);
+      exit(1);
+    }
+    passed[n] = dropped[n] = back[n] = 0;
+    src[n].sin_port = 0;
+    burst_left[n] = 0;
+  }
+  signal(SIGINT, on_signal);
+  signal(SIGTERM, on_signal);
+
+  while (!stop) {
+    n = poll(pfd, PORTS, started ? idle * 1000 : -1);
+    if (n == 0)
+      break;
+    if (n < 0)
+      continue;
+    for (n = 0; n < PORTS; n++) {
+      if (!(pfd[n].revents & POLLIN))
+        continue;
+      for (;;) {
+        fromlen = sizeof(from);
+        i = recvfrom(pfd[n].fd, buf, sizeof(buf), MSG_DONTWAIT, (struct sockaddr *)&from, &fromlen);
+        if (i < 0)
+          break;
+        started = 1;
+        if (from.sin_port == dest[n].sin_port && from.sin_addr.s_addr == dest[n].sin_addr.s_addr) {
+          if (src[n].sin_port != 0) {
+            sendto(pfd[n].fd, buf, i, 0, (struct sockaddr *)&src[n], sizeof(src[n]));
+            back[n]++;
+          }
+          continue;
+        }
+        src[n] = from;
+        if (burst_left[n] == 0 && loss > 0 && rnd() < loss)
+          burst_left[n] = burst;
+        if (burst_left[n] > 0) {
+          burst_left[n]--;
+          dropped[n]++;
+          continue;
+        }
+        sendto(pfd[n].fd, buf, i, 0, (struct sockaddr *)&dest[n], sizeof(dest[n]));
+        passed[n]++;
+      }
+    }
+  }
+
+  for (n = 0; n < PORTS; n++) {
+    if (passed[n] || dropped[n]) {
+      fprintf(stderr, "udploss: %s: %llu passed on, %llu dropped", names[n],
+              (unsigned long long)passed[n], (unsigned long long)dropped[n]);
+      if (back[n])
+        fprintf(stderr, ", %llu sent back", (unsigned long long)back[n]);
+      fprintf(stderr, "\n");
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,174 @@
+/*
+ * uring.c: just enough io_uring for dvbstream's reads and recordings,
+ * talking to the kernel directly rather than through liburing.
+ *
+ * Each ring is used by one thread only.  SQEs are taken with uring_sqe(),
+ * filled in, and handed to the kernel by uring_submit(), which can also
+ * wait for completions in the same system call.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifdef HAVE_URING
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "uring.h"
+
+static int sys_setup(unsigned int entries, struct io_uring_params *p)
+{
+  return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_enter(int fd, unsigned int submit, unsigned int wait, unsigned int flags)
+{
+  return syscall(__NR_io_uring_enter, fd, submit, wait, flags, NULL, 0);
+}
+
+static int sys_register(int fd, unsigned int op, void *arg, unsigned int n)
+{
+  return syscall(__NR_io_uring_register, fd, op, arg, n);
+}
+
+int uring_init(uring_t *u, unsigned int entries)
+{
+  struct io_uring_params p;
+  uint8_t *sq, *cq;
+
+  memset(u, 0, sizeof(uring_t));
+  memset(&p, 0, sizeof(p));
+  u->fd = sys_setup(entries, &p);
+  if (u->fd < 0) {
+    perror("io_uring_setup");
+    return -1;
+  }
+  u->entries = p.sq_entries;
+
+  u->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+  u->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    if (u->cq_ring_size > u->sq_ring_size)
+      u->sq_ring_size = u->cq_ring_size;
+    u->cq_ring_size = u->sq_ring_size;
+  }
+
+  u->sq_ring = mmap(NULL, u->sq_ring_size, PROT_READ|PROT_WRITE,
+                    MAP_SHARED|MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+  if (u->sq_ring == MAP_FAILED)
+    goto fail;
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    u->cq_ring = u->sq_ring;
+  } else {
+    u->cq_ring = mmap(NULL, u->cq_ring_size, PROT_READ|PROT_WRITE,
+                      MAP_SHARED|MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+    if (u->cq_ring == MAP_FAILED)
+      goto fail;
+  }
+  u->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+  u->sqes = mmap(NULL, u->sqes_size, PROT_READ|PROT_WRITE,
+                 MAP_SHARED|MAP_POPULATE, u->fd, IORING_OFF_SQES);
+  if (u->sqes == MAP_FAILED)
+    goto fail;
+
+  sq = u->sq_ring;
+  u->sq_head = (unsigned int *)(sq + p.sq_off.head);
+  u->sq_tail = (unsigned int *)(sq + p.sq_off.tail);
+  u->sq_mask = (unsigned int *)(sq + p.sq_off.ring_mask);
+  u->sq_array = (unsigned int *)(sq + p.sq_off.array);
+  cq = u->cq_ring;
+  u->cq_head = (unsigned int *)(cq + p.cq_off.head);
+  u->cq_tail = (unsigned int *)(cq + p.cq_off.tail);
+  u->cq_mask = (unsigned int *)(cq + p.cq_off.ring_mask);
+  u->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+  return 0;
+
+ fail:
+  perror("io_uring mmap");
+  uring_free(u);
+  return -1;
+}
+
+/* A free SQE, cleared, or NULL if the submission queue is full */
+struct io_uring_sqe *uring_sqe(uring_t *u)
+{
+  unsigned int head = __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+  unsigned int tail = *u->sq_tail + u->sq_pending;
+  struct io_uring_sqe *sqe;
+
+  if (tail - head >= u->entries)
+    return NULL;
+  sqe = &u->sqes[tail & *u->sq_mask];
+  memset(sqe, 0, sizeof(*sqe));
+  u->sq_array[tail & *u->sq_mask] = tail & *u->sq_mask;
+  u->sq_pending++;
+  return sqe;
+}
+
+/* Submit the SQEs filled in since the last call and wait for at least
+   wait completions.  Returns the number submitted or -1. */
+int uring_submit(uring_t *u, unsigned int wait)
+{
+  unsigned int n = u->sq_pending;
+  int r;
+
+  __atomic_store_n(u->sq_tail, *u->sq_tail + n, __ATOMIC_RELEASE);
+  u->sq_pending = 0;
+  if (n == 0 && wait == 0)
+    return 0;
+  do {
+    r = sys_enter(u->fd, n, wait, wait ? IORING_ENTER_GETEVENTS : 0);
+  } while (r < 0 && errno == EINTR && wait == 0);
+  if (r < 0 && errno != EINTR) {
+    perror("io_uring_enter");
+    return -1;
+  }
+  return n;
+}
+
+/* The next completion, or NULL if there is none */
+struct io_uring_cqe *uring_cqe(uring_t *u)
+{
+  unsigned int head = *u->cq_head;
+
+  if (head == __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE))
+    return NULL;
+  return &u->cqes[head & *u->cq_mask];
+}
+
+void uring_cqe_seen(uring_t *u)
+{
+  __atomic_store_n(u->cq_head, *u->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+int uring_register_buffers(uring_t *u, struct iovec *iov, unsigned int n)
+{
+  if (sys_register(u->fd, IORING_REGISTER_BUFFERS, iov, n) < 0) {
+    perror("io_uring_register");
+    return -1;
+  }
+  return 0;
+}
+
+void uring_free(uring_t *u)
+{
+  if (u->sqes != NULL && u->sqes != MAP_FAILED)
+    munmap(u->sqes, u->sqes_size);
+  if (u->cq_ring != NULL && u->cq_ring != MAP_FAILED && u->cq_ring != u->sq_ring)
+    munmap(u->cq_ring, u->cq_ring_size);
+  if (u->sq_ring != NULL && u->sq_ring != MAP_FAILED)
+    munmap(u->sq_ring, u->sq_ring_size);
+  if (u->fd >= 0)
+    close(u->fd);
+  memset(u, 0, sizeof(uring_t));
+  u->fd = -1;
+}
+
+#endif
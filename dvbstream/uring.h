@@ -0,0 +1,40 @@
+#ifndef _URING_H
+#define _URING_H
+
+/* A minimal io_uring wrapper using the raw system calls, so liburing
+   isn't needed.  Only built in with "make URING=1". */
+
+#ifdef HAVE_URING
+
+#include <stdint.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+typedef struct uring {
+  int fd;
+  unsigned int entries;
+
+  /* submission queue */
+  unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array;
+  struct io_uring_sqe *sqes;
+  unsigned int sq_pending;     /* SQEs filled in but not yet submitted */
+
+  /* completion queue */
+  unsigned int *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_cqe *cqes;
+
+  void *sq_ring, *cq_ring;
+  size_t sq_ring_size, cq_ring_size, sqes_size;
+} uring_t;
+
+int uring_init(uring_t *u, unsigned int entries);
+struct io_uring_sqe *uring_sqe(uring_t *u);
+int uring_submit(uring_t *u, unsigned int wait);
+struct io_uring_cqe *uring_cqe(uring_t *u);
+void uring_cqe_seen(uring_t *u);
+int uring_register_buffers(uring_t *u, struct iovec *iov, unsigned int n);
+void uring_free(uring_t *u);
+
+#endif
+
+#endif
@@ -6,6 +6,7 @@
 #include <fcntl.h>
 
 #include "pes.h"
+#include "ingest.h"
 
 #ifdef WIN32
   typedef int ssize_t;
@@ -57,13 +58,18 @@ uint64_t get_pes_pts (unsigned char* buf) {
   return(PTS);
 }
 
+/* TS input is framed by the shared ingest code, which reads ahead in large
+   chunks - so it is only set up for the descriptor used in TS mode. */
+static ingest_t ts_in;
+static int ts_in_fd=-1;
+
 int read_pes_packet (int fd, uint16_t pid, uint8_t* buf, int vdrmode) {
   int i;
   int n,stream_id;
   int count;
   int PES_packet_length;
   uint16_t packet_pid;
-  uint8_t tsbuf[188];
+  uint8_t* tsbuf;
   int adaption_field_control,discontinuity_indicator,adaption_field_length;
   int synced=0;
   int finished=0;
@@ -98,16 +104,16 @@ int read_pes_packet (int fd, uint16_t pid, uint8_t* buf, int vdrmode) {
     }
   } else {
     n=0; // Bytes copied into buf.
-  
+
+    if (ts_in_fd!=fd) {
+      if (ts_in_fd!=-1) ingest_free(&ts_in);
+      if (ingest_init(&ts_in,fd,INGEST_DEFAULT_PACKETS) < 0) return(-1);
+      ts_in_fd=fd;
+    }
+
     memset(buf,0xff,sizeof(buf));
     while (!finished) {
-      count=safe_read(fd,tsbuf,188);
-     if (count!=188) return(-1);
-  
-      if (tsbuf[0]!=0x47) { 
-        fprintf(stderr,"ERROR: TS sync byte not present, aborting.\n");
-        return(0);
-      }
+      if ((tsbuf=ingest_next(&ts_in))==NULL) return(-1);
   
       packet_pid=(((tsbuf[1]&0x1f)<<8) | tsbuf[2]);
   
@@ -38,6 +38,7 @@ Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
 #include <unistd.h>
 #ifdef NEWSTRUCT
 #include <linux/dvb/dmx.h>
+#include "dvbdev.h"
 #else
 #include <ost/dmx.h>
 #endif
@@ -145,7 +146,7 @@ void set_tt_filt(int fd,uint16_t tt_pid)
         pesFilterParams.pes_type = DMX_PES_OTHER;
 	pesFilterParams.flags   = DMX_IMMEDIATE_START;
 
-	if (ioctl(fd, DMX_SET_PES_FILTER, &pesFilterParams) < 0)  {
+	if (dvbdev_ioctl(fd, DMX_SET_PES_FILTER, &pesFilterParams) < 0)  {
                 fprintf(stderr,"FILTER %i: ",tt_pid);
 		perror("DMX SET PES FILTER");
         }
@@ -221,7 +222,7 @@ int main(int argc, char **argv)
 
   for (i=0;i<count;i++) {  
 #ifdef NEWSTRUCT
-    if((fd[i] = open("/dev/dvb/adapter0/demux0",O_RDWR)) < 0){
+    if((fd[i] = dvbdev_open(0,"demux0",O_RDWR)) < 0){
 #else
     if((fd[i] = open("/dev/ost/demux",O_RDWR)) < 0){
 #endif
@@ -232,7 +233,7 @@ int main(int argc, char **argv)
   }
 
 #ifdef NEWSTRUCT
-  if((fd_dvr = open("/dev/dvb/adapter0/dvr0",O_RDONLY)) < 0){
+  if((fd_dvr = dvbdev_open(0,"dvr0",O_RDONLY)) < 0){
 #else
   if((fd_dvr = open("/dev/ost/dvr",O_RDONLY)) < 0){
 #endif
@@ -46,8 +46,11 @@ transport_packet() {
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
+#include "ingest.h"
+
 typedef enum {
   TS_WAITING,
   TS_ERROR,
@@ -87,7 +90,8 @@ int check_pes(unsigned char* buf,int n) {
 }
 
 int main(int argc, char** argv) {
-  unsigned char buf[188];
+  unsigned char *buf;
+  ingest_t in;
   unsigned char pesbuf[165536];
   int peslength;
   unsigned short pid;
@@ -117,11 +121,11 @@ int main(int argc, char** argv) {
   peslength=-1;
   counter=-1;
   ts_status=TS_WAITING;
+  if (ingest_init(&in,0,INGEST_DEFAULT_PACKETS) < 0) {
+    exit(1);
+  }
   for (;;) {
-    c=0;
-    while (c<188) {
-      n=read(0,&buf[c],188-c);
-      if (n==0) {
+    if ((buf=ingest_next(&in))==NULL) {
         fprintf(stderr,"END OF STREAM\n");
         fprintf(stderr,"Processed %d TS packets (%d bytes).\n",packet,188*packet);
         fprintf(stderr,"Number of TS packets missing:  %d\n",ts_dropped);
@@ -129,11 +133,10 @@ int main(int argc, char** argv) {
 	fprintf(stderr,"Maximum PES packet size:       %d bytes\n",max_pes);
         fprintf(stderr,"Number of PES packets written: %d\n",pes_written);
         fprintf(stderr,"Number of PES packets dropped: %d\n",pes_dropped);
+        fprintf(stderr,"Sync lost %llu times, %llu bytes discarded\n",
+                (unsigned long long)in.framer.resyncs,(unsigned long long)in.framer.discarded);
         exit(0);
-      }
-      c+=n;
     }
-//    fprintf(stderr,"Read %d bytes\n",c);
 
     if ( (((buf[1]&0x1f)<<8) | buf[2]) == pid) {
       continuity_counter=buf[3]&0x0f;
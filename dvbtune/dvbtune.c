@@ -38,6 +38,7 @@
 
 // Linux includes:
 #include <stdio.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
@@ -56,6 +57,7 @@
 
 #include "tune.h"
 #include "si.h"
+#include "dvbdev.h"
 
 int fd_demuxv,fd_demuxa,fd_demuxtt,fd_demuxsi,fd_demuxrec,fd_demuxd;
 int pnr=-1;
@@ -65,9 +67,6 @@ int card=0;
 fe_spectral_inversion_t specInv = INVERSION_AUTO;
 int tone = -1;
 
-char* frontenddev[4]={"/dev/dvb/adapter0/frontend0","/dev/dvb/adapter1/frontend0","/dev/dvb/adapter2/frontend0","/dev/dvb/adapter3/frontend0"};
-char* dvrdev[4]={"/dev/dvb/adapter0/dvr0","/dev/dvb/adapter1/dvr0","/dev/dvb/adapter2/dvr0","/dev/dvb/adapter3/dvr0"};
-char* demuxdev[4]={"/dev/dvb/adapter0/demux0","/dev/dvb/adapter1/demux0","/dev/dvb/adapter2/demux0","/dev/dvb/adapter3/demux0"};
 
 transponder_t* transponders=NULL;
 int num_trans=0;
@@ -152,7 +151,7 @@ void set_recpid(int fd, ushort ttpid)
 struct dmx_pes_filter_params pesFilterParamsREC;
 
         if (ttpid==0 || ttpid==0xffff) {
-	        ioctl(fd, DMX_STOP, 0);
+	        dvbdev_ioctl(fd, DMX_STOP, 0);
 	        return;
 	}
 
@@ -161,7 +160,7 @@ struct dmx_pes_filter_params pesFilterParamsREC;
 	pesFilterParamsREC.output  = DMX_OUT_TAP; 
 	pesFilterParamsREC.pes_type = DMX_PES_OTHER; 
 	pesFilterParamsREC.flags   = DMX_IMMEDIATE_START;
-	if (ioctl(fd, DMX_SET_PES_FILTER, 
+	if (dvbdev_ioctl(fd, DMX_SET_PES_FILTER, 
 		  &pesFilterParamsREC) < 0)
 		perror("set_recpid");
 }
@@ -171,7 +170,7 @@ void set_sipid(ushort ttpid)
 struct dmx_pes_filter_params pesFilterParamsSI;
 
         if (ttpid==0 || ttpid==0xffff) {
-	        ioctl(fd_demuxsi, DMX_STOP, 0);
+	        dvbdev_ioctl(fd_demuxsi, DMX_STOP, 0);
 	        return;
 	}
 
@@ -180,7 +179,7 @@ struct dmx_pes_filter_params pesFilterParamsSI;
 	pesFilterParamsSI.output  = DMX_OUT_TS_TAP; 
 	pesFilterParamsSI.pes_type = DMX_PES_OTHER; 
 	pesFilterParamsSI.flags   = DMX_IMMEDIATE_START;
-	if (ioctl(fd_demuxsi, DMX_SET_PES_FILTER, 
+	if (dvbdev_ioctl(fd_demuxsi, DMX_SET_PES_FILTER, 
 		  &pesFilterParamsSI) < 0)
 		perror("set_sipid");
 }
@@ -190,7 +189,7 @@ void set_ttpid(ushort ttpid)
 struct dmx_pes_filter_params pesFilterParamsTT;
 
         if (ttpid==0 || ttpid==0xffff) {
-	        ioctl(fd_demuxtt, DMX_STOP, 0);
+	        dvbdev_ioctl(fd_demuxtt, DMX_STOP, 0);
 	        return;
 	}
 
@@ -199,7 +198,7 @@ struct dmx_pes_filter_params pesFilterParamsTT;
 	pesFilterParamsTT.output  = DMX_OUT_DECODER; 
 	pesFilterParamsTT.pes_type = DMX_PES_TELETEXT; 
 	pesFilterParamsTT.flags   = DMX_IMMEDIATE_START;
-	if (ioctl(fd_demuxtt, DMX_SET_PES_FILTER, 
+	if (dvbdev_ioctl(fd_demuxtt, DMX_SET_PES_FILTER, 
 		  &pesFilterParamsTT) < 0)
 		perror("set_ttpid");
 }
@@ -208,7 +207,7 @@ void set_vpid(ushort vpid)
 {  
 struct dmx_pes_filter_params pesFilterParamsV;
         if (vpid==0 || vpid==0xffff) {
-	        ioctl(fd_demuxv, DMX_STOP, 0);
+	        dvbdev_ioctl(fd_demuxv, DMX_STOP, 0);
 	        return;
 	}
 
@@ -217,7 +216,7 @@ struct dmx_pes_filter_params pesFilterParamsV;
 	pesFilterParamsV.output  = DMX_OUT_DECODER; 
 	pesFilterParamsV.pes_type = DMX_PES_VIDEO; 
 	pesFilterParamsV.flags   = DMX_IMMEDIATE_START;
-	if (ioctl(fd_demuxv, DMX_SET_PES_FILTER, 
+	if (dvbdev_ioctl(fd_demuxv, DMX_SET_PES_FILTER, 
 		  &pesFilterParamsV) < 0)
 		perror("set_vpid");
 }
@@ -226,7 +225,7 @@ void set_apid(ushort apid)
 {  
 struct dmx_pes_filter_params pesFilterParamsA;
         if (apid==0 || apid==0xffff) {
-	        ioctl(fd_demuxa, DMX_STOP, apid);
+	        dvbdev_ioctl(fd_demuxa, DMX_STOP, apid);
 	        return;
 	}
 	pesFilterParamsA.pid = apid;
@@ -234,7 +233,7 @@ struct dmx_pes_filter_params pesFilterParamsA;
 	pesFilterParamsA.output = DMX_OUT_DECODER; 
 	pesFilterParamsA.pes_type = DMX_PES_AUDIO; 
 	pesFilterParamsA.flags = DMX_IMMEDIATE_START;
-	if (ioctl(fd_demuxa, DMX_SET_PES_FILTER, 
+	if (dvbdev_ioctl(fd_demuxa, DMX_SET_PES_FILTER, 
 		  &pesFilterParamsA) < 0)
 		perror("set_apid");
 }
@@ -244,7 +243,7 @@ void set_dpid(ushort dpid)
 	struct dmx_sct_filter_params sctFilterParams;
  
         if (dpid==0 || dpid==0xffff) {
-                ioctl(fd_demuxd, DMX_STOP, dpid);
+                dvbdev_ioctl(fd_demuxd, DMX_STOP, dpid);
                 return;
         }
         memset(&sctFilterParams.filter,0,sizeof(sctFilterParams.filter));
@@ -253,7 +252,7 @@ void set_dpid(ushort dpid)
         //sctFilterParams.filter.mask[0] = 0xff; 
 	sctFilterParams.timeout = 0;
         sctFilterParams.flags = DMX_IMMEDIATE_START;
-        if (ioctl(fd_demuxd, DMX_SET_FILTER, &sctFilterParams) < 0)
+        if (dvbdev_ioctl(fd_demuxd, DMX_SET_FILTER, &sctFilterParams) < 0)
                 perror("set_dpid"); 
 }
 
@@ -272,7 +271,7 @@ void set_ts_filter(int fd,uint16_t pid)
 //  if (pid==256) pesFilterParams.pesType = DMX_PES_AUDIO;
   pesFilterParams.flags   = DMX_IMMEDIATE_START;
 
-  if (ioctl(fd, DMX_SET_PES_FILTER, &pesFilterParams) < 0)  {
+  if (dvbdev_ioctl(fd, DMX_SET_PES_FILTER, &pesFilterParams) < 0)  {
     fprintf(stderr,"FILTER %i: ",pid);
     perror("DMX SET PES FILTER");
   }
@@ -298,7 +297,7 @@ int scan_nit(int x) {
   struct dmx_sct_filter_params sctFilterParams;
   int info_len,network_id;
 
-  if((fd_nit = open(demuxdev[card],O_RDWR|O_NONBLOCK)) < 0){
+  if((fd_nit = dvbdev_open(card,"demux0",O_RDWR|O_NONBLOCK)) < 0){
       perror("fd_nit DEVICE: ");
       return -1;
   }
@@ -310,14 +309,14 @@ int scan_nit(int x) {
   sctFilterParams.filter.filter[0]=x;
   sctFilterParams.filter.mask[0]=0xff;
 
-  if (ioctl(fd_nit,DMX_SET_FILTER,&sctFilterParams) < 0) {
+  if (dvbdev_ioctl(fd_nit,DMX_SET_FILTER,&sctFilterParams) < 0) {
     perror("NIT - DMX_SET_FILTER:");
     close(fd_nit);
     return -1;
   }
 
   ufd.fd=fd_nit;
-  ufd.events=POLLPRI;
+  ufd.events=POLLIN|POLLPRI;
   if (poll(&ufd,1,10000) < 0 ) {
     fprintf(stderr,"TIMEOUT on read from fd_nit\n");
     close(fd_nit);
@@ -376,7 +375,7 @@ void scan_pmt(int pid,int sid,int change) {
 
   if (pid==0) { return; }
 
-  if((fd_pmt = open(demuxdev[card],O_RDWR|O_NONBLOCK)) < 0){
+  if((fd_pmt = dvbdev_open(card,"demux0",O_RDWR|O_NONBLOCK)) < 0){
       perror("fd_pmt DEVICE: ");
       return;
   }
@@ -388,14 +387,14 @@ void scan_pmt(int pid,int sid,int change) {
   sctFilterParams.filter.filter[0]=0x02;
   sctFilterParams.filter.mask[0]=0xff;
 
-  if (ioctl(fd_pmt,DMX_SET_FILTER,&sctFilterParams) < 0) {
+  if (dvbdev_ioctl(fd_pmt,DMX_SET_FILTER,&sctFilterParams) < 0) {
     perror("PMT - DMX_SET_FILTER:");
     close(fd_pmt);
     return;
   }
 
   ufd.fd=fd_pmt;
-  ufd.events=POLLPRI;
+  ufd.events=POLLIN|POLLPRI;
   if (poll(&ufd,1,10000) < 0) {
      fprintf(stderr,"TIMEOUT reading from fd_pmt\n");
      close(fd_pmt);
@@ -463,7 +462,7 @@ void scan_pat() {
 
   pat_t pat;
 
-  if((fd_pat = open(demuxdev[card],O_RDWR|O_NONBLOCK)) < 0){
+  if((fd_pat = dvbdev_open(card,"demux0",O_RDWR|O_NONBLOCK)) < 0){
       perror("fd_pat DEVICE: ");
       return;
   }
@@ -475,14 +474,14 @@ void scan_pat() {
   sctFilterParams.filter.filter[0]=0x0;
   sctFilterParams.filter.mask[0]=0xff;
 
-  if (ioctl(fd_pat,DMX_SET_FILTER,&sctFilterParams) < 0) {
+  if (dvbdev_ioctl(fd_pat,DMX_SET_FILTER,&sctFilterParams) < 0) {
     perror("PAT - DMX_SET_FILTER:");
     close(fd_pat);
     return;
   }
 
   ufd.fd=fd_pat;
-  ufd.events=POLLPRI;
+  ufd.events=POLLIN|POLLPRI;
   if (poll(&ufd,1,10000) < 0) {
      fprintf(stderr,"TIMEOUT reading from fd_pat\n");
      close(fd_pat);
@@ -528,7 +527,7 @@ void scan_sdt() {
   int ca,service_id,loop_length;
   struct pollfd ufd;
 
-  if((fd_sdt = open(demuxdev[card],O_RDWR|O_NONBLOCK)) < 0){
+  if((fd_sdt = dvbdev_open(card,"demux0",O_RDWR|O_NONBLOCK)) < 0){
       perror("fd_sdt DEVICE: ");
       return;
   }
@@ -540,7 +539,7 @@ void scan_sdt() {
   sctFilterParams.filter.filter[0]=0x42;
   sctFilterParams.filter.mask[0]=0xff;
 
-  if (ioctl(fd_sdt,DMX_SET_FILTER,&sctFilterParams) < 0) {
+  if (dvbdev_ioctl(fd_sdt,DMX_SET_FILTER,&sctFilterParams) < 0) {
     perror("SDT - DMX_SET_FILTER:");
     close(fd_sdt);
     return;
@@ -551,7 +550,7 @@ void scan_sdt() {
 
 for (k=0;k<max_k;k++) {
  ufd.fd=fd_sdt;
- ufd.events=POLLPRI;
+ ufd.events=POLLIN|POLLPRI;
  if (poll(&ufd,1,10000) < 0 ) {
    fprintf(stderr,"TIMEOUT on read from fd_sdt\n");
    close(fd_sdt);
@@ -608,7 +607,7 @@ int FEReadBER(int fd, uint32_t *ber)
 {
         int ans;
 
-        if ( (ans = ioctl(fd,FE_READ_BER, ber) < 0)){
+        if ( (ans = dvbdev_ioctl(fd,FE_READ_BER, ber) < 0)){
                 perror("FE READ_BER: ");
                 return -1;
         }
@@ -620,7 +619,7 @@ int FEReadSignalStrength(int fd, int32_t *strength)
 {
         int ans;
 
-        if ( (ans = ioctl(fd,FE_READ_SIGNAL_STRENGTH, strength) < 0)){
+        if ( (ans = dvbdev_ioctl(fd,FE_READ_SIGNAL_STRENGTH, strength) < 0)){
                 perror("FE READ SIGNAL STRENGTH: ");
                 return -1;
         }
@@ -631,7 +630,7 @@ int FEReadSNR(int fd, int32_t *snr)
 {
         int ans;
 
-        if ( (ans = ioctl(fd,FE_READ_SNR, snr) < 0)){
+        if ( (ans = dvbdev_ioctl(fd,FE_READ_SNR, snr) < 0)){
                 perror("FE READ_SNR: ");
                 return -1;
         }
@@ -643,7 +642,7 @@ int FEReadAFC(int fd, int32_t *snr)
 {   
         int ans;
 
-        if ( (ans = ioctl(fd,FE_READ_AFC, snr) < 0)){
+        if ( (ans = dvbdev_ioctl(fd,FE_READ_AFC, snr) < 0)){
                 perror("FE READ_AFC: ");
                 return -1;
         }
@@ -656,7 +655,7 @@ int FEReadUncorrectedBlocks(int fd, uint32_t *ucb)
 {
         int ans;
 
-        if ( (ans = ioctl(fd,FE_READ_UNCORRECTED_BLOCKS, ucb) < 0)){
+        if ( (ans = dvbdev_ioctl(fd,FE_READ_UNCORRECTED_BLOCKS, ucb) < 0)){
                 perror("FE READ UNCORRECTED BLOCKS: ");
                 return -1;
         }
@@ -885,49 +884,49 @@ int main(int argc, char **argv)
   }
 #endif
 
-  if((fd_dvr = open(dvrdev[card],O_RDONLY|O_NONBLOCK)) < 0){
+  if((fd_dvr = dvbdev_open(card,"dvr0",O_RDONLY|O_NONBLOCK)) < 0){
       fprintf(stderr,"FD %d: ",i);
       perror("fd_dvr DEMUX DEVICE: ");
       return -1;
   }
 
-  if((fd_frontend = open(frontenddev[card],O_RDWR|O_NONBLOCK)) < 0){
+  if((fd_frontend = dvbdev_open(card,"frontend0",O_RDWR|O_NONBLOCK)) < 0){
       fprintf(stderr,"frontend: %d",i);
       perror("FRONTEND DEVICE: ");
       return -1;
   }
 
-  if((fd_demuxrec = open(demuxdev[card],O_RDWR|O_NONBLOCK)) < 0){
+  if((fd_demuxrec = dvbdev_open(card,"demux0",O_RDWR|O_NONBLOCK)) < 0){
       fprintf(stderr,"FD %i: ",i);
       perror("DEMUX DEVICE: ");
       return -1;
   }
 
-  if((fd_demuxv = open(demuxdev[card],O_RDWR)) < 0){
+  if((fd_demuxv = dvbdev_open(card,"demux0",O_RDWR)) < 0){
       fprintf(stderr,"FD %i: ",i);
       perror("DEMUX DEVICE: ");
       return -1;
   }
 
-  if((fd_demuxa = open(demuxdev[card],O_RDWR)) < 0){
+  if((fd_demuxa = dvbdev_open(card,"demux0",O_RDWR)) < 0){
       fprintf(stderr,"FD %i: ",i);
       perror("DEMUX DEVICE: ");
       return -1;
   }
 
-  if((fd_demuxtt = open(demuxdev[card],O_RDWR)) < 0){
+  if((fd_demuxtt = dvbdev_open(card,"demux0",O_RDWR)) < 0){
       fprintf(stderr,"FD %i: ",i);
       perror("DEMUX DEVICE: ");
       return -1;
   }
 
-  if((fd_demuxd = open(demuxdev[card],O_RDWR)) < 0){
+  if((fd_demuxd = dvbdev_open(card,"demux0",O_RDWR)) < 0){
       fprintf(stderr,"FD %i: ",i);
       perror("DEMUX DEVICE: ");
       return -1;
   }
 
-  if((fd_demuxsi = open(demuxdev[card],O_RDWR|O_NONBLOCK)) < 0){
+  if((fd_demuxsi = dvbdev_open(card,"demux0",O_RDWR|O_NONBLOCK)) < 0){
       fprintf(stderr,"FD %i: ",i);
       perror("DEMUX DEVICE: ");
       return -1;
@@ -1014,7 +1013,7 @@ int main(int argc, char **argv)
         int32_t strength, ber, snr, uncorr;
         fe_status_t festatus;
 
-        if((fd_frontend = open(frontenddev[card],O_RDONLY|O_NONBLOCK)) < 0){
+        if((fd_frontend = dvbdev_open(card,"frontend0",O_RDONLY|O_NONBLOCK)) < 0){
                 fprintf(stderr,"frontend: %d",i);
                 perror("FRONTEND DEVICE: ");
                 return -1;
@@ -1027,7 +1026,7 @@ int main(int argc, char **argv)
                 FEReadSignalStrength(fd_frontend, &strength);
                 FEReadSNR(fd_frontend, &snr);
                 FEReadUncorrectedBlocks(fd_frontend, &uncorr);
-                ioctl(fd_frontend,FE_READ_STATUS,&festatus);
+                dvbdev_ioctl(fd_frontend,FE_READ_STATUS,&festatus);
                 fprintf(stderr,"Signal=%d, Verror=%d, SNR=%ddB, BlockErrors=%d, (", strength, ber, snr, uncorr);
 		if (festatus & FE_HAS_SIGNAL) fprintf(stderr,"S|");
 		if (festatus & FE_HAS_LOCK) fprintf(stderr,"L|");
@@ -39,6 +39,8 @@
 #include "mpegtools/ringbuffy.h"
 
 #include "rtp.h"
+#include "rtprecv.h"
+#include "fec.h"
 
 #define TS_SIZE 188
 #define IPACKS 2048
@@ -151,6 +153,7 @@ int secs;
 int Interrupted;
 
 char* user_outfile=NULL;
+int use_fec=0;
 
 int sound=0;
 struct mad_stream  Stream;
@@ -419,6 +422,8 @@ void process_args(int argc,char** argv) {
         exit(1);
       }
       user_outfile=argv[i];
+    } else if (strcmp(argv[i],"-fec")==0) {
+      use_fec=1;
     } else if (strcmp(argv[i],"-ao")==0) {
       i++;
       if (i==argc) {
@@ -514,10 +519,12 @@ static void SignalHandler(int signum) {
 int main(int argc, char *argv[]) {
   struct sockaddr_in si;
   int socketIn;
-  struct rtpheader rh;
+  rtprecv_t *rtp;
+  rtprecv_pkt_t **pkts;
+  const rtprecv_stats_t *rs;
   char *ip;
   int port;
-  unsigned short seq;
+  int i, n;
 
   fprintf(stderr,"\nrtptsaudio version 0.2, Copyright (C) 2002 Dave Chapman\n");
   fprintf(stderr,"rtptsaudio comes with ABSOLUTELY NO WARRANTY;\n");
@@ -529,12 +536,13 @@ int main(int argc, char *argv[]) {
   port = 5004;
 
   if (argc<2) {
-    fprintf(stderr,"Usage: rtptsaudio [-ao audiotype] [-o filename] [-t secs] pid\n");
+    fprintf(stderr,"Usage: rtptsaudio [-ao audiotype] [-o filename] [-t secs] [-fec] pid\n");
     fprintf(stderr,"\nOptions: -ao oss    Linux Open Sound System output (default)\n");
     fprintf(stderr,"             mpa    Unprocessed MPEG Audio stream to stdout\n");
     fprintf(stderr,"             raw    Raw PCM data (16 bit Little-Endian Stereo) to stdout\n");
     fprintf(stderr,"         -o  file   Output filename or audio device\n");
     fprintf(stderr,"         -t  secs   Number of seconds to receive before quitting\n");
+    fprintf(stderr,"         -fec       Recover lost packets with the SMPTE 2022-1 FEC on ports +2 and +4\n");
     fprintf(stderr,"\n");
     return(-1);
   }
@@ -565,28 +573,48 @@ int main(int argc, char *argv[]) {
     mad_timer_reset(&Timer);
   }
 
-  getrtp2(socketIn,&rh, (char**) &ts2es_buf.buf,&ts2es_buf.count);
-  seq=rh.b.sequence;
+  if ((rtp=rtprecv_new(socketIn,0))==NULL) {
+    fprintf(stderr,"rtptsaudio: out of memory\n");
+    return(-1);
+  }
+  if (use_fec &&
+      rtprecv_fec(rtp,makeclientsocket(ip,port+FEC_COLUMN_PORT,2,&si),makeclientsocket(ip,port+FEC_ROW_PORT,2,&si)) < 0) {
+    fprintf(stderr,"rtptsaudio: out of memory\n");
+    return(-1);
+  }
+  rs=rtprecv_stats(rtp);
 
   if (secs > 0) alarm(secs);
 
   Interrupted=0;
   while (!Interrupted) {
-   getrtp2(socketIn,&rh, (char**) &ts2es_buf.buf,&ts2es_buf.count);
-   seq++;
-   if (seq!=rh.b.sequence) {
-     fprintf(stderr,"rtptsaudio: NETWORK CONGESTION - expected %d, received %d\n",seq,rh.b.sequence);
-     seq=rh.b.sequence;
+   n=rtprecv_get(rtp,&pkts);
+   if (n<0) {
+     if (errno==EINTR) continue;
+     perror("rtptsaudio: socket read error");
+     break;
    }
-   myts2es();
-   output_mpa_frames();
-
-   if (output_type!=AUDIO_MPA) {
-     mad_process();
+   for (i=0;i<n;i++) {
+     ts2es_buf.buf=pkts[i]->data;
+     ts2es_buf.count=pkts[i]->len;
+     myts2es();
+     output_mpa_frames();
+
+     if (output_type!=AUDIO_MPA) {
+       mad_process();
+     }
    }
   }
 
   fprintf(stderr,"rtptsaudio: Received signal %d, closing cleanly.\n",Interrupted);
+  fprintf(stderr,"rtptsaudio: %llu packets, %llu lost, %llu late, %llu duplicated, %llu reordered",
+          (unsigned long long)rs->datagrams,(unsigned long long)rs->lost,(unsigned long long)rs->late,
+          (unsigned long long)rs->duplicates,(unsigned long long)rs->reordered);
+  if (use_fec)
+    fprintf(stderr,", %llu recovered from %llu FEC packets",
+            (unsigned long long)rs->recovered,(unsigned long long)rs->fec);
+  fprintf(stderr,"\n");
+  rtprecv_free(rtp);
   if ((sound!=1) && (sound!=0)) close(sound);
 
   close(socketIn);